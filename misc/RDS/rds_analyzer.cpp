@@ -0,0 +1,440 @@
+// RDS log analyzer, replaces script.py (split session.log by frequency) and convert.py (blocks to ASCII)
+// Streams each file in one pass through a fixed buffer:
+//   session logs  "[RDS] 950, , <8 binary bytes: blocks A-D>" (other lines are skipped)
+//   CSVs          8 binary bytes per line as written by script.py, frequency from the file name (950.csv)
+//   captures      rds.bin downloaded from the receiver, 8 byte records (see software/master/rds_capture.h)
+// Reports per station: group type histogram, block error rates, PS and radiotext timelines. Radiotext is
+// decoded with the firmware's code (software/master/rds_decoder.h), so it shows what the LCD would show.
+//
+// Build: g++ -O2 -std=c++17 -o rds_analyzer rds_analyzer.cpp
+// Usage: ./rds_analyzer [--min-groups N] [--dump] file...
+//   --min-groups N   stations with fewer groups (passed while scanning) are only listed, default 20
+//   --dump           print every group with its blocks and characters (what convert.py did)
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../../software/master/rds_decoder.h"
+
+#define FREQ_MIN 870
+#define RDS_MARKER 0x8000
+#define TIME_UNKNOWN UINT64_MAX
+#define READ_BUFFER 65536       // files are parsed in chunks of this size, never read whole
+
+struct Event {
+  uint64_t time;          // ms, or group number if the source has no time
+  char kind;              // 'P' - program service name, 'R' - radiotext
+  std::string text;
+};
+
+struct Station {
+  int frequency = 0;      // 100kHz
+  uint64_t groups = 0;
+  uint64_t duplicates = 0;
+  uint64_t types[32] = {};            // type * 2 + (version B)
+  uint64_t bler_a[4] = {}, bler_b[4] = {};
+  bool has_bler = false;
+  std::map<uint16_t, uint64_t> pis;
+  bool timed = false;                 // events are in ms
+  std::vector<Event> timeline;
+
+  // decoder state
+  uint8_t last_group[12] = {};
+  bool has_last = false;
+  char ps[8];
+  uint8_t ps_segments = 0;
+  std::string last_ps;
+  char radiotext_A[64], radiotext_B[32];
+  bool rds_prev_typeflag = false;
+  uint16_t rt_segments = 0;
+  std::string last_rt;
+
+  Station() {
+    memset(ps, ' ', sizeof(ps));
+    clear_radiotext(radiotext_A, radiotext_B);
+  }
+};
+
+std::map<int, Station> stations;
+uint64_t total_groups = 0;
+bool dump = false;
+
+Station* station_of(int frequency) {
+  static Station* last = nullptr;
+  if(last != nullptr && last->frequency == frequency) {
+    return last;
+  }
+  last = &stations[frequency];
+  last->frequency = frequency;
+  return last;
+}
+
+// Radiotext up to the end character, or the whole buffer
+std::string radiotext_string(const char* text, int size) {
+  int length = 0;
+  while(length < size && text[length] != '\n') {
+    length++;
+  }
+  while(length > 0 && text[length - 1] == ' ') {
+    length--;
+  }
+  return std::string(text, length);
+}
+
+// Message complete: every segment up to the one with the end character (or all segments) received
+bool radiotext_complete(const char* text, int size, int chars_per_segment, uint16_t segments) {
+  int end = size;
+  for(int i=0; i<size; i++) {
+    if(text[i] == '\n') {
+      end = i + 1;
+      break;
+    }
+  }
+  int needed = (end + chars_per_segment - 1) / chars_per_segment;
+  uint32_t mask = (needed >= 16) ? 0xffff : (1u << needed) - 1;
+  return (segments & mask) == mask;
+}
+
+// One group in requested_data layout (arr[3] low bits = BLERA/BLERB if has_bler, blocks A-D in arr[4-11])
+void analyze_group(Station* station, const uint8_t* arr, uint64_t time, bool has_bler, bool check_duplicates) {
+  // text sources log every read, RDSR stays set until the next group
+  if(check_duplicates && station->has_last && memcmp(station->last_group + 4, arr + 4, 8) == 0) {
+    station->duplicates++;
+    return;
+  }
+  memcpy(station->last_group, arr, 12);
+  station->has_last = true;
+
+  station->groups++;
+  total_groups++;
+  uint8_t type = rds_group_type(arr);
+  bool version = rds_group_version(arr);
+  station->types[type * 2 + (version ? 0 : 1)]++;
+  station->pis[arr[4] << 8 | arr[5]]++;
+
+  // uncorrectable block B, type and segment address cannot be trusted
+  bool usable = true;
+  if(has_bler) {
+    station->has_bler = true;
+    station->bler_a[(arr[3] >> 2) & 0b11]++;
+    station->bler_b[arr[3] & 0b11]++;
+    usable = (arr[3] & 0b11) != 0b11;
+  }
+
+  if(time == TIME_UNKNOWN) {
+    time = station->groups;
+  }
+  else {
+    station->timed = true;
+  }
+
+  if(dump) {
+    printf("%5.1f  %02X%02X %02X%02X %02X%02X %02X%02X  %2d%c  ", station->frequency / 10.0,
+      arr[4], arr[5], arr[6], arr[7], arr[8], arr[9], arr[10], arr[11], type, version ? 'A' : 'B');
+    for(int i=8; i<12; i++) {
+      putchar((arr[i] >= 0x20 && arr[i] <= 0x7e) ? arr[i] : '.');
+    }
+    putchar('\n');
+  }
+  if(!usable) {
+    return;
+  }
+
+  // 0A/0B program service name, 2 characters per group
+  if(type == 0) {
+    uint8_t segment = arr[7] & 0b11;
+    station->ps[2*segment] = rds_byte_to_char(arr[10]);
+    station->ps[2*segment + 1] = rds_byte_to_char(arr[11]);
+    station->ps_segments |= 1 << segment;
+    if(station->ps_segments == 0b1111) {
+      std::string ps(station->ps, 8);
+      if(ps != station->last_ps) {
+        station->timeline.push_back({time, 'P', ps});
+        station->last_ps = ps;
+      }
+      station->ps_segments = 0;
+    }
+  }
+  // 2A/2B radiotext, same steps as loop() in master.ino
+  else if(type == 2) {
+    bool rds_typeflag = (arr[7] & 0b10000) == 0b0;
+    if(rds_typeflag != station->rds_prev_typeflag) {
+      clear_radiotext(station->radiotext_A, station->radiotext_B, version ? 'A' : 'B');
+      station->rt_segments = 0;
+    }
+    update_radiotext(arr, station->radiotext_A, station->radiotext_B, version);
+    station->rds_prev_typeflag = rds_typeflag;
+    station->rt_segments |= 1 << (arr[7] & 0b1111);
+
+    const char* text = version ? station->radiotext_A : station->radiotext_B;
+    int size = version ? 64 : 32;
+    if(radiotext_complete(text, size, version ? 4 : 2, station->rt_segments)) {
+      std::string rt = radiotext_string(text, size);
+      if(rt != station->last_rt) {
+        station->timeline.push_back({time, 'R', rt});
+        station->last_rt = rt;
+      }
+    }
+  }
+}
+
+// Binary capture: markers set channel, PI and time, groups add their ms delta. Read in READ_BUFFER chunks, a
+// record cut by the end of a chunk is completed from the next one
+void analyze_capture(FILE* file) {
+  static uint8_t buffer[READ_BUFFER];
+  Station* station = nullptr;
+  uint16_t pi = 0;
+  uint64_t time = 0;
+  size_t kept = 0;
+  size_t count;
+  while((count = fread(buffer + kept, 1, READ_BUFFER - kept, file)) > 0) {
+    size_t size = kept + count;
+    size_t offset = 0;
+    for(; offset + 8 <= size; offset += 8) {
+      const uint8_t* record = buffer + offset;
+      uint16_t words[4];
+      for(int i=0; i<4; i++) {
+        words[i] = record[2*i] | record[2*i + 1] << 8;
+      }
+      if(words[0] & RDS_MARKER) {
+        station = station_of(FREQ_MIN + (words[0] & 0x7fff));
+        pi = words[1];
+        time = words[2] | (uint32_t)words[3] << 16;
+        continue;
+      }
+      // groups before the first marker cannot be placed
+      if(station == nullptr) {
+        continue;
+      }
+      time += words[0] & 0x7ff;
+      uint8_t arr[12] = {};
+      arr[3] = (words[0] >> 11) & 0b1111;
+      arr[4] = pi >> 8; arr[5] = pi & 0xff;
+      for(int i=1; i<4; i++) {
+        arr[4 + 2*i] = words[i] >> 8;
+        arr[5 + 2*i] = words[i] & 0xff;
+      }
+      analyze_group(station, arr, time, true, false);
+    }
+    kept = size - offset;
+    memmove(buffer, buffer + offset, kept);
+  }
+}
+
+// Up to 8 bytes written as groups of 8 binary digits, separated by anything else; returns bytes found
+int parse_binary_bytes(const char* start, const char* end, uint8_t* bytes) {
+  int count = 0;
+  int bits = 0;
+  uint8_t value = 0;
+  for(const char* c = start; c <= end; c++) {
+    if(c < end && (*c == '0' || *c == '1')) {
+      value = value << 1 | (*c - '0');
+      bits++;
+      continue;
+    }
+    if(bits == 8 && count < 8) {
+      bytes[count++] = value;
+    }
+    else if(bits != 0) {
+      return -1;
+    }
+    bits = 0;
+    value = 0;
+  }
+  return count;
+}
+
+// One line of a session log or CSV; csv_frequency is used for lines without "[RDS] <frequency>,"
+void analyze_line(const char* text, const char* line_end, int csv_frequency, uint64_t* skipped) {
+  int frequency = csv_frequency;
+  const char* fields = text;
+  if(line_end - text > 6 && memcmp(text, "[RDS] ", 6) == 0) {
+    frequency = 0;
+    fields = text + 6;
+    while(fields < line_end && *fields >= '0' && *fields <= '9') {
+      frequency = frequency * 10 + (*fields - '0');
+      fields++;
+    }
+  }
+
+  uint8_t bytes[8];
+  if(frequency != 0 && parse_binary_bytes(fields, line_end, bytes) == 8) {
+    uint8_t arr[12] = {};
+    memcpy(arr + 4, bytes, 8);
+    analyze_group(station_of(frequency), arr, TIME_UNKNOWN, false, true);
+  }
+  else {
+    (*skipped)++;
+  }
+}
+
+// Session log or CSV, line by line in READ_BUFFER chunks. A line cut by the end of a chunk is completed from
+// the next one, a line longer than the buffer cannot be a group and is skipped
+void analyze_text(FILE* file, int csv_frequency, uint64_t* skipped) {
+  static char buffer[READ_BUFFER];
+  size_t kept = 0;
+  bool overlong = false;    // dropping the rest of a line longer than the buffer
+  while(true) {
+    size_t count = fread(buffer + kept, 1, READ_BUFFER - kept, file);
+    size_t size = kept + count;
+    if(size == 0) {
+      break;
+    }
+    const char* text = buffer;
+    const char* end = buffer + size;
+    const char* line_end;
+    while((line_end = (const char*)memchr(text, '\n', end - text)) != nullptr) {
+      if(overlong) {
+        overlong = false;
+      }
+      else {
+        analyze_line(text, line_end, csv_frequency, skipped);
+      }
+      text = line_end + 1;
+    }
+    kept = end - text;
+    if(count == 0) {
+      // last line without a newline
+      if(!overlong) {
+        analyze_line(text, end, csv_frequency, skipped);
+      }
+      break;
+    }
+    if(kept == READ_BUFFER) {
+      if(!overlong) {
+        (*skipped)++;
+        overlong = true;
+      }
+      kept = 0;
+    }
+    memmove(buffer, text, kept);
+  }
+}
+
+void print_time(const Station& station, uint64_t time) {
+  if(station.timed) {
+    printf("  %10.3fs  ", time / 1000.0);
+  }
+  else {
+    printf("  group %5llu  ", (unsigned long long)time);
+  }
+}
+
+void print_station(const Station& station) {
+  uint16_t pi = 0;
+  uint64_t pi_count = 0;
+  for(const auto& entry : station.pis) {
+    if(entry.second > pi_count) {
+      pi = entry.first;
+      pi_count = entry.second;
+    }
+  }
+  printf("== %.1f MHz  PI %04X  %llu groups", station.frequency / 10.0, pi, (unsigned long long)station.groups);
+  if(station.duplicates != 0) {
+    printf(", %llu repeated reads skipped", (unsigned long long)station.duplicates);
+  }
+  printf("\n");
+
+  printf("  group types:");
+  for(int i=0; i<32; i++) {
+    if(station.types[i] != 0) {
+      printf(" %d%c %llu", i / 2, (i % 2) ? 'B' : 'A', (unsigned long long)station.types[i]);
+    }
+  }
+  printf("\n");
+
+  // block A carries the PI, a different PI is a block A error (or another station)
+  printf("  PI mismatches: %.1f%%\n", 100.0 * (station.groups - pi_count) / station.groups);
+  if(station.has_bler) {
+    const char* levels[4] = {"0", "1-2", "3-5", "6+"};
+    printf("  block errors:");
+    for(int block=0; block<2; block++) {
+      const uint64_t* bler = block ? station.bler_b : station.bler_a;
+      printf("  %c", block ? 'B' : 'A');
+      for(int level=0; level<4; level++) {
+        printf(" %s:%.1f%%", levels[level], 100.0 * bler[level] / station.groups);
+      }
+    }
+    printf("\n");
+  }
+
+  for(const Event& event : station.timeline) {
+    print_time(station, event.time);
+    printf("%s \"%s\"\n", event.kind == 'P' ? "PS" : "RT", event.text.c_str());
+  }
+  printf("\n");
+}
+
+// Frequency from a file name like "path/950.csv", 0 if there is none
+int frequency_from_name(const char* path) {
+  const char* name = strrchr(path, '/');
+  name = (name == nullptr) ? path : name + 1;
+  int frequency = atoi(name);
+  return (frequency >= FREQ_MIN && frequency <= 1080) ? frequency : 0;
+}
+
+int main(int argc, char** argv) {
+  uint64_t min_groups = 20;
+  std::vector<const char*> paths;
+  for(int i=1; i<argc; i++) {
+    if(strcmp(argv[i], "--dump") == 0) {
+      dump = true;
+    }
+    else if(strcmp(argv[i], "--min-groups") == 0 && i + 1 < argc) {
+      min_groups = strtoull(argv[++i], nullptr, 10);
+    }
+    else {
+      paths.push_back(argv[i]);
+    }
+  }
+  if(paths.empty()) {
+    fprintf(stderr, "Usage: %s [--min-groups N] [--dump] session.log|station.csv|rds.bin...\n", argv[0]);
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  uint64_t skipped = 0;
+  for(const char* path : paths) {
+    FILE* file = fopen(path, "rb");
+    if(file == nullptr) {
+      fprintf(stderr, "Cannot open %s\n", path);
+      continue;
+    }
+    size_t length = strlen(path);
+    if(length > 4 && strcmp(path + length - 4, ".bin") == 0) {
+      analyze_capture(file);
+    }
+    else {
+      analyze_text(file, frequency_from_name(path), &skipped);
+    }
+    if(ferror(file)) {
+      fprintf(stderr, "Cannot read %s\n", path);
+    }
+    fclose(file);
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::string others;
+  for(const auto& entry : stations) {
+    if(entry.second.groups >= min_groups) {
+      print_station(entry.second);
+    }
+    else if(entry.second.groups != 0) {
+      char item[32];
+      snprintf(item, sizeof(item), " %.1f(%llu)", entry.first / 10.0, (unsigned long long)entry.second.groups);
+      others += item;
+    }
+  }
+  if(!others.empty()) {
+    printf("Stations under %llu groups:%s\n", (unsigned long long)min_groups, others.c_str());
+  }
+  fprintf(stderr, "%llu groups, %llu other lines in %.3fs (%.0f groups/s)\n", (unsigned long long)total_groups,
+    (unsigned long long)skipped, seconds, seconds > 0 ? total_groups / seconds : 0.0);
+  return 0;
+}
@@ -0,0 +1,509 @@
+// Host microbenchmarks for the radio core hot paths
+// Runs the firmware's own code (the headers without Arduino dependencies) on the PC:
+//   rds_byte_to_char, update_radiotext, clear_radiotext   software/master/rds_decoder.h
+//   freq_register, volume registers                      software/master/rda5807m.h (change_freq, change_vol)
+//   slave frame build, master reassembly                 software/master/metadata.h (build_frames on the slave,
+//                                                        packet receive in loop() on the master)
+//   JSON responses                                       software/master/json.h (ServerBegin handlers)
+//   state publish and read                               software/master/device_state.h (end of loop(), web
+//                                                        handlers)
+//   time shift encode and decode                         software/slave/adpcm.h (radio input and audio output tasks
+//                                                        on the slave, per 44.1kHz frame: ns x 44100 / 1e7 = % of
+//                                                        one PC core, the ESP32 share is not measured here)
+//   DSP chain                                            software/slave/dsp.h (output task, per Bluetooth sample)
+// Absolute numbers are for the PC, compare them against a baseline from the same machine.
+//
+// Build: g++ -O2 -std=c++17 -pthread -o benchmark benchmark.cpp
+// Usage: ./benchmark [--save baseline.txt] [--baseline baseline.txt] [--threshold 20] [--filter name]
+//        ./benchmark --stress seconds
+//   Output is one line per benchmark: name, ns per operation, baseline ns and change in % (tab separated).
+//   With --baseline, benchmarks slower than the baseline by more than --threshold % are marked REGRESSION and
+//   the exit code is 1.
+//   --stress publishes the device state from one thread while STRESS_READERS threads read it, and checks that
+//   every read is one whole published state. The exit code is 1 if a read was torn.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <cmath>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../software/master/rds_decoder.h"
+#include "../../software/master/rda5807m.h"
+#include "../../software/master/metadata.h"
+#include "../../software/master/json.h"
+#include "../../software/master/device_state.h"
+#include "../../software/slave/adpcm.h"
+#include "../../software/slave/dsp.h"
+
+#define BATCH_MS 20       // minimum time of one measured batch
+#define BATCHES 7         // best batch is reported
+#define STRESS_READERS 3
+
+// Keeps the compiler from removing the benchmarked work
+template<typename T>
+inline void keep(const T& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Best ns per operation over BATCHES batches, body runs ops operations per call
+template<typename F>
+double measure(F body, uint64_t ops) {
+  using clock = std::chrono::steady_clock;
+  uint64_t calls = 1;
+  // grow the batch until it takes BATCH_MS
+  while(true) {
+    auto start = clock::now();
+    for(uint64_t i=0; i<calls; i++) {
+      body();
+    }
+    double ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    if(ms >= BATCH_MS) {
+      break;
+    }
+    calls *= (ms < 1) ? 10 : 2;
+  }
+  double best = 1e300;
+  for(int batch=0; batch<BATCHES; batch++) {
+    auto start = clock::now();
+    for(uint64_t i=0; i<calls; i++) {
+      body();
+    }
+    double ns = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+    if(ns / (calls * ops) < best) {
+      best = ns / (calls * ops);
+    }
+  }
+  return best;
+}
+
+// Inputs
+
+// 2A group in requested_data layout (blocks A-D in bytes 4-11), segment address in block B
+void radiotext_group(uint8_t* arr, uint8_t segment, const char* text) {
+  memset(arr, 0, 12);
+  arr[4] = 0xa2; arr[5] = 0x02;
+  arr[6] = 0x20; arr[7] = segment & 0b1111;
+  memcpy(arr + 8, text + 4*segment, 4);
+}
+
+Metadata sample_metadata() {
+  Metadata metadata;
+  metadata_clear(&metadata);
+  const char* name = "Pixel 7 Pro";
+  const char* title = "A \"quoted\" song title that is long enough to need scrolling on the LCD";
+  const char* artist = "Some Artist feat. Another Artist";
+  const char* album = "The Album (Deluxe Edition)";
+  metadata_set(metadata.device_name, sizeof(metadata.device_name), name, strlen(name));
+  metadata_set(metadata.media_title, sizeof(metadata.media_title), title, strlen(title), METADATA_ELLIPSIS);
+  metadata_set(metadata.media_artist, sizeof(metadata.media_artist), artist, strlen(artist), METADATA_ELLIPSIS);
+  metadata_set(metadata.media_album, sizeof(metadata.media_album), album, strlen(album), METADATA_ELLIPSIS);
+  return metadata;
+}
+
+// Audio telemetry field as audio_telemetry() writes it: fill,target,underruns,lost,bitrate
+const char telemetry[] = "3072,2048,4,1280,328000";
+
+// Slave data as build_frames() writes it, returns the length
+uint16_t slave_data(uint8_t* data, const Metadata& metadata) {
+  return frame_build_data(data, 1, 1, 1, &metadata, telemetry, strlen(telemetry));
+}
+
+// Benchmarks
+
+typedef double (*Benchmark)();
+
+double bench_rds_byte_to_char() {
+  return measure([] {
+    for(int byte=0; byte<256; byte++) {
+      keep(rds_byte_to_char(byte));
+    }
+  }, 256);
+}
+
+double bench_update_radiotext() {
+  static const char text[] = "Mediacorp CLASS95 - Singapore's only English classical station  ";
+  static uint8_t groups[16][12];
+  for(int segment=0; segment<16; segment++) {
+    radiotext_group(groups[segment], segment, text);
+  }
+  static char radiotext_A[64], radiotext_B[32];
+  clear_radiotext(radiotext_A, radiotext_B);
+  return measure([] {
+    for(int segment=0; segment<16; segment++) {
+      update_radiotext(groups[segment], radiotext_A, radiotext_B, true);
+    }
+    keep(radiotext_A);
+  }, 16);
+}
+
+double bench_clear_radiotext() {
+  static char radiotext_A[64], radiotext_B[32];
+  return measure([] {
+    for(int i=0; i<16; i++) {
+      clear_radiotext(radiotext_A, radiotext_B);
+      keep(radiotext_A);
+    }
+  }, 16);
+}
+
+double bench_freq_register() {
+  static uint8_t tune_config[4] = {RDA_TUNE_02.high(), RDA_TUNE_02.low(), RDA_TUNE_03.high(), RDA_TUNE_03.low()};
+  return measure([] {
+    for(int frequency=FREQ_MIN; frequency<=FREQ_MAX; frequency++) {
+      freq_register(tune_config, frequency);
+      keep(tune_config);
+      keep(direct_freq_register(frequency).word);
+    }
+  }, FREQ_MAX - FREQ_MIN + 1);
+}
+
+double bench_volume_register() {
+  static uint8_t tune_config[4] = {RDA_TUNE_02.high(), RDA_TUNE_02.low(), RDA_TUNE_03.high(), RDA_TUNE_03.low()};
+  return measure([] {
+    for(int volume=0; volume<16; volume++) {
+      rda_set(tune_config, RDA_DMUTE, volume != 0);
+      keep(tune_config);
+      keep(volume_register(volume).word);
+    }
+  }, 16);
+}
+
+double bench_slave_frame_build() {
+  static Metadata metadata = sample_metadata();
+  static uint8_t frames[SLAVE_FRAMES][32];
+  return measure([] {
+    uint8_t data[SLAVE_FRAMES * SLAVE_FRAME_DATA];
+    uint16_t length = slave_data(data, metadata);
+    keep(frame_split(frames, data, length));
+    keep(frames);
+  }, 1);
+}
+
+double bench_master_reassembly() {
+  static Metadata sent = sample_metadata();
+  static uint8_t frames[SLAVE_FRAMES][32];
+  static uint8_t count;
+  uint8_t data[SLAVE_FRAMES * SLAVE_FRAME_DATA];
+  count = frame_split(frames, data, slave_data(data, sent));
+  static Metadata received;
+  metadata_clear(&received);
+  return measure([] {
+    static uint8_t datastring[SLAVE_FRAMES * SLAVE_FRAME_DATA];
+    for(int i=0; i<count; i++) {
+      frame_store(datastring, frames[i]);
+    }
+    uint16_t separator_pos[SLAVE_FIELDS];
+    if(frame_scan_fields(datastring, SLAVE_FRAME_DATA*count, separator_pos) != SLAVE_FIELDS) {
+      abort();
+    }
+    const char* fields = (const char*)datastring;
+    metadata_set(received.device_name, sizeof(received.device_name), fields + separator_pos[2] + 1, separator_pos[3] - separator_pos[2] - 1);
+    metadata_set(received.media_title, sizeof(received.media_title), fields + separator_pos[3] + 1, separator_pos[4] - separator_pos[3] - 1, METADATA_ELLIPSIS);
+    metadata_set(received.media_artist, sizeof(received.media_artist), fields + separator_pos[4] + 1, separator_pos[5] - separator_pos[4] - 1, METADATA_ELLIPSIS);
+    metadata_set(received.media_album, sizeof(received.media_album), fields + separator_pos[5] + 1, separator_pos[6] - separator_pos[5] - 1, METADATA_ELLIPSIS);
+    keep(received);
+  }, 1);
+}
+
+double bench_json_metadata() {
+  static Metadata metadata = sample_metadata();
+  return measure([] {
+    char buffer[1024];
+    JsonWriter json;
+    json_begin(&json, buffer, sizeof(buffer));
+    json_int(&json, "connection_state", 1);
+    json_int(&json, "playback_state", 1);
+    json_string(&json, "device_name", metadata.device_name);
+    json_string(&json, "media_title", metadata.media_title);
+    json_string(&json, "media_artist", metadata.media_artist);
+    json_string(&json, "media_album", metadata.media_album);
+    keep(json_end(&json));
+  }, 1);
+}
+
+double bench_json_update() {
+  return measure([] {
+    char buffer[256];
+    JsonWriter json;
+    json_begin(&json, buffer, sizeof(buffer));
+    json_int(&json, "frequency", 950);
+    json_int(&json, "volume", 4);
+    json_string(&json, "radiotext", "Mediacorp CLASS95 - Singapore's only English classical station");
+    keep(json_end(&json));
+  }, 1);
+}
+
+// loop() end: the loop's variables into the state, one field changed
+double bench_state_publish() {
+  static Metadata metadata = sample_metadata();
+  static int frequency = 870;
+  return measure([] {
+    frequency = (frequency == 1080) ? 870 : frequency + 1;
+    state_set_frequency(frequency);
+    state_set_volume(4);
+    state_set_ready(true);
+    state_set_bluetooth(false, 0, 0);
+    state_set_radiotext("Mediacorp CLASS95 - Singapore's only English classical station");
+    state_set_metadata(&metadata);
+    keep(state_publish());
+  }, 1);
+}
+
+double bench_state_read() {
+  return measure([] {
+    DeviceState state;
+    state_read(&state);
+    keep(state);
+  }, 1);
+}
+
+// Radio block of the input task: 256 frames of music-like audio (two tones and noise), one block in 4 completes
+double bench_timeshift_encode() {
+  static int16_t frames[256 * 2];
+  uint32_t seed = 1;
+  for(int i=0; i<256; i++) {
+    seed = seed * 1103515245 + 12345;
+    double t = i / 44100.0;
+    frames[2*i] = (int16_t)(8000 * sin(2 * M_PI * 440 * t) + 3000 * sin(2 * M_PI * 3150 * t) + (int)(seed >> 20) - 2048);
+    frames[2*i + 1] = (int16_t)(8000 * sin(2 * M_PI * 440 * t + 0.5) + (int)(seed >> 21) - 1024);
+  }
+  static AdpcmEncoder encoder;
+  adpcm_encoder_begin(&encoder);
+  static uint8_t ring[ADPCM_BLOCK_BYTES];
+  return measure([] {
+    const int16_t* block = frames;
+    uint32_t count = 256;
+    while(count > 0) {
+      bool full;
+      uint32_t used = adpcm_encode(&encoder, block, count, &full);
+      if(full) {
+        memcpy(ring, encoder.block, ADPCM_BLOCK_BYTES);
+      }
+      block += 2 * used;
+      count -= used;
+    }
+    keep(ring);
+  }, 256);
+}
+
+// One ring block back to 44.1kHz stereo, as the output task plays it behind live
+double bench_timeshift_decode() {
+  static int16_t frames[ADPCM_BLOCK_FRAMES * 2];
+  for(int i=0; i<ADPCM_BLOCK_FRAMES; i++) {
+    frames[2*i] = frames[2*i + 1] = (int16_t)(8000 * sin(2 * M_PI * 440 * i / 44100.0));
+  }
+  static AdpcmEncoder encoder;
+  adpcm_encoder_begin(&encoder);
+  bool full = false;
+  adpcm_encode(&encoder, frames, ADPCM_BLOCK_FRAMES, &full);
+  static uint8_t block[ADPCM_BLOCK_BYTES];
+  memcpy(block, encoder.block, ADPCM_BLOCK_BYTES);
+  return measure([] {
+    static int16_t decoded[ADPCM_BLOCK_FRAMES * 2];
+    static int16_t previous = 0;
+    adpcm_decode_block(block, decoded, &previous);
+    keep(decoded);
+  }, ADPCM_BLOCK_FRAMES);
+}
+
+// EQ, loudness and limiter on one output block of 256 frames (music-like, loudness on), per sample
+double bench_dsp_chain() {
+  static int16_t input[256 * 2];
+  uint32_t seed = 1;
+  for(int i=0; i<256; i++) {
+    seed = seed * 1103515245 + 12345;
+    double t = i / 44100.0;
+    input[2*i] = (int16_t)(12000 * sin(2 * M_PI * 110 * t) + 6000 * sin(2 * M_PI * 2500 * t) + (int)(seed >> 20) - 2048);
+    input[2*i + 1] = (int16_t)(12000 * sin(2 * M_PI * 110 * t + 0.5) + (int)(seed >> 21) - 1024);
+  }
+  static DspChain dsp;
+  dsp_begin(&dsp);
+  dsp_set_volume(&dsp, 64);
+  return measure([] {
+    static int16_t block[256 * 2];
+    memcpy(block, input, sizeof(block));
+    dsp_process(&dsp, block, 256);
+    keep(block);
+  }, 256 * 2);
+}
+
+// Writer publishes states whose fields all encode the same number, readers check every copy they get
+int stress_state(double seconds) {
+  Metadata metadata;
+  metadata_clear(&metadata);
+  metadata_set(metadata.media_title, sizeof(metadata.media_title), "0", 1);
+  metadata_set(metadata.media_album, sizeof(metadata.media_album), "0", 1);
+  state_set_frequency(0);
+  state_set_volume(0);
+  state_set_radiotext("0");
+  state_set_metadata(&metadata);
+  state_publish();
+
+  std::atomic<bool> stop(false);
+  std::atomic<uint64_t> reads(0), torn(0);
+  std::vector<std::thread> readers;
+  for(int i=0; i<STRESS_READERS; i++) {
+    readers.emplace_back([&] {
+      uint64_t count = 0;
+      while(!stop.load(std::memory_order_relaxed)) {
+        DeviceState state;
+        state_read(&state);
+        char expected[16];
+        snprintf(expected, sizeof(expected), "%d", state.frequency);
+        if(strcmp(state.radiotext, expected) != 0 || strcmp(state.metadata.media_title, expected) != 0
+           || strcmp(state.metadata.media_album, expected) != 0 || state.volume != (uint8_t)state.frequency) {
+          torn++;
+        }
+        count++;
+      }
+      reads += count;
+    });
+  }
+
+  uint64_t publishes = 0;
+  auto end = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+  while(std::chrono::steady_clock::now() < end) {
+    for(int i=0; i<1000; i++) {
+      int value = (int)(publishes++ % 100000) + 1;
+      char text[16];
+      int length = snprintf(text, sizeof(text), "%d", value);
+      metadata_set(metadata.media_title, sizeof(metadata.media_title), text, length);
+      metadata_set(metadata.media_album, sizeof(metadata.media_album), text, length);
+      state_set_frequency(value);
+      state_set_volume((uint8_t)value);
+      state_set_radiotext(text);
+      state_set_metadata(&metadata);
+      state_publish();
+    }
+  }
+  stop = true;
+  for(auto& reader : readers) {
+    reader.join();
+  }
+  printf("publishes\t%llu\nreads\t%llu\ntorn\t%llu\n", (unsigned long long)publishes,
+    (unsigned long long)reads.load(), (unsigned long long)torn.load());
+  return torn == 0 ? 0 : 1;
+}
+
+const struct {
+  const char* name;
+  Benchmark run;
+} benchmarks[] = {
+  {"rds_byte_to_char", bench_rds_byte_to_char},
+  {"update_radiotext", bench_update_radiotext},
+  {"clear_radiotext", bench_clear_radiotext},
+  {"freq_register", bench_freq_register},
+  {"volume_register", bench_volume_register},
+  {"slave_frame_build", bench_slave_frame_build},
+  {"master_reassembly", bench_master_reassembly},
+  {"json_metadata", bench_json_metadata},
+  {"json_update", bench_json_update},
+  {"state_publish", bench_state_publish},
+  {"state_read", bench_state_read},
+  {"timeshift_encode", bench_timeshift_encode},
+  {"timeshift_decode", bench_timeshift_decode},
+  {"dsp_chain", bench_dsp_chain},
+};
+
+// Baseline file: "name ns" per line, # comments
+std::map<std::string, double> read_baseline(const char* path) {
+  std::map<std::string, double> baseline;
+  FILE* file = fopen(path, "r");
+  if(file == nullptr) {
+    fprintf(stderr, "Cannot open baseline %s\n", path);
+    exit(2);
+  }
+  char line[256];
+  while(fgets(line, sizeof(line), file) != nullptr) {
+    char name[128];
+    double ns;
+    if(line[0] != '#' && sscanf(line, "%127s %lf", name, &ns) == 2) {
+      baseline[name] = ns;
+    }
+  }
+  fclose(file);
+  return baseline;
+}
+
+int main(int argc, char** argv) {
+  const char* save_path = nullptr;
+  const char* baseline_path = nullptr;
+  const char* filter = nullptr;
+  double threshold = 20;
+  for(int i=1; i<argc; i++) {
+    if(strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+      save_path = argv[++i];
+    }
+    else if(strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+      baseline_path = argv[++i];
+    }
+    else if(strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+      threshold = atof(argv[++i]);
+    }
+    else if(strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      filter = argv[++i];
+    }
+    else if(strcmp(argv[i], "--stress") == 0 && i + 1 < argc) {
+      return stress_state(atof(argv[++i]));
+    }
+    else {
+      fprintf(stderr, "Usage: %s [--save file] [--baseline file] [--threshold percent] [--filter name] | --stress seconds\n", argv[0]);
+      return 2;
+    }
+  }
+
+  std::map<std::string, double> baseline;
+  if(baseline_path != nullptr) {
+    baseline = read_baseline(baseline_path);
+  }
+  FILE* save = nullptr;
+  if(save_path != nullptr) {
+    save = fopen(save_path, "w");
+    if(save == nullptr) {
+      fprintf(stderr, "Cannot write %s\n", save_path);
+      return 2;
+    }
+    fprintf(save, "# benchmark ns_per_op\n");
+  }
+
+  int regressions = 0;
+  printf("benchmark\tns_per_op\tbaseline\tchange\n");
+  for(const auto& benchmark : benchmarks) {
+    if(filter != nullptr && strstr(benchmark.name, filter) == nullptr) {
+      continue;
+    }
+    double ns = benchmark.run();
+    printf("%s\t%.3f", benchmark.name, ns);
+    auto entry = baseline.find(benchmark.name);
+    if(entry != baseline.end()) {
+      double change = 100.0 * (ns - entry->second) / entry->second;
+      printf("\t%.3f\t%+.1f%%", entry->second, change);
+      if(change > threshold) {
+        printf("\tREGRESSION");
+        regressions++;
+      }
+    }
+    else {
+      printf("\t-\t-");
+    }
+    printf("\n");
+    if(save != nullptr) {
+      fprintf(save, "%s %.3f\n", benchmark.name, ns);
+    }
+  }
+  if(save != nullptr) {
+    fclose(save);
+  }
+  if(regressions != 0) {
+    fprintf(stderr, "%d benchmarks slower than the baseline by more than %.0f%%\n", regressions, threshold);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,2081 @@
+// Host tests for firmware logic that does not need the hardware
+// Runs the firmware's own code (the headers without Arduino dependencies) on the PC against simulated inputs:
+//   bt_jitter       software/slave/audio_ring.h: Bluetooth ring depth with late bursts and dropped packets
+//   radio_drift     software/slave/audio_ring.h: radio ring with the RDA5807M clock off by up to 200ppm
+//   dsp_biquads     software/slave/dsp.h: fixed point EQ and loudness against double precision RBJ biquads
+//   dsp_limiter     software/slave/dsp.h: limiter against a double precision model, never over the threshold
+//   encoder         software/master/quadrature.h: knob turns, contact bounce, invalid transitions, acceleration
+//   slave_frames    software/master/metadata.h: slave packet double buffer, latch at packet 0, SLAVE_SERVE_MS
+//   metadata_soak   software/master/metadata.h: slots and slave packets round trip, no heap allocations
+//   ota_upload      software/master/ota_upload.h: master upload over a local HTTP connection, token, 409, aborts
+//   ota_forward     software/master/ota_upload.h, ota_protocol.h: slave image over a lossy bus, CRC, resend, window
+//   af_replay       software/master/af_follow.h: AF checks, switch margin, PI verification, muted time per check
+//   ta_replay       software/master/ta_monitor.h: TA on/off, clear group hysteresis, TA_LOST_MS, EON confirm/timeout
+//   volume_path     software/master/rda_control.h: volume knob on a simulated register file, 0x05 only, frames
+//   tune_sweep      software/master/rda_control.h: 100 detent knob sweeps, latest target only, one tune in flight
+//   power_duty      software/master/power_model.h: loop() wait schedule per mode, duty cycle, average current
+//   lcd_runs        software/master/lcd_shadow.h: LCD redraws split into runs over loop passes, frequency cells sent
+// Time is simulated, the tests are deterministic and take a few seconds (ota_upload needs a socket on 127.0.0.1).
+//
+// Build: g++ -O2 -std=c++17 -pthread -o host_tests host_tests.cpp
+// Usage: ./host_tests [--filter name]
+//   Output is one line per test: name, PASS or FAIL, and what was measured (tab separated). Failed checks are
+//   printed above their test. The exit code is 1 if a test failed.
+
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../../software/slave/audio_ring.h"
+#include "../../software/slave/dsp.h"
+#include "../../software/master/quadrature.h"
+#include "../../software/master/metadata.h"
+#include "../../software/master/constants.h"
+#include "../../software/master/ota_upload.h"
+#undef AF_MAX                         // socket address families, af_follow.h has its own
+#include "../../software/master/af_follow.h"
+#include "../../software/master/ta_monitor.h"
+#include "../../software/master/rda_control.h"
+#include "../../software/master/power_model.h"
+#include "../../software/master/lcd_shadow.h"
+
+// Failed checks of the running test
+int failures = 0;
+std::string summary;
+
+#define CHECK(condition, ...) do { \
+  if(!(condition)) { \
+    printf("  %s:%d: ", __FILE__, __LINE__); \
+    printf(__VA_ARGS__); \
+    printf("\n"); \
+    failures++; \
+  } \
+} while(0)
+
+// Heap allocations of the whole program (operator new and, with glibc, malloc), for tests that must not
+// allocate. Only the difference over a test's loop counts, printf and std::string allocate as well
+uint64_t allocations = 0;
+
+#ifdef __GLIBC__
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* pointer, size_t size);
+extern "C" void* malloc(size_t size) { allocations++; return __libc_malloc(size); }
+extern "C" void* calloc(size_t count, size_t size) { allocations++; return __libc_calloc(count, size); }
+extern "C" void* realloc(void* pointer, size_t size) { allocations++; return __libc_realloc(pointer, size); }
+#endif
+
+void* operator new(size_t size) {
+  allocations++;
+  void* pointer = malloc(size);
+  if(pointer == nullptr) throw std::bad_alloc();
+  return pointer;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* pointer) noexcept { free(pointer); }
+void operator delete[](void* pointer) noexcept { free(pointer); }
+void operator delete(void* pointer, size_t) noexcept { free(pointer); }
+void operator delete[](void* pointer, size_t) noexcept { free(pointer); }
+
+// Deterministic pseudo random numbers
+uint32_t random_state = 1;
+uint32_t random_next() {
+  random_state = random_state * 1103515245 + 12345;
+  return random_state >> 8;
+}
+
+// Measured values for the result line
+void report(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void report(const char* format, ...) {
+  char text[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+  if(!summary.empty()) summary += ", ";
+  summary += text;
+}
+
+// Tests
+
+// Output task every block against the BT_JITTER_TEST source: 512 frame packets, 10% late by up to 60ms (they
+// arrive together with the following ones). 2 minutes late packets only: the target deepens until the bursts are
+// covered. 1 minute with 2% of the packets dropped as well: every drop drains the ring by a packet, playback has
+// to resume after each underrun. 3 minutes clean: no underruns, the target shrinks back to BT_TARGET_MIN
+void test_bt_jitter() {
+  static FrameRing ring;
+  memset(&ring, 0, sizeof(ring));
+  BtDepth depth;
+  bt_depth_begin(&depth);
+  static int16_t packet[512 * 2];
+  static int16_t block[AUDIO_BLOCK_FRAMES * 2];
+  random_state = 1;
+
+  const uint64_t late_us = 120 * 1000000ULL;
+  const uint64_t drops_us = late_us + 60 * 1000000ULL;
+  const uint64_t end_us = drops_us + 180 * 1000000ULL;   // > 3 x BT_STABLE_MS
+  uint64_t packet_due = 0;      // stream clock of the next packet
+  uint64_t packet_arrival = 0;
+  uint64_t last_data = 0;
+  uint32_t max_target = 0;
+  uint32_t underruns[4] = {0};  // first and second minute late, drops, clean
+  uint32_t drop_blocks = 0, drop_played = 0;
+  uint64_t output_us = 0;
+  uint64_t output_blocks = 0;
+
+  while(output_us < end_us) {
+    // packets that arrived before this output block
+    while(packet_arrival <= output_us) {
+      bool jittery = packet_due < drops_us;
+      if(packet_due < late_us || packet_due >= drops_us || random_next() % 50 != 0) {
+        ring_write(&ring, packet, 512);
+        last_data = packet_arrival;
+      }
+      packet_due += 512 * 1000000ULL / AUDIO_SAMPLE_RATE;
+      uint64_t late = (jittery && random_next() % 10 == 0) ? random_next() % 60000 : 0;
+      // a late packet holds back the ones behind it
+      packet_arrival = (packet_due + late > packet_arrival) ? packet_due + late : packet_arrival;
+    }
+
+    bool streaming = output_us - last_data <= BT_PAUSE_MS * 1000ULL;
+    uint32_t before = ring.underruns;
+    bool buffering = depth.buffering;
+    bt_ring_block(&ring, &depth, block, streaming, true, (uint32_t)(output_us / 1000));
+    int phase = (output_us < late_us / 2) ? 0 : (output_us < late_us) ? 1 : (output_us < drops_us) ? 2 : 3;
+    underruns[phase] += ring.underruns - before;
+    if(phase == 2) {
+      drop_blocks++;
+      if(!buffering) drop_played++;
+    }
+    CHECK(depth.target >= BT_TARGET_MIN && depth.target <= BT_TARGET_MAX, "target %u out of range", depth.target);
+    if(depth.target > max_target) max_target = depth.target;
+    output_blocks++;
+    output_us = output_blocks * AUDIO_BLOCK_FRAMES * 1000000ULL / AUDIO_SAMPLE_RATE;
+  }
+
+  CHECK(underruns[0] > 0, "late packets never underran, the test does not test anything");
+  // once deep enough, the target is probed one step lower every BT_STABLE_MS, which may cost an underrun each
+  CHECK(underruns[1] <= 60000 / BT_STABLE_MS, "no adaptation: %u underruns in the first minute, %u in the second",
+    underruns[0], underruns[1]);
+  CHECK(drop_played >= drop_blocks * 8 / 10, "with drops only %u of %u blocks played", drop_played, drop_blocks);
+  CHECK(underruns[3] == 0, "%u underruns with a clean source", underruns[3]);
+  CHECK(depth.target == BT_TARGET_MIN, "target %u did not shrink back to %u", depth.target, BT_TARGET_MIN);
+  report("underruns %u/%u late, %u with drops (%u%% played), %u clean, max target %u, overruns %u", underruns[0],
+    underruns[1], underruns[2], drop_blocks ? 100 * drop_played / drop_blocks : 0, underruns[3], max_target,
+    ring.overruns);
+}
+
+// Radio input written in DMA blocks of AUDIO_BLOCK_FRAMES at 44.1kHz x (1 + ppm), with up to 1ms of task
+// jitter, output at 44.1kHz. After priming the ring never underruns or overruns and the fill stays in the band,
+// skipped minus repeated frames follow the drift
+void test_radio_drift() {
+  const int ppms[] = {-200, -50, 0, 50, 200};
+  static FrameRing ring;
+  static int16_t input[AUDIO_BLOCK_FRAMES * 2];
+  static int16_t block[AUDIO_BLOCK_FRAMES * 2];
+  // input frames count up, the output has to play them in order with at most one frame skipped or repeated
+  uint32_t worst_gap = 0;
+  for(int ppm : ppms) {
+    memset(&ring, 0, sizeof(ring));
+    RadioDrift drift;
+    memset(&drift, 0, sizeof(drift));
+    radio_drift_reset(&drift);
+    random_state = 7;
+
+    const double seconds = 600;
+    const double input_rate = AUDIO_SAMPLE_RATE * (1 + ppm * 1e-6);
+    uint64_t input_blocks = 0, output_blocks = 0;
+    uint32_t written = 0;
+    uint32_t underruns = 0;
+    uint32_t min_fill = UINT32_MAX, max_fill = 0;
+    int32_t last = -1;
+    bool playing = false;
+    while(output_blocks * AUDIO_BLOCK_FRAMES < seconds * AUDIO_SAMPLE_RATE) {
+      double output_s = (double)output_blocks * AUDIO_BLOCK_FRAMES / AUDIO_SAMPLE_RATE;
+      // input blocks complete at the input rate, the task wakes up to 1ms later
+      while(true) {
+        double input_s = (double)(input_blocks + 1) * AUDIO_BLOCK_FRAMES / input_rate + (random_next() % 1000) * 1e-6;
+        if(input_s > output_s) break;
+        for(int i=0; i<AUDIO_BLOCK_FRAMES; i++) {
+          input[2*i] = (int16_t)(written & 0x7fff);
+          input[2*i + 1] = (int16_t)(written >> 15);
+          written++;
+        }
+        ring_write(&ring, input, AUDIO_BLOCK_FRAMES);
+        input_blocks++;
+      }
+
+      uint32_t fill = ring_fill(&ring);
+      if(!radio_ring_block(&ring, &drift, block)) {
+        underruns++;
+      }
+      if(!drift.priming && playing) {
+        if(fill < min_fill) min_fill = fill;
+        if(fill > max_fill) max_fill = fill;
+      }
+      if(!drift.priming) {
+        for(int i=0; i<AUDIO_BLOCK_FRAMES; i++) {
+          int32_t frame = (uint16_t)block[2*i] | (int32_t)(uint16_t)block[2*i + 1] << 15;
+          if(last >= 0 && playing) {
+            uint32_t gap = (uint32_t)abs(frame - last);
+            if(gap > worst_gap) worst_gap = gap;
+          }
+          last = frame;
+        }
+        playing = true;
+      }
+      output_blocks++;
+    }
+
+    int32_t drift_frames = (int32_t)(written - ring_fill(&ring)) - (int32_t)(output_blocks * AUDIO_BLOCK_FRAMES);
+    int32_t corrected = (int32_t)drift.skipped - (int32_t)drift.repeated;
+    CHECK(underruns == 0, "%+dppm: %u underruns", ppm, underruns);
+    CHECK(ring.overruns == 0, "%+dppm: %u frames overran", ppm, ring.overruns);
+    CHECK(min_fill + AUDIO_BLOCK_FRAMES >= RADIO_TARGET_FRAMES - RADIO_SLIP_FRAMES &&
+      max_fill <= RADIO_TARGET_FRAMES + RADIO_SLIP_FRAMES + 2 * AUDIO_BLOCK_FRAMES,
+      "%+dppm: fill %u-%u out of the band", ppm, min_fill, max_fill);
+    // frames before the output started playing are not corrected
+    CHECK(abs(drift_frames - corrected) <= RADIO_TARGET_FRAMES + RADIO_SLIP_FRAMES + AUDIO_BLOCK_FRAMES,
+      "%+dppm: %d frames of drift, %d corrected", ppm, drift_frames, corrected);
+    if(ppm == 0) {
+      CHECK(drift.skipped + drift.repeated <= 2, "0ppm: %u skipped, %u repeated", drift.skipped, drift.repeated);
+    }
+    report("%+dppm %u/%u", ppm, drift.skipped, drift.repeated);
+  }
+  // a skipped frame is a gap of 2, a repeated one 0
+  CHECK(worst_gap <= 2, "frames out of order, gap %u", worst_gap);
+}
+
+// Double precision RBJ audio EQ cookbook biquad, Direct Form I per channel, output saturated to 16 bits like
+// every stage of the firmware chain but not rounded
+struct ReferenceBiquad {
+  double b0, b1, b2, a1, a2;
+  double x1[2], x2[2], y1[2], y2[2];
+};
+
+void reference_design(ReferenceBiquad* bq, uint8_t type, double freq, double q, double gain_db) {
+  memset(bq, 0, sizeof(ReferenceBiquad));
+  double a = pow(10.0, gain_db / 40.0);
+  double w0 = 2.0 * M_PI * freq / 44100.0;
+  double alpha = sin(w0) / (2.0 * q);
+  double b0, b1, b2, a0, a1, a2;
+  if(type == DSP_HIGHPASS) {
+    b0 = (1 + cos(w0)) / 2; b1 = -(1 + cos(w0)); b2 = (1 + cos(w0)) / 2;
+    a0 = 1 + alpha; a1 = -2 * cos(w0); a2 = 1 - alpha;
+  }
+  else if(type == DSP_PEAK) {
+    b0 = 1 + alpha * a; b1 = -2 * cos(w0); b2 = 1 - alpha * a;
+    a0 = 1 + alpha / a; a1 = -2 * cos(w0); a2 = 1 - alpha / a;
+  }
+  else if(type == DSP_LOWSHELF) {
+    b0 = a * ((a + 1) - (a - 1) * cos(w0) + 2 * sqrt(a) * alpha);
+    b1 = 2 * a * ((a - 1) - (a + 1) * cos(w0));
+    b2 = a * ((a + 1) - (a - 1) * cos(w0) - 2 * sqrt(a) * alpha);
+    a0 = (a + 1) + (a - 1) * cos(w0) + 2 * sqrt(a) * alpha;
+    a1 = -2 * ((a - 1) + (a + 1) * cos(w0));
+    a2 = (a + 1) + (a - 1) * cos(w0) - 2 * sqrt(a) * alpha;
+  }
+  else {
+    b0 = a * ((a + 1) + (a - 1) * cos(w0) + 2 * sqrt(a) * alpha);
+    b1 = -2 * a * ((a - 1) + (a + 1) * cos(w0));
+    b2 = a * ((a + 1) + (a - 1) * cos(w0) - 2 * sqrt(a) * alpha);
+    a0 = (a + 1) - (a - 1) * cos(w0) + 2 * sqrt(a) * alpha;
+    a1 = 2 * ((a - 1) - (a + 1) * cos(w0));
+    a2 = (a + 1) - (a - 1) * cos(w0) - 2 * sqrt(a) * alpha;
+  }
+  bq->b0 = b0 / a0; bq->b1 = b1 / a0; bq->b2 = b2 / a0; bq->a1 = a1 / a0; bq->a2 = a2 / a0;
+}
+
+double reference_biquad(ReferenceBiquad* bq, int ch, double x) {
+  double y = bq->b0 * x + bq->b1 * bq->x1[ch] + bq->b2 * bq->x2[ch] - bq->a1 * bq->y1[ch] - bq->a2 * bq->y2[ch];
+  y = std::max(-32768.0, std::min(32767.0, y));
+  bq->x2[ch] = bq->x1[ch]; bq->x1[ch] = x;
+  bq->y2[ch] = bq->y1[ch]; bq->y1[ch] = y;
+  return y;
+}
+
+// Test signal: log chirp 20Hz-20kHz on the left, 1kHz plus noise on the right, peak amplitude level
+void dsp_signal(int16_t* samples, int frames, int offset, double level) {
+  uint32_t seed = 99 + offset;
+  for(int i=0; i<frames; i++) {
+    double t = (offset + i) / 44100.0;
+    double phase = 2 * M_PI * 20 * 10.0 * (pow(1000.0, t / 10.0) - 1) / log(1000.0);
+    seed = seed * 1103515245 + 12345;
+    double noise = ((int32_t)(seed >> 16) % 2000 - 1000) / 1000.0;
+    samples[2*i] = (int16_t)lrint(level * sin(phase));
+    samples[2*i + 1] = (int16_t)lrint(level * (0.8 * sin(2 * M_PI * 1000 * t) + 0.2 * noise));
+  }
+}
+
+// EQ and loudness of the firmware (Q28 coefficients, 64-bit accumulators with second order error feedback)
+// against double precision biquads designed independently from the same bands. 10s of signal at -6dBFS for
+// volume 127, 64 and 0 (loudness off, half, full). Tolerance: 6 LSB peak, 1.5 LSB RMS. Q28 rounding moves
+// the poles by ~1e-8, which is negligible; the error is the 16-bit output of each of the 5 stages: truncation
+// noise shaped by (1 - z^-1)^2 is up to 2 LSB peak and 0.71 LSB RMS per stage, and the following stages
+// (loudness up to +9dB) amplify it
+void test_dsp_biquads() {
+  const uint8_t volumes[] = {127, 64, 0};
+  const int frames = 441000;
+  static int16_t block[AUDIO_BLOCK_FRAMES * 2];
+  static int16_t input[AUDIO_BLOCK_FRAMES * 2];
+  for(uint8_t volume : volumes) {
+    DspChain dsp;
+    dsp_begin(&dsp);
+    dsp_design_loudness(&dsp, volume);
+
+    ReferenceBiquad reference[DSP_EQ_BANDS + 2];
+    for(int i=0; i<DSP_EQ_BANDS; i++) {
+      reference_design(&reference[i], dsp_eq_bands[i].type, dsp_eq_bands[i].freq, dsp_eq_bands[i].q, dsp_eq_bands[i].gain_db);
+    }
+    double quietness = 1.0 - volume / 127.0;
+    reference_design(&reference[DSP_EQ_BANDS], DSP_LOWSHELF, 150.0, 0.707, 9.0 * quietness);
+    reference_design(&reference[DSP_EQ_BANDS + 1], DSP_HIGHSHELF, 8000.0, 0.707, 4.0 * quietness);
+
+    double peak = 0, square = 0;
+    for(int offset=0; offset<frames; offset+=AUDIO_BLOCK_FRAMES) {
+      dsp_signal(input, AUDIO_BLOCK_FRAMES, offset, 16384);
+      memcpy(block, input, sizeof(block));
+      for(int i=0; i<DSP_EQ_BANDS; i++) {
+        dsp_biquad(&dsp.eq[i], block, AUDIO_BLOCK_FRAMES);
+      }
+      dsp_biquad(&dsp.loudness_low, block, AUDIO_BLOCK_FRAMES);
+      dsp_biquad(&dsp.loudness_high, block, AUDIO_BLOCK_FRAMES);
+
+      for(int i=0; i<AUDIO_BLOCK_FRAMES * 2; i++) {
+        double y = input[i];
+        for(int f=0; f<DSP_EQ_BANDS + 2; f++) {
+          y = reference_biquad(&reference[f], i & 1, y);
+        }
+        double error = fabs(block[i] - y);
+        peak = std::max(peak, error);
+        square += error * error;
+      }
+    }
+    double rms = sqrt(square / (frames * 2.0));
+    CHECK(peak <= 6.0 && rms <= 1.5, "volume %u: error %.2f LSB peak, %.3f LSB RMS", volume, peak, rms);
+    report("volume %u %.2f/%.3f LSB", volume, peak, rms);
+  }
+}
+
+// Limiter against a double precision model of what dsp.h promises: output = input delayed by
+// DSP_LIMITER_FRAMES x a gain that ramps linearly over each 32 frame sub-block to the lowest of the release
+// step towards unity, threshold / peak of the sub-block played and threshold / peak of the next one. The
+// release is a step of whole Q15 units rounded up (reaching unity), as in the firmware: a continuous release
+// only gets within 1/32768 of unity after 260 steps and drifts away from it by up to 15 LSB.
+// 10s of chirp and noise from -20dBFS up to full scale and back. Checks: no output sample over
+// DSP_LIMITER_THRESHOLD, error against the model 3 LSB peak (1 LSB each for the Q15 limit rounded down, the
+// release step of that rounded gain and the truncating multiply), unity gain and exact delay while the input
+// stays under the threshold
+void test_dsp_limiter() {
+  Limiter limiter;
+  memset(&limiter, 0, sizeof(limiter));
+  limiter.gain = 32767;
+  const int frames = 441000;
+  static int16_t block[AUDIO_BLOCK_FRAMES * 2];
+  static int16_t input[AUDIO_BLOCK_FRAMES * 2];
+  static int16_t delayed[DSP_LIMITER_FRAMES * 2];
+  memset(delayed, 0, sizeof(delayed));
+  double delayed_peak = 0;
+  double gain = 32767 / 32768.0;
+  double peak_error = 0;
+  int32_t over = 0, quiet_mismatches = 0;
+  double min_gain = 1.0;
+  for(int offset=0; offset<frames; offset+=AUDIO_BLOCK_FRAMES) {
+    // level ramps from 3277 up to 32767 at 5s and back down
+    double position = fabs(offset - frames / 2.0) / (frames / 2.0);
+    double level = 32767 * pow(10.0, -position);
+    dsp_signal(input, AUDIO_BLOCK_FRAMES, offset, level);
+    memcpy(block, input, sizeof(block));
+    dsp_limiter(&limiter, block, AUDIO_BLOCK_FRAMES);
+
+    for(int start=0; start<AUDIO_BLOCK_FRAMES; start+=DSP_LIMITER_FRAMES) {
+      const int16_t* incoming = input + 2*start;
+      double peak = 0;
+      for(int i=0; i<DSP_LIMITER_FRAMES * 2; i++) {
+        peak = std::max(peak, fabs((double)incoming[i]));
+      }
+      double gain_end = gain + ceil((32767 / 32768.0 - gain) * DSP_LIMITER_RELEASE) / 32768.0;
+      if(delayed_peak > DSP_LIMITER_THRESHOLD) gain_end = std::min(gain_end, DSP_LIMITER_THRESHOLD / delayed_peak);
+      if(peak > DSP_LIMITER_THRESHOLD) gain_end = std::min(gain_end, DSP_LIMITER_THRESHOLD / peak);
+      // under the threshold and the look-ahead does not see a peak coming either
+      bool quiet = delayed_peak <= DSP_LIMITER_THRESHOLD && peak <= DSP_LIMITER_THRESHOLD && gain >= 32767 / 32768.0;
+      for(int i=0; i<DSP_LIMITER_FRAMES; i++) {
+        double g = gain + (gain_end - gain) * (i + 1) / DSP_LIMITER_FRAMES;
+        for(int ch=0; ch<2; ch++) {
+          int16_t out = block[2*(start + i) + ch];
+          double expected = delayed[2*i + ch] * g;
+          peak_error = std::max(peak_error, fabs(out - expected));
+          if(abs(out) > DSP_LIMITER_THRESHOLD) over++;
+          // unity gain in Q15 is 32767/32768, the truncating multiply takes at most 1 LSB off
+          if(quiet && abs(out - delayed[2*i + ch]) > 1) quiet_mismatches++;
+        }
+      }
+      memcpy(delayed, incoming, sizeof(delayed));
+      delayed_peak = peak;
+      gain = gain_end;
+      min_gain = std::min(min_gain, gain);
+    }
+  }
+  CHECK(over == 0, "%d samples over the threshold", over);
+  CHECK(peak_error <= 3.0, "error %.2f LSB peak against the model", peak_error);
+  CHECK(quiet_mismatches == 0, "%d samples changed by more than 1 LSB under the threshold", quiet_mismatches);
+  CHECK(min_gain < 0.95, "the limiter never limited, the test does not test anything");
+  report("error %.2f LSB peak, lowest gain %.3f", peak_error, min_gain);
+}
+
+// Pin states (CLK << 1 | DT) fed to the decoder gap_us apart, returns the summed channel steps and detents
+int32_t encoder_feed(Quadrature* knob, const uint8_t* states, int count, uint32_t* now_us, uint32_t gap_us, int32_t* detents) {
+  int32_t channels = 0;
+  for(int i=0; i<count; i++) {
+    *now_us += gap_us;
+    int32_t step = quadrature_update(knob, states[i], *now_us);
+    if(step != 0) {
+      channels += step;
+      *detents += (step > 0) ? 1 : -1;
+    }
+  }
+  return channels;
+}
+
+// Detents from the knob's pin sequences. Clockwise 11 -> 01 -> 00 -> 10 -> 11 and back. Bounce: every edge
+// chatters a few times before it settles. Invalid: both pins change at once (a missed sample), which counts
+// nothing by itself; a detent needs half a detent of valid movement. Acceleration: detents 20ms apart give 10
+// channels, 40ms apart 5, slower ones and the first after a direction change 1
+void test_encoder() {
+  const uint8_t cw[] = {0b01, 0b00, 0b10, 0b11};
+  const uint8_t ccw[] = {0b10, 0b00, 0b01, 0b11};
+  Quadrature knob;
+  quadrature_begin(&knob, 0b11);
+  uint32_t now = 0;
+  int32_t detents = 0;
+
+  // slow turns, one detent each
+  int32_t channels = 0;
+  for(int i=0; i<10; i++) channels += encoder_feed(&knob, cw, 4, &now, 100000, &detents);
+  CHECK(detents == 10 && channels == 10, "clockwise: %d detents, %d channels, expected 10", detents, channels);
+  detents = 0; channels = 0;
+  for(int i=0; i<10; i++) channels += encoder_feed(&knob, ccw, 4, &now, 100000, &detents);
+  CHECK(detents == -10 && channels == -10, "counter-clockwise: %d detents, %d channels, expected -10", detents, channels);
+
+  // bouncing contacts: every edge repeats 3 times before it settles
+  const uint8_t bounce_cw[] = {
+    0b01, 0b11, 0b01, 0b11, 0b01,
+    0b00, 0b01, 0b00, 0b01, 0b00,
+    0b10, 0b00, 0b10, 0b00, 0b10,
+    0b11, 0b10, 0b11, 0b10, 0b11,
+  };
+  detents = 0; channels = 0;
+  for(int i=0; i<5; i++) channels += encoder_feed(&knob, bounce_cw, sizeof(bounce_cw), &now, 100000, &detents);
+  CHECK(detents == 5 && channels == 5, "bounce: %d detents, %d channels, expected 5", detents, channels);
+  // bounce at the detent itself, back and forth around 11 without reaching half a detent
+  const uint8_t jitter[] = {0b01, 0b11, 0b10, 0b11, 0b01, 0b11};
+  detents = 0;
+  encoder_feed(&knob, jitter, sizeof(jitter), &now, 100000, &detents);
+  CHECK(detents == 0, "jitter around the detent: %d detents, expected 0", detents);
+
+  // invalid transitions
+  const uint8_t invalid[] = {0b00, 0b11, 0b00, 0b11};
+  detents = 0;
+  encoder_feed(&knob, invalid, sizeof(invalid), &now, 100000, &detents);
+  CHECK(detents == 0, "11 <-> 00: %d detents, expected 0", detents);
+  const uint8_t missed_cw[] = {0b01, 0b10, 0b11};
+  detents = 0;
+  encoder_feed(&knob, missed_cw, sizeof(missed_cw), &now, 100000, &detents);
+  CHECK(detents == 1, "clockwise with 00 missed: %d detents, expected 1", detents);
+  const uint8_t invalid_back[] = {0b01, 0b10, 0b01, 0b11};
+  detents = 0;
+  encoder_feed(&knob, invalid_back, sizeof(invalid_back), &now, 100000, &detents);
+  CHECK(detents == 0, "11 -> 01 -> 10 -> 01 -> 11: %d detents, expected 0", detents);
+
+  // acceleration, gap per transition = detent interval / 4
+  struct { uint32_t interval_us; int32_t step; } speeds[] = {{20000, 10}, {40000, 5}, {80000, 1}};
+  for(auto speed : speeds) {
+    now += 1000000;
+    detents = 0;
+    int32_t first = encoder_feed(&knob, cw, 4, &now, speed.interval_us / 4, &detents);
+    int32_t next = encoder_feed(&knob, cw, 4, &now, speed.interval_us / 4, &detents);
+    CHECK(first == 1 && next == speed.step, "detents %uus apart: steps %d then %d, expected 1 then %d",
+      speed.interval_us, first, next, speed.step);
+    report("%uus %d", speed.interval_us, next);
+  }
+  // fast spin reversed: the first detent of the new direction is a single step
+  int32_t reversed = encoder_feed(&knob, ccw, 4, &now, 5000, &detents);
+  CHECK(reversed == -1, "first detent after a reversal: %d channels, expected -1", reversed);
+}
+
+// Slave loop() and the master's reads on one ms clock that starts 10s before millis() wraps around. The data
+// changes every 1-40ms, every byte of a build is (generation + position), the length changes with it. The
+// master reads every 100ms, one packet every 0-20ms. One read of 20 stops after packet 0 and the master is
+// silent for 1s (reset), loop() waits for SLAVE_SERVE_MS then. Checks:
+// every read is one whole build, the newest at packet 0; loop() never builds into the latched buffer while
+// SLAVE_SERVE_MS runs and always can afterwards; an index out of range gets the empty packet with the total
+void test_slave_frames() {
+  static FrameBuffers buffers;
+  memset(&buffers, 0, sizeof(buffers));
+  uint8_t data[SLAVE_FRAMES * SLAVE_FRAME_DATA];
+  uint32_t generation = 0;
+  auto build = [&](int back) {
+    uint16_t length = 60 + (generation % 7) * 50;
+    for(int i=0; i<length; i++) data[i] = (uint8_t)(generation + i);
+    frame_publish(&buffers, back, data, length);
+  };
+  uint32_t now = 0xFFFFFFFF - 10000;
+  build(frame_back_buffer(&buffers, now));
+
+  uint32_t published = generation;      // generation in buffers.ready
+  bool dirty = false;
+  uint32_t next_change = now + 1;
+  uint32_t reads = 0, torn = 0, stale = 0, abandoned = 0;
+  uint32_t blocked_early = 0, blocked_late = 0;
+  uint32_t max_stall = 0, stall_start = 0;
+  bool stalled = false;
+
+  // read state of the master
+  uint32_t next_read = now + 100;
+  int read_packet = -1;                 // next packet of the current read, -1 between reads
+  uint32_t next_packet = 0;
+  uint32_t read_generation = 0;
+  uint8_t read_count = 0;
+  bool read_torn = false;
+  bool give_up = false;
+
+  for(uint32_t tick=0; tick<600000; tick++, now++) {
+    // data changes, loop() builds
+    if((int32_t)(now - next_change) >= 0) {
+      generation++;
+      dirty = true;
+      next_change = now + 1 + random_next() % 40;
+    }
+    if(dirty) {
+      int back = frame_back_buffer(&buffers, now);
+      bool latched_recently = (buffers.ready ^ 1) == buffers.serving && now - buffers.latched < SLAVE_SERVE_MS;
+      if(back < 0) {
+        if(!latched_recently) blocked_late++;
+        if(!stalled) { stalled = true; stall_start = now; }
+      }
+      else {
+        if(latched_recently) blocked_early++;
+        if(stalled) { stalled = false; max_stall = std::max(max_stall, now - stall_start); }
+        build(back);
+        published = generation;
+        dirty = false;
+      }
+    }
+
+    // master
+    if(read_packet < 0 && (int32_t)(now - next_read) >= 0) {
+      read_packet = 0;
+      next_packet = now;
+      read_torn = false;
+      give_up = reads % 20 == 19;
+      next_read = now + 100;
+    }
+    if(read_packet >= 0 && (int32_t)(now - next_packet) >= 0) {
+      uint8_t packet[32];
+      frame_serve(&buffers, read_packet, now, packet);
+      uint32_t packet_generation = (uint8_t)(packet[2] - read_packet * SLAVE_FRAME_DATA);
+      if(read_packet == 0) {
+        read_generation = packet_generation;
+        read_count = packet[1];
+        if(packet_generation != (uint8_t)published) stale++;
+      }
+      else if(packet_generation != read_generation || packet[1] != read_count || packet[0] != read_packet) {
+        read_torn = true;
+      }
+      read_packet++;
+      next_packet = now + random_next() % 21;
+      if(give_up) {
+        // master reset, silent for a second
+        abandoned++;
+        reads++;
+        read_packet = -1;
+        next_read = now + 1000;
+      }
+      else if(read_packet >= read_count) {
+        // one past the end: empty packet with the total
+        frame_serve(&buffers, read_packet, now, packet);
+        if(packet[0] != read_packet || packet[1] != read_count || packet[2] != 0) read_torn = true;
+        if(read_torn) torn++;
+        reads++;
+        read_packet = -1;
+      }
+    }
+  }
+  CHECK(reads > 1000, "only %u reads", reads);
+  CHECK(torn == 0, "%u of %u reads mixed two builds", torn, reads);
+  CHECK(stale == 0, "%u reads did not start at the newest build", stale);
+  CHECK(blocked_early == 0, "%u builds went into the latched buffer within SLAVE_SERVE_MS", blocked_early);
+  CHECK(blocked_late == 0, "%u builds blocked after SLAVE_SERVE_MS", blocked_late);
+  CHECK(abandoned > 0 && max_stall > SLAVE_SERVE_MS / 2 && max_stall <= SLAVE_SERVE_MS,
+    "abandoned reads %u, longest stall %ums", abandoned, max_stall);
+  report("%u reads, %u abandoned, %u builds, longest stall %ums", reads, abandoned, generation, max_stall);
+}
+
+// Random UTF-8 text of up to max_length bytes: ASCII, 2, 3 and 4 byte characters (no control characters,
+// the 0x1d separator never appears in metadata text)
+size_t random_utf8(char* text, size_t max_length) {
+  const char* characters[] = {"a", "Z", "7", " ", "-", "\xc3\xa9", "\xc5\x91", "\xe2\x82\xac", "\xe6\x97\xa5", "\xf0\x9f\x8e\xb5"};
+  size_t target = random_next() % (max_length + 1);
+  size_t length = 0;
+  while(true) {
+    const char* character = characters[random_next() % 10];
+    size_t size = strlen(character);
+    if(length + size > target) break;
+    memcpy(text + length, character, size);
+    length += size;
+  }
+  text[length] = '\0';
+  return length;
+}
+
+// True if text ends with a whole UTF-8 character
+bool utf8_whole(const char* text) {
+  size_t length = strlen(text);
+  size_t start = length;
+  while(start > 0 && ((uint8_t)text[start - 1] & 0b11000000) == 0b10000000) start--;
+  if(start == 0) return length == 0;
+  uint8_t lead = text[start - 1];
+  size_t size = (lead < 0x80) ? 1 : (lead >= 0xf0) ? 4 : (lead >= 0xe0) ? 3 : 2;
+  return length - (start - 1) == size;
+}
+
+// 200000 metadata changes of the Bluetooth callbacks with random UTF-8 of up to 150 bytes (slots are 63 and
+// 96), each one built into slave packets with frame_build_data() (build_frames() of the slave), reassembled
+// and parsed into the master's slots like slave_sync_parse(). Checks: the master ends up with the slave's
+// slots, cut slots end with a whole character, setting the same text again reports no change, and no heap
+// allocation happens in the loop
+void test_metadata_soak() {
+  static Metadata slave, master;
+  metadata_clear(&slave);
+  metadata_clear(&master);
+  static uint8_t frames[SLAVE_FRAMES][32];
+  static uint8_t datastring[SLAVE_FRAMES * SLAVE_FRAME_DATA];
+  char text[160];
+  const char* telemetry = "3072,2048,4,1280,328000";
+  uint32_t mismatches = 0, broken = 0, repeated_changes = 0, invalid = 0, max_packets = 0;
+
+  uint64_t start_allocations = allocations;
+  for(int n=0; n<200000; n++) {
+    // one callback
+    size_t length = random_utf8(text, 150);
+    char* slots[] = {slave.device_name, slave.media_title, slave.media_artist, slave.media_album};
+    int slot = random_next() % 4;
+    if(slot == 0) metadata_set(slave.device_name, sizeof(slave.device_name), text, length);
+    else metadata_set(slots[slot], METADATA_TEXT_SIZE, text, length, METADATA_ELLIPSIS);
+    if(!utf8_whole(slots[slot])) broken++;
+    if(slot == 0 ? metadata_set(slave.device_name, sizeof(slave.device_name), text, length)
+                 : metadata_set(slots[slot], METADATA_TEXT_SIZE, text, length, METADATA_ELLIPSIS)) {
+      repeated_changes++;
+    }
+
+    // slave build
+    uint8_t data[SLAVE_FRAMES * SLAVE_FRAME_DATA];
+    uint16_t data_length = frame_build_data(data, 1, 1, 1, &slave, telemetry, strlen(telemetry));
+    uint8_t count = frame_split(frames, data, data_length);
+    max_packets = std::max<uint32_t>(max_packets, count);
+
+    // master reassembly and parse
+    for(int i=0; i<count; i++) frame_store(datastring, frames[i]);
+    uint16_t separator_pos[SLAVE_FIELDS];
+    if(frame_scan_fields(datastring, SLAVE_FRAME_DATA*count, separator_pos) != SLAVE_FIELDS) {
+      invalid++;
+      continue;
+    }
+    const char* fields = (const char*)datastring;
+    metadata_set(master.device_name, sizeof(master.device_name), fields + separator_pos[2] + 1, separator_pos[3] - separator_pos[2] - 1);
+    metadata_set(master.media_title, sizeof(master.media_title), fields + separator_pos[3] + 1, separator_pos[4] - separator_pos[3] - 1, METADATA_ELLIPSIS);
+    metadata_set(master.media_artist, sizeof(master.media_artist), fields + separator_pos[4] + 1, separator_pos[5] - separator_pos[4] - 1, METADATA_ELLIPSIS);
+    metadata_set(master.media_album, sizeof(master.media_album), fields + separator_pos[5] + 1, separator_pos[6] - separator_pos[5] - 1, METADATA_ELLIPSIS);
+    if(strcmp(slave.device_name, master.device_name) != 0 || strcmp(slave.media_title, master.media_title) != 0 ||
+       strcmp(slave.media_artist, master.media_artist) != 0 || strcmp(slave.media_album, master.media_album) != 0) {
+      mismatches++;
+    }
+  }
+  uint64_t loop_allocations = allocations - start_allocations;
+
+  CHECK(invalid == 0, "%u packets without %d fields", invalid, SLAVE_FIELDS);
+  CHECK(mismatches == 0, "%u round trips changed the metadata", mismatches);
+  CHECK(broken == 0, "%u slots cut inside a character", broken);
+  CHECK(repeated_changes == 0, "%u repeated texts reported as changes", repeated_changes);
+  CHECK(loop_allocations == 0, "%llu heap allocations", (unsigned long long)loop_allocations);
+  // the counter itself works
+  uint64_t before = allocations;
+  std::string probe(100, 'x');
+  CHECK(allocations > before, "allocation counter does not count");
+  report("200000 changes, up to %u packets, %llu allocations", max_packets, (unsigned long long)loop_allocations);
+}
+
+// Master firmware upload through a local HTTP connection. A client thread POSTs multipart/form-data to a socket
+// on 127.0.0.1, in odd sized writes. The server side stands in for ESPAsyncWebServer: it passes the file part to
+// the handler as it arrives (index = offset, final with the last chunk) with the same calls as ota.h (token,
+// ota_start(), ota_master_chunk(), ota_upload_closed() when the connection drops, ota_upload_code()) and writes
+// into a partition in memory whose image check wants the ESP32 image magic (0xE9).
+// Checks: a good upload is flashed byte for byte and answered 200; wrong, truncated or missing tokens get 403
+// without opening the partition; an upload while another update runs gets 409; a connection closed half way
+// aborts the partition and fails the update; a bad image gets 500; a good upload works again afterwards.
+#define TEST_BOUNDARY "----dipe036"
+
+struct TestFlash {
+  std::vector<uint8_t> image;
+  bool open;
+  uint32_t begins;
+  uint32_t aborts;
+} test_flash;
+
+bool test_flash_begin() {
+  test_flash.image.clear();
+  test_flash.open = true;
+  test_flash.begins++;
+  return true;
+}
+
+size_t test_flash_write(const uint8_t* data, size_t length) {
+  if(!test_flash.open) return 0;
+  test_flash.image.insert(test_flash.image.end(), data, data + length);
+  return length;
+}
+
+bool test_flash_end() {
+  test_flash.open = false;
+  return !test_flash.image.empty() && test_flash.image[0] == 0xe9;
+}
+
+void test_flash_abort() {
+  test_flash.open = false;
+  test_flash.aborts++;
+}
+
+const char* test_flash_error() {
+  return "image check failed";
+}
+
+const OtaFlash test_flash_ops = {test_flash_begin, test_flash_write, test_flash_end, test_flash_abort, test_flash_error};
+
+struct HttpUpload {
+  uint16_t port;
+  const char* token;                  // nullptr - no token header
+  const std::vector<uint8_t>* image;
+  size_t cut;                         // image bytes sent before the connection is closed, 0 - all
+  int status;                         // response status, 0 - none
+};
+
+// Client: one upload, reads the status line of the response
+void http_client(HttpUpload* upload) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(upload->port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+    close(fd);
+    return;
+  }
+  std::string part = "--" TEST_BOUNDARY "\r\nContent-Disposition: form-data; name=\"firmware\"; filename=\"master.bin\"\r\n"
+    "Content-Type: application/octet-stream\r\n\r\n";
+  std::string end = "\r\n--" TEST_BOUNDARY "--\r\n";
+  std::string request = "POST /ota/master HTTP/1.1\r\nHost: 192.168.4.1\r\n";
+  if(upload->token != nullptr) {
+    request += std::string(OTA_TOKEN_HEADER ": ") + upload->token + "\r\n";
+  }
+  request += "Content-Type: multipart/form-data; boundary=" TEST_BOUNDARY "\r\nContent-Length: " +
+    std::to_string(part.size() + upload->image->size() + end.size()) + "\r\n\r\n" + part;
+  size_t length = request.size() + (upload->cut != 0 ? upload->cut : upload->image->size() + end.size());
+  request.append((const char*)upload->image->data(), upload->image->size());
+  request += end;
+
+  for(size_t sent=0, step=700; sent < length; step = step % 1900 + 333) {
+    ssize_t written = send(fd, request.data() + sent, std::min(step, length - sent), MSG_NOSIGNAL);
+    if(written <= 0) break;
+    sent += written;
+  }
+  if(upload->cut == 0) {
+    char response[64] = {};
+    size_t received = 0;
+    ssize_t count;
+    while(received < sizeof(response) - 1 && (count = recv(fd, response + received, sizeof(response) - 1 - received, 0)) > 0) {
+      received += count;
+    }
+    sscanf(response, "HTTP/1.1 %d", &upload->status);
+  }
+  close(fd);
+}
+
+// Web server: one request from fd, the file part goes to the upload handler as it arrives. Returns the status
+// sent, 0 if the client closed the connection first
+int http_serve(int fd, uint32_t* now_ms) {
+  std::string buffer;
+  char data[1436];
+  size_t part = std::string::npos;
+  while(part == std::string::npos) {
+    ssize_t count = recv(fd, data, sizeof(data), 0);
+    if(count <= 0) return 0;
+    buffer.append(data, count);
+    size_t headers = buffer.find("\r\n\r\n");
+    if(headers != std::string::npos) part = buffer.find("\r\n\r\n", headers + 4);
+  }
+  size_t token_start = buffer.find("\r\n" OTA_TOKEN_HEADER ": ");
+  std::string token;
+  if(token_start != std::string::npos) {
+    token_start += strlen("\r\n" OTA_TOKEN_HEADER ": ");
+    token = buffer.substr(token_start, buffer.find("\r\n", token_start) - token_start);
+  }
+  bool authorized = ota_token_valid(token_start != std::string::npos ? token.c_str() : nullptr, OTA_TOKEN);
+  std::string pending = buffer.substr(part + 4);
+  const std::string delimiter = "\r\n--" TEST_BOUNDARY;
+  const void* request = &buffer;      // request identity, like the AsyncWebServerRequest pointer
+  size_t index = 0;
+
+  while(true) {
+    size_t end = pending.find(delimiter);
+    bool final = (end != std::string::npos);
+    // the end of the data could be the start of the delimiter, it is held back
+    size_t length = final ? end : (pending.size() >= delimiter.size() ? pending.size() - delimiter.size() + 1 : 0);
+    if(length > 0 || final) {
+      // ota_master_upload()
+      if(index == 0 && !(authorized && ota_start(OTA_TARGET_MASTER, request, *now_ms))) {
+        index = SIZE_MAX;
+      }
+      if(index != SIZE_MAX) {
+        ota_master_chunk(&test_flash_ops, request, index, (const uint8_t*)pending.data(), length, final, *now_ms);
+        index += length;
+      }
+      pending.erase(0, length);
+    }
+    if(final) break;
+    ssize_t count = recv(fd, data, sizeof(data), 0);
+    if(count <= 0) {
+      ota_upload_closed(&test_flash_ops, request, *now_ms);
+      return 0;
+    }
+    pending.append(data, count);
+    *now_ms += 1;
+  }
+
+  int code = ota_upload_code(request, authorized);
+  std::string response = "HTTP/1.1 " + std::to_string(code) + " \r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+  send(fd, response.data(), response.size(), MSG_NOSIGNAL);
+  ota_upload_closed(&test_flash_ops, request, *now_ms);
+  return code;
+}
+
+void test_ota_upload() {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t address_length = sizeof(address);
+  if(bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 1) != 0 ||
+     getsockname(listener, (sockaddr*)&address, &address_length) != 0) {
+    CHECK(false, "no local socket");
+    close(listener);
+    return;
+  }
+
+  std::vector<uint8_t> image(300000), bad_image(20000);
+  for(auto& byte : image) byte = random_next();
+  for(auto& byte : bad_image) byte = random_next();
+  image[0] = 0xe9;
+  bad_image[0] = 0;
+  // the multipart delimiter inside the image, it only ends the part after CRLF
+  memcpy(image.data() + 1000, "--" TEST_BOUNDARY, strlen("--" TEST_BOUNDARY));
+
+  uint32_t now_ms = 0;
+  int other = 0;                      // owner of an update running elsewhere
+  auto run = [&](const char* token, const std::vector<uint8_t>& file, size_t cut) {
+    HttpUpload upload = {ntohs(address.sin_port), token, &file, cut, 0};
+    std::thread client(http_client, &upload);
+    int fd = accept(listener, nullptr, nullptr);
+    int served = http_serve(fd, &now_ms);
+    close(fd);
+    client.join();
+    CHECK(served == upload.status, "server sent %d, client got %d", served, upload.status);
+    return upload.status;
+  };
+
+  int status = run(OTA_TOKEN, image, 0);
+  CHECK(status == 200, "good upload answered %d", status);
+  CHECK(test_flash.image == image, "flashed image differs (%zu of %zu bytes)", test_flash.image.size(), image.size());
+  CHECK(ota.state == OTA_DONE && ota.total == image.size(), "state %d, total %u", ota.state, ota.total);
+
+  uint32_t begins = test_flash.begins;
+  std::string prefix(OTA_TOKEN, strlen(OTA_TOKEN) - 1);
+  const char* wrong[] = {"wrong", prefix.c_str(), OTA_TOKEN "x", "", nullptr};
+  for(const char* token : wrong) {
+    status = run(token, image, 0);
+    CHECK(status == 403, "token \"%s\" answered %d", token != nullptr ? token : "(none)", status);
+  }
+  CHECK(test_flash.begins == begins, "partition opened without a valid token");
+
+  ota_start(OTA_TARGET_SLAVE, &other, now_ms);
+  status = run(OTA_TOKEN, image, 0);
+  CHECK(status == 409, "upload during another update answered %d", status);
+  CHECK(test_flash.begins == begins && ota.target == OTA_TARGET_SLAVE && ota.state == OTA_RECEIVING,
+    "running update disturbed");
+  ota_upload_closed(&test_flash_ops, &other, now_ms);
+
+  uint32_t aborts = test_flash.aborts;
+  status = run(OTA_TOKEN, image, image.size() / 2);
+  CHECK(status == 0, "interrupted upload answered %d", status);
+  CHECK(ota.state == OTA_FAILED && strcmp(ota.message, "upload interrupted") == 0 && test_flash.aborts == aborts + 1,
+    "interrupted upload: state %d (%s), %u aborts", ota.state, ota.message, test_flash.aborts - aborts);
+
+  status = run(OTA_TOKEN, bad_image, 0);
+  CHECK(status == 500 && ota.state == OTA_FAILED, "bad image answered %d", status);
+
+  status = run(OTA_TOKEN, image, 0);
+  CHECK(status == 200 && test_flash.image == image, "upload after failures answered %d", status);
+  close(listener);
+  report("%zu KB over 127.0.0.1, 5 token rejections, 409, interrupted, bad image", image.size() / 1024);
+}
+
+// Slave firmware forwarding (ota_slave_step(), ota_check_block()) over a lossy bus. The upload offers chunks of
+// random size every ms and offers them again while the ring is full, as ota_slave_upload() does. The slave
+// side is the slave's ota_receive()/ota_loop() with a 16 block queue and a flash that writes a block per 3ms and
+// stalls for 45ms every 4KB (sector erase), it keeps flashing during the 3ms a block takes on the bus. Block
+// writes are not acknowledged (2%), acknowledged but lost (1%) or get a flipped bit (2%), status reads fail (3%).
+// Checks: the slave flash ends up equal to the image (every block once, in order), the update is DONE with
+// rejected and resent blocks, no chunk waits OTA_UPLOAD_WAIT_MS for ring space; a slave flash error fails the
+// update and the slave is told to abort.
+#define SIM_QUEUE 16
+
+struct SimSlave {
+  uint8_t state;
+  uint16_t next;
+  uint8_t error;
+  uint8_t queue[SIM_QUEUE][OTA_BLOCK_DATA];
+  uint8_t lengths[SIM_QUEUE];
+  uint32_t head, count;
+  std::vector<uint8_t> flash;
+  bool end_requested;
+  uint32_t size;
+  uint32_t busy_until;                // flash stall or image check
+  uint32_t fail_at;                   // flash write fails at this size, 0 - never
+  uint32_t nacks, lost, corrupted, rejected[OTA_REPEATED + 1], aborts;
+} sim;
+uint32_t sim_now = 0;
+
+void sim_report(uint8_t error) {
+  sim.rejected[error]++;
+  if(sim.error == OTA_OK) sim.error = error;
+}
+
+// ota_receive() of the slave
+void sim_receive(const uint8_t* message, size_t len) {
+  switch(message[3]) {
+    case 'S':
+      sim.state = OTA_RECEIVING;
+      sim.next = 0;
+      sim.error = OTA_OK;
+      sim.head = sim.count = 0;
+      sim.flash.clear();
+      sim.end_requested = false;
+      break;
+    case 'B': {
+      if(sim.state != OTA_RECEIVING) break;
+      uint8_t length;
+      uint8_t result = ota_check_block(message, len, sim.next, &length);
+      if(result == OTA_REPEATED) {
+        sim.rejected[result]++;
+        break;
+      }
+      if(result == OTA_OK && sim.count == SIM_QUEUE) result = OTA_FULL;
+      if(result != OTA_OK) {
+        sim_report(result);
+        break;
+      }
+      uint32_t slot = (sim.head + sim.count++) % SIM_QUEUE;
+      memcpy(sim.queue[slot], message + OTA_BLOCK_HEADER, length);
+      sim.lengths[slot] = length;
+      sim.next++;
+      break;
+    }
+    case 'E':
+      sim.size = message[4] | message[5] << 8 | message[6] << 16 | (uint32_t)message[7] << 24;
+      sim.end_requested = true;
+      break;
+    case 'A':
+      sim.aborts++;
+      sim.state = OTA_IDLE;
+      break;
+  }
+}
+
+// ota_loop() of the slave, once per ms
+void sim_loop() {
+  if(sim.state == OTA_FINISHING && (int32_t)(sim_now - sim.busy_until) >= 0) {
+    sim.state = (sim.flash.size() == sim.size) ? OTA_DONE : OTA_FAILED;
+  }
+  if(sim.state != OTA_RECEIVING || (int32_t)(sim_now - sim.busy_until) < 0) return;
+  if(sim.count > 0) {
+    if(sim.fail_at != 0 && sim.flash.size() >= sim.fail_at) {
+      sim.state = OTA_FAILED;
+      sim_report(OTA_FLASH);
+      return;
+    }
+    size_t before = sim.flash.size();
+    sim.flash.insert(sim.flash.end(), sim.queue[sim.head], sim.queue[sim.head] + sim.lengths[sim.head]);
+    sim.head = (sim.head + 1) % SIM_QUEUE;
+    sim.count--;
+    sim.busy_until = sim_now + ((before / 4096 != sim.flash.size() / 4096) ? 45 : 3);
+  }
+  else if(sim.end_requested) {
+    sim.end_requested = false;
+    sim.state = OTA_FINISHING;
+    sim.busy_until = sim_now + 200;
+  }
+}
+
+// Block writes take 3ms on the bus (121 bytes at 400kHz), the slave keeps flashing meanwhile
+void sim_bus(uint32_t ms) {
+  for(uint32_t i=0; i<ms; i++) {
+    sim_now++;
+    sim_loop();
+  }
+}
+
+bool sim_write(const uint8_t* message, size_t length) {
+  if(length <= 8) {
+    sim_receive(message, length);
+    return true;
+  }
+  sim_bus(3);
+  uint32_t fault = random_next() % 1000;
+  if(fault < 20) {
+    sim.nacks++;
+    return false;
+  }
+  if(fault < 30) {
+    sim.lost++;
+    return true;
+  }
+  uint8_t copy[OTA_BLOCK_SIZE];
+  memcpy(copy, message, length);
+  if(fault < 50) {
+    copy[4 + random_next() % (length - 4)] ^= 1 << (random_next() % 8);
+    sim.corrupted++;
+  }
+  sim_receive(copy, length);
+  return true;
+}
+
+bool sim_status(uint8_t* status) {
+  if(random_next() % 100 < 3) return false;
+  uint8_t values[OTA_STATUS_SIZE] = {'O', sim.state, (uint8_t)(sim.next & 0xff), (uint8_t)(sim.next >> 8), sim.error, 0, 0, 0};
+  memcpy(status, values, OTA_STATUS_SIZE);
+  sim.error = OTA_OK;
+  return true;
+}
+
+const OtaLink sim_link = {sim_write, sim_status};
+
+
+// One slave update of image, returns the longest wait of a chunk for ring space (ms)
+uint32_t sim_update(const std::vector<uint8_t>& image, uint32_t fail_at) {
+  sim = SimSlave();
+  sim.fail_at = fail_at;
+  sim.busy_until = sim_now;
+  int owner = 0;
+  ota_start(OTA_TARGET_SLAVE, &owner, sim_now);
+  size_t index = 0, length = 0;
+  uint32_t offered = sim_now, max_wait = 0;
+  for(uint32_t end = sim_now + 120000; (int32_t)(sim_now - end) < 0; sim_now++) {
+    // web server task: next chunk, or the same one again while the ring is full
+    if(index < image.size()) {
+      if(length == 0) {
+        length = std::min<size_t>(1 + random_next() % 1436, image.size() - index);
+        offered = sim_now;
+      }
+      bool final = (index + length == image.size());
+      uint8_t result = ota_slave_chunk(&owner, index, image.data() + index, length, final, sim_now);
+      if(result == OTA_CHUNK_TAKEN) {
+        max_wait = std::max(max_wait, sim_now - offered);
+        index += length;
+        length = 0;
+      }
+      else if(result == OTA_CHUNK_DROPPED) {
+        index = image.size();
+      }
+      else if(sim_now - offered > OTA_UPLOAD_WAIT_MS) {
+        ota_fail("slave not accepting blocks", sim_now);
+      }
+    }
+    ota_slave_step(&sim_link, sim_now);
+    sim_loop();
+    if(ota.state == OTA_DONE || (ota.state == OTA_FAILED && !ota_slave_started)) break;
+  }
+  return max_wait;
+}
+
+void test_ota_forward() {
+  std::vector<uint8_t> image(200000);
+  for(auto& byte : image) byte = random_next();
+  uint32_t start = sim_now;
+  uint32_t max_wait = sim_update(image, 0);
+  uint32_t seconds_ms = sim_now - start;
+
+  CHECK(ota.state == OTA_DONE && sim.state == OTA_DONE, "master state %d (%s), slave state %d", ota.state, ota.message, sim.state);
+  CHECK(sim.flash == image, "slave flash differs (%zu of %zu bytes)", sim.flash.size(), image.size());
+  CHECK(ota.written == image.size(), "%u bytes reported written", ota.written);
+  CHECK(sim.rejected[OTA_CRC] > 0 && sim.rejected[OTA_ORDER] > 0 && ota.resent > 0,
+    "faults not exercised: %u CRC, %u order, %u resent", sim.rejected[OTA_CRC], sim.rejected[OTA_ORDER], ota.resent);
+  CHECK(max_wait < OTA_UPLOAD_WAIT_MS, "chunk waited %ums for ring space", max_wait);
+
+  uint32_t resent = ota.resent, crc = sim.rejected[OTA_CRC], order = sim.rejected[OTA_ORDER];
+  uint32_t full = sim.rejected[OTA_FULL], nacks = sim.nacks, lost = sim.lost;
+  sim_update(image, 50000);
+  CHECK(ota.state == OTA_FAILED && strcmp(ota.message, "slave flash error") == 0, "flash error: state %d (%s)",
+    ota.state, ota.message);
+  CHECK(sim.aborts == 1 && !ota_slave_started, "slave told to abort %u times", sim.aborts);
+
+  report("%zu KB in %.1fs, %u nacked, %u lost, %u CRC, %u order, %u full, %u resent, chunk wait <= %ums",
+    image.size() / 1024, seconds_ms / 1000.0, nacks, lost, crc, order, full, resent, max_wait);
+}
+
+// AF following (af_follow.h) replayed against a simulated band. loop() is modelled as in master.ino: a register
+// read (requested_data) every 10ms, the check state machine every ms while it runs. The simulated chip reaches
+// STC 8ms after a tune (never on stations marked so), RDS syncs 300ms after a tune and sends a group every
+// 88ms: group 0A with the station's PI and, in block C, the other frequencies of the band as AF codes.
+// Scenarios: home above AF_THRESHOLD with much stronger AFs; a weak home with an AF just under AF_MARGIN, then
+// one exactly at it; a stronger AF with another PI; a stronger AF without RDS; an AF that never reports STC;
+// input (af_follow_cancel()) while an AF is verified, with the same and with another PI.
+// Checks: no check above the threshold, a switch only at AF_MARGIN, back to the home frequency on a PI mismatch
+// or after AF_VERIFY_MS, nothing audible from a station with another PI, every check muted at most AF_BUDGET_MS.
+struct AfSimStation {
+  int frequency;
+  uint8_t rssi;
+  uint16_t pi;
+  bool rds;
+  bool stc;                           // false - the chip never reports STC on it
+};
+
+struct AfSim {
+  const AfSimStation* stations;
+  int count;
+  int tuned;
+  uint32_t tuned_at;
+  bool muted;
+  bool check_mute;                    // muted by a check (not a switch)
+  uint32_t muted_at;
+  uint32_t max_check_mute;
+  uint32_t wrong_audible_ms;          // unmuted on a station with another PI
+  uint32_t last_group;
+} af_sim;
+uint32_t af_now = 0;
+
+const AfSimStation* af_sim_station(int frequency) {
+  for(int i=0; i<af_sim.count; i++) {
+    if(af_sim.stations[i].frequency == frequency) return &af_sim.stations[i];
+  }
+  return nullptr;
+}
+
+void af_sim_tune(const uint8_t*, int frequency) {
+  af_sim.tuned = frequency;
+  af_sim.tuned_at = af_now;
+}
+
+void af_sim_mute(const uint8_t*) {
+  if(af_sim.muted) return;
+  af_sim.muted = true;
+  af_sim.check_mute = (af_state == AF_START);
+  af_sim.muted_at = af_now;
+}
+
+void af_sim_unmute(const uint8_t*) {
+  if(!af_sim.muted) return;
+  af_sim.muted = false;
+  if(af_sim.check_mute) {
+    af_sim.max_check_mute = std::max(af_sim.max_check_mute, af_now - af_sim.muted_at);
+  }
+}
+
+// Registers 0x0A-0x0D as the chip has them now, group = an RDS group is ready
+void af_sim_registers(uint8_t* arr, bool group) {
+  const AfSimStation* station = af_sim_station(af_sim.tuned);
+  memset(arr, 0, 12);
+  bool stc = af_now - af_sim.tuned_at >= 8 && (station == nullptr || station->stc);
+  arr[0] = (stc ? 0b01000000 : 0) | (group ? 0b10000000 : 0);
+  arr[1] = af_sim.tuned - FREQ_MIN;
+  arr[2] = (station != nullptr) ? (station->rssi << 1 | 1) : 4 << 1;
+  if(group) {
+    arr[4] = station->pi >> 8;
+    arr[5] = station->pi & 0xff;
+    arr[6] = 0;                       // group 0A
+    // two other frequencies of the band per group
+    int first = (af_now / 88) % af_sim.count;
+    arr[8] = af_sim.stations[first].frequency - 875;
+    arr[9] = af_sim.stations[(first + 1) % af_sim.count].frequency - 875;
+  }
+}
+
+void af_sim_status(uint8_t* status) {
+  uint8_t arr[12];
+  af_sim_registers(arr, false);
+  memcpy(status, arr, 4);
+}
+
+const AfRadio af_sim_radio = {af_sim_tune, af_sim_mute, af_sim_unmute, af_sim_status};
+
+// Runs the band for ms from the current frequency, cancel_verify - input while an AF is verified.
+// Returns the ms from each switch to the return home (0 - none)
+uint32_t af_replay(const AfSimStation* stations, int count, int home, uint32_t ms, bool cancel_verify) {
+  af_state = AF_IDLE;
+  af_reset(0);
+  af_last_check = 0;
+  af_counters = AfCounters();
+  af_sim = AfSim();
+  af_sim.stations = stations;
+  af_sim.count = count;
+  af_sim.tuned = home;
+  af_sim.tuned_at = af_now;
+  uint8_t config[4] = {0b11000000, 0, 0, 0};
+  freq_register(config, home);
+  int frequency = home;
+  uint16_t home_pi = af_sim_station(home)->pi;
+  uint32_t switched_at = 0, longest_return = 0;
+  bool cancelled = false;
+
+  for(uint32_t end = af_now + ms; af_now != end; af_now++) {
+    if(af_checking()) {
+      af_follow_check(&af_sim_radio, config, &frequency, af_now);
+      if(af_state == AF_VERIFY) {
+        af_sim.check_mute = false;
+        switched_at = af_now;
+        cancelled = false;
+      }
+    }
+    else if(af_now % 10 == 0) {
+      const AfSimStation* station = af_sim_station(af_sim.tuned);
+      bool group = station != nullptr && station->rds && af_now - af_sim.tuned_at >= 300 && af_now - af_sim.last_group >= 88;
+      if(group) af_sim.last_group = af_now;
+      uint8_t arr[12];
+      af_sim_registers(arr, group);
+      frequency = arr[1] + FREQ_MIN;  // update_freq()
+      af_follow_update(&af_sim_radio, arr, config, &frequency, af_now);
+    }
+    if(cancel_verify && af_state == AF_VERIFY && !cancelled) {
+      af_follow_cancel(&af_sim_radio, config, af_now);
+      cancelled = true;
+    }
+    if(switched_at != 0 && af_state == AF_RETURNING) {
+      longest_return = std::max(longest_return, af_now - switched_at);
+      switched_at = 0;
+    }
+    if(switched_at != 0 && af_state == AF_IDLE) {
+      switched_at = 0;                // confirmed
+    }
+    const AfSimStation* station = af_sim_station(af_sim.tuned);
+    if(!af_sim.muted && station != nullptr && station->pi != home_pi) {
+      af_sim.wrong_audible_ms++;
+    }
+  }
+  return longest_return;
+}
+
+void test_af_replay() {
+  uint32_t max_mute = 0;
+  auto band = [&](const AfSimStation* stations, int count, uint32_t ms, bool cancel_verify) {
+    uint32_t longest_return = af_replay(stations, count, stations[0].frequency, ms, cancel_verify);
+    max_mute = std::max(max_mute, af_sim.max_check_mute);
+    return longest_return;
+  };
+
+  const AfSimStation strong[] = {{950, 30, 0xd3c2, true, true}, {1012, 70, 0xd3c2, true, true}, {1043, 60, 0xd3c2, true, true}};
+  band(strong, 3, 30000, false);
+  CHECK(af_counters.checks == 0 && af_sim.tuned == 950, "home above the threshold: %u checks, on %d",
+    af_counters.checks, af_sim.tuned);
+
+  const AfSimStation under[] = {{950, 12, 0xd3c2, true, true}, {1012, 12 + AF_MARGIN - 1, 0xd3c2, true, true}};
+  band(under, 2, 30000, false);
+  CHECK(af_counters.checks > 0 && af_counters.switches == 0 && af_sim.tuned == 950,
+    "AF under the margin: %u checks, %u switches, on %d", af_counters.checks, af_counters.switches, af_sim.tuned);
+  uint32_t under_checks = af_counters.checks;
+
+  const AfSimStation margin[] = {{950, 12, 0xd3c2, true, true}, {1012, 12 + AF_MARGIN - 1, 0xd3c2, true, true},
+    {1043, 12 + AF_MARGIN, 0xd3c2, true, true}};
+  band(margin, 3, 30000, false);
+  CHECK(af_counters.switches == 1 && af_sim.tuned == 1043 && af_state == AF_IDLE && !af_sim.muted,
+    "AF at the margin: %u switches, on %d, state %d", af_counters.switches, af_sim.tuned, af_state);
+
+  const AfSimStation other_pi[] = {{950, 12, 0xd3c2, true, true}, {1012, 40, 0x1234, true, true}};
+  uint32_t pi_return = band(other_pi, 2, 30000, false);
+  CHECK(af_counters.rejected > 0 && af_counters.switches == 0 && af_sim.tuned == 950,
+    "AF with another PI: %u rejected, %u switches, on %d", af_counters.rejected, af_counters.switches, af_sim.tuned);
+  CHECK(af_sim.wrong_audible_ms == 0, "another PI audible for %ums", af_sim.wrong_audible_ms);
+  CHECK(pi_return > 0 && pi_return < AF_VERIFY_MS, "PI mismatch left after %ums", pi_return);
+
+  const AfSimStation no_rds[] = {{950, 12, 0xd3c2, true, true}, {1012, 40, 0xd3c2, false, true}};
+  uint32_t timeout_return = band(no_rds, 2, 30000, false);
+  CHECK(af_counters.rejected > 0 && af_sim.tuned == 950 && timeout_return >= AF_VERIFY_MS &&
+    timeout_return <= AF_VERIFY_MS + 10, "AF without RDS: %u rejected, on %d, left after %ums",
+    af_counters.rejected, af_sim.tuned, timeout_return);
+
+  const AfSimStation no_stc[] = {{950, 12, 0xd3c2, true, true}, {1012, 40, 0xd3c2, true, false}};
+  band(no_stc, 2, 30000, false);
+  CHECK(af_counters.checks > 0 && af_counters.switches == 0 && af_sim.tuned == 950,
+    "AF without STC: %u checks, %u switches, on %d", af_counters.checks, af_counters.switches, af_sim.tuned);
+  uint32_t no_stc_mute = af_sim.max_check_mute;
+
+  band(margin, 3, 30000, true);
+  CHECK(af_counters.switches == 1 && af_sim.tuned == 1043 && !af_sim.muted,
+    "input while verified, same PI: %u switches, on %d", af_counters.switches, af_sim.tuned);
+  uint32_t cancel_return = band(other_pi, 2, 30000, true);
+  CHECK(af_counters.switches == 0 && af_sim.tuned == 950 && af_pi == 0xd3c2 && cancel_return < AF_VERIFY_MS,
+    "input while verified, another PI: %u switches, on %d, PI %04x, left after %ums", af_counters.switches,
+    af_sim.tuned, af_pi, cancel_return);
+
+  CHECK(max_mute <= AF_BUDGET_MS, "check muted for %ums", max_mute);
+  report("%u checks under the margin, PI mismatch left after %ums, no RDS after %ums, muted <= %ums (no STC %ums)",
+    under_checks, pi_return, timeout_return, max_mute, no_stc_mute);
+}
+
+// Traffic announcements (ta_monitor.h) replayed against a simulated tuner in Bluetooth mode. ta_monitor_loop()
+// runs every ms as in loop(), it reads the registers every TA_POLL_MS. The tuned station sends a group every
+// 88ms, 100ms after a tune: the home station (TP) cycles 0A, 2A, 14A variant 5 (maps the other network), 0A,
+// 14B (TA of the other network); the other network cycles 0A, 2A. TA flags follow a script per scenario.
+// Scenarios: TA on the home station; TA_CLEAR_GROUPS - 1 clear groups in the middle of an announcement; the
+// signal lost during one; an EON announcement on the other network; EON without groups from the other network;
+// Bluetooth mode ending during an announcement.
+// Checks: radio within 4 groups of TA, Bluetooth back after TA_CLEAR_GROUPS clear groups and not after fewer,
+// back TA_LOST_MS after the last group, EON tunes to the mapped frequency and back, unconfirmed EON ends after
+// TA_EON_CONFIRM_MS, the mode switch ends the announcement without a slave message.
+#define TA_SIM_HOME 950
+#define TA_SIM_OTHER 1043
+
+struct TaSim {
+  uint32_t home_ta_from, home_ta_to;  // TA set on the home station
+  uint32_t other_ta_from, other_ta_to;// TA of the other network, in its groups and in 14B of the home station
+  uint32_t glitch_at;                 // from here TA_CLEAR_GROUPS - 1 0A groups of the home station clear TA
+  uint32_t lost_at;                   // no groups from here, 0 - never
+  bool other_rds;                     // the other network sends groups
+  int tuned;
+  uint32_t tuned_at;
+  uint32_t last_group;
+  uint32_t groups;                    // groups sent since the tune
+  int glitches;
+  uint32_t switches[8];               // times of the audio switches, radio first
+  bool radio[8];
+  int switch_count;
+} ta_sim;
+uint32_t ta_now = 0;
+
+void ta_sim_tune(const uint8_t*, int frequency) {
+  ta_sim.tuned = frequency;
+  ta_sim.tuned_at = ta_now;
+  ta_sim.groups = 0;
+}
+
+void ta_sim_read(uint8_t* arr) {
+  memset(arr, 0, 12);
+  bool home = (ta_sim.tuned == TA_SIM_HOME);
+  arr[0] = (ta_now - ta_sim.tuned_at >= 8) ? 0b01000000 : 0;
+  arr[1] = ta_sim.tuned - FREQ_MIN;
+  bool sending = ta_now - ta_sim.tuned_at >= 100 && (ta_sim.lost_at == 0 || ta_now < ta_sim.lost_at) &&
+    (home || ta_sim.other_rds);
+  if(!sending || ta_now - ta_sim.last_group < 88) {
+    return;
+  }
+  ta_sim.last_group = ta_now;
+  uint32_t kind = ta_sim.groups++ % (home ? 5 : 2);
+  bool home_ta = ta_now >= ta_sim.home_ta_from && ta_now < ta_sim.home_ta_to;
+  bool other_ta = ta_now >= ta_sim.other_ta_from && ta_now < ta_sim.other_ta_to;
+  uint16_t pi = home ? 0xd3c2 : 0x5555;
+  arr[0] |= 0b10000000;
+  arr[4] = pi >> 8;
+  arr[5] = pi & 0xff;
+  if(kind == 0 || kind == 3) {
+    bool ta = home ? home_ta : other_ta;
+    if(home && ta_sim.glitch_at != 0 && ta_now >= ta_sim.glitch_at && ta_sim.glitches < TA_CLEAR_GROUPS - 1) {
+      ta_sim.glitches++;
+      ta = false;
+    }
+    arr[6] = 0x00 | 0b100;            // 0A, TP
+    arr[7] = ta ? 0b10000 : 0;
+  }
+  else if(kind == 1) {
+    arr[6] = 0x20 | 0b100;            // 2A
+  }
+  else if(kind == 2) {
+    arr[6] = 0xe0 | 0b100;            // 14A variant 5, block C: tuned and mapped frequency
+    arr[7] = 5;
+    arr[8] = TA_SIM_HOME - 875;
+    arr[9] = TA_SIM_OTHER - 875;
+    arr[10] = 0x55;
+    arr[11] = 0x55;
+  }
+  else {
+    arr[6] = 0xe8 | 0b100;            // 14B, TA of the other network
+    arr[7] = other_ta ? 0b1000 : 0;
+    arr[10] = 0x55;
+    arr[11] = 0x55;
+  }
+}
+
+void ta_sim_audio(bool radio, uint32_t) {
+  if(ta_sim.switch_count < 8) {
+    ta_sim.switches[ta_sim.switch_count] = ta_now;
+    ta_sim.radio[ta_sim.switch_count] = radio;
+  }
+  ta_sim.switch_count++;
+}
+
+const TaRadio ta_sim_radio = {ta_sim_tune, ta_sim_read, ta_sim_audio};
+
+// Runs a scenario for 20s in Bluetooth mode (until bluetooth_until), times relative to its start
+void ta_replay(TaSim scenario, uint32_t bluetooth_until = UINT32_MAX) {
+  ta_sim = scenario;
+  ta_sim.tuned = TA_SIM_HOME;
+  ta_state = TA_IDLE;
+  ta_frequency = 0;
+  ta_last_poll = 0;
+  ta_eon_pi = 0;
+  uint8_t config[4] = {0b11000000, 0, 0, 0};
+  uint8_t arr[12];
+  for(ta_now = 1; ta_now < 20000; ta_now++) {
+    ta_monitor_loop(&ta_sim_radio, ta_now < bluetooth_until, arr, config, TA_SIM_HOME, ta_now);
+  }
+}
+
+void test_ta_replay() {
+  TaSim plain = {};
+  plain.home_ta_from = 5000;
+  plain.home_ta_to = 15000;
+  ta_replay(plain);
+  uint32_t on_delay = ta_sim.switches[0] - 5000, off_delay = ta_sim.switches[1] - 15000;
+  CHECK(ta_sim.switch_count == 2 && ta_sim.radio[0] && !ta_sim.radio[1], "TA on the station: %d switches",
+    ta_sim.switch_count);
+  CHECK(on_delay <= 4 * 88 + TA_POLL_MS, "radio %ums after TA", on_delay);
+  CHECK(off_delay >= 88 * (TA_CLEAR_GROUPS - 1) && off_delay <= 5 * 88 * TA_CLEAR_GROUPS / 2 + TA_POLL_MS,
+    "Bluetooth %ums after TA cleared", off_delay);
+
+  TaSim glitch = plain;
+  glitch.glitch_at = 9000;
+  ta_replay(glitch);
+  CHECK(ta_sim.glitches == TA_CLEAR_GROUPS - 1 && ta_sim.switch_count == 2 && ta_sim.switches[1] >= 15000,
+    "%d clear groups: %d switches, back at %u", ta_sim.glitches, ta_sim.switch_count, ta_sim.switches[1]);
+
+  TaSim lost = plain;
+  lost.lost_at = 8000;
+  ta_replay(lost);
+  uint32_t lost_delay = ta_sim.switches[1] - 8000;
+  CHECK(ta_sim.switch_count == 2 && lost_delay >= TA_LOST_MS - 88 && lost_delay <= TA_LOST_MS + TA_POLL_MS,
+    "signal lost: %d switches, Bluetooth %ums after the last group", ta_sim.switch_count, lost_delay);
+
+  TaSim eon = {};
+  eon.other_ta_from = 5000;
+  eon.other_ta_to = 12000;
+  eon.other_rds = true;
+  ta_replay(eon);
+  CHECK(ta_sim.switch_count == 2 && ta_sim.radio[0] && ta_sim.switches[0] >= 5000 && ta_sim.switches[1] >= 12000 &&
+    ta_sim.tuned == TA_SIM_HOME, "EON: %d switches at %u and %u, tuned to %d", ta_sim.switch_count,
+    ta_sim.switches[0], ta_sim.switches[1], ta_sim.tuned);
+  uint32_t eon_delay = ta_sim.switches[0] - 5000;
+
+  TaSim unconfirmed = {};
+  unconfirmed.other_ta_from = 5000;
+  unconfirmed.other_ta_to = 5500;
+  ta_replay(unconfirmed);
+  uint32_t confirm_wait = ta_sim.switches[1] - ta_sim.switches[0];
+  CHECK(ta_sim.switch_count == 2 && confirm_wait >= TA_EON_CONFIRM_MS - TA_STC_TIMEOUT_MS &&
+    confirm_wait <= TA_EON_CONFIRM_MS + TA_POLL_MS && ta_sim.tuned == TA_SIM_HOME,
+    "EON without confirmation: %d switches, back after %ums, tuned to %d", ta_sim.switch_count, confirm_wait,
+    ta_sim.tuned);
+
+  ta_replay(plain, 8000);
+  CHECK(ta_sim.switch_count == 1 && ta_state == TA_IDLE, "radio mode during the announcement: %d switches, state %d",
+    ta_sim.switch_count, ta_state);
+
+  report("radio %ums after TA, Bluetooth %ums after clear, lost %ums, EON %ums, EON unconfirmed %ums", on_delay,
+    off_delay, lost_delay, eon_delay, confirm_wait);
+}
+
+// Simulated RDA5807M register file for the control writes (rda_control.h). Writes come through an RdaBus:
+// sequential from register 0x02 (RDA5807M_ADDRESS) or random access with the register address first
+// (RDA5807M_RANDOM_ADDRESS). TUNE (0x03) or SEEK (0x02) clears STC and empties the RDS FIFO, STC is set again
+// stc_delay_ms later on the new channel; RDS_FIFO_CLR (0x04) empties the FIFO. While STC is set an RDS group
+// arrives every 88ms. rda_sim_status() returns registers 0x0A-0x0B as request_data() reads them.
+struct RdaSim {
+  uint16_t regs[0x10];
+  uint32_t now_ms;
+  uint32_t stc_delay_ms;
+  uint32_t tune_start;
+  bool stc;
+  int channel;                        // READCHAN, valid at STC
+  uint32_t fifo;                      // RDS groups buffered
+  uint32_t last_group;
+  uint32_t writes[0x10];              // register writes
+  uint32_t sequential;                // transactions to RDA5807M_ADDRESS
+  uint32_t tunes;                     // TUNE or SEEK written
+  uint32_t tunes_in_flight;           // TUNE or SEEK written while STC was clear
+  uint32_t fifo_clears;               // FIFO emptied by a write
+  uint32_t dmute_unchanged;           // register 0x02 written with the same DMUTE
+} rda_sim;
+
+void rda_sim_reset(uint32_t stc_delay_ms, int channel) {
+  memset(&rda_sim, 0, sizeof(rda_sim));
+  rda_sim.stc_delay_ms = stc_delay_ms;
+  rda_sim.stc = true;
+  rda_sim.channel = channel;
+}
+
+// Time passes up to now_ms
+void rda_sim_advance(uint32_t now_ms) {
+  rda_sim.now_ms = now_ms;
+  if(!rda_sim.stc && now_ms - rda_sim.tune_start >= rda_sim.stc_delay_ms) {
+    rda_sim.stc = true;
+    RdaRegister<0x03> reg03{rda_sim.regs[0x03]};
+    RdaRegister<0x07> reg07{rda_sim.regs[0x07]};
+    rda_sim.channel = reg07.get(RDA_FREQ_MODE) ? rda_sim.regs[0x08] / 100 : reg03.get(RDA_CHAN);
+    rda_sim.last_group = now_ms;
+  }
+  if(rda_sim.stc && now_ms - rda_sim.last_group >= 88) {
+    rda_sim.fifo++;
+    rda_sim.last_group = now_ms;
+  }
+}
+
+void rda_sim_register(uint8_t reg, uint16_t value) {
+  uint16_t old = rda_sim.regs[reg & 0x0f];
+  rda_sim.regs[reg & 0x0f] = value;
+  rda_sim.writes[reg & 0x0f]++;
+  if(reg == 0x02 && RdaRegister<0x02>{old}.get(RDA_DMUTE) == RdaRegister<0x02>{value}.get(RDA_DMUTE)) {
+    rda_sim.dmute_unchanged++;
+  }
+  bool tune = (reg == 0x03 && RdaRegister<0x03>{value}.get(RDA_TUNE)) ||
+    (reg == 0x02 && RdaRegister<0x02>{value}.get(RDA_SEEK));
+  if(tune) {
+    if(!rda_sim.stc) {
+      rda_sim.tunes_in_flight++;
+    }
+    rda_sim.tunes++;
+    rda_sim.stc = false;
+    rda_sim.tune_start = rda_sim.now_ms;
+  }
+  if(tune || (reg == 0x04 && RdaRegister<0x04>{value}.get(RDA_RDS_FIFO_CLR))) {
+    rda_sim.fifo_clears += (rda_sim.fifo > 0);
+    rda_sim.fifo = 0;
+  }
+}
+
+uint8_t rda_sim_write(uint8_t address, const uint8_t* data, size_t len) {
+  uint8_t reg = 0x02;
+  size_t start = 0;
+  if(address == RDA5807M_RANDOM_ADDRESS) {
+    reg = data[0];
+    start = 1;
+  }
+  else {
+    rda_sim.sequential++;
+  }
+  for(size_t i=start; i+1<len; i+=2) {
+    rda_sim_register(reg++, data[i] << 8 | data[i + 1]);
+  }
+  return 0;
+}
+
+const RdaBus rda_sim_bus = {rda_sim_write};
+
+// Registers 0x0A-0x0B: STC (bit 14), READCHAN (bits 9-0)
+void rda_sim_status(uint8_t* arr) {
+  uint16_t reg0a = (rda_sim.stc ? 0x4000 : 0) | (rda_sim.channel & 0x3ff);
+  arr[0] = reg0a >> 8;
+  arr[1] = reg0a & 0xff;
+  arr[2] = 0;
+  arr[3] = 0;
+}
+
+// Knob detents at the given times (ms, negative = counter-clockwise) through the quadrature decoder, summed into
+// detents and channels as the knob ISR does (encoder.h)
+struct KnobSim {
+  Quadrature decoder;
+  int32_t detents;
+  int32_t channels;
+};
+
+void knob_sim_detent(KnobSim* knob, bool clockwise, uint32_t now_ms) {
+  const uint8_t cw[] = {0b01, 0b00, 0b10, 0b11};
+  const uint8_t ccw[] = {0b10, 0b00, 0b01, 0b11};
+  for(int i=0; i<4; i++) {
+    int32_t step = quadrature_update(&knob->decoder, clockwise ? cw[i] : ccw[i], now_ms * 1000 + i * 200);
+    if(step != 0) {
+      knob->channels += step;
+      knob->detents += (step > 0) ? 1 : -1;
+    }
+  }
+}
+
+// Volume knob (rda_control.h) against the simulated register file, loop() modelled as in master.ino: every ms
+// the detents are taken, curr_vol is clamped to 0-15 and marked pending, volume_due() decides the write.
+// Spin: 12 detents down from volume 4 in 60ms (0 reached after 4, then held), 20 up in 100ms, then 5 slow ones
+// 200ms apart. RDS groups keep arriving meanwhile.
+// Checks: only registers 0x05 and 0x02 are written, all through random access (0x11); 0x02 only when DMUTE
+// changes (mute at 0, unmute above); STC never drops (ready_state) and the RDS FIFO is never emptied; writes
+// to 0x05 at least VOLUME_FRAME apart, the chip ends at the last volume.
+void test_volume_path() {
+  rda_sim_reset(60, 950 - FREQ_MIN);
+  uint8_t config[4] = {RDA_TUNE_02.high(), RDA_TUNE_02.low(), RDA_TUNE_03.high(), RDA_TUNE_03.low()};
+  freq_register(config, 950);
+  rda_sim.regs[0x02] = RDA_TUNE_02.word;
+  uint8_t volume = 4;
+  rda_volume(&rda_sim_bus, config, volume);   // setup() unmutes
+  memset(rda_sim.writes, 0, sizeof(rda_sim.writes));
+
+  KnobSim knob = {};
+  quadrature_begin(&knob.decoder, 0b11);
+  VolumeFrame frame = {false, 0};
+  uint32_t detent_count = 0, not_ready = 0, fifo_max = 0, last_write = 0, min_gap = UINT32_MAX, volume_writes = 0;
+  for(uint32_t now=1; now<2000; now++) {
+    rda_sim_advance(now);
+    if(now >= 100 && now < 160 && now % 5 == 0) {
+      knob_sim_detent(&knob, false, now);
+      detent_count++;
+    }
+    if(now >= 200 && now < 300 && now % 5 == 0) {
+      knob_sim_detent(&knob, true, now);
+      detent_count++;
+    }
+    if(now >= 400 && now < 1400 && now % 200 == 0) {
+      knob_sim_detent(&knob, true, now);
+      detent_count++;
+    }
+
+    // loop(): ready_state from the status, knob, volume frame
+    uint8_t status[4];
+    rda_sim_status(status);
+    not_ready += (status[0] & 0b01000000) == 0;
+    if(knob.detents != 0) {
+      volume = std::min(15, std::max(0, volume + knob.detents));
+      knob.detents = 0;
+      knob.channels = 0;
+      frame.pending = true;
+    }
+    uint32_t before = rda_sim.writes[0x05];
+    if(volume_due(&frame, now)) {
+      rda_volume(&rda_sim_bus, config, volume);
+    }
+    if(rda_sim.writes[0x05] != before) {
+      if(volume_writes > 0 && now - last_write < min_gap) min_gap = now - last_write;
+      last_write = now;
+      volume_writes++;
+    }
+    fifo_max = std::max(fifo_max, rda_sim.fifo);
+  }
+
+  int other_writes = 0;
+  for(int reg=0; reg<0x10; reg++) {
+    if(reg != 0x02 && reg != 0x05) other_writes += rda_sim.writes[reg];
+  }
+  CHECK(other_writes == 0 && rda_sim.sequential == 0, "%d writes to other registers, %u sequential", other_writes,
+    rda_sim.sequential);
+  CHECK(rda_sim.writes[0x02] == 2 && rda_sim.dmute_unchanged == 0, "%u writes to 0x02, %u without a DMUTE change",
+    rda_sim.writes[0x02], rda_sim.dmute_unchanged);
+  CHECK(not_ready == 0 && rda_sim.tunes == 0, "STC cleared for %u passes, %u tunes", not_ready, rda_sim.tunes);
+  CHECK(rda_sim.fifo_clears == 0 && rda_sim.fifo == fifo_max, "RDS FIFO emptied %u times", rda_sim.fifo_clears);
+  CHECK(min_gap >= VOLUME_FRAME, "writes to 0x05 %ums apart", min_gap);
+  CHECK(volume_writes < detent_count && RdaRegister<0x05>{rda_sim.regs[0x05]}.get(RDA_VOLUME) == volume &&
+    volume == 15, "%u writes for %u detents, chip at %d, knob at %d", volume_writes, detent_count,
+    RdaRegister<0x05>{rda_sim.regs[0x05]}.get(RDA_VOLUME), volume);
+  report("%u detents, %u writes to 0x05 (>= %ums apart), %u to 0x02, STC kept, %u RDS groups kept", detent_count,
+    volume_writes, min_gap, rda_sim.writes[0x02], rda_sim.fifo);
+}
+
+// Tuning requests (rda_control.h) replayed against the simulated register file with STC 50ms after a tune.
+// loop() is modelled as in master.ino: while STC is clear (ready_state false) nothing is taken, detents add up
+// in the knob; once it is set the knob channels move the frequency (step_freq(), tune_request()) and the
+// latest pending frequency is tuned (rda_tune()); otherwise the frequency is read back from the chip.
+// Sweeps of 100 detents: 65ms apart (1 channel each, 10MHz) and 10ms apart (accelerated, 10 channels each).
+// Checks: no tune written while one is in flight, every tune goes to the latest requested frequency, the chip
+// ends on the knob's final frequency, a fast sweep needs at most one tune per STC time, only register 0x03 is
+// written (random access, TUNE_DIRECT_MODE 0). Requests are counted
+// per loop() pass that takes knob channels, detents arriving during a tune are one request.
+struct TuneSweep {
+  uint32_t requests;
+  uint32_t tunes;
+  int final_frequency;
+  int expected;
+  uint32_t stale;                     // tunes to another frequency than the latest request
+  uint32_t in_flight;
+  uint32_t duration_ms;
+  int channels;                       // knob channels of the 100 detents
+  uint32_t other_writes;              // writes to other registers than 0x03, or sequential
+};
+
+TuneSweep tune_sweep(uint32_t gap_ms) {
+  const int start = 950;
+  rda_sim_reset(50, start - FREQ_MIN);
+  uint8_t config[4] = {RDA_TUNE_02.high(), RDA_TUNE_02.low(), RDA_TUNE_03.high(), RDA_TUNE_03.low()};
+  freq_register(config, start);
+  tune_counters = {};
+  KnobSim knob = {};
+  quadrature_begin(&knob.decoder, 0b11);
+  TuneSweep sweep = {};
+  int frequency = start, requested = start, channels = 0;
+  bool pending = false;
+  uint32_t detents = 0, end = 0;
+  for(uint32_t now=1; now<20000; now++) {
+    rda_sim_advance(now);
+    if(now >= 1000 && detents < 100 && (now - 1000) % gap_ms == 0) {
+      int32_t before = knob.channels;
+      knob_sim_detent(&knob, true, now);
+      channels += knob.channels - before;
+      detents++;
+      end = now;
+    }
+    uint8_t status[4];
+    rda_sim_status(status);
+    if((status[0] & 0b01000000) == 0) {
+      tune_sweep_close(now);
+      continue;
+    }
+    if(knob.channels != 0) {
+      frequency = step_freq(frequency, knob.channels);
+      requested = frequency;
+      knob.channels = 0;
+      knob.detents = 0;
+      tune_request(&pending, now);
+    }
+    bool tuned = pending;
+    if(pending) {
+      rda_tune(&rda_sim_bus, config, frequency);
+      pending = false;
+      sweep.stale += (RdaRegister<0x03>{rda_sim.regs[0x03]}.get(RDA_CHAN) + FREQ_MIN != requested);
+    }
+    rda_sim_status(status);
+    if(!tuned && (status[0] & 0b01000000) != 0) {
+      frequency = ((status[0] & 0b11) << 8 | status[1]) + FREQ_MIN;
+    }
+    tune_sweep_close(now);
+  }
+  sweep.requests = tune_counters.last_sweep_requests;
+  sweep.tunes = tune_counters.last_sweep_tunes;
+  sweep.final_frequency = rda_sim.channel + FREQ_MIN;
+  sweep.expected = step_freq(start, channels);
+  sweep.in_flight = rda_sim.tunes_in_flight;
+  sweep.duration_ms = end - 1000;
+  sweep.channels = channels;
+  sweep.other_writes = rda_sim.sequential;
+  for(int reg=0; reg<0x10; reg++) {
+    if(reg != 0x03) sweep.other_writes += rda_sim.writes[reg];
+  }
+  return sweep;
+}
+
+void test_tune_sweep() {
+  TuneSweep slow = tune_sweep(65);
+  TuneSweep fast = tune_sweep(10);
+  CHECK(slow.expected == 1050 && slow.final_frequency == slow.expected, "10MHz sweep ends on %d, expected %d",
+    slow.final_frequency, slow.expected);
+  CHECK(fast.final_frequency == fast.expected, "fast sweep ends on %d, expected %d", fast.final_frequency,
+    fast.expected);
+  CHECK(slow.in_flight == 0 && fast.in_flight == 0, "tunes written during a tune: %u slow, %u fast",
+    slow.in_flight, fast.in_flight);
+  CHECK(slow.other_writes == 0 && fast.other_writes == 0, "%u/%u writes besides register 0x03 (random access)",
+    slow.other_writes, fast.other_writes);
+  CHECK(slow.stale == 0 && fast.stale == 0, "tunes to an older request: %u slow, %u fast", slow.stale, fast.stale);
+  CHECK(slow.requests == 100 && slow.tunes <= slow.requests, "10MHz sweep: %u requests, %u tunes", slow.requests,
+    slow.tunes);
+  CHECK(fast.tunes <= fast.duration_ms / 50 + 2, "fast sweep: %u tunes for 100 detents in %ums", fast.tunes,
+    fast.duration_ms);
+  report("10MHz in %.1fs: 100 detents, %u requests, %u tunes; %d channels in %.1fs: 100 detents, %u requests, "
+    "%u tunes", slow.duration_ms / 1000.0, slow.requests, slow.tunes, fast.channels, fast.duration_ms / 1000.0,
+    fast.requests, fast.tunes);
+}
+
+// Wait schedule of loop() (power_model.h) replayed per mode for 2 minutes. A pass is busy for its typical
+// time (POWER_PASS_US_*, 3x longer at POWER_IDLE_MHZ), then waits power_wait_ms(): 1ms while the tuner seeks or
+// a write is pending after an input, POWER_WAIT_MS otherwise, an input ends the wait early. The button scanner
+// runs at 1kHz while a button is held and for BUTTON_IDLE_SCANS scans after, at 100Hz otherwise; its scans are
+// busy time inside the waits. Backlight and CPU frequency follow POWER_DIM_MS and POWER_IDLE_MS after an input.
+// Radio: seek by button (800ms), two knob tunes at 40s (STC after 60ms), a volume detent at 100s. Bluetooth:
+// the mode button at 0 only. Settings: a button every 5s. Light sleep is off (POWER_LIGHT_SLEEP 0).
+// Checks: loop() never waits longer than POWER_WAIT_MS and is not busier than the schedule allows (all passes at
+// 80MHz, 1ms waits only after inputs), the number of wakeups follows the schedule, the scanner costs under 0.5%,
+// the current lies within the model's range, settings (backlight and 240MHz always on) draws the most, the idle
+// frequency is reached in radio and Bluetooth mode only.
+struct PowerInput {
+  uint32_t ms;
+  bool button;
+  uint32_t busy_ms;                   // 1ms waits after the input (seek, STC, pending write)
+};
+
+struct PowerReplay {
+  PowerModel model;
+  uint32_t passes;
+  uint64_t scan_us;
+  float busy_ratio;
+  float current;
+};
+
+PowerReplay power_replay(uint32_t pass_us, const PowerInput* inputs, int input_count, uint32_t duration_ms) {
+  PowerReplay replay = {};
+  const uint64_t end = (uint64_t)duration_ms * 1000;
+  const uint32_t scale = POWER_ACTIVE_MHZ / POWER_IDLE_MHZ;
+  uint64_t now = 0, activity = 0, busy_until = 0;
+  uint64_t scan_us[2] = {0, 0};
+  int next = 0;
+
+  // loop() passes
+  while(now < end) {
+    if(next < input_count && (uint64_t)inputs[next].ms * 1000 <= now) {
+      activity = (uint64_t)inputs[next].ms * 1000;
+      busy_until = std::max(busy_until, activity + (uint64_t)inputs[next].busy_ms * 1000);
+      next++;
+    }
+    bool idle = now - activity >= (uint64_t)POWER_IDLE_MS * 1000;
+    bool backlight = now - activity < (uint64_t)POWER_DIM_MS * 1000;
+    uint64_t busy_us = pass_us * (idle ? scale : 1);
+    uint64_t wake = now + busy_us + (uint64_t)power_wait_ms(now < busy_until) * 1000;
+    if(next < input_count && (uint64_t)inputs[next].ms * 1000 < wake) {
+      wake = std::max(now + busy_us, (uint64_t)inputs[next].ms * 1000);
+    }
+    power_model_count(&replay.model, idle, backlight, busy_us, wake - now - busy_us);
+    replay.passes++;
+    now = wake;
+  }
+
+  // Button scanner, 1kHz while a button is held (100ms) and BUTTON_IDLE_SCANS scans after
+  uint64_t touched = 0;
+  bool was_touched = false;
+  next = 0;
+  activity = 0;
+  for(uint64_t scan=0; scan<end; ) {
+    while(next < input_count && (uint64_t)inputs[next].ms * 1000 <= scan) {
+      activity = (uint64_t)inputs[next].ms * 1000;
+      if(inputs[next].button) {
+        touched = activity + 100000;
+        was_touched = true;
+      }
+      next++;
+    }
+    bool idle = scan - activity >= (uint64_t)POWER_IDLE_MS * 1000;
+    scan_us[idle] += POWER_SCAN_US * (idle ? scale : 1);
+    bool fast = was_touched && scan < touched + (uint64_t)BUTTON_IDLE_SCANS * BUTTON_SCAN_US;
+    scan += fast ? BUTTON_SCAN_US : BUTTON_IDLE_SCAN_US;
+  }
+  for(int idle=0; idle<2; idle++) {
+    replay.model.busy_us[idle] += scan_us[idle];
+    replay.model.wait_us[idle] -= std::min(scan_us[idle], replay.model.wait_us[idle]);
+  }
+  replay.scan_us = scan_us[0] + scan_us[1];
+  replay.busy_ratio = power_model_busy_ratio(&replay.model);
+  replay.current = power_model_current(&replay.model);
+  return replay;
+}
+
+void test_power_duty() {
+  const uint32_t duration = 120000;
+  const PowerInput radio_inputs[] = {{0, true, 800}, {40000, false, 60}, {40100, false, 60}, {100000, false, VOLUME_FRAME}};
+  const PowerInput bluetooth_inputs[] = {{0, true, 0}};
+  PowerInput settings_inputs[duration / 5000];
+  for(uint32_t i=0; i<duration / 5000; i++) {
+    settings_inputs[i] = {i * 5000, true, 0};
+  }
+  const char* names[POWER_MODES] = {"radio", "bluetooth", "settings"};
+  const uint32_t pass_us[POWER_MODES] = {POWER_PASS_US_RADIO, POWER_PASS_US_BLUETOOTH, POWER_PASS_US_SETTINGS};
+  const PowerInput* inputs[POWER_MODES] = {radio_inputs, bluetooth_inputs, settings_inputs};
+  const int input_counts[POWER_MODES] = {4, 1, (int)(duration / 5000)};
+
+  PowerReplay replays[POWER_MODES];
+  std::string measured;
+  for(int mode=0; mode<POWER_MODES; mode++) {
+    PowerReplay* replay = &replays[mode];
+    *replay = power_replay(pass_us[mode], inputs[mode], input_counts[mode], duration);
+    uint32_t busy_ms = 0;
+    for(int i=0; i<input_counts[mode]; i++) busy_ms += inputs[mode][i].busy_ms;
+
+    // a full POWER_WAIT_MS after every pass at 240MHz, at most 1ms waits for the busy times and passes at 80MHz
+    uint32_t slow_us = pass_us[mode] * POWER_ACTIVE_MHZ / POWER_IDLE_MHZ;
+    float floor = (float)pass_us[mode] / (pass_us[mode] + POWER_WAIT_MS * 1000);
+    float ceiling = (float)slow_us / (slow_us + POWER_WAIT_MS * 1000) + (float)busy_ms / duration + 0.005f;
+    CHECK(replay->busy_ratio >= floor && replay->busy_ratio <= ceiling, "%s: %.2f%% busy, expected %.2f%% to %.2f%%",
+      names[mode], replay->busy_ratio * 100, floor * 100, ceiling * 100);
+    CHECK(replay->passes <= duration / POWER_WAIT_MS + busy_ms + 2 * input_counts[mode], "%s: %u loop() passes",
+      names[mode], replay->passes);
+    CHECK(replay->scan_us < duration * 1000ULL / 200, "%s: scanner busy %.2f%%", names[mode],
+      replay->scan_us / (duration * 10.0));
+    float low = POWER_WIFI_MA + POWER_RDA5807M_MA + POWER_WAIT_MA_80;
+    float high = POWER_WIFI_MA + POWER_RDA5807M_MA + POWER_BUSY_MA_240 + POWER_BACKLIGHT_MA;
+    CHECK(replay->current > low && replay->current < high, "%s: %.1fmA, outside %.1f-%.1fmA", names[mode],
+      replay->current, low, high);
+    char line[96];
+    snprintf(line, sizeof(line), "%s%s %.2f%% busy %.1fmA (%.1f wakeups/s)", mode == 0 ? "" : ", ", names[mode],
+      replay->busy_ratio * 100, replay->current, replay->passes * 1000.0 / duration);
+    measured += line;
+  }
+  CHECK(replays[2].current > replays[0].current && replays[2].current > replays[1].current,
+    "settings %.1fmA, radio %.1fmA, Bluetooth %.1fmA", replays[2].current, replays[0].current, replays[1].current);
+  CHECK(replays[0].model.wait_us[1] > 0 && replays[1].model.wait_us[1] > 0 && replays[2].model.wait_us[1] == 0 &&
+    replays[2].model.busy_us[1] == 0, "idle frequency: radio %s, Bluetooth %s, settings %s",
+    replays[0].model.wait_us[1] ? "yes" : "no", replays[1].model.wait_us[1] ? "yes" : "no",
+    replays[2].model.wait_us[1] ? "yes" : "no");
+  report("%s", measured.c_str());
+}
+
+// LCD service (lcd_shadow.h) stepped like i2c_bus_run() at the end of each loop() pass: runs are sent while the
+// pass is within I2C_RUN_BUDGET_US and one more run as long as the last one would still fit (i2c_bus_step()).
+// A run costs its bytes at I2C_LCD_CLOCK_HZ: the address, the cursor command and 6 bytes per cell.
+// Screens: the radio screen drawn over a blank display (after lcd.clear()), then a frequency change, then the
+// volume bar over the RDS text. The frequency cells are watched as in master.ino (display_freq_sent()).
+// Checks: no pass goes over the budget, the full redraw is split over several passes, sends every changed cell
+// and ends with the wanted screen, every run is one row and at most LCD_RUN_CELLS long, the watch fires once per frequency change and
+// only when all its cells are on the display.
+struct LcdReplay {
+  uint32_t passes;
+  uint32_t runs;
+  uint32_t cells;
+  uint32_t max_pass_us;               // bus time of the longest pass
+  uint32_t watch_pass;                // pass the watch fired in, 0 - not fired
+  uint32_t long_runs;                 // runs over LCD_RUN_CELLS or across rows
+};
+
+LcdShadow lcd_sim;
+uint32_t lcd_sim_watched = 0;         // watch calls
+bool lcd_sim_watch_early = false;     // called with watched cells not on the display
+
+void lcd_sim_sent() {
+  lcd_sim_watched++;
+  lcd_sim_watch_early |= !lcd_shadow_watched_shown(&lcd_sim);
+}
+
+void lcd_sim_print(uint8_t row, uint8_t col, const char* text) {
+  for(size_t i=0; text[i] != '\0' && col + i < LCD_COLS; i++) {
+    lcd_sim.wanted[row][col + i] = text[i];
+  }
+}
+
+LcdReplay lcd_replay() {
+  LcdReplay replay = {};
+  uint32_t watched = lcd_sim_watched;
+  while(lcd_shadow_changed(&lcd_sim, 0) >= 0 && replay.passes < 100) {
+    replay.passes++;
+    uint32_t elapsed = 0, step_us = 0;
+    LcdRun run;
+    while(elapsed + step_us < I2C_RUN_BUDGET_US && lcd_shadow_next_run(&lcd_sim, &run)) {
+      uint32_t bytes = 1 + (1 + run.end - run.col) * 6;
+      step_us = bytes * 9 * 1000000ULL / I2C_LCD_CLOCK_HZ;
+      elapsed += step_us;
+      replay.runs++;
+      replay.cells += run.end - run.col;
+      replay.long_runs += (run.end - run.col > LCD_RUN_CELLS || run.end > LCD_COLS);
+      bool more = lcd_shadow_sent(&lcd_sim, &run);
+      if(lcd_sim_watched != watched && replay.watch_pass == 0) {
+        replay.watch_pass = replay.passes;
+      }
+      if(!more) break;
+    }
+    replay.max_pass_us = std::max(replay.max_pass_us, elapsed);
+  }
+  return replay;
+}
+
+void test_lcd_runs() {
+  lcd_shadow_clear(&lcd_sim);
+  lcd_sim.watch = {0, 3, 11};
+  lcd_sim.watch_sent = lcd_sim_sent;
+  lcd_sim_watched = 0;
+  lcd_sim_watch_early = false;
+
+  // radio screen: channel, frequency, signal (symbols 0-3), RDS text
+  lcd_sim_print(0, 0, "C2  98.5MHz \x01\x02\x03\x04");
+  lcd_sim_print(1, 0, "Radio Text Demo!");
+  uint32_t changed = 0;
+  for(int i=0; i<LCD_ROWS * LCD_COLS; i++) {
+    changed += (lcd_sim.wanted[i / LCD_COLS][i % LCD_COLS] != lcd_sim.shown[i / LCD_COLS][i % LCD_COLS]);
+  }
+  LcdReplay full = lcd_replay();
+  bool complete = memcmp(lcd_sim.shown, lcd_sim.wanted, sizeof(lcd_sim.shown)) == 0;
+  uint32_t full_watched = lcd_sim_watched;
+
+  lcd_sim_print(0, 0, "  ");
+  lcd_sim_print(0, 3, "107.9MHz");
+  LcdReplay tune = lcd_replay();
+  uint32_t tune_watched = lcd_sim_watched - full_watched;
+
+  lcd_sim_print(1, 0, "\x05\x06\x06\x06\x06\x06\x06           ");
+  LcdReplay volume = lcd_replay();
+
+  CHECK(full.max_pass_us <= I2C_RUN_BUDGET_US && tune.max_pass_us <= I2C_RUN_BUDGET_US &&
+    volume.max_pass_us <= I2C_RUN_BUDGET_US, "pass over the budget: %u/%u/%uus", full.max_pass_us, tune.max_pass_us,
+    volume.max_pass_us);
+  CHECK(complete && full.passes > 1 && full.cells >= changed, "full redraw: %u of %u cells in %u passes%s",
+    full.cells, changed, full.passes, complete ? "" : ", screen not drawn");
+  CHECK(full.long_runs == 0 && tune.long_runs == 0 && volume.long_runs == 0, "runs over %u cells: %u/%u/%u",
+    LCD_RUN_CELLS, full.long_runs, tune.long_runs, volume.long_runs);
+  CHECK(full_watched == 1 && tune_watched == 1 && lcd_sim_watched == 2, "frequency watch called %u/%u/%u times",
+    full_watched, tune_watched, lcd_sim_watched - full_watched - tune_watched);
+  CHECK(!lcd_sim_watch_early, "frequency watch called before its cells were on the display");
+  CHECK(tune.watch_pass > 0 && tune.watch_pass <= tune.passes, "frequency change traced in pass %u of %u",
+    tune.watch_pass, tune.passes);
+  report("full redraw %u cells, %u runs over %u passes (<= %uus each, frequency sent in pass %u); frequency "
+    "change %u runs over %u passes; volume bar %u runs over %u passes", full.cells, full.runs, full.passes,
+    full.max_pass_us, full.watch_pass, tune.runs, tune.passes, volume.runs, volume.passes);
+}
+
+typedef void (*Test)();
+
+const struct {
+  const char* name;
+  Test run;
+} tests[] = {
+  {"bt_jitter", test_bt_jitter},
+  {"radio_drift", test_radio_drift},
+  {"dsp_biquads", test_dsp_biquads},
+  {"dsp_limiter", test_dsp_limiter},
+  {"encoder", test_encoder},
+  {"slave_frames", test_slave_frames},
+  {"metadata_soak", test_metadata_soak},
+  {"ota_upload", test_ota_upload},
+  {"ota_forward", test_ota_forward},
+  {"af_replay", test_af_replay},
+  {"ta_replay", test_ta_replay},
+  {"volume_path", test_volume_path},
+  {"tune_sweep", test_tune_sweep},
+  {"power_duty", test_power_duty},
+  {"lcd_runs", test_lcd_runs},
+};
+
+int main(int argc, char** argv) {
+  const char* filter = nullptr;
+  for(int i=1; i<argc; i++) {
+    if(strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      filter = argv[++i];
+    }
+    else {
+      fprintf(stderr, "Usage: %s [--filter name]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  int failed = 0;
+  printf("test\tresult\tmeasured\n");
+  for(const auto& test : tests) {
+    if(filter != nullptr && strstr(test.name, filter) == nullptr) {
+      continue;
+    }
+    failures = 0;
+    summary.clear();
+    test.run();
+    printf("%s\t%s\t%s\n", test.name, failures == 0 ? "PASS" : "FAIL", summary.c_str());
+    if(failures != 0) {
+      failed++;
+    }
+  }
+  if(failed != 0) {
+    fprintf(stderr, "%d tests failed\n", failed);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,90 @@
+#ifndef af_h
+#define af_h
+
+#include "Arduino.h"
+#include "Wire.h"
+
+#include "constants.h"
+#include "rda5807m.h"             // Register fields
+#include "main_functions.h"       // write_register()
+#include "metrics.h"              // Counted I2C transactions
+#include "logger.h"               // Non-blocking logs
+#include "af_follow.h"            // AF list, checks and verification
+
+// Alternative frequency (AF) following on the RDA5807M (see af_follow.h)
+// Connects the state machine to the I2C registers, millis() and the log.
+
+// Tune the chip to frequency, without changing tune_config (direct mode writes register 0x08 too)
+void af_tune(const uint8_t* config, int frequency) {
+  uint8_t arr[4] = {config[0], config[1], config[2], config[3]};
+  freq_register(arr, frequency);
+#if TUNE_DIRECT_MODE
+  RdaRegister<0x08> direct_config = direct_freq_register(frequency);
+  write_register(0x08, direct_config.high(), direct_config.low());
+#endif
+  write_register(0x03, arr[2], arr[3]);
+}
+
+void af_mute(const uint8_t* config) {
+  write_register(0x02, rda_register<0x02>(config).with(RDA_DMUTE, 0).high(), config[1]);
+}
+
+// Mute as the user set it (config = tune_config)
+void af_unmute(const uint8_t* config) {
+  write_register(0x02, config[0], config[1]);
+}
+
+// Registers 0x0A-0x0B only (STC, channel, RSSI)
+void af_read_status(uint8_t* status) {
+  i2c_request(I2C_RDA5807M, RDA5807M_ADDRESS, 4);
+  for(int i=0; i<4; i++) {
+    status[i] = Wire.read();
+  }
+}
+
+const AfRadio af_radio = {af_tune, af_mute, af_unmute, af_read_status};
+
+// Log what the last step did
+void af_log() {
+  uint8_t events = af_events;
+  af_events = 0;
+  if(events & AF_EVENT_CHECKED) {
+    LOG_DEBUG(RADIO, "AF %d.%dMHz RSSI %d, home %d", af_candidate / 10, af_candidate % 10, af_candidate_rssi,
+      af_rssi >> 4);
+  }
+  if(events & AF_EVENT_STRONGER) {
+    LOG_INFO(RADIO, "AF %d.%dMHz stronger (RSSI %d), switching", af_candidate / 10, af_candidate % 10,
+      af_candidate_rssi);
+  }
+  if(events & AF_EVENT_CONFIRMED) {
+    LOG_INFO(RADIO, "AF %d.%dMHz confirmed", af_candidate / 10, af_candidate % 10);
+  }
+  if(events & AF_EVENT_REJECTED) {
+    LOG_INFO(RADIO, "AF %d.%dMHz rejected, PI does not match, back to %d.%dMHz",
+      af_candidate / 10, af_candidate % 10, af_home / 10, af_home % 10);
+  }
+  if(events & AF_EVENT_SLOW) {
+    LOG_WARN(RADIO, "AF check took %lums", (unsigned long)af_duration);
+  }
+}
+
+// Every register read of loop() (arr=requested_data, config=tune_config, frequency=&curr_freq, after update_freq())
+void af_update(const uint8_t* arr, uint8_t* config, int* frequency) {
+#if AF_FOLLOWING
+  af_follow_update(&af_radio, arr, config, frequency, millis());
+  af_log();
+#endif
+}
+
+// Drive the running check (from loop() while af_checking(), config=tune_config, frequency=&curr_freq)
+void af_check(uint8_t* config, int* frequency) {
+  af_follow_check(&af_radio, config, frequency, millis());
+  af_log();
+}
+
+// Input ends a check right away (from loop(), config=tune_config), loop() handles it in the same pass
+void af_cancel(const uint8_t* config) {
+  af_follow_cancel(&af_radio, config, millis());
+}
+
+#endif
@@ -0,0 +1,310 @@
+#ifndef af_follow_h
+#define af_follow_h
+
+#include "stdint.h"
+
+#include "constants.h"
+#include "rda5807m.h"             // Register fields
+#include "rds_decoder.h"          // Group type and version
+
+// Alternative frequency (AF) following, without the I2C access and the log (af.h connects them)
+// The station's PI and its AF list (group 0A, block C) are collected from the groups loop() reads, and the
+// RSSI of the tuned frequency is smoothed. When it stays below AF_THRESHOLD for AF_WEAK_MS, one AF is checked
+// every AF_CHECK_GAP_MS: the radio is muted, tuned to the AF, the RSSI is read at STC, and it is tuned back
+// and unmuted, all within AF_BUDGET_MS. loop() owns the I2C bus, so the check is a state machine that loop()
+// drives once per pass (1ms apart while it runs), the display and RDS wait for it. Any input cancels it.
+// An AF that is AF_MARGIN stronger is kept, muted until a group with the same PI confirms it (RDS needs
+// longer than a check to sync), and left again if another PI or none arrives within AF_VERIFY_MS.
+// Times are passed in (millis()). No Arduino dependencies, also used by misc/benchmark.
+
+#define AF_MAX 25                 // AF codes per list (RDS method A)
+#define AF_SAMPLE_MS 100          // RSSI sample period
+#define AF_SMOOTHING 3            // RSSI average over 2^3 samples (exponential)
+#define AF_THRESHOLD 20           // smoothed RSSI below this is weak (0-127)
+#define AF_MARGIN 6               // an AF must be this much stronger than the smoothed RSSI
+#define AF_WEAK_MS 2000           // weak this long before checks start
+#define AF_CHECK_GAP_MS 1000      // between two checks
+#define AF_ROUND_GAP_MS 20000     // after every AF was checked without a better one
+#define AF_STC_TIMEOUT_MS 20      // longest wait for STC, on the AF and back
+#define AF_BUDGET_MS 50           // muted time of one check
+#define AF_VERIFY_MS 2000         // an AF must send the same PI within this time
+
+// States
+#define AF_IDLE 0
+#define AF_START 1                // check due, starts in the next loop
+#define AF_TUNING 2               // muted, tuned to the AF, waiting for STC
+#define AF_RETURNING 3            // muted, tuned back, waiting for STC
+#define AF_VERIFY 4               // switched to the AF, muted until its PI is confirmed
+
+// Events for the log, set below and cleared by af.h once logged
+#define AF_EVENT_CHECKED 0x01     // af_candidate measured, af_candidate_rssi
+#define AF_EVENT_STRONGER 0x02    // switched to af_candidate, verifying its PI
+#define AF_EVENT_CONFIRMED 0x04
+#define AF_EVENT_REJECTED 0x08    // other PI or none within AF_VERIFY_MS, back to af_home
+#define AF_EVENT_SLOW 0x10        // check muted longer than AF_BUDGET_MS, af_duration
+
+struct AfCounters {
+  uint32_t checks;
+  uint32_t switches;      // stronger AF with the same PI
+  uint32_t rejected;      // stronger AF, but its PI did not match
+  uint32_t max_check_ms;  // longest muted check
+};
+
+// RDA5807M access (I2C on the ESP32), config = tune_config
+struct AfRadio {
+  void (*tune)(const uint8_t* config, int frequency);    // without changing config
+  void (*mute)(const uint8_t* config);
+  void (*unmute)(const uint8_t* config);                 // mute as the user set it
+  void (*read_status)(uint8_t* status);                  // registers 0x0A-0x0B (STC, channel, RSSI)
+};
+
+uint8_t af_state = AF_IDLE;
+uint16_t af_pi = 0;               // PI of the station, 0 - unknown
+uint8_t af_list[AF_MAX];          // channels (frequency - FREQ_MIN)
+uint8_t af_count = 0;
+uint8_t af_next = 0;              // next AF to check
+uint8_t af_checked = 0;           // AFs checked since the last AF_ROUND_GAP_MS
+int af_frequency = 0;             // frequency the list belongs to
+int af_home = 0;                  // frequency to return to
+int af_candidate = 0;
+uint8_t af_candidate_rssi = 0;
+uint16_t af_rssi = 0;             // smoothed RSSI * 16
+uint32_t af_last_sample = 0;
+uint32_t af_weak_since = 0;       // 0 - not weak
+uint32_t af_last_check = 0;
+uint32_t af_check_start = 0;
+uint32_t af_tune_start = 0;
+uint32_t af_duration = 0;         // muted time of the last check
+uint8_t af_events = 0;
+AfCounters af_counters;
+
+// A check or return is running, loop() drives it with af_check()
+bool af_checking() {
+  return af_state == AF_START || af_state == AF_TUNING || af_state == AF_RETURNING;
+}
+
+// New station, list and PI start over
+void af_reset(int frequency) {
+  af_frequency = frequency;
+  af_pi = 0;
+  af_count = 0;
+  af_next = 0;
+  af_checked = 0;
+  af_rssi = 0;
+  af_last_sample = 0;
+  af_weak_since = 0;
+}
+
+void af_add(int frequency) {
+  if(frequency < FREQ_MIN || frequency > FREQ_MAX || frequency == af_frequency) {
+    return;
+  }
+  uint8_t channel = frequency - FREQ_MIN;
+  for(int i=0; i<af_count; i++) {
+    if(af_list[i] == channel) {
+      return;
+    }
+  }
+  if(af_count < AF_MAX) {
+    af_list[af_count++] = channel;
+  }
+}
+
+// AF code from group 0A, 1-204: 87.6-107.9MHz, other codes are counts, fillers and LF/MF
+void af_add_code(uint8_t code) {
+  if(code >= 1 && code <= 204) {
+    af_add(875 + code);
+  }
+}
+
+void af_remove(int frequency) {
+  uint8_t channel = frequency - FREQ_MIN;
+  for(int i=0; i<af_count; i++) {
+    if(af_list[i] == channel) {
+      af_list[i] = af_list[--af_count];
+      return;
+    }
+  }
+}
+
+// Go back from a rejected AF, muted until the return is done
+void af_leave(const AfRadio* radio, uint8_t* config, int* frequency, uint32_t now_ms) {
+  af_events |= AF_EVENT_REJECTED;
+  af_counters.rejected++;
+  int rejected = af_candidate;
+  freq_register(config, af_home);
+  *frequency = af_home;
+  af_frequency = af_home;
+  af_remove(rejected);
+  radio->mute(config);
+  radio->tune(config, af_home);
+  af_tune_start = now_ms;
+  af_check_start = now_ms;
+  af_state = AF_RETURNING;
+}
+
+// Every register read of loop() (arr=requested_data, config=tune_config, frequency=&curr_freq, after update_freq())
+// Collects PI and AFs, smooths the RSSI and schedules checks
+void af_follow_update(const AfRadio* radio, const uint8_t* arr, uint8_t* config, int* frequency, uint32_t now_ms) {
+  if(*frequency != af_frequency) {
+    // the user tuned away while an AF was verified
+    if(af_state == AF_VERIFY) {
+      radio->unmute(config);
+      af_state = AF_IDLE;
+    }
+    af_reset(*frequency);
+  }
+
+  // RDS group with block A received without errors
+  if((arr[0] & 0b10000000) != 0 && ((arr[3] >> 2) & 0b11) == 0) {
+    uint16_t pi = rds_pi(arr);
+    if(af_state == AF_VERIFY) {
+      if(pi != af_pi) {
+        af_leave(radio, config, frequency, now_ms);
+        return;
+      }
+      af_events |= AF_EVENT_CONFIRMED;
+      af_counters.switches++;
+      radio->unmute(config);
+      af_state = AF_IDLE;
+    }
+    if(af_pi == 0) {
+      af_pi = pi;
+    }
+    // group 0A, block C has two AF codes
+    if(pi == af_pi && rds_group_type(arr) == 0 && rds_group_version(arr) && (arr[3] & 0b11) == 0) {
+      af_add_code(arr[8]);
+      af_add_code(arr[9]);
+    }
+  }
+  if(af_state == AF_VERIFY && now_ms - af_check_start >= AF_VERIFY_MS) {
+    af_leave(radio, config, frequency, now_ms);
+    return;
+  }
+
+  // STC not set, the chip is seeking
+  if((arr[0] & 0b01000000) == 0 || now_ms - af_last_sample < AF_SAMPLE_MS) {
+    return;
+  }
+  af_last_sample = now_ms;
+  uint16_t rssi = (arr[2] >> 1) << 4;
+  af_rssi = (af_rssi == 0) ? rssi : af_rssi + ((int)rssi - (int)af_rssi) / (1 << AF_SMOOTHING);
+
+  if(af_state != AF_IDLE || af_rssi >= AF_THRESHOLD << 4) {
+    af_weak_since = 0;
+    return;
+  }
+  if(af_weak_since == 0) {
+    af_weak_since = now_ms;
+  }
+  if(af_pi == 0 || af_count == 0 || now_ms - af_weak_since < AF_WEAK_MS) {
+    return;
+  }
+  // every AF checked, wait before the next round
+  if(af_checked >= af_count) {
+    if(now_ms - af_last_check < AF_ROUND_GAP_MS) {
+      return;
+    }
+    af_checked = 0;
+  }
+  if(now_ms - af_last_check >= AF_CHECK_GAP_MS) {
+    af_state = AF_START;
+  }
+}
+
+// Checked AF is done, config back on the home frequency (tune_config)
+void af_return(const AfRadio* radio, const uint8_t* config, uint32_t now_ms) {
+  radio->tune(config, af_home);
+  af_tune_start = now_ms;
+  af_state = AF_RETURNING;
+}
+
+void af_finish(const AfRadio* radio, const uint8_t* config, uint32_t now_ms) {
+  radio->unmute(config);
+  af_state = AF_IDLE;
+  af_last_check = now_ms;
+  af_duration = now_ms - af_check_start;
+  if(af_duration > af_counters.max_check_ms) {
+    af_counters.max_check_ms = af_duration;
+  }
+  if(af_duration > AF_BUDGET_MS) {
+    af_events |= AF_EVENT_SLOW;
+  }
+}
+
+// Drive the running check (from loop() while af_checking(), config=tune_config, frequency=&curr_freq)
+void af_follow_check(const AfRadio* radio, uint8_t* config, int* frequency, uint32_t now_ms) {
+  uint8_t status[4];
+  switch(af_state) {
+    case AF_START:
+      if(af_count == 0) {
+        af_state = AF_IDLE;
+        break;
+      }
+      af_home = *frequency;
+      af_candidate = af_list[af_next % af_count] + FREQ_MIN;
+      af_next = (af_next + 1) % af_count;
+      af_checked++;
+      af_counters.checks++;
+      af_check_start = now_ms;
+      radio->mute(config);
+      radio->tune(config, af_candidate);
+      af_tune_start = now_ms;
+      af_state = AF_TUNING;
+      break;
+
+    case AF_TUNING: {
+      radio->read_status(status);
+      bool stc = (status[0] & 0b01000000) != 0;
+      if(!stc && now_ms - af_tune_start < AF_STC_TIMEOUT_MS) {
+        break;
+      }
+      af_candidate_rssi = status[2] >> 1;
+      bool station = (status[2] & 0b1) != 0;
+      af_events |= AF_EVENT_CHECKED;
+      // stronger, stay muted until its PI is confirmed by af_follow_update()
+      if(stc && station && af_candidate_rssi >= (af_rssi >> 4) + AF_MARGIN) {
+        af_events |= AF_EVENT_STRONGER;
+        freq_register(config, af_candidate);
+        *frequency = af_candidate;
+        af_frequency = af_candidate;
+        af_remove(af_candidate);
+        af_add(af_home);
+        af_rssi = af_candidate_rssi << 4;
+        af_weak_since = 0;
+        af_checked = 0;
+        af_last_check = now_ms;
+        af_state = AF_VERIFY;
+        break;
+      }
+      af_return(radio, config, now_ms);
+      break;
+    }
+
+    case AF_RETURNING:
+      radio->read_status(status);
+      if((status[0] & 0b01000000) != 0 || now_ms - af_tune_start >= AF_STC_TIMEOUT_MS) {
+        af_finish(radio, config, now_ms);
+      }
+      break;
+  }
+}
+
+// Input ends a check right away (from loop(), config=tune_config), loop() handles it in the same pass
+// An AF being verified is unmuted but still verified: its PI has to match within AF_VERIFY_MS, or it is left
+void af_follow_cancel(const AfRadio* radio, const uint8_t* config, uint32_t now_ms) {
+  if(af_state == AF_VERIFY) {
+    radio->unmute(config);
+    return;
+  }
+  if(af_state == AF_TUNING) {
+    radio->tune(config, af_home);
+  }
+  if(af_state != AF_IDLE) {
+    radio->unmute(config);
+    af_state = AF_IDLE;
+    af_last_check = now_ms;
+  }
+}
+
+#endif
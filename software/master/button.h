@@ -1,90 +1,201 @@
 #ifndef button_h
 #define button_h
 
+#include "Arduino.h"
+#include "esp_timer.h"            // Scan timer
+#include "soc/gpio_reg.h"         // GPIO input register
+#include "power_model.h"          // Scan rates (BUTTON_SCAN_US, BUTTON_IDLE_SCAN_US)
+
+// Buttons
+// All buttons are sampled together at 1kHz by a timer, with one read of the GPIO input register (pins must
+// be below 32). Debouncing is an integrator per pin: a 3 bit vertical counter, so all pins are counted in
+// parallel with a few bitwise operations, and a pin changes state after 8 equal samples (8ms). State changes
+// and long presses are pushed into a queue as events. buttons_poll() (once at the start of loop()) hands the
+// queued events to their buttons, Button::update() takes them, debounce()/release()/start_longpress()/
+// start_custom_longpress() are then true until the next update(). Events of buttons that are not updated in
+// that loop are dropped, like before. Timing no longer depends on how fast loop() runs, and presses during
+// blocking code stay in the queue until the next loop.
+
+#define BUTTON_LONGPRESS_MS 500           // basic long press
+#define BUTTON_CUSTOM_LONGPRESS_MS 5000   // custom long press
+#define BUTTON_QUEUE_SIZE 32
+
+// Event types
+#define BUTTON_PRESS 0
+#define BUTTON_RELEASE 1
+#define BUTTON_LONGPRESS 2
+#define BUTTON_CUSTOM_LONGPRESS 3
+
+struct ButtonEvent {
+  uint8_t pin;
+  uint8_t type;
+};
+
+class Button;
+
+// Scanner state, bit n = GPIO n
+Button* button_by_pin[32];                  // button object of each pin
+volatile uint32_t button_mask = 0;          // pins with a button
+volatile uint32_t button_inverted = 0;      // pins that read 0 when pressed
+volatile uint32_t button_pressed = 0;       // debounced state, 1 - pressed
+QueueHandle_t button_queue = NULL;
+esp_timer_handle_t button_timer = NULL;
+uint32_t button_events_dropped = 0;         // queue was full
+TaskHandle_t button_wake_task = NULL;       // notified when events are queued (loop task)
+
+// Timer callback, 1kHz
+void button_scan(void* parameter) {
+  static uint32_t count0 = 0xffffffff, count1 = 0xffffffff, count2 = 0xffffffff; // vertical counters, 7 = idle
+  static uint16_t held_ms[32];
+  static uint16_t idle_scans = 0;
+  static bool slow = false;
+
+  uint32_t sample = (REG_READ(GPIO_IN_REG) ^ button_inverted) & button_mask;
+  uint32_t state = button_pressed;
+
+  // count down while the sample differs from the state, reset to 7 when it is equal,
+  // state toggles when the counter wraps around (8 differing samples in a row)
+  uint32_t differs = sample ^ state;
+  uint32_t new0 = ~(count0 & differs);
+  uint32_t new1 = ~(differs & (count1 ^ count0));
+  uint32_t new2 = ~(differs & ~(count2 ^ (~count0 & ~count1)));
+  count0 = new0; count1 = new1; count2 = new2;
+  uint32_t toggled = differs & count0 & count1 & count2;
+  state ^= toggled;
+  button_pressed = state;
+
+  // scan slower while nothing is touched (fewer wakeups when idle)
+  if((sample | state) == 0) {
+    if(idle_scans < BUTTON_IDLE_SCANS) {
+      idle_scans++;
+    }
+    else if(!slow) {
+      slow = true;
+      esp_timer_stop(button_timer);
+      esp_timer_start_periodic(button_timer, BUTTON_IDLE_SCAN_US);
+    }
+  }
+  else {
+    idle_scans = 0;
+    if(slow) {
+      slow = false;
+      esp_timer_stop(button_timer);
+      esp_timer_start_periodic(button_timer, BUTTON_SCAN_US);
+    }
+  }
+  bool queued = toggled != 0;
+
+  // press/release events
+  while(toggled != 0) {
+    uint8_t pin = __builtin_ctz(toggled);
+    toggled &= toggled - 1;
+    ButtonEvent event = {pin, (uint8_t)(((state >> pin) & 1) ? BUTTON_PRESS : BUTTON_RELEASE)};
+    held_ms[pin] = 0;
+    if(xQueueSend(button_queue, &event, 0) != pdTRUE) button_events_dropped++;
+  }
+
+  // long press events, only pressed pins
+  uint32_t held = state;
+  while(held != 0) {
+    uint8_t pin = __builtin_ctz(held);
+    held &= held - 1;
+    if(held_ms[pin] < BUTTON_CUSTOM_LONGPRESS_MS) {
+      held_ms[pin]++;
+      ButtonEvent event = {pin, BUTTON_LONGPRESS};
+      if(held_ms[pin] == BUTTON_CUSTOM_LONGPRESS_MS) event.type = BUTTON_CUSTOM_LONGPRESS;
+      if(held_ms[pin] == BUTTON_LONGPRESS_MS || held_ms[pin] == BUTTON_CUSTOM_LONGPRESS_MS) {
+        if(xQueueSend(button_queue, &event, 0) != pdTRUE) button_events_dropped++;
+        queued = true;
+      }
+    }
+  }
+
+  if(queued && button_wake_task != NULL) {
+    xTaskNotifyGive(button_wake_task);
+  }
+}
+
 class Button {
   private:
     uint8_t btn; // pin number
-    uint8_t btn_state;
-    unsigned long last_debounce_time = 0;
-    bool inverted = true; // default is inverted input, 0 is pressed, 1 is released
-    // basic long press - 0.5s
-    bool longpress_state = false;
-    bool prev_longpress_state = false;
-    bool start_longpress_state = false;
-    // custom long press - 5s
-    bool custom_longpress_state = false;
-    bool prev_custom_longpress_state = false;
-    bool start_custom_longpress_state = false;
+    uint8_t pending = 0; // events of this loop from buttons_poll(), bit = event type
+    uint8_t events = 0;  // events of the last update()
+
+    friend bool buttons_poll();
 
   public:
-    // initialize button
+    // initialize button, starts the scanner with the first button
     void begin(uint8_t button, bool inverted_input = true) {
       btn = button;
-      btn_state = 0xff;
       pinMode(btn, INPUT_PULLUP);
-      inverted = inverted_input;
-    }
-
-    // update btn_state
-    void update() {
-      // update shift state
-      bool button_input;
-      if(inverted) {
-        button_input = digitalRead(btn);
-      }
-      else {
-        button_input = !digitalRead(btn);
+      button_by_pin[btn] = this;
+      if(inverted_input) {
+        button_inverted |= 1UL << btn;
       }
-      btn_state = (btn_state << 1) | button_input | 0b11111100;
+      button_mask |= 1UL << btn;
 
-      // if debounce(off->on), update
-      if(debounce()) {
-        last_debounce_time = millis();
+      if(button_timer == NULL) {
+        button_queue = xQueueCreate(BUTTON_QUEUE_SIZE, sizeof(ButtonEvent));
+        esp_timer_create_args_t timer_args = {};
+        timer_args.callback = button_scan;
+        timer_args.name = "buttons";
+        esp_timer_create(&timer_args, &button_timer);
+        esp_timer_start_periodic(button_timer, BUTTON_SCAN_US);
       }
+    }
 
-      // if in long press mode, update (here we set duration to 500ms)
-      longpress_state = (fully_pressed() && (millis() - last_debounce_time > 500));
-      // check if it toggled
-      start_longpress_state = (prev_longpress_state == false) && (longpress_state == true);
-      // update previous state
-      prev_longpress_state = longpress_state;
-
-      // custom timing
-      // if in long press mode, update (here we set duration to 500ms)
-      custom_longpress_state = (fully_pressed() && (millis() - last_debounce_time > 5000));
-      // check if it toggled
-      start_custom_longpress_state = (prev_custom_longpress_state == false) && (custom_longpress_state == true);
-      // update previous state
-      prev_custom_longpress_state = custom_longpress_state;
+    // take events of this button from this loop
+    void update() {
+      events = pending;
+      pending = 0;
     }
 
     //-----------NORMAL BUTTONS-------------//
 
-    // detects for sequence 100000000 for last 9 bits
-    // released(1) to pressed(0) transition
+    // released to pressed transition
     bool debounce() {
-      return (btn_state == 0b11111110);
+      return (events & (1 << BUTTON_PRESS)) != 0;
     }
-    // detects for sequence 011111111 for last 9 bits
-    // pressed(0) to release(1) transition
+    // pressed to released transition
     bool release() {
-      return (btn_state == 0b11111101);
+      return (events & (1 << BUTTON_RELEASE)) != 0;
     }
-    // true if button is fully pressed
+    // true if button is fully pressed (debounced)
     bool fully_pressed() {
-      return (btn_state == 0b11111100);
+      return ((button_pressed >> btn) & 1) != 0;
     }
 
-    // true if long press is activated
+    // true if long press is activated (held for 500ms)
     bool start_longpress() {
-      return start_longpress_state;
+      return (events & (1 << BUTTON_LONGPRESS)) != 0;
     }
 
-    // true if custom long press is activated
+    // true if custom long press is activated (held for 5s)
     bool start_custom_longpress() {
-      return start_custom_longpress_state;
+      return (events & (1 << BUTTON_CUSTOM_LONGPRESS)) != 0;
     }
 
 };
 
-#endif
\ No newline at end of file
+// Hand queued events to their buttons, call once at the start of loop(). Returns true if there were events
+bool buttons_poll() {
+  if(button_queue == NULL) {
+    return false;
+  }
+  // events from the last loop that no update() took are dropped
+  uint32_t pins = button_mask;
+  while(pins != 0) {
+    uint8_t pin = __builtin_ctz(pins);
+    pins &= pins - 1;
+    button_by_pin[pin]->pending = 0;
+  }
+  bool received = false;
+  ButtonEvent event;
+  while(xQueueReceive(button_queue, &event, 0) == pdTRUE) {
+    button_by_pin[event.pin]->pending |= 1 << event.type;
+    received = true;
+  }
+  return received;
+}
+
+#endif
@@ -7,9 +7,21 @@
 
 // I2C addresses
 #define RDA5807M_ADDRESS 0x10
+#define RDA5807M_RANDOM_ADDRESS 0x11 // random access, one register at a time
 #define LCD_ADDRESS 0x27
 #define SLAVE_ADDRESS 0x55
 
+// I2C clock (Hz). RDA5807M and slave run Fast-mode, the PCF8574 of the LCD backpack is only rated for 100kHz
+// (most backpacks work at 400kHz too, then set I2C_LCD_CLOCK_HZ to I2C_CLOCK_HZ and the bus never switches)
+#define I2C_CLOCK_HZ 400000
+#define I2C_LCD_CLOCK_HZ 100000
+// Deferred I2C work (LCD, slave sync) per loop (us)
+#define I2C_RUN_BUDGET_US 3000
+
+// Time between the PACKET command and reading the packet (ms), the slave only has to latch the index,
+// its frames are prebuilt
+#define SLAVE_PACKET_DELAY 3
+
 // Button pin numbers
 #define LEFT_BUTTON 18
 #define RIGHT_BUTTON 17
@@ -28,9 +40,25 @@
 // other pin numbers
 #define ANALOG_SWITCH 14
 
+// Digital audio path
+// 1 - RDA5807M sends radio audio over I2S to the slave, which mixes it with Bluetooth (slave needs RADIO_I2S_INPUT 1)
+// 0 - radio audio is analog, ANALOG_SWITCH selects between radio and Bluetooth
+#define I2S_AUDIO_PATH 0
+// 1 - tune with the direct frequency mode (register 0x07 FREQ_MODE, frequency in register 0x08)
+#define TUNE_DIRECT_MODE 0
+// RDA5807M I2S role, 0 - master (generates BCK/WS), 1 - slave (clocks from the slave ESP32)
+#define RDA_I2S_SLAVE 0
+
+// 1 - follow alternative frequencies (RDS AF list) when the signal fades (see af.h)
+#define AF_FOLLOWING 1
+// 1 - traffic announcements (RDS TA/EON) of the last radio station interrupt Bluetooth (see ta.h)
+#define TA_MONITOR 1
+
 // default frequency and volume levels
 #define FREQ_DEFAULT 870
 #define VOL_DEFAULT 4
+// minimum interval between volume writes in ms, fast knob spins are merged into one write
+#define VOLUME_FRAME 20
 
 // Text auto-scrolling update interval in ms
 #define RDS_SCROLL 500
@@ -39,5 +67,7 @@
 // Wi-Fi
 #define WIFI_SSID "DIP-E036 Speaker"
 #define WIFI_PW "123456789"
+// Token the /ota page sends with firmware uploads (OTA_TOKEN_HEADER), change it before deploying
+#define OTA_TOKEN "dip-e036-update"
 
 #endif
\ No newline at end of file
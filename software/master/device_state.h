@@ -0,0 +1,166 @@
+#ifndef device_state_h
+#define device_state_h
+
+#include "stdint.h"
+#include "string.h"
+
+#include "metadata.h"             // Bluetooth metadata slots
+
+// Device state published by loop()
+// loop() is the only writer. It sets fields of its working copy (state_set_*), which marks them dirty, and
+// state_publish() at the end of the loop copies it into the published copy under a sequence lock and calls the
+// subscribers of the changed fields. Readers on other tasks (web handlers) copy the published state with
+// state_read(), without locks: the copy is retried if the sequence changed meanwhile, so they never see half
+// an update and never touch memory loop() frees. A reader that finds a publish running sleeps a tick
+// (STATE_READ_YIELD): on the ESP32 the readers (async_tcp, priority 3) are above loop() (loopTask, priority 1),
+// spinning would keep the writer from finishing. The session save and the LCD's radio screen (master.ino)
+// subscribe, the screen is redrawn where the state changed.
+// No Arduino dependencies, also used by misc/benchmark.
+
+#ifndef STATE_READ_YIELD
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#define STATE_READ_YIELD() vTaskDelay(1)  // taskYIELD() only yields to equal or higher priorities
+#else
+#include "sched.h"
+#define STATE_READ_YIELD() sched_yield()
+#endif
+#endif
+
+// Fields, bits of the changed mask
+#define STATE_FREQUENCY (1 << 0)
+#define STATE_VOLUME (1 << 1)
+#define STATE_READY (1 << 2)
+#define STATE_BLUETOOTH (1 << 3)
+#define STATE_CONNECTION (1 << 4)
+#define STATE_PLAYBACK (1 << 5)
+#define STATE_RADIOTEXT (1 << 6)
+#define STATE_METADATA (1 << 7)
+#define STATE_TIMESHIFT (1 << 8)
+
+#define STATE_RADIOTEXT_SIZE 65       // version A radiotext, including terminator
+#define STATE_SUBSCRIBERS 4
+
+struct DeviceState {
+  int frequency;                      // MHz / 0.1MHz
+  uint8_t volume;
+  bool ready;                         // tuner not seeking or tuning
+  bool bluetooth_mode;
+  uint8_t connection_state;           // 0 - OFF, 1 - CONNECTED, 2 - DISCONNECTED, 3 - CONNECTING, 4 - DISCONNECTING
+  uint8_t playback_state;             // 0 - STOPPED, 1 - PLAYING, 2 - PAUSED, 3 - FWD SEEK, 4 - REV SEEK, 5 - ERROR
+  char radiotext[STATE_RADIOTEXT_SIZE];
+  Metadata metadata;
+  uint8_t timeshift_state;            // TIMESHIFT_OFF ... TIMESHIFT_BEHIND (timeshift_protocol.h)
+  uint16_t timeshift_delay;           // seconds behind live
+  uint16_t timeshift_skip;            // skip step in seconds, the slave's ring may hold less than TIMESHIFT_SKIP_S
+};
+
+// Called by state_publish() with the changed fields of its mask (in loop())
+typedef void (*StateCallback)(uint32_t changed, const DeviceState* state);
+
+struct StateSubscriber {
+  uint32_t mask;
+  StateCallback callback;
+};
+
+DeviceState state_working;            // loop() only
+uint32_t state_dirty = 0;
+DeviceState state_published;
+volatile uint32_t state_sequence = 0; // odd while state_published is written
+StateSubscriber state_subscribers[STATE_SUBSCRIBERS];
+uint8_t state_subscriber_count = 0;
+
+// Call callback after publishes that change a field in mask, returns false if there is no room
+bool state_subscribe(uint32_t mask, StateCallback callback) {
+  if(state_subscriber_count >= STATE_SUBSCRIBERS) {
+    return false;
+  }
+  state_subscribers[state_subscriber_count++] = {mask, callback};
+  return true;
+}
+
+template<typename T>
+void state_set(T* field, T value, uint32_t bit) {
+  if(*field != value) {
+    *field = value;
+    state_dirty |= bit;
+  }
+}
+
+void state_set_frequency(int frequency) {
+  state_set(&state_working.frequency, frequency, STATE_FREQUENCY);
+}
+void state_set_volume(uint8_t volume) {
+  state_set(&state_working.volume, volume, STATE_VOLUME);
+}
+void state_set_ready(bool ready) {
+  state_set(&state_working.ready, ready, STATE_READY);
+}
+void state_set_bluetooth(bool bluetooth_mode, uint8_t connection_state, uint8_t playback_state) {
+  state_set(&state_working.bluetooth_mode, bluetooth_mode, STATE_BLUETOOTH);
+  state_set(&state_working.connection_state, connection_state, STATE_CONNECTION);
+  state_set(&state_working.playback_state, playback_state, STATE_PLAYBACK);
+}
+
+void state_set_timeshift(uint8_t timeshift_state, uint16_t timeshift_delay, uint16_t timeshift_skip) {
+  state_set(&state_working.timeshift_state, timeshift_state, STATE_TIMESHIFT);
+  state_set(&state_working.timeshift_delay, timeshift_delay, STATE_TIMESHIFT);
+  state_set(&state_working.timeshift_skip, timeshift_skip, STATE_TIMESHIFT);
+}
+
+// Text is cut to the slot
+void state_set_radiotext(const char* text) {
+  size_t length = strnlen(text, STATE_RADIOTEXT_SIZE - 1);
+  if(strncmp(state_working.radiotext, text, length) != 0 || state_working.radiotext[length] != '\0') {
+    memcpy(state_working.radiotext, text, length);
+    state_working.radiotext[length] = '\0';
+    state_dirty |= STATE_RADIOTEXT;
+  }
+}
+
+void state_set_metadata(const Metadata* metadata) {
+  if(memcmp(&state_working.metadata, metadata, sizeof(Metadata)) != 0) {
+    memcpy(&state_working.metadata, metadata, sizeof(Metadata));
+    state_dirty |= STATE_METADATA;
+  }
+}
+
+// Publish the working copy if a field changed (from loop()), returns the changed fields
+uint32_t state_publish() {
+  uint32_t changed = state_dirty;
+  if(changed == 0) {
+    return 0;
+  }
+  uint32_t sequence = state_sequence;
+  __atomic_store_n(&state_sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(&state_published, &state_working, sizeof(DeviceState));
+  __atomic_store_n(&state_sequence, sequence + 2, __ATOMIC_RELEASE);
+  state_dirty = 0;
+
+  for(int i=0; i<state_subscriber_count; i++) {
+    if((state_subscribers[i].mask & changed) != 0) {
+      state_subscribers[i].callback(changed & state_subscribers[i].mask, &state_working);
+    }
+  }
+  return changed;
+}
+
+// Consistent copy of the published state (any task)
+void state_read(DeviceState* state) {
+  while(true) {
+    uint32_t before = __atomic_load_n(&state_sequence, __ATOMIC_ACQUIRE);
+    if((before & 1) == 0) {
+      memcpy(state, &state_published, sizeof(DeviceState));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if(__atomic_load_n(&state_sequence, __ATOMIC_RELAXED) == before) {
+        return;
+      }
+    }
+    // loop() is publishing, let it finish
+    STATE_READ_YIELD();
+  }
+}
+
+#endif
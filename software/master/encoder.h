@@ -0,0 +1,68 @@
+#ifndef encoder_h
+#define encoder_h
+
+#include "Arduino.h"
+#include "soc/gpio_reg.h"         // GPIO input register
+
+#include "quadrature.h"           // Transition table and acceleration
+
+// Rotary encoder (knob)
+// Both pins are sampled with one read of the GPIO input register and decoded in quadrature.h. Detents are
+// added to atomic counters in the ISR, loop() takes all of them at once, so fast spins do not lose steps.
+
+class Encoder {
+  private:
+    uint8_t clk_pin;
+    uint8_t dt_pin;
+    Quadrature knob = {0b11, 0, 0, 0};
+    int32_t detents = 0;              // signed detents, not taken yet
+    int32_t channels = 0;             // signed detents with acceleration, not taken yet
+
+  public:
+    // initialize encoder, pins must be below 32 (GPIO_IN_REG)
+    void begin(uint8_t clk, uint8_t dt) {
+      clk_pin = clk;
+      dt_pin = dt;
+      pinMode(clk_pin, INPUT); pinMode(dt_pin, INPUT);
+      uint32_t input = REG_READ(GPIO_IN_REG);
+      quadrature_begin(&knob, ((input >> clk_pin) & 1) << 1 | ((input >> dt_pin) & 1));
+    }
+
+    // call from the pin change ISR, returns true if a detent was counted
+    bool IRAM_ATTR update() {
+      uint32_t input = REG_READ(GPIO_IN_REG);
+      uint8_t state = ((input >> clk_pin) & 1) << 1 | ((input >> dt_pin) & 1);
+      int32_t step = quadrature_update(&knob, state, micros());
+      if(step == 0) {
+        return false;
+      }
+      __atomic_add_fetch(&detents, (step > 0) ? 1 : -1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&channels, step, __ATOMIC_RELAXED);
+      return true;
+    }
+
+    // true if there are detents not taken yet
+    bool pending() {
+      return __atomic_load_n(&detents, __ATOMIC_RELAXED) != 0;
+    }
+
+    // signed detents since the last take, 1 per detent (volume)
+    int32_t take_detents() {
+      __atomic_exchange_n(&channels, 0, __ATOMIC_RELAXED);
+      return __atomic_exchange_n(&detents, 0, __ATOMIC_RELAXED);
+    }
+
+    // signed channel steps since the last take, with acceleration (frequency)
+    int32_t take_channels() {
+      __atomic_exchange_n(&detents, 0, __ATOMIC_RELAXED);
+      return __atomic_exchange_n(&channels, 0, __ATOMIC_RELAXED);
+    }
+
+    // drop detents not taken yet
+    void clear() {
+      __atomic_exchange_n(&detents, 0, __ATOMIC_RELAXED);
+      __atomic_exchange_n(&channels, 0, __ATOMIC_RELAXED);
+    }
+};
+
+#endif
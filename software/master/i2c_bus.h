@@ -0,0 +1,398 @@
+#ifndef i2c_bus_h
+#define i2c_bus_h
+
+#include "Arduino.h"
+#include "Wire.h"                 // I2C Communication
+#include "LiquidCrystal_I2C.h"    // LCD I2C library
+
+#include "constants.h"
+#include "latency_trace.h"        // Histograms for the queueing latency
+#include "lcd_shadow.h"           // LCD cells and runs
+#include "logger.h"
+
+// I2C bus scheduler
+// loop() owns Wire, and every transaction goes through this file. RDA5807M, LCD backpack and slave share the
+// bus, each transaction belongs to a priority class: tuner control, RDS reads, LCD, slave sync. Tuner control and
+// RDS reads go to the bus right away, loop() needs their result. LCD and slave work is deferred into services:
+// the LCD is drawn into a shadow buffer, slave packets are fetched by a step function. i2c_bus_run() (end of
+// loop()) steps the requested services class by class, one transaction per step, within I2C_RUN_BUDGET_US (a step
+// starts only if the last one would still fit), so a redraw or a slave fetch never sits between loop() and the
+// next tuner read. A service that waits for the slave
+// returns and is stepped again in the next loop, instead of delay().
+// Adjacent transactions to one device are batched: changed LCD cells go in one transaction per run of cells,
+// a slave packet read is followed by the next packet command in the same step.
+// The bus runs at I2C_CLOCK_HZ and drops to I2C_LCD_CLOCK_HZ for LCD transfers. Counters per device and per
+// class, queueing latency per class (request of a service to its first transaction, 0 for direct transactions)
+// and the bus occupancy of the last second are printed on /metrics.
+
+// I2C devices on the bus
+#define I2C_RDA5807M 0
+#define I2C_LCD 1
+#define I2C_SLAVE 2
+#define I2C_DEVICES 3
+
+// Priority classes, highest first
+#define I2C_CLASS_TUNER 0         // RDA5807M writes and status reads
+#define I2C_CLASS_RDS 1           // RDA5807M register reads with the RDS blocks
+#define I2C_CLASS_LCD 2
+#define I2C_CLASS_SLAVE 3
+#define I2C_CLASSES 4
+
+// Service step results
+#define I2C_IDLE 0                // nothing left to do
+#define I2C_WAITING 1             // not due yet, no transaction, step again in the next run
+#define I2C_MORE 2                // did a transaction, more to do
+
+#define I2C_SERVICES 4
+#define I2C_OCCUPANCY_US 1000000  // occupancy window
+
+struct I2CCounters {
+  uint32_t transactions;
+  uint32_t bytes_written;
+  uint32_t bytes_read;
+  uint32_t errors;        // NACK or bus errors from endTransmission
+  uint32_t short_reads;   // requestFrom returned less bytes than requested
+  uint64_t busy_us;       // time spent in Wire calls
+};
+
+struct I2CClassCounters {
+  uint32_t transactions;
+  uint64_t busy_us;
+  LatencyHistogram wait;  // queueing latency, us
+};
+
+typedef uint8_t (*I2CStep)();
+
+struct I2CService {
+  uint8_t cls;
+  I2CStep step;
+  bool pending;
+  bool started;           // first transaction done, its latency recorded
+  unsigned long requested_us;
+};
+
+I2CCounters i2c_counters[I2C_DEVICES];
+I2CClassCounters i2c_class_counters[I2C_CLASSES];
+I2CService i2c_services[I2C_SERVICES];
+uint8_t i2c_service_count = 0;
+bool i2c_in_service = false;          // a service step is running, its transactions are not direct
+uint32_t i2c_clock = 0;
+unsigned long i2c_window_start = 0;
+uint32_t i2c_window_busy_us = 0;
+float i2c_occupancy = 0;              // share of the last full window the bus was busy
+float i2c_occupancy_max = 0;
+
+// Start the bus (from setup())
+void i2c_bus_begin() {
+  Wire.begin(); // (SDA, SCL)
+  Wire.setClock(I2C_CLOCK_HZ);
+  i2c_clock = I2C_CLOCK_HZ;
+  i2c_window_start = micros();
+}
+
+// Clock for a transfer to device
+void i2c_bus_clock(uint8_t device) {
+  uint32_t clock = (device == I2C_LCD) ? I2C_LCD_CLOCK_HZ : I2C_CLOCK_HZ;
+  if(clock != i2c_clock) {
+    Wire.setClock(clock);
+    i2c_clock = clock;
+  }
+}
+
+// Class of a transaction, reads of more than the status registers (0x0A-0x0B) carry RDS blocks
+uint8_t i2c_class(uint8_t device, uint8_t read_len) {
+  if(device == I2C_LCD) return I2C_CLASS_LCD;
+  if(device == I2C_SLAVE) return I2C_CLASS_SLAVE;
+  return (read_len > 4) ? I2C_CLASS_RDS : I2C_CLASS_TUNER;
+}
+
+// Count transactions of device that took the bus since start (micros())
+void i2c_account(uint8_t device, uint8_t cls, uint32_t transactions, unsigned long start) {
+  unsigned long now = micros();
+  uint32_t busy = now - start;
+  i2c_counters[device].transactions += transactions;
+  i2c_counters[device].busy_us += busy;
+  I2CClassCounters* counters = &i2c_class_counters[cls];
+  counters->transactions += transactions;
+  counters->busy_us += busy;
+  // direct transactions do not queue
+  if(!i2c_in_service) {
+    trace_record(&counters->wait, 0);
+  }
+
+  i2c_window_busy_us += busy;
+  if(now - i2c_window_start >= I2C_OCCUPANCY_US) {
+    i2c_occupancy = (float)i2c_window_busy_us / (now - i2c_window_start);
+    if(i2c_occupancy > i2c_occupancy_max) i2c_occupancy_max = i2c_occupancy;
+    i2c_window_start = now;
+    i2c_window_busy_us = 0;
+  }
+}
+
+// I2C write of len bytes to address, returns endTransmission status (0 = success)
+uint8_t i2c_write(uint8_t device, uint8_t address, const uint8_t* data, size_t len) {
+  i2c_bus_clock(device);
+  unsigned long start = micros();
+  Wire.beginTransmission(address);
+  Wire.write(data, len);
+  uint8_t status = Wire.endTransmission();
+
+  i2c_counters[device].bytes_written += len;
+  if(status != 0) i2c_counters[device].errors++;
+  i2c_account(device, i2c_class(device, 0), 1, start);
+  return status;
+}
+
+// I2C read of len bytes from address, returns number of bytes received (read them with Wire.read)
+uint8_t i2c_request(uint8_t device, uint8_t address, uint8_t len) {
+  i2c_bus_clock(device);
+  unsigned long start = micros();
+  uint8_t received = Wire.requestFrom(address, len);
+
+  I2CCounters* counters = &i2c_counters[device];
+  counters->bytes_read += received;
+  if(received != len) {
+    counters->short_reads++;
+    counters->errors++;
+  }
+  i2c_account(device, i2c_class(device, len), 1, start);
+  return received;
+}
+
+// Deferred work of class, step() does at most one transaction per call (from setup()). Returns its id
+uint8_t i2c_bus_service(uint8_t cls, I2CStep step) {
+  if(i2c_service_count >= I2C_SERVICES) {
+    LOG_ERROR(I2C, "No room for I2C service of class %d", cls);
+    return 0xff;
+  }
+  i2c_services[i2c_service_count] = {cls, step, false, false, 0};
+  return i2c_service_count++;
+}
+
+// Service has work, stepped from the next i2c_bus_run(). A service that is already pending keeps its request time
+void i2c_bus_request(uint8_t id) {
+  if(id >= i2c_service_count || i2c_services[id].pending) {
+    return;
+  }
+  I2CService* service = &i2c_services[id];
+  service->pending = true;
+  service->started = false;
+  service->requested_us = micros();
+}
+
+bool i2c_bus_requested(uint8_t id) {
+  return id < i2c_service_count && i2c_services[id].pending;
+}
+
+// Step a pending service until it waits, is done or budget_us since start would be used by another step as long
+// as the last one
+void i2c_bus_step(I2CService* service, unsigned long start, uint32_t budget_us) {
+  I2CClassCounters* counters = &i2c_class_counters[service->cls];
+  unsigned long step_us = 0;
+  while(service->pending && micros() - start + step_us < budget_us) {
+    uint32_t before = counters->transactions;
+    unsigned long step_start = micros();
+    i2c_in_service = true;
+    uint8_t result = service->step();
+    i2c_in_service = false;
+    step_us = micros() - step_start;
+    if(!service->started && counters->transactions != before) {
+      trace_record(&counters->wait, step_start - service->requested_us);
+      service->started = true;
+    }
+    if(result == I2C_IDLE) {
+      service->pending = false;
+    }
+    if(result != I2C_MORE) {
+      break;
+    }
+  }
+}
+
+// Deferred work, highest class first (end of loop())
+void i2c_bus_run() {
+  unsigned long start = micros();
+  for(int cls=0; cls<I2C_CLASSES; cls++) {
+    for(int i=0; i<i2c_service_count; i++) {
+      if(i2c_services[i].cls == cls) {
+        i2c_bus_step(&i2c_services[i], start, I2C_RUN_BUDGET_US);
+      }
+    }
+  }
+}
+
+// Run one service to the end now, e.g. the LCD before a blocking message. Blocks while the service waits
+void i2c_bus_finish(uint8_t id) {
+  if(id >= i2c_service_count) {
+    return;
+  }
+  while(i2c_services[id].pending) {
+    i2c_bus_step(&i2c_services[id], micros(), UINT32_MAX);
+    if(i2c_services[id].pending) {
+      delay(1);
+    }
+  }
+}
+
+// Deferred work left, loop() comes back after 1ms
+bool i2c_bus_pending() {
+  for(int i=0; i<i2c_service_count; i++) {
+    if(i2c_services[i].pending) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// LCD through the PCF8574 backpack (P0 RS, P2 EN, P3 backlight, P4-P7 D4-D7), 16x2
+// print()/write()/setCursor() only change a shadow of the screen (lcd_shadow.h). The LCD service sends the cells
+// that differ from the screen: a run of adjacent changed cells is one transaction with the cursor command and
+// every nibble as 3 expander bytes (data, EN high, EN low), the bus time covers the HD44780 command times.
+// A run is one row at most and LCD_RUN_CELLS long, so one step stays within I2C_RUN_BUDGET_US at
+// I2C_LCD_CLOCK_HZ (a full row at 100kHz is 102 bytes, 9ms); a longer change is drawn over several loops.
+// Unchanged screens cost nothing. Counted per transaction with the bytes sent.
+#define LCD_PIN_RS 0b00000001
+#define LCD_PIN_EN 0b00000100
+#define LCD_PIN_BACKLIGHT 0b00001000
+
+class MeteredLCD;
+MeteredLCD* i2c_lcd = nullptr;
+uint8_t lcd_flush_step();
+
+class MeteredLCD : public LiquidCrystal_I2C {
+  public:
+    MeteredLCD(uint8_t address, uint8_t cols, uint8_t rows) : LiquidCrystal_I2C(address, cols, rows), address(address) {
+      lcd_shadow_clear(&shadow);
+      shadow.watch = {0, 0, 0};
+      shadow.watch_sent = nullptr;
+    }
+
+    // Initialize the display, its service draws the shadow (from setup())
+    void init() {
+      i2c_bus_clock(I2C_LCD);
+      unsigned long start = micros();
+      LiquidCrystal_I2C::init();
+      i2c_account(I2C_LCD, I2C_CLASS_LCD, 1, start);
+      memset(shadow.shown, ' ', sizeof(shadow.shown));
+      i2c_lcd = this;
+      service = i2c_bus_service(I2C_CLASS_LCD, lcd_flush_step);
+    }
+
+    size_t write(uint8_t value) {
+      if(row < LCD_ROWS && col < LCD_COLS) {
+        shadow.wanted[row][col] = value;
+        if(shadow.shown[row][col] != value) {
+          i2c_bus_request(service);
+        }
+      }
+      col++;
+      return 1;
+    }
+
+    void setCursor(uint8_t col, uint8_t row) {
+      this->col = col;
+      this->row = row;
+    }
+
+    void clear() {
+      i2c_bus_clock(I2C_LCD);
+      unsigned long start = micros();
+      LiquidCrystal_I2C::clear();
+      i2c_account(I2C_LCD, I2C_CLASS_LCD, 6, start);
+      i2c_counters[I2C_LCD].bytes_written += 6;
+      lcd_shadow_clear(&shadow);
+      col = 0;
+      row = 0;
+    }
+
+    void backlight() {
+      i2c_bus_clock(I2C_LCD);
+      unsigned long start = micros();
+      LiquidCrystal_I2C::backlight();
+      i2c_account(I2C_LCD, I2C_CLASS_LCD, 1, start);
+      light = LCD_PIN_BACKLIGHT;
+    }
+
+    // Custom symbol into CGRAM slot location (from setup()), the cursor command of the next run goes back to
+    // the display RAM. The library sends every expander byte as its own transaction
+    void createChar(uint8_t location, uint8_t charmap[]) {
+      i2c_bus_clock(I2C_LCD);
+      unsigned long start = micros();
+      LiquidCrystal_I2C::createChar(location, charmap);
+      i2c_account(I2C_LCD, I2C_CLASS_LCD, 9 * 6, start);
+      i2c_counters[I2C_LCD].bytes_written += 9 * 6;
+    }
+
+    void noBacklight() {
+      i2c_bus_clock(I2C_LCD);
+      unsigned long start = micros();
+      LiquidCrystal_I2C::noBacklight();
+      i2c_account(I2C_LCD, I2C_CLASS_LCD, 1, start);
+      light = 0;
+    }
+
+    // Draw the shadow now, before a blocking message
+    void flush() {
+      i2c_bus_finish(service);
+    }
+
+    // Call sent() from the LCD service once the cells col to col + cols - 1 of row are on the display after a
+    // change (from setup())
+    void watch(uint8_t row, uint8_t col, uint8_t cols, void (*sent)()) {
+      shadow.watch = {row, col, (uint8_t)(col + cols)};
+      shadow.watch_sent = sent;
+    }
+
+    // Watched cells on the display, nothing left to send
+    bool watched_shown() {
+      return lcd_shadow_watched_shown(&shadow);
+    }
+
+    // One run of changed cells (LCD service)
+    uint8_t flush_step() {
+      LcdRun run;
+      if(!lcd_shadow_next_run(&shadow, &run)) {
+        return I2C_IDLE;
+      }
+
+      uint8_t data[(LCD_COLS + 1) * 6];
+      size_t length = 0;
+      const uint8_t row_offsets[LCD_ROWS] = {0x00, 0x40};
+      length = add_byte(data, length, 0x80 | (run.col + row_offsets[run.row]), 0);
+      for(uint8_t i=run.col; i<run.end; i++) {
+        length = add_byte(data, length, shadow.wanted[run.row][i], LCD_PIN_RS);
+      }
+      if(i2c_write(I2C_LCD, address, data, length) != 0) {
+        // not drawn, the next print() of these cells requests the service again
+        LOG_WARN(UI, "LCD write failed");
+        return I2C_IDLE;
+      }
+      return lcd_shadow_sent(&shadow, &run) ? I2C_MORE : I2C_IDLE;
+    }
+
+  private:
+    uint8_t address;
+    uint8_t service = 0xff;
+    LcdShadow shadow;
+    uint8_t col = 0;
+    uint8_t row = 0;
+    uint8_t light = LCD_PIN_BACKLIGHT;
+
+    // Byte as 2 nibbles of 3 expander bytes each, mode = LCD_PIN_RS for data, 0 for commands
+    size_t add_byte(uint8_t* data, size_t length, uint8_t value, uint8_t mode) {
+      uint8_t nibbles[2] = {(uint8_t)(value & 0xf0), (uint8_t)(value << 4)};
+      for(int i=0; i<2; i++) {
+        uint8_t pins = nibbles[i] | mode | light;
+        data[length++] = pins;
+        data[length++] = pins | LCD_PIN_EN;
+        data[length++] = pins;
+      }
+      return length;
+    }
+};
+
+uint8_t lcd_flush_step() {
+  return i2c_lcd->flush_step();
+}
+
+#endif
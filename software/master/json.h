@@ -0,0 +1,97 @@
+#ifndef json_h
+#define json_h
+
+#include "stdint.h"
+#include "stdio.h"
+#include "string.h"
+
+// JSON responses for the web server handlers
+// Objects are written into a caller buffer (usually on the stack), no String concatenation. Values are always
+// strings, the web pages read them that way. No Arduino dependencies, also used by misc/benchmark.
+
+struct JsonWriter {
+  char* buffer;
+  size_t size;
+  size_t length;
+  bool overflow;    // buffer too small, the object is not valid
+};
+
+void json_append(JsonWriter* json, const char* text, size_t length) {
+  if(json->length + length >= json->size) {
+    json->overflow = true;
+    return;
+  }
+  memcpy(json->buffer + json->length, text, length);
+  json->length += length;
+}
+
+// Start an object in buffer (size bytes including terminator)
+void json_begin(JsonWriter* json, char* buffer, size_t size) {
+  json->buffer = buffer;
+  json->size = size;
+  json->length = 0;
+  json->overflow = false;
+  json_append(json, "{", 1);
+}
+
+// "key":"value", value escaped (quotes, backslashes and control characters)
+void json_string(JsonWriter* json, const char* key, const char* value) {
+  if(json->length > 1) {
+    json_append(json, ",", 1);
+  }
+  json_append(json, "\"", 1);
+  json_append(json, key, strlen(key));
+  json_append(json, "\":\"", 3);
+
+  // unescaped runs are copied at once
+  const char* run = value;
+  for(const char* c = value; *c != '\0'; c++) {
+    uint8_t byte = *c;
+    if(byte != '"' && byte != '\\' && byte >= 0x20) {
+      continue;
+    }
+    json_append(json, run, c - run);
+    char escaped[7];
+    if(byte == '"' || byte == '\\') {
+      escaped[0] = '\\';
+      escaped[1] = byte;
+      json_append(json, escaped, 2);
+    }
+    else {
+      snprintf(escaped, sizeof(escaped), "\\u%04x", byte);
+      json_append(json, escaped, 6);
+    }
+    run = c + 1;
+  }
+  json_append(json, run, strlen(run));
+  json_append(json, "\"", 1);
+}
+
+// "key":"value" for integers
+void json_int(JsonWriter* json, const char* key, long value) {
+  // digits backwards from the end, no snprintf
+  char number[21];
+  char* digit = number + sizeof(number) - 1;
+  *digit = '\0';
+  unsigned long magnitude = (value < 0) ? 0UL - value : value;
+  do {
+    *--digit = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while(magnitude != 0);
+  if(value < 0) {
+    *--digit = '-';
+  }
+  json_string(json, key, digit);
+}
+
+// Close the object, returns the terminated text, nullptr if it did not fit
+const char* json_end(JsonWriter* json) {
+  json_append(json, "}", 1);
+  if(json->overflow) {
+    return nullptr;
+  }
+  json->buffer[json->length] = '\0';
+  return json->buffer;
+}
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef latency_trace_h
+#define latency_trace_h
+
+#include "Arduino.h"
+
+// Tuning latency tracing
+// A trace is started by an input (knob ISR or web /get request) and is stamped at every later stage
+// of the tuning path, until the LCD shows the new frequency. Each stage is stored as the latency
+// from the input, in microseconds, in a log-linear histogram (4 buckets per power of 2).
+// Marking a stage is a micros() read and a few stores, so tracing is always on.
+
+// Trace sources
+#define TRACE_KNOB 0
+#define TRACE_WEB 1
+#define TRACE_SOURCES 2
+
+// Trace stages (in order of the tuning path)
+#define TRACE_CONSUMED 0      // knob: direction consumed by loop(), web: command applied by loop()
+#define TRACE_I2C_WRITTEN 1   // change_freq() finished writing to RDA5807M
+#define TRACE_STC 2           // RDA5807M reports seek/tune complete
+#define TRACE_LCD 3           // LCD service sent the new frequency (or it was on the LCD at STC)
+#define TRACE_STAGES 4
+
+// Histogram size, 4 linear buckets per power of 2, up to 2^24us (~16s)
+#define TRACE_BUCKETS 100
+
+struct LatencyHistogram {
+  uint32_t buckets[TRACE_BUCKETS];
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint64_t sum;
+};
+
+LatencyHistogram trace_hist[TRACE_SOURCES][TRACE_STAGES];
+const char* const trace_source_names[TRACE_SOURCES] = {"knob", "web"};
+const char* const trace_stage_names[TRACE_STAGES] = {"consumed", "i2c_written", "stc", "lcd"};
+
+// Currently open trace, only one tuning operation is traced at a time
+portMUX_TYPE trace_mux = portMUX_INITIALIZER_UNLOCKED;
+volatile bool trace_open = false;
+volatile uint8_t trace_source = TRACE_KNOB;
+volatile uint32_t trace_origin = 0;   // micros() at the input
+volatile int8_t trace_last_stage = -1; // last stage stamped, stages are stamped in order
+
+// Bucket index of latency in us
+uint8_t trace_bucket(uint32_t latency) {
+  if(latency < 4) {
+    return latency;
+  }
+  uint8_t octave = 31 - __builtin_clz(latency); // position of highest bit, >= 2
+  if(octave > 24) {
+    return TRACE_BUCKETS - 1;
+  }
+  uint8_t sub = (latency >> (octave - 2)) & 0b11;
+  return (octave - 1) * 4 + sub;
+}
+
+// Highest latency in us that falls into bucket
+uint32_t trace_bucket_upper(uint8_t bucket) {
+  if(bucket < 4) {
+    return bucket;
+  }
+  uint8_t octave = bucket / 4 + 1;
+  uint8_t sub = bucket % 4;
+  uint32_t lower = (uint32_t)(4 + sub) << (octave - 2);
+  return lower + (1UL << (octave - 2)) - 1;
+}
+
+void trace_record(LatencyHistogram* hist, uint32_t latency) {
+  hist->buckets[trace_bucket(latency)]++;
+  if(hist->count == 0 || latency < hist->min) hist->min = latency;
+  if(latency > hist->max) hist->max = latency;
+  hist->sum += latency;
+  hist->count++;
+}
+
+// Latency (upper bucket bound) below which the given fraction of samples lies
+uint32_t trace_percentile(const LatencyHistogram* hist, float fraction) {
+  if(hist->count == 0) {
+    return 0;
+  }
+  uint32_t target = (uint32_t)(fraction * hist->count + 0.999f);
+  uint32_t seen = 0;
+  for(int i=0; i<TRACE_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if(seen >= target) {
+      uint32_t upper = trace_bucket_upper(i);
+      return (upper > hist->max) ? hist->max : upper;
+    }
+  }
+  return hist->max;
+}
+
+// Start trace, from knob ISR. An open trace is kept so that fast spins are measured from the first detent
+void IRAM_ATTR trace_begin_isr(uint8_t source) {
+  portENTER_CRITICAL_ISR(&trace_mux);
+  if(!trace_open) {
+    trace_origin = micros();
+    trace_source = source;
+    trace_last_stage = -1;
+    trace_open = true;
+  }
+  portEXIT_CRITICAL_ISR(&trace_mux);
+}
+
+// Start trace, from loop() or the web server task
+void trace_begin(uint8_t source) {
+  portENTER_CRITICAL(&trace_mux);
+  if(!trace_open) {
+    trace_origin = micros();
+    trace_source = source;
+    trace_last_stage = -1;
+    trace_open = true;
+  }
+  portEXIT_CRITICAL(&trace_mux);
+}
+
+// Stamp a stage of the open trace, only if the previous stage was stamped. Trace is closed once the LCD is updated
+void trace_mark(uint8_t stage) {
+  if(!trace_open || (int8_t)stage != trace_last_stage + 1) {
+    return;
+  }
+  uint32_t latency = micros() - trace_origin;
+  trace_record(&trace_hist[trace_source][stage], latency);
+  trace_last_stage = stage;
+  if(stage == TRACE_LCD) {
+    trace_open = false;
+  }
+}
+
+// Close open trace without reaching the LCD (e.g. input was a volume change)
+void trace_close() {
+  trace_open = false;
+}
+
+// Print all histograms in Prometheus text format (output = /metrics response stream)
+void trace_print(Print& output) {
+  const char* const* source_names = trace_source_names;
+  const char* const* stage_names = trace_stage_names;
+
+  output.println("# HELP tuning_latency_us Latency from knob/web input to each tuning stage, microseconds");
+  output.println("# TYPE tuning_latency_us summary");
+  for(int src=0; src<TRACE_SOURCES; src++) {
+    for(int stage=0; stage<TRACE_STAGES; stage++) {
+      const LatencyHistogram* hist = &trace_hist[src][stage];
+      output.printf("tuning_latency_us{source=\"%s\",stage=\"%s\",quantile=\"0.95\"} %lu\n",
+        source_names[src], stage_names[stage], (unsigned long)trace_percentile(hist, 0.95f));
+      output.printf("tuning_latency_us_sum{source=\"%s\",stage=\"%s\"} %llu\n", source_names[src], stage_names[stage], (unsigned long long)hist->sum);
+      output.printf("tuning_latency_us_count{source=\"%s\",stage=\"%s\"} %lu\n", source_names[src], stage_names[stage], (unsigned long)hist->count);
+    }
+  }
+  // min/avg/max are not part of a summary, separate gauges
+  const char* gauge_names[3] = {"tuning_latency_min_us", "tuning_latency_avg_us", "tuning_latency_max_us"};
+  for(int gauge=0; gauge<3; gauge++) {
+    output.printf("# TYPE %s gauge\n", gauge_names[gauge]);
+    for(int src=0; src<TRACE_SOURCES; src++) {
+      for(int stage=0; stage<TRACE_STAGES; stage++) {
+        const LatencyHistogram* hist = &trace_hist[src][stage];
+        uint32_t value = hist->max;
+        if(gauge == 0) value = hist->min;
+        else if(gauge == 1) value = (hist->count == 0) ? 0 : (uint32_t)(hist->sum / hist->count);
+        output.printf("%s{source=\"%s\",stage=\"%s\"} %lu\n", gauge_names[gauge], source_names[src], stage_names[stage], (unsigned long)value);
+      }
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef lcd_shadow_h
+#define lcd_shadow_h
+
+#include "stdint.h"
+#include "string.h"
+
+#include "constants.h"            // I2C_LCD_CLOCK_HZ, I2C_RUN_BUDGET_US
+
+// LCD shadow (MeteredLCD in i2c_bus.h)
+// print()/write() only change the wanted screen. The LCD service sends the cells that differ from the shown
+// screen in runs: adjacent changed cells of one row, a single unchanged cell in between is sent along (same bytes
+// as a new cursor command). A run is LCD_RUN_CELLS long at most, so one transaction stays within
+// I2C_RUN_BUDGET_US at I2C_LCD_CLOCK_HZ and a longer change is drawn over several loops. A range of watched cells
+// (the frequency) calls back once a run sent the last of its cells that differed, lcd_shadow_watched_shown()
+// tells if they are on the display already.
+// No Arduino dependencies, also used by misc/benchmark.
+
+#define LCD_COLS 16
+#define LCD_ROWS 2
+// Cells per run: 9 clocks per byte, 6 bytes per cell and the cursor command (4 at 100kHz, 16 at 400kHz)
+#define LCD_RUN_BYTES ((uint32_t)I2C_RUN_BUDGET_US * (I2C_LCD_CLOCK_HZ / 1000) / 9000)
+#define LCD_RUN_CELLS ((int)((LCD_RUN_BYTES / 6 - 1 < LCD_COLS) ? LCD_RUN_BYTES / 6 - 1 : LCD_COLS))
+static_assert(LCD_RUN_BYTES / 6 >= 2, "I2C_RUN_BUDGET_US too short for one LCD cell");
+
+// Cells col to end - 1 of row
+struct LcdRun {
+  uint8_t row;
+  uint8_t col;
+  uint8_t end;
+};
+
+struct LcdShadow {
+  uint8_t shown[LCD_ROWS][LCD_COLS];    // on the display
+  uint8_t wanted[LCD_ROWS][LCD_COLS];   // drawn by loop()
+  LcdRun watch;                         // watched cells, end = 0 - none
+  void (*watch_sent)();                 // called when a run sent the watched cells
+};
+
+// Both screens blank, like the display after a clear command
+void lcd_shadow_clear(LcdShadow* shadow) {
+  memset(shadow->shown, ' ', sizeof(shadow->shown));
+  memset(shadow->wanted, ' ', sizeof(shadow->wanted));
+}
+
+// First cell from index (row * LCD_COLS + col) that differs from the display, -1 if none
+int lcd_shadow_changed(const LcdShadow* shadow, int index) {
+  for(int i=index; i<LCD_ROWS * LCD_COLS; i++) {
+    if(shadow->wanted[i / LCD_COLS][i % LCD_COLS] != shadow->shown[i / LCD_COLS][i % LCD_COLS]) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Next run to send, false if the display shows the wanted screen
+bool lcd_shadow_next_run(const LcdShadow* shadow, LcdRun* run) {
+  int first = lcd_shadow_changed(shadow, 0);
+  if(first < 0) {
+    return false;
+  }
+  run->row = first / LCD_COLS;
+  run->col = first % LCD_COLS;
+  // the run goes on over single unchanged cells, same bytes as a new cursor command
+  const uint8_t* wanted = shadow->wanted[run->row];
+  const uint8_t* shown = shadow->shown[run->row];
+  uint8_t end = run->col + 1;
+  while(end < LCD_COLS && end - run->col < LCD_RUN_CELLS) {
+    if(wanted[end] != shown[end]) {
+      end++;
+    }
+    else if(end + 1 < LCD_COLS && wanted[end + 1] != shown[end + 1]) {
+      end += 2;
+    }
+    else {
+      break;
+    }
+  }
+  if(end - run->col > LCD_RUN_CELLS) {
+    end = run->col + LCD_RUN_CELLS;
+  }
+  run->end = end;
+  return true;
+}
+
+// Watched cells all on the display
+bool lcd_shadow_watched_shown(const LcdShadow* shadow) {
+  const LcdRun* watch = &shadow->watch;
+  return memcmp(&shadow->wanted[watch->row][watch->col], &shadow->shown[watch->row][watch->col],
+    watch->end - watch->col) == 0;
+}
+
+// Run was sent to the display, returns true if more cells differ
+bool lcd_shadow_sent(LcdShadow* shadow, const LcdRun* run) {
+  memcpy(&shadow->shown[run->row][run->col], &shadow->wanted[run->row][run->col], run->end - run->col);
+  const LcdRun* watch = &shadow->watch;
+  if(shadow->watch_sent != nullptr && run->row == watch->row && run->col < watch->end && run->end > watch->col &&
+    lcd_shadow_watched_shown(shadow)) {
+    shadow->watch_sent();
+  }
+  return lcd_shadow_changed(shadow, run->row * LCD_COLS + run->end) >= 0;
+}
+
+#endif
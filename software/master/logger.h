@@ -0,0 +1,150 @@
+#ifndef logger_h
+#define logger_h
+
+#include "Arduino.h"
+
+// Logging facade
+// LOG_ERROR/LOG_WARN/LOG_INFO/LOG_DEBUG(module, format, ...) with a compile-time level and a switch per
+// module. Disabled logs are removed by the compiler. Enabled logs are formatted into a ring buffer and
+// written to Serial by a low priority task, so callers never wait for the UART.
+// Usage: LOG_INFO(RADIO, "Tuned to frequency %d", frequency);
+
+// Log levels
+#define LOGGER_NONE 0
+#define LOGGER_ERROR 1
+#define LOGGER_WARN 2
+#define LOGGER_INFO 3
+#define LOGGER_DEBUG 4
+
+// Compile-time level, logs above this level are removed
+#ifndef LOGGER_LEVEL
+#define LOGGER_LEVEL LOGGER_INFO
+#endif
+
+// Module switches, 1 - enabled, 0 - removed
+#ifndef LOGGER_RADIO
+#define LOGGER_RADIO 1      // RDA5807M control (tuning, volume, seek)
+#endif
+#ifndef LOGGER_NVS
+#define LOGGER_NVS 1        // Saved channels
+#endif
+#ifndef LOGGER_UI
+#define LOGGER_UI 1         // Buttons, knob, modes
+#endif
+#ifndef LOGGER_SLAVE
+#define LOGGER_SLAVE 1      // Master side of the slave data packets
+#endif
+#ifndef LOGGER_WIFI
+#define LOGGER_WIFI 1       // Access point and web server
+#endif
+#ifndef LOGGER_I2C
+#define LOGGER_I2C 1        // I2C link (slave callbacks, master bus)
+#endif
+#ifndef LOGGER_BLUETOOTH
+#define LOGGER_BLUETOOTH 1  // A2DP/AVRCP state and metadata
+#endif
+#ifndef LOGGER_AUDIO
+#define LOGGER_AUDIO 1      // Slave audio path (rings, mixer)
+#endif
+#ifndef LOGGER_OTA
+#define LOGGER_OTA 1        // Firmware updates
+#endif
+#ifndef LOGGER_METRICS
+#define LOGGER_METRICS 1    // Latency summary on request over serial
+#endif
+
+// Ring buffer size and maximum length of one log line
+#define LOGGER_RING_SIZE 4096
+#define LOGGER_LINE_SIZE 160
+
+#define LOG_AT(level, prefix, module, ...) \
+  do { if(LOGGER_##module && LOGGER_LEVEL >= level) log_push(prefix #module "] ", __VA_ARGS__); } while(0)
+#define LOG_ERROR(module, ...) LOG_AT(LOGGER_ERROR, "[E][", module, __VA_ARGS__)
+#define LOG_WARN(module, ...) LOG_AT(LOGGER_WARN, "[W][", module, __VA_ARGS__)
+#define LOG_INFO(module, ...) LOG_AT(LOGGER_INFO, "[I][", module, __VA_ARGS__)
+#define LOG_DEBUG(module, ...) LOG_AT(LOGGER_DEBUG, "[D][", module, __VA_ARGS__)
+
+char log_ring[LOGGER_RING_SIZE];
+volatile size_t log_head = 0; // write position
+volatile size_t log_tail = 0; // read position, only moved by the drain task
+uint32_t log_dropped = 0;     // lines dropped because the ring was full
+portMUX_TYPE log_mux = portMUX_INITIALIZER_UNLOCKED;
+TaskHandle_t log_task = NULL;
+
+// Format one line into the ring, drops the line if there is no space
+void log_push(const char* prefix, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void log_push(const char* prefix, const char* format, ...) {
+  char line[LOGGER_LINE_SIZE];
+  int len = snprintf(line, LOGGER_LINE_SIZE, "%s", prefix);
+
+  va_list args;
+  va_start(args, format);
+  int text_len = vsnprintf(line + len, LOGGER_LINE_SIZE - len, format, args);
+  va_end(args);
+  if(text_len < 0) {
+    return;
+  }
+  len += text_len;
+  // truncated, keep space for newline
+  if(len > LOGGER_LINE_SIZE - 2) {
+    len = LOGGER_LINE_SIZE - 2;
+  }
+  line[len++] = '\n';
+
+  portENTER_CRITICAL(&log_mux);
+  size_t used = (log_head - log_tail + LOGGER_RING_SIZE) % LOGGER_RING_SIZE;
+  if(LOGGER_RING_SIZE - 1 - used < (size_t)len) {
+    log_dropped++;
+  }
+  else {
+    size_t head = log_head;
+    for(int i=0; i<len; i++) {
+      log_ring[head] = line[i];
+      head = (head + 1) % LOGGER_RING_SIZE;
+    }
+    log_head = head;
+  }
+  portEXIT_CRITICAL(&log_mux);
+
+  if(log_task != NULL) {
+    xTaskNotifyGive(log_task);
+  }
+}
+
+// Drain task, writes the ring to Serial
+void log_drain(void* parameter) {
+  uint32_t reported_dropped = 0;
+  while(true) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+
+    while(log_tail != log_head) {
+      size_t head = log_head;
+      size_t tail = log_tail;
+      // contiguous part of the ring
+      size_t len = (head > tail) ? (head - tail) : (LOGGER_RING_SIZE - tail);
+      Serial.write((const uint8_t*)&log_ring[tail], len);
+      log_tail = (tail + len) % LOGGER_RING_SIZE;
+    }
+
+    if(log_dropped != reported_dropped) {
+      Serial.printf("[W][LOGGER] %lu lines dropped\n", (unsigned long)(log_dropped - reported_dropped));
+      reported_dropped = log_dropped;
+    }
+  }
+}
+
+// Hex dump of len bytes into out (3 chars per byte + terminator), returns out
+const char* log_hex(char* out, const uint8_t* data, size_t len) {
+  for(size_t i=0; i<len; i++) {
+    snprintf(out + 3*i, 4, "%02x ", data[i]);
+  }
+  out[3*len] = '\0';
+  return out;
+}
+
+// Start drain task, call after Serial.begin()
+void logger_begin() {
+  xTaskCreate(log_drain, "log_drain", 2048, NULL, tskIDLE_PRIORITY + 1, &log_task);
+}
+
+#endif
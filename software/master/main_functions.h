@@ -7,77 +7,77 @@
 #include "LiquidCrystal_I2C.h"    // LCD I2C library
 
 #include "constants.h"
+#include "rda5807m.h"             // Register values
+#include "rds_decoder.h"          // RDS radiotext decoding (also used by misc/RDS/rds_analyzer)
+#include "rda_control.h"          // Tune and volume writes (also used by misc/benchmark)
+#include "metrics.h"              // Counted I2C transactions
+#include "logger.h"               // Non-blocking logs
+
+uint8_t rda_i2c_write(uint8_t address, const uint8_t* data, size_t len) {
+  return i2c_write(I2C_RDA5807M, address, data, len);
+}
+
+const RdaBus rda_bus = {rda_i2c_write};
 
-// Conversion from frequency to individual bits
-uint8_t freq_byte1(int frequency) {
-  uint8_t channel = frequency - FREQ_MIN;
-  return (channel >> 2);
+// Write one register through random access mode (reg = register address, high/low = register bytes)
+uint8_t write_register(uint8_t reg, uint8_t high, uint8_t low) {
+  return rda_write_register(&rda_bus, reg, high, low);
 }
-uint8_t freq_byte2(int frequency) {
-  uint8_t channel = frequency - FREQ_MIN;
-  return (channel & 0b11) << 6; // gets last 2 bits, then shifts left 6 bits
+
+// Request tuning to curr_freq (pending=&tune_pending). Requests are merged, loop() only tunes the latest
+// one, and only when the previous tune is complete
+void request_tune(bool* pending) {
+  tune_request(pending, millis());
 }
 
 // Changing frequency in datastream (frequency = MHz / 0.1MHz) (arr=tuned_config[], frequency=curr_freq)
+// Only register 0x03 (and 0x08 in direct mode) is written, register 0x02 (mute, seek) is kept
 void change_freq(uint8_t* arr, int frequency) {
   if(FREQ_MIN <= frequency && frequency <= FREQ_MAX) {
-    arr[2] = freq_byte1(frequency);
-    arr[3] = freq_byte2(frequency) | (arr[3] & 0b111111); // (2 bits frequency and 6 empty bits) OR (last 6 bits of original 4th bit of arr)
+    rda_tune(&rda_bus, arr, frequency);
 
-
-    Wire.beginTransmission(RDA5807M_ADDRESS);
-    Wire.write(arr, 4);
-    Wire.endTransmission();
-
-    Serial.print("Tuned to frequency ");
-    Serial.print(frequency / 10); Serial.print("."); Serial.print(frequency % 10); Serial.println("MHz.");
+    LOG_INFO(RADIO, "Tuned to frequency %d.%dMHz.", frequency / 10, frequency % 10);
   }
   else {
-    Serial.println("[ERROR] change_freq(): Frequency out of range.");
+    LOG_ERROR(RADIO, "change_freq(): Frequency out of range.");
   }
 }
 
 // Change volume output for RDA5807 (arr=tuned_config[])
+// Only register 0x05 is written (and 0x02 to mute/unmute), so the channel is not retuned (STC stays set)
+// and the RDS FIFO is kept (see rda_control.h)
 void change_vol(uint8_t* arr, uint8_t volume) {
-  // if volume = 0, change outside tune config to mute
-  if(volume == 0) {
-    arr[0] = 0b10000000;
-  }
-  else {
-    arr[0] = 0b11000000;
-  }
+  rda_volume(&rda_bus, arr, volume);
+
+#if I2S_AUDIO_PATH
+  // Radio audio goes through the slave, which applies the volume digitally
+  const uint8_t slave_command[] = {'V', 'O', 'L', 'U', 'M', 'E', volume};
+  i2c_write(I2C_SLAVE, SLAVE_ADDRESS, slave_command, 7);
+#endif
+
+  LOG_INFO(RADIO, "Changed volume to %d", volume);
+}
 
-  // take last 4 bits
-  uint8_t volume_bytes = 0b1111 & volume;
-
-  uint8_t vol_config[] = {
-    // register 0x02
-    arr[0], arr[1],
-    // register 0x03
-    arr[2], arr[3],
-    // register 0x04
-    0b00001110, 0b00000000,
-    // register 0x05
-    0b10001000, volume_bytes | 0b10000000
-    // VOLUME(last 4 bits, 0000-1111)
-  };
-
-  Wire.beginTransmission(RDA5807M_ADDRESS);
-  Wire.write(vol_config, 8);
-  Wire.endTransmission();
-
-  Serial.print("Changed volume to "); Serial.println(volume);
+// Route audio output, ANALOG_SWITCH LOW - slave I2S output, HIGH - RDA5807M analog output
+void select_audio_output(bool bluetooth) {
+#if I2S_AUDIO_PATH
+  // radio audio also comes from the slave, the slave crossfades between radio and Bluetooth
+  digitalWrite(ANALOG_SWITCH, LOW);
+#else
+  digitalWrite(ANALOG_SWITCH, bluetooth ? LOW : HIGH);
+#endif
 }
 
 // Autotune command for RDA5807 (arr=tuned_config[])
-void autotune(const uint8_t* arr, bool seekup) {
-  uint8_t seekup_config[] = {seekup ? 0b11000011 : 0b11000001, arr[1]};
+void autotune(uint8_t* arr, bool seekup) {
+  // unmuted, seek in the direction, arr keeps DMUTE so change_vol() mutes again at volume 0
+  rda_set(arr, RDA_DMUTE, 1);
+  RdaRegister<0x02> seek = rda_register<0x02>(arr).with(RDA_SEEKUP, seekup).with(RDA_SEEK, 1);
+  uint8_t seekup_config[] = {seek.high(), seek.low()};
 
-  Wire.beginTransmission(RDA5807M_ADDRESS);
-  Wire.write(seekup_config, 2);
-  Wire.endTransmission();
+  i2c_write(I2C_RDA5807M, RDA5807M_ADDRESS, seekup_config, 2);
 
-  Serial.println(seekup ? "Autotune up started." : "Autotune down started.");
+  LOG_INFO(RADIO, seekup ? "Autotune up started." : "Autotune down started.");
 }
 
 // save frequency to storage (arr=saved_channels[], frequency=curr_freq/curr_vol (depends on use case))
@@ -119,7 +119,7 @@ void save_channel(int* arr, int frequency, int chn_num) {
         // Close NVS handle
         nvs_close(nvs_handle);
 
-        Serial.print(0xff); Serial.print(" saved to channel "); Serial.println(chn_num);
+        LOG_INFO(NVS, "%d saved to channel %d", 0xff, i);
       }
     }
 
@@ -154,7 +154,7 @@ void save_channel(int* arr, int frequency, int chn_num) {
       // Close NVS handle
       nvs_close(nvs_handle);
 
-      Serial.print(channel); Serial.print(" saved to channel "); Serial.println(chn_num);
+      LOG_INFO(NVS, "%d saved to channel %d", channel, chn_num);
     }
   }
   // saving current frequency as last session frequency
@@ -191,7 +191,7 @@ void save_channel(int* arr, int frequency, int chn_num) {
       // Close NVS handle
       nvs_close(nvs_handle);
 
-      Serial.print(channel); Serial.print(" saved to channel "); Serial.println(chn_num);
+      LOG_INFO(NVS, "%d saved to channel %d", channel, chn_num);
     }
   }
   // saving current volume as last current volume
@@ -228,36 +228,35 @@ void save_channel(int* arr, int frequency, int chn_num) {
       // Close NVS handle
       nvs_close(nvs_handle);
 
-      Serial.print(volume); Serial.print(" saved to channel "); Serial.println(chn_num);
+      LOG_INFO(NVS, "%d saved to channel %d", volume, chn_num);
     }
   }
   else {
-    Serial.println("[ERROR] save_channel(): Channel number out of range.");
+    LOG_ERROR(NVS, "save_channel(): Channel number out of range.");
   }
 }
 
-// reads channel number from storage (channel = frequency - FREQ_MIN)
-uint8_t read_channel(int chn_num) {
-  if(1 <= chn_num && chn_num <= 8) {
-    const char key[] = {'0' + chn_num, '\0'};
-    
-    // Initialize NVS
-    esp_err_t err = nvs_flash_init();
-    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        err = nvs_flash_init();
-    }
-    ESP_ERROR_CHECK(err);
+// reads all channel numbers from storage with one NVS open (arr=saved_channels[], channel = frequency - FREQ_MIN)
+// keys "1"-"6" saved channels (0xff - empty), "7" last session frequency, "8" last session volume
+void read_channels(int* arr) {
+  // Initialize NVS
+  esp_err_t err = nvs_flash_init();
+  if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+      ESP_ERROR_CHECK(nvs_flash_erase());
+      err = nvs_flash_init();
+  }
+  ESP_ERROR_CHECK(err);
 
-    // Open NVS storage with read access
-    nvs_handle_t nvs_handle;
-    err = nvs_open("storage", NVS_READWRITE, &nvs_handle);
-    ESP_ERROR_CHECK(err);
+  // Open NVS storage with read access
+  nvs_handle_t nvs_handle;
+  err = nvs_open("storage", NVS_READWRITE, &nvs_handle);
+  ESP_ERROR_CHECK(err);
+
+  for(int chn_num=1; chn_num<=8; chn_num++) {
+    const char key[] = {(char)('0' + chn_num), '\0'};
 
-    // Setup variables
-    uint8_t my_byte = 0;
-    uint8_t output;
     // set default value
+    uint8_t output;
     if(chn_num <= 6) {
       output = 0xff;
     }
@@ -269,36 +268,34 @@ uint8_t read_channel(int chn_num) {
     }
 
     // read the value from NVS
+    uint8_t my_byte = 0;
     err = nvs_get_u8(nvs_handle, key, &my_byte);
     if (err == ESP_OK) {
       output = my_byte;
-    } else if (err == ESP_ERR_NVS_NOT_FOUND) {
-      Serial.println("NVS not found.");
-    } else {
-      Serial.println("Error reading from NVS.");
+    } else if (err != ESP_ERR_NVS_NOT_FOUND) {
+      LOG_ERROR(NVS, "Error reading %s from NVS.", key);
     }
+    arr[chn_num-1] = output;
+  }
 
-    // Close NVS handle
-    nvs_close(nvs_handle);
+  // Close NVS handle
+  nvs_close(nvs_handle);
 
-    Serial.print(key); Serial.print(" read: "); Serial.println(output);
-    return output;
-  }
+  LOG_INFO(NVS, "Channels read: %d %d %d %d %d %d, frequency %d, volume %d",
+    arr[0], arr[1], arr[2], arr[3], arr[4], arr[5], arr[6], arr[7]);
 }
 
 // requests registry 0x0A onwards from RDA5807 module (arr=requested_data)
 void request_data(uint8_t* arr) {
-  Wire.beginTransmission(RDA5807M_ADDRESS);
-  Wire.requestFrom(RDA5807M_ADDRESS, 12);
+  // sequential read starts from register 0x0A, no register address needed
+  i2c_request(I2C_RDA5807M, RDA5807M_ADDRESS, 12);
   
   for(int i=0; i<12; i++) {
     arr[i] = Wire.read();
   }
-
-  Wire.endTransmission();
 }
 
-// determine if device is seeking (arr=requested_data) *CHANGING VOLUME also triggers it
+// determine if device is seeking (arr=requested_data)
 bool seeking(const uint8_t* arr) {
   uint8_t byte1 = arr[0];
 
@@ -317,7 +314,7 @@ void update_freq(const uint8_t* arr, int* global_freq) {
 }
 
 // display frequency on top(lcd_ptr = &lcd)
-void display_freq(int frequency, LiquidCrystal_I2C* lcd_ptr) {
+void display_freq(int frequency, MeteredLCD* lcd_ptr) {
   (*lcd_ptr).setCursor(3, 0);
   if(frequency < 1000) {
     (*lcd_ptr).print(" ");
@@ -331,7 +328,7 @@ void display_freq(int frequency, LiquidCrystal_I2C* lcd_ptr) {
 }
 
 // display signal strength on top (arr=requested_data)
-void display_signal(const uint8_t* arr, LiquidCrystal_I2C* lcd_ptr) {
+void display_signal(const uint8_t* arr, MeteredLCD* lcd_ptr) {
   // get high byte of 0x0B
   uint8_t byte3 = arr[2];
 
@@ -367,55 +364,6 @@ void display_signal(const uint8_t* arr, LiquidCrystal_I2C* lcd_ptr) {
   }
 }
 
-// clear RDS radiotext, default char is space (arr_A=radiotext_A, arr_B=radiotext_B)
-void clear_radiotext(char* arr_A, char* arr_B, char version = ' ') {
-  // version A
-  if(version != 'B') {
-    for(int i=0; i<64; i++) {
-      arr_A[i] = ' ';
-    }
-  }
-  // version B
-  if(version != 'A') {
-    for(int i=0; i<32; i++) {
-      arr_B[i] = ' ';
-    }
-  }
-}
-
-// void radiotext byte to char
-char rds_byte_to_char(uint8_t input) {
-  char output;
-  if(input == 0x0d) {
-    output = '\n';
-  }
-  else if ((input >= 0x20) && (input <= 0x7e)) {
-    output = (char)input;
-  }
-  else {
-    output = ' ';
-  }
-  return output;
-}
-
-// decode and update RDS radiotext from read data of RDA5807 (arr=requested_data, arr_A=radiotext_A, arr_B=radiotext_B)
-void update_radiotext(const uint8_t* arr, char* arr_A, char* arr_B, bool version) {
-  uint8_t segment_address = arr[7] & 0b1111;
-
-  // version A radiotext
-  if(version == true) {
-    for(int i=0; i<4; i++) {
-      arr_A[segment_address*4 + i] = rds_byte_to_char(arr[8+i]);
-    }
-  }
-  // version B radiotext
-  else {
-    for(int i=0; i<2; i++) {
-      arr_B[segment_address*2 + i] = rds_byte_to_char(arr[10+i]);
-    }
-  }
-}
-
 // clear NVS memory
 void clear_memory() {
   // Initialize the NVS
@@ -428,9 +376,9 @@ void clear_memory() {
   // Clear NVS
   err = nvs_flash_erase();  // This will clear all the data stored in NVS
   if (err == ESP_OK) {
-      printf("NVS erased successfully!\n");
+      LOG_INFO(NVS, "NVS erased successfully!");
   } else {
-      printf("Error erasing NVS: %s\n", esp_err_to_name(err));
+      LOG_ERROR(NVS, "Error erasing NVS: %s", esp_err_to_name(err));
   }
 }
 
@@ -9,27 +9,35 @@
 #include "constants.h"            // Constants header
 #include "main_functions.h"       // Main functions for RDA5807M
 #include "button.h"               // Button detection and debouncing
+#include "encoder.h"              // Knob quadrature decoding
 #include "lcd_symbols.h"          // Containing custom symbols
 #include "wifi_functions.h"       // Functions for Wi-Fi and web server
+#include "latency_trace.h"        // Tuning latency tracing
+#include "metrics.h"              // I2C and loop metrics
+#include "logger.h"               // Non-blocking logs
+#include "metadata.h"             // Bluetooth metadata slots, shared with the slave
+#include "rds_capture.h"          // RDS group capture ring and live stream
+#include "ota.h"                  // Firmware updates for master and slave
+#include "af.h"                   // Alternative frequency following
+#include "ta.h"                   // Traffic announcements in Bluetooth mode
+#include "signal.h"               // Signal history
+#include "device_state.h"         // Device state published to the web server
+#include "timeshift.h"            // Radio time shift controls
 
 // Setup global variables
 unsigned long last_vol_adj = 0;
-unsigned long loop_num = 1;
-int saved_channels[] = {
-  read_channel(1), read_channel(2), read_channel(3), read_channel(4), read_channel(5), read_channel(6), 
-  read_channel(7), read_channel(8)
-}; // last session frequency and volume, chn_num 7, 8, needs to keep updating every 100 loops
-int curr_freq = saved_channels[6] + FREQ_MIN; // default frequency = 87.0MHz
-uint8_t curr_vol = saved_channels[7]; // default volume = 4 (0-15)
+int saved_channels[8]; // read in setup(), last session frequency and volume, chn_num 7, 8, saved when they settle (SESSION_SAVE_MS)
+int curr_freq = FREQ_DEFAULT; // last session frequency from saved_channels in setup()
+uint8_t curr_vol = VOL_DEFAULT; // default volume = 4 (0-15), last session volume from saved_channels in setup()
 int prev_freq = curr_freq;
 bool knob_state = true; // true - frequency, false - volume
 bool scan_ongoing = false;
 bool ready_state = true;
-int wifi_freq_update = 0xff; uint8_t wifi_vol_update = 0xff; String wifi_tune_update = "Nan"; // True if user on wifi wants to change volume or frequency
+bool tune_pending = false; // frequency changed but not tuned yet (see request_tune())
+VolumeFrame volume_frame = {false, 0}; // volume changed but not written yet (see VOLUME_FRAME)
+int wifi_freq_update = 0xff; uint8_t wifi_vol_update = 0xff; String wifi_tune_update = "Nan"; // web commands not handled yet (see web_command_receive())
+char wifi_timeshift_update = 0; // web time shift command not handled yet, 0 - none
 String RDS_radiotext = "";
-volatile uint8_t clk_state = 0b11111000;
-volatile uint8_t dt_state = 0b11111000;
-volatile int direction = 0;
 bool settings_mode = false;
 bool rds_enabled = true;
 
@@ -37,12 +45,9 @@ bool rds_enabled = true;
 bool bluetooth_mode = false;
 uint8_t connection_state = 0; // 0 - OFF, 1 - CONNECTED, 2 - DISCONNECTED, 3 - CONNECTING, 4 - DISCONNECTING
 uint8_t playback_state = 0; // 0 - STOPPED, 1 - PLAYING, 2 - PAUSED, 3 - FWD SEEK, 4 - REV SEEK, 5 - ERROR
-char* device_name = (char*)malloc(1);
-char* media_title = (char*)malloc(1);
-char* media_artist = (char*)malloc(1);
-char* media_album = (char*)malloc(1);
+Metadata metadata; // device name and media, fixed slots (see metadata.h)
 // Bluetooth received datastring
-uint8_t* datastring = (uint8_t*)malloc(1);
+uint8_t datastring[SLAVE_FRAMES * SLAVE_FRAME_DATA];
 // Bluetooth mode from server
 bool server_bluetooth_mode = false;
 
@@ -50,129 +55,33 @@ bool server_bluetooth_mode = false;
 // using 0.1Mhz as channel spacing
 
 // LCD
-LiquidCrystal_I2C lcd(LCD_ADDRESS, 16, 2); // 16x2 LCD
+MeteredLCD lcd(LCD_ADDRESS, 16, 2); // 16x2 LCD, drawn between loops by the I2C bus
 
 // Buttons
 Button l_key, r_key;
 Button chn_button[6];
 Button knob_switch;
+Encoder knob;
 Button settings;
 
 // Knob ISR function
 void clockwise_ISR();
 void anticlockwise_ISR();
 
-// Initialize device
+// Initialize device, registers 0x02-0x07 (values and fields in rda5807m.h)
 uint8_t init_config[] = {
-  // register 0x02
-  0b10000000, 0b00001011,
-    // DHIZ audio output high-z disable                   1: normal operation
-    // DMUTE mute disable                                 0: mute
-    // MONO mono select                                   0: stereo
-    // BASS bass boost                                    0: disabled
-    // RCLK NON-CALIBRATE MODE                            0: RCLK is always supplied
-    // RCLK DIRECT INPUT MODE                             0: RCLK is not in direct input mode
-    // SEEKUP                                             0: seek down
-    // SEEK                                               0: disable/stop seek (when seek operation completes, SEEK->0, STC->1)
-    //
-    // SKMODE seek mode                                   0: wrap at upper or lower band limit and contiue seeking
-    // CLK_MODE clock mode                              000: 32.768kHZ clock rate (match the watch cystal on the module)
-    // RDS_EN radio data system enable                    1: enable radio data system
-    // NEW_METHOD                                         0: disabled new demodulate method for improved sensitivity (can try enabling)
-    // SOFT_RESET                                         1: perform a reset
-    // ENABLE power up enable                             1: enabled, device ready to operate
-
-  // register 0x03
-  0b00000000, 0b00000000,
-    // CHAN channel 8MSB/10                        00000000: initialize at 87.0MHz (channel = 0)
-    //
-    // CHAN channel 2LSB/10                              00: initialize at 87.0MHz (channel = 0)
-    // DIRECT MODE used only when test                    0: disabled by default
-    // TUNE tune operation                                0: disable (don't tune to selected channel)
-    // BAND band select                                  00: 87–108 MHz (US/Europe)
-    // SPACE channel spacing                             00: spacing of 0.1MHz
-
-  // register 0x04
-  0b00001110, 0b00000000,
-    // RESERVED                                           0: default
-    // STCIEN Seek/Tune Complete Interrupt                0: disable Interrupt
-    // RBDS                                               0: RDS mode only (RBDS only used in US)
-    // RDS_FIFO_EN                                        0: RDS fifo mode disable (can try enabling)
-    // DE De-emphasis                                     1: 50us (Americas and South Korea - 75 μs, rest of the world - 50us)
-    // RDS_FIFO_CLR                                       1: clear RDS fifo (default setting)
-    // SOFTMUTE_EN                                        1: soft mute enabled (gradual reduce of audio volume when signal quality drops)
-    // AFCD automatic frequency control disable           0: AFC enabled
-    // 
-    // RESERVED                                           0: default
-    // I2S_ENABLE                                         0: disable (might want to enable when integrating bluetooth/Wi-Fi)
-    // GPIO general purpose I/O                      000000: default values
-
-  // register 0x05
-  0b10000010, 0b10110111,
-    // INT_MODE                                           1: interrupt last until read reg 0x0C, default setting
-    // SEEK_MODE                                         00: Default value; 10 enables RSSI seek mode (older)
-    // RESERVED                                           0: by assumption
-    // SEEKTH seek SNR threshold                       0100: default threshold, 71dB
-    //
-    // LNA_PORT_SEL LNA input port                       10: LNAP, default setting
-    // LNA_ICSEL_BIT LNA working current              00-11: 1.8mA, default setting
-    // VOLUME                                          0111: default volume (0000=mute, 1111=max, logarithmic)
-
-  // register 0x06
-  0b00000000, 0b00000000,
-    // RESERVED                                             0: default
-    // OPEN_MODE open reserved registers mode              00: default setting
-    // SLAVE_MASTER I2S slave or master                     0: master, default setting
-    // WS_LR audio channel indication for I2S               0: default setting
-    // SCLK_I_EDGE                                          0: default setting
-    // DATA_SIGNED                                          0: I2S output unsigned 16-bit audio data, default setting
-    // WS_I_EDGE                                            0: default setting
-    //
-    // I2S_SW_CNT (Only valid in master mode)            0000: default setting
-    // SW_O_EDGE                                            0: default setting
-    // SCLK_O_EDGE                                          0: default setting
-    // L_DELY                                               0: default setting
-    // R_DELY                                               0: default setting
-
-  // register 0x07
-  0b01000010, 0b00000010,
-    // RESERVED                                             0: default
-    // TH_SOFRBLEND threshhold for noise soft blend     10000: default setting
-    // 65M_50M MODE                                         1: default setting
-    // RESERVED                                             0: default
-    //
-    // SEEK_TH_OLD seek threshold for old seek mode    000000: default setting
-    // SOFTBLEND_EN soft blend enable                       1: default setting
-    // FREQ_MODE                                            0: default setting
+  RDA_INIT_02.high(), RDA_INIT_02.low(),
+  RDA_INIT_03.high(), RDA_INIT_03.low(),
+  RDA_INIT_04.high(), RDA_INIT_04.low(),
+  RDA_INIT_05.high(), RDA_INIT_05.low(),
+  RDA_INIT_06.high(), RDA_INIT_06.low(),
+  RDA_INIT_07.high(), RDA_INIT_07.low()
 };
 
-// Tune to specific channel
+// Tune to specific channel, registers 0x02-0x03 (channel set in setup())
 uint8_t tune_config[] = {
-  // register 0x02
-  0b10000000, 0b00001001,
-    // DHIZ audio output high-z disable                   1: normal operation
-    // DMUTE mute disable                                 0: mute
-    // MONO mono select                                   0: stereo
-    // BASS bass boost                                    0: disabled
-    // RCLK NON-CALIBRATE MODE                            0: RCLK is always supplied
-    // RCLK DIRECT INPUT MODE                             0: RCLK is not in direct input mode
-    // SEEKUP                                             0: seek down
-    // SEEK                                               0: disable/stop seek (when seek operation completes, SEEK->0, STC->1)
-    //
-    // SKMODE seek mode                                   0: wrap at upper or lower band limit and contiue seeking
-    // CLK_MODE clock mode                              000: 32.768kHZ clock rate (match the watch cystal on the module)
-    // RDS_EN radio data system enable                    1: enable radio data system
-    // NEW_METHOD                                         0: disabled new demodulate method for improved sensitivity (can try enabling)
-    // SOFT_RESET                                         0: perform a reset
-    // ENABLE power up enable                             1: enabled, device ready to operate
-
-  // register 0x03
-  freq_byte1(curr_freq), freq_byte2(curr_freq) | 0b010000
-    // Tuning frequency
-    // DIRECT MODE used only when test                    0: disabled by default
-    // TUNE tune operation                                1: enable
-    // BAND band select                                  00: 87–108 MHz (US/Europe)
-    // SPACE channel spacing                             00: spacing of 0.1MHz
+  RDA_TUNE_02.high(), RDA_TUNE_02.low(),
+  RDA_TUNE_03.high(), RDA_TUNE_03.low()
 };
 
 // Current read data from RDA5807
@@ -188,27 +97,315 @@ bool rds_prev_typeflag = false;
 // Web server
 AsyncWebServer server(80);
 
-void setup() {
-  Serial.begin(115200); // serial communication speed 115200 bps
+// Startup, the longest the RDA5807M may take to report STC before unmuting anyway
+#define BOOT_STC_TIMEOUT 500
+// Last session frequency and volume are saved once they did not change for this long
+#define SESSION_SAVE_MS 2000
 
-  // Initialize buttons
-  l_key.begin(LEFT_BUTTON); r_key.begin(RIGHT_BUTTON);
-  chn_button[0].begin(CH1); chn_button[1].begin(CH2); chn_button[2].begin(CH3);
-  chn_button[3].begin(CH4); chn_button[4].begin(CH5); chn_button[5].begin(CH6);
-  settings.begin(SETTINGS_BUTTON);
+// Last session frequency and volume, changed (subscribed in setup()) but not saved yet
+bool session_pending = false;
+unsigned long session_changed = 0;
 
-  // Initialize knob button
-  knob_switch.begin(13);
-  pinMode(CLK, INPUT); pinMode(DT, INPUT);
+void session_changed_callback(uint32_t changed, const DeviceState* state) {
+  session_pending = true;
+  session_changed = millis();
+}
+
+// Radio screen, drawn from the device state (subscribed in setup()): frequency and saved channel (top), volume bar,
+// time shift delay or RDS text (bottom, while the tuner is ready). loop() draws the signal bars, "Scanning..." and
+// the time driven redraws (text scrolling, end of the volume bar); Bluetooth mode draws its screen from the slave
+// packets (slave_sync_parse()), settings mode its menu
+#define DISPLAY_STATE (STATE_FREQUENCY | STATE_VOLUME | STATE_READY | STATE_BLUETOOTH | STATE_RADIOTEXT | STATE_TIMESHIFT)
+#define DISPLAY_VOLUME_MS 2000    // volume bar after the last adjustment
+bool display_volume = false;      // volume bar drawn
+unsigned long display_scroll = 0; // text scroll step drawn (RDS_SCROLL)
+
+// Bottom row
+void display_bottom(const DeviceState* state) {
+  display_volume = millis() - last_vol_adj < DISPLAY_VOLUME_MS;
+  display_scroll = millis() / RDS_SCROLL;
+
+  // volume (when adjusting volume, shown for 2s after the last adjustment)
+  if(display_volume) {
+    lcd.setCursor(0, 1);
+    lcd.write(4); // volume symbol
+    for(int i=1; i<=15; i++) {
+      if(i <= state->volume) {
+        lcd.write(5);
+      }
+      else {
+        lcd.print(" ");
+      }
+    }
+  }
+  // Paused or behind live, display the delay instead of the RDS text
+  else if(timeshift_active()) {
+    timeshift_display(&lcd);
+  }
+  // RDS text, scrolling if it is longer than the row (trailing spaces are not scrolled)
+  else if(rds_enabled) {
+    const char* text = state->radiotext;
+    int length = strlen(text);
+    while(length > 0 && text[length - 1] == ' ') {
+      length--;
+    }
+    lcd.setCursor(0, 1);
+    int offset = (length <= 16) ? 0 : display_scroll % (length + 3); // 3 spaces between end and beginning
+    for(int i=0; i<16; i++) {
+      int index = (length <= 16) ? i : (i + offset) % (length + 3);
+      if(index < length) {
+        lcd.print(text[index]);
+      }
+      else {
+        lcd.print(" ");
+      }
+    }
+  }
+  // Display nothing if RDS disabled
+  else {
+    lcd.setCursor(0, 1);
+    lcd.print("                ");
+  }
+}
+
+void display_state_callback(uint32_t changed, const DeviceState* state) {
+  if(settings_mode || state->bluetooth_mode) {
+    return;
+  }
+  // Back in radio mode, the screen was cleared
+  if(changed & STATE_BLUETOOTH) {
+    changed = DISPLAY_STATE;
+  }
+
+  if(changed & STATE_FREQUENCY) {
+    display_freq(state->frequency, &lcd);
+    // if said frequency is one of the saved channels, display number (top)
+    lcd.setCursor(0, 0);
+    for(int i=1; i<=6; i++) {
+      int saved_freq = saved_channels[i-1] + FREQ_MIN;
+      if(state->frequency == saved_freq) {
+        lcd.print("C");
+        lcd.print(i);
+        break;
+      }
+      // no successful channels
+      if(i == 6) {
+        lcd.print("  ");
+      }
+    }
+  }
+  if((changed & (STATE_VOLUME | STATE_READY | STATE_RADIOTEXT | STATE_TIMESHIFT)) && state->ready) {
+    display_bottom(state);
+  }
+}
+
+// Whole radio screen after the LCD was cleared (settings menu, messages)
+void display_redraw() {
+  display_state_callback(DISPLAY_STATE, &state_published);
+}
+
+// Frequency cells sent to the LCD (LCD service, watched from setup())
+void display_freq_sent() {
+  trace_mark(TRACE_LCD);
+}
+
+// Tune or seek complete (not seeking), the frequency may be on the LCD already
+void trace_tune_complete() {
+  trace_mark(TRACE_STC);
+  if(lcd.watched_shown()) {
+    trace_mark(TRACE_LCD);
+  }
+}
+
+// Copy the loop's variables into the device state and publish what changed (end of setup() and loop())
+void state_update() {
+  state_set_frequency(curr_freq);
+  state_set_volume(curr_vol);
+  state_set_ready(ready_state);
+  state_set_bluetooth(bluetooth_mode, connection_state, playback_state);
+  state_set_radiotext(RDS_radiotext.c_str());
+  state_set_metadata(&metadata);
+  state_set_timeshift(timeshift.state, timeshift.delay_s, timeshift_skip_s());
+  state_publish();
+}
+
+// Access point and web server, started from setup() on core 0 so audio does not wait for them
+void wifi_start_task(void* parameter) {
+  WifiAP_begin();
+  ServerBegin(&server);
+  metrics_boot(BOOT_WIFI);
+  vTaskDelete(NULL);
+}
+
+// Bluetooth information from the slave, SLAVE_FRAMES packets of 32 bytes. Each packet is selected with
+// "PACKET<index>" and read SLAVE_PACKET_DELAY ms later. The I2C bus steps the fetch between loops: a step reads
+// one packet and selects the next one in the same go, then waits for the slave. Failed packets are selected again
+uint8_t slave_sync_service = 0xff;
+uint8_t slave_sync_index = 0;       // packet selected
+uint8_t slave_sync_num = 0;         // packets in this fetch, from packet 0
+bool slave_sync_selected = false;
+unsigned long slave_sync_selected_us = 0;
+
+// Select packet index
+void slave_sync_select(uint8_t index) {
+  const uint8_t packet_command[] = {'P', 'A', 'C', 'K', 'E', 'T', index};
+  i2c_write(I2C_SLAVE, SLAVE_ADDRESS, packet_command, 7);
+  slave_sync_index = index;
+  slave_sync_selected = true;
+  slave_sync_selected_us = micros();
+}
+
+// Use the datastring to update global bluetooth variables
+void slave_sync_parse() {
+  // Double check if packet is valid (has 8 variables), also to retrieve separator index in datastring
+  uint16_t separator_pos[SLAVE_FIELDS]; // index position of separator 0x1d
+  int separator_count = frame_scan_fields(datastring, SLAVE_FRAME_DATA*slave_sync_num, separator_pos);
+  if(separator_count != SLAVE_FIELDS) {
+    LOG_WARN(SLAVE, "Error occured, number of variables invalid");
+    // Try another time, don't save data
+    return;
+  }
+
+  // bluetooth_mode, 0, connection_state, 1, playback_state, 2
+  // device_name, 3, media_title, 4, media_artist, 5, media_album, 6, audio telemetry, 7
+  slave_audio_update((const char*)datastring + separator_pos[6] + 1, separator_pos[7] - separator_pos[6] - 1);
+  // bluetooth_mode ignored
+  connection_state = datastring[separator_pos[1] - 1];
+  playback_state = datastring[separator_pos[2] - 1];
+
+  // Strings into their slots, only if CONNECTED, media only if playback is not STOPPED
+  if(connection_state != 1) {
+    metadata_clear(&metadata);
+  }
+  else {
+    const char* fields = (const char*)datastring;
+    metadata_set(metadata.device_name, sizeof(metadata.device_name), fields + separator_pos[2] + 1, separator_pos[3] - separator_pos[2] - 1);
+    if(playback_state == 0) {
+      metadata.media_title[0] = '\0';
+      metadata.media_artist[0] = '\0';
+      metadata.media_album[0] = '\0';
+    }
+    else {
+      metadata_set(metadata.media_title, sizeof(metadata.media_title), fields + separator_pos[3] + 1, separator_pos[4] - separator_pos[3] - 1, METADATA_ELLIPSIS);
+      metadata_set(metadata.media_artist, sizeof(metadata.media_artist), fields + separator_pos[4] + 1, separator_pos[5] - separator_pos[4] - 1, METADATA_ELLIPSIS);
+      metadata_set(metadata.media_album, sizeof(metadata.media_album), fields + separator_pos[5] + 1, separator_pos[6] - separator_pos[5] - 1, METADATA_ELLIPSIS);
+    }
+  }
+
+  // Finish receiving data
+  LOG_DEBUG(SLAVE, "Finished receiving data.");
+}
+
+// One step of the fetch (I2C bus service)
+uint8_t slave_sync_step() {
+  // left Bluetooth mode or the slave is updated, the next fetch starts over
+  if(!bluetooth_mode || ota_slave_active()) {
+    slave_sync_selected = false;
+    return I2C_IDLE;
+  }
+  if(!slave_sync_selected) {
+    LOG_DEBUG(SLAVE, "Requesting data...");
+    slave_sync_select(0);
+    return I2C_WAITING;
+  }
+  if(micros() - slave_sync_selected_us < SLAVE_PACKET_DELAY * 1000UL) {
+    return I2C_WAITING;
+  }
+
+  // Requests packet
+  uint8_t packet[32];
+  uint8_t bytesReceived = i2c_request(I2C_SLAVE, SLAVE_ADDRESS, 32); // Reads 1 packet = 32 bytes
+  if(bytesReceived != 32) {
+    LOG_WARN(SLAVE, "Error occured, received packet is not 32 bytes");
+    slave_packet_retries++;
+    slave_sync_select(slave_sync_index);
+    return I2C_WAITING;
+  }
+  Wire.readBytes(packet, 32);
+
+  // Print packet
+  char hex[3*32 + 1];
+  LOG_DEBUG(SLAVE, "%s", log_hex(hex, packet, 32));
+
+  // Checking validity, packet 0 gives the total packet number
+  if(packet[0] != slave_sync_index) {
+    LOG_WARN(SLAVE, "Error occured, packet index mismatch");
+    slave_packet_retries++;
+    slave_sync_select(slave_sync_index);
+    return I2C_WAITING;
+  }
+  if(slave_sync_index == 0) {
+    if(packet[1] == 0 || packet[1] > SLAVE_FRAMES) {
+      LOG_WARN(SLAVE, "Error occured, total packet number is %d", packet[1]);
+      slave_packet_retries++;
+      slave_sync_select(0);
+      return I2C_WAITING;
+    }
+    slave_sync_num = packet[1];
+  }
+  else if(packet[1] != slave_sync_num) {
+    // Retry entire packet receival
+    LOG_WARN(SLAVE, "Error occured, total packet number mismatch");
+    slave_packet_retries++;
+    LOG_WARN(SLAVE, "Restarting packet receival");
+    slave_sync_select(0);
+    return I2C_WAITING;
+  }
+
+  // Saves packet
+  frame_store(datastring, packet);
+  LOG_DEBUG(SLAVE, "Packet index %d received successfully.", slave_sync_index);
+
+  // Next packet, or all of them received
+  if(slave_sync_index + 1 < slave_sync_num) {
+    slave_sync_select(slave_sync_index + 1);
+    return I2C_WAITING;
+  }
+  slave_sync_selected = false;
+  slave_sync_parse();
+  return I2C_IDLE;
+}
+
+// Startup is ordered for the shortest time to audio: saved station, tune, unmute on STC. The LCD is
+// initialized while the chip tunes, Wi-Fi and the web server come up in the background afterwards
+void setup() {
+  Serial.begin(115200); // serial communication speed 115200 bps
+  logger_begin();
 
   // Pin to toggle analog switch, initially radio mode
   pinMode(ANALOG_SWITCH, OUTPUT);
-  digitalWrite(ANALOG_SWITCH, HIGH);
+  select_audio_output(false);
+
+  // Last session frequency and volume, saved channels
+  read_channels(saved_channels);
+  curr_freq = saved_channels[6] + FREQ_MIN;
+  curr_vol = saved_channels[7];
+  if(curr_freq < FREQ_MIN || curr_freq > FREQ_MAX) {
+    curr_freq = FREQ_DEFAULT;
+  }
+  if(curr_vol > 15) {
+    curr_vol = VOL_DEFAULT;
+  }
+  prev_freq = curr_freq;
+  freq_register(tune_config, curr_freq);
+  metrics_boot(BOOT_NVS);
 
-  // Startup I2C
-  Wire.begin(); // (SDA, SCL)
+  // Startup I2C, Fast-mode
+  i2c_bus_begin();
 
-  // Initialize the LCD
+  // Initialize device
+  i2c_write(I2C_RDA5807M, RDA5807M_ADDRESS, init_config, 12);
+  LOG_INFO(RADIO, "Initialization complete.");
+
+  // Tune to last session channel, muted until STC
+#if TUNE_DIRECT_MODE
+  RdaRegister<0x08> direct_config = direct_freq_register(curr_freq);
+  write_register(0x08, direct_config.high(), direct_config.low());
+#endif
+  i2c_write(I2C_RDA5807M, RDA5807M_ADDRESS, tune_config, 4);
+  metrics_boot(BOOT_TUNED);
+
+  // Initialize the LCD while the chip tunes
   lcd.init();
   lcd.backlight();
   lcd.createChar(0, sym_antenna);
@@ -219,48 +416,92 @@ void setup() {
   lcd.createChar(5, sym_full);
   lcd.createChar(6, sym_bluetooth);
   lcd.createChar(7, sym_play);
+  lcd.watch(0, 3, 8, display_freq_sent); // display_freq(), "xxx.xMHz"
 
-  // Welcome screen
+  // Welcome screen, replaced by the radio screen at the end of setup()
   lcd.setCursor(4, 0); // (col index, row index)
   lcd.print("DIP E036");
   lcd.setCursor(2, 1);
   lcd.print("FM Receiver");
+  lcd.flush();
+
+  // Unmute as soon as the chip reports STC
+  unsigned long stc_start = millis();
+  request_data(requested_data);
+  while(seeking(requested_data) && millis() - stc_start < BOOT_STC_TIMEOUT) {
+    delay(2);
+    request_data(requested_data);
+  }
+  if(seeking(requested_data)) {
+    LOG_WARN(RADIO, "No STC after %dms, unmuting anyway", BOOT_STC_TIMEOUT);
+  }
+  metrics_boot(BOOT_STC);
+  LOG_INFO(RADIO, "Tuning complete.");
+  change_vol(tune_config, curr_vol);
+  metrics_boot(BOOT_AUDIO);
 
   // clear RDS text just in case
   clear_radiotext(radiotext_A, radiotext_B);
 
-  // Initialize device
-  Wire.beginTransmission(RDA5807M_ADDRESS);
-  Wire.write(init_config, 12);
-  Wire.endTransmission();
-  Serial.println("Initialization complete.");
-
-  // Tune to default channel
-  Wire.beginTransmission(RDA5807M_ADDRESS);
-  Wire.write(tune_config, 4); 
-  Wire.endTransmission();
-  Serial.println("Tuning complete.");
-
-  // Read registry data of RDA5807
-  request_data(requested_data);
+  // Access point and web server in the background, with the state published once
+  state_subscribe(STATE_FREQUENCY | STATE_VOLUME, session_changed_callback);
+  state_update();
+  session_pending = false;
+  xTaskCreatePinnedToCore(wifi_start_task, "wifi_start", 4096, NULL, 1, NULL, 0);
 
-  // Delay a while and clear LCD
-  delay(3000);
-  lcd.clear();
-  // unmute
-  change_vol(tune_config, curr_vol);
+  // Initialize buttons
+  l_key.begin(LEFT_BUTTON); r_key.begin(RIGHT_BUTTON);
+  chn_button[0].begin(CH1); chn_button[1].begin(CH2); chn_button[2].begin(CH3);
+  chn_button[3].begin(CH4); chn_button[4].begin(CH5); chn_button[5].begin(CH6);
+  settings.begin(SETTINGS_BUTTON);
 
-  // Open web server
-  WifiAP_begin();
-  ServerBegin(&server, &curr_freq, &curr_vol, &ready_state, &wifi_freq_update, &wifi_vol_update, &wifi_tune_update, &RDS_radiotext, &bluetooth_mode, &connection_state, &playback_state, &device_name, &media_title, &media_artist, &media_album, &server_bluetooth_mode);
+  // Initialize knob button
+  knob_switch.begin(13);
+  static_assert(CLK < 32 && DT < 32, "knob pins must be in GPIO_IN_REG");
+  knob.begin(CLK, DT);
+
+  // Power manager, knob and buttons wake from light sleep
+  const uint8_t wake_pins[] = {CLK, DT, LEFT_BUTTON, RIGHT_BUTTON, CH1, CH2, CH3, CH4, CH5, CH6, SETTINGS_BUTTON, 13};
+  power_begin(wake_pins, sizeof(wake_pins));
 
   // Initialize knob
   attachInterrupt(digitalPinToInterrupt(CLK), updatestate_ISR, CHANGE);
   attachInterrupt(digitalPinToInterrupt(DT), updatestate_ISR, CHANGE);
+
+  // Slave packets between loops, after the tuner and the LCD
+  slave_sync_service = i2c_bus_service(I2C_CLASS_SLAVE, slave_sync_step);
+  timeshift_begin();
+
+  // Welcome screen off, radio screen from the published state and its changes from now on
+  lcd.clear();
+  state_subscribe(DISPLAY_STATE, display_state_callback);
+  display_redraw();
+  metrics_boot(BOOT_READY);
 }
 
 // Loops while device is running
 void loop() {
+  unsigned long loop_start = micros();
+
+  // Latency summary if requested over serial
+  metrics_serial_poll();
+  // Inputs keep the backlight on and the CPU at full speed
+  if(buttons_poll() || knob.pending()) {
+    power_activity();
+    // and end an AF check, they are handled in this loop
+    af_cancel(tune_config);
+  }
+
+  // Commands from the web pages, handled like before by the modes below
+  WebCommand command;
+  while(web_command_receive(&command)) {
+    if(command.type == WEB_FREQUENCY) wifi_freq_update = command.value;
+    else if(command.type == WEB_VOLUME) wifi_vol_update = command.value;
+    else if(command.type == WEB_TUNE) wifi_tune_update = command.value ? "up" : "down";
+    else if(command.type == WEB_BLUETOOTH) server_bluetooth_mode = command.value;
+    else if(command.type == WEB_TIMESHIFT) wifi_timeshift_update = command.value;
+  }
+
   // Always detect settings button no matter mode
   settings.update();
 
@@ -270,6 +511,9 @@ void loop() {
     settings_mode = !settings_mode;
 
     lcd.clear();
+    if(!settings_mode) {
+      display_redraw();
+    }
   }
   // Settings mode, can't control radio functions in settings mode
   if(settings_mode) {
@@ -293,6 +537,12 @@ void loop() {
       // Toggle RDS mode
       if(rds_enabled) lcd.print("Disable RDS");
       else lcd.print("Enable RDS");
+      // Pause the radio, time shift
+      if(timeshift.state != TIMESHIFT_OFF) {
+        lcd.setCursor(14, 1);
+        lcd.print("3");
+        lcd.write(2); // pause
+      }
     }
 
     // Button functions
@@ -303,24 +553,21 @@ void loop() {
 
       // Turn on/off bluetooth
       if(bluetooth_mode) {
-        // Enable bluetooth
-        digitalWrite(ANALOG_SWITCH, LOW);
-        Serial.println("Bluetooth mode enabled.");
+        // Enable bluetooth, the radio is live when it comes back
+        timeshift_catch_up();
+        select_audio_output(true);
+        LOG_INFO(UI, "Bluetooth mode enabled.");
 
         // Sends request to slave
-        Wire.beginTransmission(SLAVE_ADDRESS);
-        Wire.printf("BLUETOOTH ON");
-        Wire.endTransmission();
+        i2c_write(I2C_SLAVE, SLAVE_ADDRESS, (const uint8_t*)"BLUETOOTH ON", 12);
       }
       else {
         // Disable bluetooth
-        digitalWrite(ANALOG_SWITCH, HIGH);
-        Serial.println("Bluetooth mode disabled.");
+        select_audio_output(false);
+        LOG_INFO(UI, "Bluetooth mode disabled.");
 
         // Sends request to slave
-        Wire.beginTransmission(SLAVE_ADDRESS);
-        Wire.printf("BLUETOOTH OFF");
-        Wire.endTransmission();
+        i2c_write(I2C_SLAVE, SLAVE_ADDRESS, (const uint8_t*)"BLUETOOTH OFF", 13);
       }
       // Exit settings
       settings_mode = !settings_mode;
@@ -330,13 +577,14 @@ void loop() {
       lcd.setCursor(0, 0);
       if(bluetooth_mode) lcd.print("Bluetooth Mode");
       else lcd.print("Radio Mode");
+      lcd.flush();
       delay(2000);
       lcd.clear();
     }
     // button 2 pressed, only toggle RDS when in radio mode
     else if(!bluetooth_mode && chn_button[1].release()) {
       rds_enabled = !rds_enabled;
-      Serial.println("RDS display toggled.");
+      LOG_INFO(UI, "RDS display toggled.");
 
       // Clear rds memory
       clear_radiotext(radiotext_A, radiotext_B);
@@ -344,18 +592,47 @@ void loop() {
       // Exit settings
       settings_mode = !settings_mode;
       lcd.clear();
+      display_redraw();
+    }
+    // button 3 pressed, pause the radio (time shift)
+    else if(!bluetooth_mode && timeshift.state != TIMESHIFT_OFF && chn_button[2].release()) {
+      LOG_INFO(UI, "Radio paused.");
+      bool answered = timeshift_command('P') && timeshift_wait();
+
+      // Exit settings
+      settings_mode = !settings_mode;
+      lcd.clear();
+
+      // The slave has no time shift ring, display it for 2 seconds
+      if(!answered || timeshift.state == TIMESHIFT_OFF) {
+        lcd.setCursor(0, 0);
+        lcd.print("No time shift");
+        lcd.flush();
+        delay(2000);
+        lcd.clear();
+      }
+      display_redraw();
     }
   }
   // Usual operation modes
   else {
+    // Traffic announcements of the radio station while Bluetooth plays, its reads go into the signal history
+    if(ta_loop(bluetooth_mode, requested_data, tune_config, curr_freq) && !seeking(requested_data)) {
+      signal_sample(requested_data);
+    }
+
     // Bluetooth mode
     if(bluetooth_mode) {
       // Display information using bluetooth variables
       // bluetooth symbol, top right first 2 chars
       lcd.setCursor(0, 0);
       lcd.write(6); lcd.print(" ");
+      // Traffic announcement, the radio is heard
+      if(ta_active()) {
+        ta_display(curr_freq, &lcd);
+      }
       // If no device connected, top display 'not connected'
-      if(connection_state == 2) {
+      else if(connection_state == 2) {
         lcd.print("Not connected ");
         lcd.setCursor(0, 1);
         lcd.print("                ");
@@ -376,10 +653,10 @@ void loop() {
         if(playback_state == 0) {
           // Display device name on top, bottom is empty (scroll if device name is > 14)
           // Short text, no scrolling
-          if(strlen(device_name) <= 14) {
+          if(strlen(metadata.device_name) <= 14) {
             for(int i=0; i<14; i++) {
-              if(i < strlen(device_name)) {
-                lcd.print(device_name[i]);
+              if(i < strlen(metadata.device_name)) {
+                lcd.print(metadata.device_name[i]);
               }
               else {
                 lcd.print(" ");
@@ -388,11 +665,11 @@ void loop() {
           }
           // Scrolling
           else {
-            int offset = (millis() / TITLE_SCROLL) % (strlen(device_name) + 3); // 3 spaces between end and beginning
+            int offset = (millis() / TITLE_SCROLL) % (strlen(metadata.device_name) + 3); // 3 spaces between end and beginning
             for(int i=0; i<14; i++) {
-              int index = (i + offset) % (strlen(device_name) + 3);
-              if(index < strlen(device_name)) {
-                lcd.print(device_name[index]);
+              int index = (i + offset) % (strlen(metadata.device_name) + 3);
+              if(index < strlen(metadata.device_name)) {
+                lcd.print(metadata.device_name[index]);
               }
               else {
                 lcd.print(" ");
@@ -409,12 +686,12 @@ void loop() {
         else if(1 <= playback_state && playback_state <= 4) {
           // Top display song title
           // playing AND too long, scroll
-          if(playback_state == 1 && strlen(media_title) > 14) {
-            int offset = (millis() / TITLE_SCROLL) % (strlen(media_title) + 3); // 3 spaces between end and beginning
+          if(playback_state == 1 && strlen(metadata.media_title) > 14) {
+            int offset = (millis() / TITLE_SCROLL) % (strlen(metadata.media_title) + 3); // 3 spaces between end and beginning
             for(int i=0; i<14; i++) {
-              int index = (i + offset) % (strlen(media_title) + 3);
-              if(index < strlen(media_title)) {
-                lcd.print(media_title[index]);
+              int index = (i + offset) % (strlen(metadata.media_title) + 3);
+              if(index < strlen(metadata.media_title)) {
+                lcd.print(metadata.media_title[index]);
               }
               else {
                 lcd.print(" ");
@@ -424,8 +701,8 @@ void loop() {
           // No scroll
           else{
             for(int i=0; i<14; i++) {
-              if(i < strlen(media_title)) {
-                lcd.print(media_title[i]);
+              if(i < strlen(metadata.media_title)) {
+                lcd.print(metadata.media_title[i]);
               }
               else {
                 lcd.print(" ");
@@ -443,22 +720,22 @@ void loop() {
           }
           lcd.print(" ");
           // Bottom display album name
-          if(strlen(media_artist) + strlen(media_album) != 0) {
+          if(strlen(metadata.media_artist) + strlen(metadata.media_album) != 0) {
             for(int i=0; i<14; i++) {
-              if(i < strlen(media_artist)) {
-                lcd.print(media_artist[i]);
+              if(i < strlen(metadata.media_artist)) {
+                lcd.print(metadata.media_artist[i]);
               }
-              else if(i == strlen(media_artist)) {
+              else if(i == strlen(metadata.media_artist)) {
                 lcd.print(" ");
               }
-              else if(i == strlen(media_artist) + 1) {
+              else if(i == strlen(metadata.media_artist) + 1) {
                 lcd.print("|");
               }
-              else if(i == strlen(media_artist) + 2) {
+              else if(i == strlen(metadata.media_artist) + 2) {
                 lcd.print(" ");
               }
-              else if(i > strlen(media_artist) + 2 && i < strlen(media_artist) + strlen(media_album) + 3) {
-                lcd.print(media_album[i - (strlen(media_artist) + 3)]);
+              else if(i > strlen(metadata.media_artist) + 2 && i < strlen(metadata.media_artist) + strlen(metadata.media_album) + 3) {
+                lcd.print(metadata.media_album[i - (strlen(metadata.media_artist) + 3)]);
               }
               else {
                 lcd.print(" ");
@@ -471,263 +748,17 @@ void loop() {
         }
       }
 
-      // Retrieves bluetooth information from slave
-      bool retry;
-      do {
-        retry = false;
-
-        Serial.println("");
-        Serial.println("Requesting data...");
-
-        // Local variables
-        uint8_t packet_index;
-        uint8_t packet_num;
-
-        // Retrieve first packet first
-        uint8_t first_packet[32]; // First received byte string
-        // Retry until received packet
-        while(true) {
-          // Change slave packet index
-          Wire.beginTransmission(SLAVE_ADDRESS);
-          Wire.printf("PACKET");
-          Wire.write((uint8_t)0);
-          Wire.endTransmission();
-
-          delay(10);
-          
-          // Requests packet
-          uint8_t bytesReceived = Wire.requestFrom(SLAVE_ADDRESS, 32); // Reads 1 packet = 32 bytes
-          if(bytesReceived != 32) {
-            Serial.println("Error occured, received packet is not 32 bytes");
-            continue;
-          }
-
-          // Saves packet
-          Wire.readBytes(first_packet, 32);
-
-          // Print first packet received
-          for(int i=0; i<32; i++) Serial.printf("%02x ", first_packet[i]);
-          Serial.println("");
-
-          // Determine packet index and total packet number
-          packet_index = first_packet[0];
-          packet_num = first_packet[1];
-
-          // Checking validity
-          if(packet_index != 0) {
-            Serial.println("Error occured, first packet received is not indexed 0");
-            continue;
-          }
-          else if(packet_num == 0) {
-            Serial.println("Error occured, total packet number is 0");
-            continue;
-          }
-
-          // Successfully received packet
-          Serial.printf("Packet index %d received successfully.\n", packet_index);
-          break;
-        }
-
-        // Free old and create new datastring
-        free(datastring);
-        datastring = (uint8_t*)malloc(30 * packet_num);
-        // Save the first received byte in datastring
-        for(int i=0; i<30; i++) {
-          datastring[30*packet_index + i] = first_packet[2 + i];
-        }
-
-        // Save the rest of the bytes
-        for(packet_index = 1; packet_index < packet_num; packet_index++) {
-          // Retrying until received packet
-          while(true) {
-            // Change slave packet index
-            Wire.beginTransmission(SLAVE_ADDRESS);
-            Wire.printf("PACKET");
-            Wire.write((uint8_t)packet_index);
-            Wire.endTransmission();
-
-            delay(10);
-
-            // Requests packet
-            uint8_t bytesReceived = Wire.requestFrom(SLAVE_ADDRESS, 32); // Reads 1 packet = 32 bytes
-            if(bytesReceived != 32) {
-              Serial.println("Error occured, received packet is not 32 bytes");
-              continue;
-            }
-
-            // Save byte into temp array
-            uint8_t packet[32];
-            Wire.readBytes(packet, 32);
-
-            // Print packet
-            for(int i=0; i<32; i++) Serial.printf("%02x ", packet[i]);
-            Serial.println("");
-            if(packet_index != packet[0]) {
-              Serial.println("Error occured, packet index mismatch");
-              continue;
-            }
-            if(packet_num != packet[1]) {
-              Serial.println("Error occured, total packet number mismatch");
-              retry = true; // Retry entire packet receival
-              break;
-            }
-
-            // Saves packet
-            for(int i=0; i<30; i++) {
-              datastring[30*packet_index + i] = packet[2 + i];
-            }
-
-            // Successfully saved one packet
-            Serial.printf("Packet index %d received successfully.\n", packet_index);
-            break;
-          }
-
-          // Leave loop if retry is true
-          if(retry) {
-            break;
-          }
-        }
-
-        // Go directly to next loop if retry is true
-        if(retry) {
-          Serial.println("Restarting packet receival");
-          break;
-        }
-
-        // Double check if packet is valid (has 7 variables), also to retrieve separator index in datastring
-        int separator_count = 0;
-        uint8_t separator_pos[7]; // index position of separator 0x1d
-        for(int i=0; i<30*packet_num; i++) {
-          if(datastring[i] == 0x1d) {
-            separator_pos[separator_count] = i;
-            separator_count += 1;
-          }
-        }
-        if(separator_count != 7) {
-          Serial.println("Error occured, number of variables invalid");
-          break;
-          // Try another time, don't save data
-        }
-
-        // Use the datastring to update global bluetooth variables
-        // bluetooth_mode, 0, connection_state, 1, playback_state, 2
-        // device_name, 3, media_title, 4, media_artist, 5, media_album, 6
-        for(int i=0; i<30*packet_num; i++) {
-          // bluetooth_mode ignored
-          // connection_state
-          if(i == separator_pos[1] - 1) {
-            connection_state = datastring[i];
-          }
-          // playback_state
-          else if(i == separator_pos[2] - 1) {
-            playback_state = datastring[i];
-          }
-          // device_name
-          else if(i > separator_pos[2] && i < separator_pos[3]) {
-            // Create new variable
-            if(i == separator_pos[2] + 1) {
-              free(device_name);
-              device_name = (char*)malloc(separator_pos[3] - separator_pos[2]); // including terminator
-              device_name[0] = datastring[i];
-            }
-            else {
-              device_name[i - (separator_pos[2] + 1)] = datastring[i];
-              // if last char, add a terminator 
-              if(i == separator_pos[3] - 1) {
-                device_name[separator_pos[3] - separator_pos[2] - 1] = '\0';
-              }
-            }
-          }
-          // media_title
-          else if(i > separator_pos[3] && i < separator_pos[4]) {
-            // Create new variable
-            if(i == separator_pos[3] + 1) {
-              free(media_title);
-              media_title = (char*)malloc(separator_pos[4] - separator_pos[3]); // including terminator
-              media_title[0] = datastring[i];
-            }
-            else {
-              media_title[i - (separator_pos[3] + 1)] = datastring[i];
-              // if last char, add a terminator 
-              if(i == separator_pos[4] - 1) {
-                media_title[separator_pos[4] - separator_pos[3] - 1] = '\0';
-              }
-            }
-          }
-          // media_artist
-          else if(i > separator_pos[4] && i < separator_pos[5]) {
-            // Create new variable
-            if(i == separator_pos[4] + 1) {
-              free(media_artist);
-              media_artist = (char*)malloc(separator_pos[5] - separator_pos[4]); // including terminator
-              media_artist[0] = datastring[i];
-            }
-            else {
-              media_artist[i - (separator_pos[4] + 1)] = datastring[i];
-              // if last char, add a terminator 
-              if(i == separator_pos[5] - 1) {
-                media_artist[separator_pos[5] - separator_pos[4] - 1] = '\0';
-              }
-            }
-          }
-          // media_album
-          else if(i > separator_pos[5] && i < separator_pos[6]) {
-            // Create new variable
-            if(i == separator_pos[5] + 1) {
-              free(media_album);
-              media_album = (char*)malloc(separator_pos[6] - separator_pos[5]); // including terminator
-              media_album[0] = datastring[i];
-            }
-            else {
-              media_album[i - (separator_pos[5] + 1)] = datastring[i];
-              // if last char, add a terminator 
-              if(i == separator_pos[6] - 1) {
-                media_album[separator_pos[6] - separator_pos[5] - 1] = '\0';
-              }
-            }
-          }
-        }
-
-        // Remove unnecessary variables
-        // Not in CONNECTED state
-        if(connection_state != 1) {
-          free(device_name);
-          device_name = (char*)malloc(1);
-          device_name[0] = '\0';
-
-          free(media_title);
-          media_title = (char*)malloc(1);
-          media_title[0] = '\0';
-
-          free(media_artist);
-          media_artist = (char*)malloc(1);
-          media_artist[0] = '\0';
-          
-          free(media_album);
-          media_album = (char*)malloc(1);
-          media_album[0] = '\0';
-        }
-        // Playback is STOPPED
-        else if(playback_state == 0) {
-          free(media_title);
-          media_title = (char*)malloc(1);
-          media_title[0] = '\0';
-
-          free(media_artist);
-          media_artist = (char*)malloc(1);
-          media_artist[0] = '\0';
-          
-          free(media_album);
-          media_album = (char*)malloc(1);
-          media_album[0] = '\0';
-        }
-
-        // Finish receiving data
-        Serial.println("Finished receiving data.");
-        Serial.println("");
-      } while(false);
+      // Bluetooth information from the slave, fetched between loops (slave_sync_step()), the slave answers with
+      // its update status while it is updated
+      if(!ota_slave_active()) {
+        i2c_bus_request(slave_sync_service);
+      }
     }
 
+    // Radio mode, AF check running (see af.h): muted on another frequency for a few ms, nothing else is done
+    else if(af_checking()) {
+      af_check(tune_config, &curr_freq);
+    }
     // Radio mode
     else {
       // ignores all operations if device is scanning
@@ -754,9 +785,7 @@ void loop() {
           clear_memory();
 
           // Clear the temp storage
-          for(int i=0; i<8; i++) {
-            saved_channels[i] = read_channel(i+1);
-          }
+          read_channels(saved_channels);
 
           // Progress bar interval 10%, 0.25 sec
           lcd.clear();
@@ -771,87 +800,76 @@ void loop() {
             // percent
             lcd.setCursor(10, 1);
             lcd.print(i*10); lcd.print("%");
+            lcd.flush();
             delay(250);
           }
 
           lcd.clear();
+          display_redraw();
+        }
+        // Time shift, play or pause
+        else if(timeshift_active() && knob_switch.release()) {
+          LOG_DEBUG(UI, "Time shift play/pause.");
+          timeshift_command(timeshift.state == TIMESHIFT_PAUSED ? 'R' : 'P');
         }
         // Toggle knob state if pressed and released
         else if(knob_switch.release()) {
           knob_state = !knob_state;
           if(knob_state) {
-            Serial.println("Knob mode: frequency");
+            LOG_INFO(UI, "Knob mode: frequency");
           }
           else {
-            Serial.println("Knob mode: volume");
+            LOG_INFO(UI, "Knob mode: volume");
             // display volume symbol
             last_vol_adj = millis();
           }
         }
-        // clockwise detected
-        else if(direction == 1) {
-          Serial.println("Knob turned clockwise");
-          // frequency mode
+        // knob turned, all detents since the last loop (clockwise > 0)
+        else if(knob.pending()) {
+          // frequency mode, fast spins move 5 or 10 channels per detent
           if(knob_state) {
-            // update current freq
-            if(curr_freq == FREQ_MAX) {
-              curr_freq = FREQ_MIN;
-            }
-            else {
-              curr_freq += 1;
-            }
-
-            // update ic freq
-            change_freq(tune_config, curr_freq);
-          }
-          // volume mode
-          else {
-            last_vol_adj = millis();
+            int32_t steps = knob.take_channels();
+            LOG_DEBUG(UI, "Knob turned %ld channels", (long)steps);
 
-            if(curr_vol != 15) {
-              curr_vol += 1;
-            }
-            change_vol(tune_config, curr_vol);
-          }
-
-          direction = 0;
-        }
-        // anticlockwise detected
-        else if(direction == -1) {
-          Serial.println("Knob turned anticlockwise");
-
-          // frequency mode
-          if(knob_state) {
-            // update current freq
-            if(curr_freq == FREQ_MIN) {
-              curr_freq = FREQ_MAX;
-            }
-            else {
-              curr_freq -= 1;
-            }
+            // update current freq, wraps around the band
+            curr_freq = step_freq(curr_freq, steps);
 
             // update ic freq
-            change_freq(tune_config, curr_freq);
+            trace_mark(TRACE_CONSUMED);
+            request_tune(&tune_pending);
           }
           // volume mode
           else {
+            int32_t steps = knob.take_detents();
+            LOG_DEBUG(UI, "Knob turned %ld detents", (long)steps);
             last_vol_adj = millis();
 
-            if(curr_vol != 0) {
-              curr_vol -= 1;
-            }
-            change_vol(tune_config, curr_vol);
+            curr_vol = constrain((int)curr_vol + steps, 0, 15);
+            volume_frame.pending = true;
+            trace_close();
           }
-
-          direction = 0;
         }
 
 
         //--------------BUTTONS--------------//
 
+        // Time shift, left/right skip back/forward, long press to the oldest audio/live
+        else if(timeshift_active() && l_key.debounce()) {
+          timeshift_command('S', -timeshift_skip_s());
+        }
+        else if(timeshift_active() && l_key.start_longpress()) {
+          timeshift_command('S', INT16_MIN);
+        }
+        else if(timeshift_active() && r_key.debounce()) {
+          timeshift_command('S', timeshift_skip_s());
+        }
+        else if(timeshift_active() && r_key.start_longpress()) {
+          timeshift_command('L');
+        }
+
         // press detected for left button, short press-tune, long press-scan
         else if(l_key.debounce()) {
-          Serial.println("Left key pressed.");
+          LOG_DEBUG(UI, "Left key pressed.");
 
           // update current freq
           if(curr_freq == FREQ_MIN) {
@@ -862,19 +880,20 @@ void loop() {
           }
 
           // update ic freq
-          change_freq(tune_config, curr_freq);
+          request_tune(&tune_pending);
         }
         // transition to long press
         else if(l_key.start_longpress()) {
-          Serial.println("Left key long pressed.");
+          LOG_DEBUG(UI, "Left key long pressed.");
           // tells ic to scan downwards - false: downward
           scan_ongoing = true;
+          tune_pending = false;
           autotune(tune_config, false);
         }
 
         // press detected for right button
         else if(r_key.debounce()) {
-          Serial.println("Right key pressed.");
+          LOG_DEBUG(UI, "Right key pressed.");
           
           // update current freq
           if(curr_freq == FREQ_MAX) {
@@ -885,13 +904,14 @@ void loop() {
           }
 
           // update ic freq
-          change_freq(tune_config, curr_freq);
+          request_tune(&tune_pending);
         }
         // transition to long press
         else if(r_key.start_longpress()) {
-          Serial.println("Right key long pressed.");
+          LOG_DEBUG(UI, "Right key long pressed.");
           // tells ic to scan upwards - true: upward
           scan_ongoing = true;
+          tune_pending = false;
           autotune(tune_config, true);
         }
 
@@ -902,12 +922,12 @@ void loop() {
           if(chn_button[chn_num-1].release()) {
 
             // check if there is any frequency saved there
-            Serial.print("Channel "); Serial.print(chn_num); Serial.println(" released.");
+            LOG_DEBUG(UI, "Channel %d released.", chn_num);
             uint16_t channel = saved_channels[chn_num-1];
             if(channel <= (FREQ_MAX - FREQ_MIN) && channel != (curr_freq - FREQ_MIN)) {
               // update current frequency
               curr_freq = channel + FREQ_MIN;
-              change_freq(tune_config, curr_freq);
+              request_tune(&tune_pending);
             }
             // if no frequency saved there, do nothing
 
@@ -915,7 +935,7 @@ void loop() {
           }
           // transition to long press
           else if(chn_button[chn_num-1].start_longpress()) {
-            Serial.print("Channel "); Serial.print(chn_num); Serial.println(" long pressed.");
+            LOG_DEBUG(UI, "Channel %d long pressed.", chn_num);
             // writes current freq to ch1
             save_channel(saved_channels, curr_freq, chn_num);
 
@@ -926,88 +946,100 @@ void loop() {
         //----------------WIFI OPERATIONS----------------//
         if(wifi_freq_update != 0xff) {
           curr_freq = wifi_freq_update;
-          change_freq(tune_config, curr_freq);
+          trace_mark(TRACE_CONSUMED);
+          request_tune(&tune_pending);
 
           // After changing frequency
           wifi_freq_update = 0xff;
         }
         else if(wifi_vol_update != 0xff) {
           curr_vol = wifi_vol_update;
-          change_vol(tune_config, curr_vol);
+          volume_frame.pending = true;
 
           // After changing volume
           wifi_vol_update = 0xff;
         }
         else if(wifi_tune_update == "up") {
           scan_ongoing = true;
+          tune_pending = false;
+          trace_mark(TRACE_CONSUMED);
           autotune(tune_config, true);
+          trace_mark(TRACE_I2C_WRITTEN);
 
           // After tuning up
           wifi_tune_update = "Nan";
         }
         else if(wifi_tune_update == "down") {
           scan_ongoing = true;
+          tune_pending = false;
+          trace_mark(TRACE_CONSUMED);
           autotune(tune_config, false);
+          trace_mark(TRACE_I2C_WRITTEN);
 
           // After tuning down
           wifi_tune_update = "Nan";
         }
+        else if(wifi_timeshift_update != 0) {
+          if(wifi_timeshift_update == 'B') timeshift_command('S', -timeshift_skip_s());
+          else if(wifi_timeshift_update == 'F') timeshift_command('S', timeshift_skip_s());
+          else timeshift_command(wifi_timeshift_update);
+
+          // After the time shift command
+          wifi_timeshift_update = 0;
+        }
+
+        // Tuning plays live again, the time shift keeps recording the new station
+        if(tune_pending || scan_ongoing) {
+          timeshift_catch_up();
+        }
+        // Delay behind live for the display
+        timeshift_poll();
+
+        // Tune to the latest requested frequency, the chip is not tuning now (ready_state)
+        bool tuned = tune_pending;
+        if(tune_pending) {
+          change_freq(tune_config, curr_freq);
+          trace_mark(TRACE_I2C_WRITTEN);
+          tune_pending = false;
+        }
+
+        // Volume, one write per VOLUME_FRAME however fast the knob turns
+        if(volume_due(&volume_frame, millis())) {
+          change_vol(tune_config, curr_vol);
+        }
 
         //------------------DISPLAY OPERATIONS--------------//
 
         // after all control operations
         // Read registry data of RDA5807
         request_data(requested_data);
+        if(!seeking(requested_data)) trace_tune_complete();
+        rds_capture(requested_data, curr_freq);
+        if(!seeking(requested_data)) signal_sample(requested_data);
 
-        // display current_freq (top)
-        update_freq(requested_data, &curr_freq);
-        display_freq(curr_freq, &lcd);
+        // display current_freq (top), read back from ic unless a tune was just written
+        if(!tuned) {
+          update_freq(requested_data, &curr_freq);
+        }
+        // PI, AF list and signal for AF following, may switch to an AF or back
+        af_update(requested_data, tune_config, &curr_freq);
         // display signal strngth (top)
         display_signal(requested_data, &lcd);
-        // if said frequency is one of the saved channels, display number (top)
-        lcd.setCursor(0, 0);
-        for(int i=1; i<=6; i++) {
-          int saved_freq = saved_channels[i-1] + FREQ_MIN;
-          if(curr_freq == saved_freq) {
-            lcd.print("C");
-            lcd.print(i);
-            break;
-          }
-          // no successful channels
-          if(i == 6) {
-            lcd.print("  ");
-          }
-        }
 
-        // volume (when adjusting volume, will delay for 1s after done adjustment)
-        if(millis() - last_vol_adj < 2000) {
-          lcd.setCursor(0, 1);
-          lcd.write(4); // volume symbol
-          for(int i=1; i<=15; i++) {
-            if(i <= curr_vol) {
-              lcd.write(5);
-            }
-            else {
-              lcd.print(" ");
-            }
-          }
-        }
-
-        // Display the RDS text if not adjusting volume and RDS mode is on
-        else if(rds_enabled) {
-          // Determining bottom display
+        // RDS text, decoded while RDS mode is on (drawn with the device state)
+        if(rds_enabled) {
           // Clear RDS radio text if changed frequency
           if(curr_freq != prev_freq) {
-            Serial.println("Frequency changed, clearing RDS data.");
+            LOG_DEBUG(RADIO, "Frequency changed, clearing RDS data.");
 
             clear_radiotext(radiotext_A, radiotext_B);
           }
           // display id RDSR = 1, new RDS group is ready
           if((requested_data[0] >> 7) == 0b1) {
             // only update if data type is radiotext, group type code = 0010
-            if((requested_data[6] >> 4) == 0b0010) {
+            if(rds_group_type(requested_data) == 0b0010) {
               // check version, a = true
-              rds_version = ((requested_data[6] & 0b1000) == 0b0);
+              rds_version = rds_group_version(requested_data);
               // check type a/b, a = true
               rds_typeflag = ((requested_data[7] & 0b10000) == 0b0);
               // if type flag updated(NOT THE SAME AS VERSION), clear current type radio text
@@ -1027,65 +1059,30 @@ void loop() {
               rds_prev_typeflag = rds_typeflag;
             }
           }
-          // determine text length
-          int rds_length = 16;
+          // text up to the end of text character
           String radio_text = "";
           // version A radiotext
           if(rds_version == true) {
-            for(int i=0; i<64; i++) {
-              if(radiotext_A[i] == '\n') {
-                rds_length = i;
-                break;
-              }
+            for(int i=0; i<64 && radiotext_A[i] != '\n'; i++) {
               radio_text += radiotext_A[i];
             }
           }
           // version B radiotext
           else {
-            for(int i=0; i<32; i++) {
-              if(radiotext_B[i] == '\n') {
-                rds_length = i;
-                break;
-              }
+            for(int i=0; i<32 && radiotext_B[i] != '\n'; i++) {
               radio_text += radiotext_B[i];
             }
           }
           RDS_radiotext = radio_text;
-
-          // Starts printing
-          lcd.setCursor(0, 1);
-          // Short text, no scrolling
-          if(rds_length <= 16) {
-            for(int i=0; i<16; i++) {
-              if(i < rds_length) {
-                lcd.print(radio_text[i]);
-              }
-              else {
-                lcd.print(" ");
-              }
-            }
-          }
-          // Scrolling
-          else {
-            int offset = (millis() / RDS_SCROLL) % (rds_length + 3); // 3 spaces between end and beginning
-            for(int i=0; i<16; i++) {
-              int index = (i + offset) % (rds_length + 3);
-              if(index < rds_length) {
-                lcd.print(radio_text[index]);
-              }
-              else {
-                lcd.print(" ");
-              }
-            }
-          }
         }
-
-        // Display nothing if RDS disabled
         else {
           RDS_radiotext = "Disabled";
+        }
 
-          lcd.setCursor(0, 1);
-          lcd.print("                ");
+        // Bottom row changes with time too: text scrolling, end of the volume bar, time shift recording
+        if(millis() / RDS_SCROLL != display_scroll || (millis() - last_vol_adj < DISPLAY_VOLUME_MS) != display_volume ||
+          timeshift_active()) {
+          display_bottom(&state_published);
         }
 
         //------------END OF LOOP OPERATIONS-------------//
@@ -1102,22 +1099,32 @@ void loop() {
         prev_freq = curr_freq;
       }
       else {
-        Serial.println("Not ready");
+        LOG_DEBUG(RADIO, "Not ready");
 
         // Read registry data of RDA5807
         request_data(requested_data);
+        if(!seeking(requested_data)) trace_tune_complete();
 
-        // Top row update current frequency (read from ic) and signal
-        update_freq(requested_data, &curr_freq);
-        display_freq(curr_freq, &lcd);
+        if(scan_ongoing) {
+          // Top row update current frequency (read from ic)
+          update_freq(requested_data, &curr_freq);
+
+          // Update tune_config for current frequency
+          freq_register(tune_config, curr_freq);
+        }
+        else {
+          // Tune in progress, knob keeps moving the target, it is tuned when this tune completes.
+          // Top row shows the target at the end of this loop (display_state_callback())
+          if(knob_state && knob.pending()) {
+            curr_freq = step_freq(curr_freq, knob.take_channels());
+            trace_mark(TRACE_CONSUMED);
+            request_tune(&tune_pending);
+          }
+        }
         display_signal(requested_data, &lcd);
 
-        // Update tune_config for current frequency
-        tune_config[2] = freq_byte1(curr_freq);
-        tune_config[3] = freq_byte2(curr_freq) | (tune_config[3] & 0b111111);
-        
         if(scan_ongoing) {
-          Serial.println("Scanning...");      
+          LOG_DEBUG(RADIO, "Scanning...");
 
           // Put "Scanning..." if scan is ongoing
           lcd.setCursor(0, 1);
@@ -1136,10 +1143,11 @@ void loop() {
         }
       }
 
-      // save current volume and frequency into NVS every 100 loops
-      if(loop_num % 100 == 0) {
+      // save current volume and frequency into NVS once they settled
+      if(session_pending && millis() - session_changed >= SESSION_SAVE_MS) {
         save_channel(saved_channels, curr_freq, 7);
         save_channel(saved_channels, curr_vol, 8);
+        session_pending = false;
       }
     }
 
@@ -1149,24 +1157,21 @@ void loop() {
       
       // Turn on/off bluetooth
       if(bluetooth_mode) {
-        // Enable bluetooth
-        digitalWrite(ANALOG_SWITCH, LOW);
-        Serial.println("Bluetooth mode enabled.");
+        // Enable bluetooth, the radio is live when it comes back
+        timeshift_catch_up();
+        select_audio_output(true);
+        LOG_INFO(UI, "Bluetooth mode enabled.");
 
         // Sends request to slave
-        Wire.beginTransmission(SLAVE_ADDRESS);
-        Wire.printf("BLUETOOTH ON");
-        Wire.endTransmission();
+        i2c_write(I2C_SLAVE, SLAVE_ADDRESS, (const uint8_t*)"BLUETOOTH ON", 12);
       }
       else {
         // Disable bluetooth
-        digitalWrite(ANALOG_SWITCH, HIGH);
-        Serial.println("Bluetooth mode disabled.");
+        select_audio_output(false);
+        LOG_INFO(UI, "Bluetooth mode disabled.");
 
         // Sends request to slave
-        Wire.beginTransmission(SLAVE_ADDRESS);
-        Wire.printf("BLUETOOTH OFF");
-        Wire.endTransmission();
+        i2c_write(I2C_SLAVE, SLAVE_ADDRESS, (const uint8_t*)"BLUETOOTH OFF", 13);
       }
 
       // Display 'bluetooth/radio mode' for 2 seconds
@@ -1174,46 +1179,46 @@ void loop() {
       lcd.setCursor(0, 0);
       if(bluetooth_mode) lcd.print("Bluetooth Mode");
       else lcd.print("Radio Mode");
+      lcd.flush();
       delay(2000);
       lcd.clear();
     }
+  }
 
-    // increment loop number when in bluetooth/radio mode
-    loop_num++;
+  // Slave image forwarding, the slave comes back with Bluetooth off
+  if(ota_loop() && bluetooth_mode) {
+    i2c_write(I2C_SLAVE, SLAVE_ADDRESS, (const uint8_t*)"BLUETOOTH ON", 12);
   }
-  
-  // delay 1ms
-  delay(1);
+
+  // Live RDS stream to inspector clients
+  rds_stream();
+
+  // Web server and subscribers see this loop's changes
+  state_update();
+
+  // LCD and slave work queued by this loop
+  i2c_bus_run();
+
+  // loop time, without the wait
+  uint8_t mode = settings_mode ? LOOP_SETTINGS : (bluetooth_mode ? LOOP_BLUETOOTH : LOOP_RADIO);
+  metrics_loop(mode, loop_start);
+
+  // Wait for the next input, or 1ms while the tuner is busy, an AF is checked, the tuner goes to a traffic
+  // announcement, the slave is updated or I2C work is left, or POWER_WAIT_MS for the display and RDS
+  power_update(&lcd);
+  bool busy = (mode == LOOP_RADIO && (!ready_state || tune_pending || volume_frame.pending || af_checking())) || ta_tuning() ||
+    ota_slave_active() || i2c_bus_pending();
+  power_wait(mode, loop_start, power_wait_ms(busy));
 }
 
-void updatestate_ISR() {
-  // Knob is only needed in radio mode
-  if(!bluetooth_mode) {
-    uint8_t clk_input = digitalRead(CLK);
-    uint8_t dt_input = digitalRead(DT);
-    // New input is different than past input
-    if((clk_state & 1) != clk_input || (dt_state & 1) != dt_input) {
-      // Update states
-      clk_state = clk_state << 1 | clk_input | 0b11111000;
-      dt_state = dt_state << 1 | dt_input | 0b11111000;
-      // Clockwise detected
-      if(clk_state == 0b11111100 && dt_state == 0b11111110) {
-        direction = 1;
-        // Reset state
-        clk_state = 0b11111000; dt_state = 0b11111000;
-      }
-      // Anticlockwise detected
-      else if(clk_state == 0b11111110 && dt_state == 0b11111100) {
-        direction = -1;
-        // Reset state
-        clk_state = 0b11111000; dt_state = 0b11111000;
-      }
-    }
+void IRAM_ATTR updatestate_ISR() {
+  // state is always tracked, detents are only needed in radio mode
+  bool detent = knob.update();
+  if(bluetooth_mode) {
+    knob.clear();
   }
-  // Do nothing, ensure variables are in default state
-  else {
-    if(direction != 0) direction = 0;
-    if(clk_state != 0b11111000) clk_state = 0b11111000;
-    if(dt_state != 0b11111000) dt_state = 0b11111000;
+  else if(detent) {
+    trace_begin_isr(TRACE_KNOB);
+    power_wake_isr();
   }
-}
\ No newline at end of file
+}
@@ -0,0 +1,192 @@
+#ifndef metadata_h
+#define metadata_h
+
+#include "stdint.h"
+#include "string.h"
+
+// Bluetooth metadata shared by master and slave (same file in both sketches, keep them equal)
+// Every string has a fixed slot, so metadata changes never touch the heap. Longer strings are cut at a
+// UTF-8 character boundary, never inside a multi-byte character, following the truncation policy of the slot.
+// The slot sizes also bound the slave data packets: all fields always fit in SLAVE_FRAMES frames.
+
+#define METADATA_NAME_SIZE 64         // device name, including terminator
+#define METADATA_TEXT_SIZE 97         // title, artist, album, including terminator
+#define METADATA_TELEMETRY_SIZE 56    // audio telemetry text, including terminator
+
+// Slave data packets: 32 bytes = packet index, total packet number, 30 bytes of data
+#define SLAVE_FRAME_DATA 30
+#define SLAVE_FRAMES 16
+#define SLAVE_FIELDS 8                // fields, each followed by the 0x1d separator
+static_assert(3 * 2 + (METADATA_NAME_SIZE + 3 * METADATA_TEXT_SIZE) + METADATA_TELEMETRY_SIZE <= SLAVE_FRAMES * SLAVE_FRAME_DATA,
+              "slave frames too small for the metadata slots");
+
+// Truncation policies
+#define METADATA_CUT 0                // cut at the last whole character
+#define METADATA_ELLIPSIS 1           // cut and end with "..." so the cut is visible
+
+struct Metadata {
+  char device_name[METADATA_NAME_SIZE];
+  char media_title[METADATA_TEXT_SIZE];
+  char media_artist[METADATA_TEXT_SIZE];
+  char media_album[METADATA_TEXT_SIZE];
+};
+
+// Length of text cut to at most max bytes without splitting a UTF-8 character
+size_t utf8_cut(const char* text, size_t length, size_t max) {
+  if(length <= max) {
+    return length;
+  }
+  size_t cut = max;
+  // back to the start of the character at the cut (continuation bytes are 10xxxxxx)
+  while(cut > 0 && ((uint8_t)text[cut] & 0b11000000) == 0b10000000) {
+    cut--;
+  }
+  return cut;
+}
+
+// Copy length bytes of text into slot (size bytes including terminator), returns true if the slot changed
+bool metadata_set(char* slot, size_t size, const char* text, size_t length, uint8_t policy = METADATA_CUT) {
+  char value[METADATA_TEXT_SIZE > METADATA_NAME_SIZE ? METADATA_TEXT_SIZE : METADATA_NAME_SIZE];
+  size_t limit = (size <= sizeof(value) ? size : sizeof(value)) - 1;
+  size_t value_length;
+  if(length > limit && policy == METADATA_ELLIPSIS && limit > 3) {
+    value_length = utf8_cut(text, length, limit - 3);
+    memcpy(value, text, value_length);
+    memcpy(value + value_length, "...", 3);
+    value_length += 3;
+  }
+  else {
+    value_length = utf8_cut(text, length, limit);
+    memcpy(value, text, value_length);
+  }
+  value[value_length] = '\0';
+
+  if(strcmp(slot, value) == 0) {
+    return false;
+  }
+  memcpy(slot, value, value_length + 1);
+  return true;
+}
+
+// Empty all slots
+void metadata_clear(Metadata* metadata) {
+  metadata->device_name[0] = '\0';
+  metadata->media_title[0] = '\0';
+  metadata->media_artist[0] = '\0';
+  metadata->media_album[0] = '\0';
+}
+
+// Slave data packets
+// The slave appends fields and splits the data into packets, the master stores each packet at its index and
+// scans the reassembled data for the separators.
+
+// Append length bytes of field and the 0x1d separator to data (length = bytes used so far)
+void frame_append_field(uint8_t* data, uint16_t* length, const char* field, size_t field_length) {
+  memcpy(data + *length, field, field_length);
+  *length += field_length;
+  data[(*length)++] = 0x1d;
+}
+
+// Slave data as build_frames() sends it: bluetooth_mode, connection_state and playback_state (one byte each),
+// device name, title, artist, album and the audio telemetry text ("fill,target,underruns,lost,bitrate", cut to
+// METADATA_TELEMETRY_SIZE - 1), each field followed by the 0x1d separator. data holds SLAVE_FRAMES *
+// SLAVE_FRAME_DATA bytes, returns the length
+uint16_t frame_build_data(uint8_t* data, uint8_t bluetooth_mode, uint8_t connection_state, uint8_t playback_state,
+                          const Metadata* metadata, const char* telemetry, size_t telemetry_length) {
+  uint16_t length = 0;
+  data[length++] = bluetooth_mode; data[length++] = 0x1d;
+  data[length++] = connection_state; data[length++] = 0x1d;
+  data[length++] = playback_state; data[length++] = 0x1d;
+  frame_append_field(data, &length, metadata->device_name, strlen(metadata->device_name));
+  frame_append_field(data, &length, metadata->media_title, strlen(metadata->media_title));
+  frame_append_field(data, &length, metadata->media_artist, strlen(metadata->media_artist));
+  frame_append_field(data, &length, metadata->media_album, strlen(metadata->media_album));
+  if(telemetry_length > METADATA_TELEMETRY_SIZE - 1) {
+    telemetry_length = METADATA_TELEMETRY_SIZE - 1;
+  }
+  frame_append_field(data, &length, telemetry, telemetry_length);
+  return length;
+}
+
+// Split length bytes of data (SLAVE_FRAMES * SLAVE_FRAME_DATA bytes buffer) into packets: index, packet count,
+// SLAVE_FRAME_DATA bytes of data padded with 0x00. Returns the packet count
+uint8_t frame_split(uint8_t frames[][32], uint8_t* data, uint16_t length) {
+  uint8_t count = (length - 1) / SLAVE_FRAME_DATA + 1;
+  memset(data + length, 0x00, count * SLAVE_FRAME_DATA - length);
+  for(int i=0; i<count; i++) {
+    frames[i][0] = i;
+    frames[i][1] = count;
+    memcpy(&frames[i][2], data + SLAVE_FRAME_DATA*i, SLAVE_FRAME_DATA);
+  }
+  return count;
+}
+
+// Double buffered packets of the slave. loop() builds into the buffer the master is not reading and publishes it
+// by switching ready. The I2C request callback latches the ready buffer at packet 0 and serves the whole read
+// from it, so a read never mixes two builds. A latch older than SLAVE_SERVE_MS is a read the master gave up
+// (a read of all packets takes less), its buffer is free again.
+#define SLAVE_SERVE_MS 500
+
+struct FrameBuffers {
+  uint8_t frames[2][SLAVE_FRAMES][32];
+  uint8_t count[2];                   // packets in each buffer
+  volatile uint8_t ready;             // buffer with the latest data
+  volatile uint8_t serving;           // buffer latched by the master at packet 0
+  volatile uint32_t latched;          // ms of the latch
+};
+
+// Buffer to build into at now_ms (loop()), -1 while the master is still reading it
+int frame_back_buffer(const FrameBuffers* buffers, uint32_t now_ms) {
+  uint8_t back = buffers->ready ^ 1;
+  if(back == buffers->serving && now_ms - buffers->latched < SLAVE_SERVE_MS) {
+    return -1;
+  }
+  return back;
+}
+
+// Split length bytes of data into the back buffer and publish it (loop())
+void frame_publish(FrameBuffers* buffers, int back, uint8_t* data, uint16_t length) {
+  buffers->count[back] = frame_split(buffers->frames[back], data, length);
+  __atomic_store_n(&buffers->ready, (uint8_t)back, __ATOMIC_RELEASE);
+}
+
+// Packet index of the current read at now_ms into packet (32 bytes, I2C request callback). An index out of
+// range gets an empty packet with the current total
+void frame_serve(FrameBuffers* buffers, uint8_t index, uint32_t now_ms, uint8_t* packet) {
+  if(index == 0) {
+    buffers->serving = __atomic_load_n(&buffers->ready, __ATOMIC_ACQUIRE);
+    buffers->latched = now_ms;
+  }
+  uint8_t buffer = buffers->serving;
+  if(index < buffers->count[buffer]) {
+    memcpy(packet, buffers->frames[buffer][index], 32);
+  }
+  else {
+    memset(packet, 0, 32);
+    packet[0] = index;
+    packet[1] = buffers->count[buffer];
+  }
+}
+
+// Store the data of a received packet at its index (index checked by the caller)
+void frame_store(uint8_t* data, const uint8_t* packet) {
+  memcpy(data + SLAVE_FRAME_DATA*packet[0], packet + 2, SLAVE_FRAME_DATA);
+}
+
+// Positions of the first SLAVE_FIELDS separators in length bytes of data, returns the number of separators
+// (SLAVE_FIELDS if the data is valid)
+int frame_scan_fields(const uint8_t* data, uint16_t length, uint16_t* separator_pos) {
+  int separator_count = 0;
+  const uint8_t* end = data + length;
+  const uint8_t* position = data;
+  while((position = (const uint8_t*)memchr(position, 0x1d, end - position)) != nullptr) {
+    if(separator_count < SLAVE_FIELDS) {
+      separator_pos[separator_count] = position - data;
+    }
+    separator_count++;
+    position++;
+  }
+  return separator_count;
+}
+
+#endif
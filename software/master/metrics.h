@@ -0,0 +1,261 @@
+#ifndef metrics_h
+#define metrics_h
+
+#include "Arduino.h"
+#include "esp_heap_caps.h"        // Heap fragmentation
+
+#include "constants.h"
+#include "latency_trace.h"        // Histograms shared with tuning latency tracing
+#include "i2c_bus.h"              // I2C counters per device and class
+#include "power.h"                // Duty cycle and current estimates
+#include "af_follow.h"            // AF counters
+#include "rda_control.h"          // Tuning counters
+#include "logger.h"
+
+// Metrics subsystem
+// Prints the I2C usage per device and class on the shared bus (counted in i2c_bus.h), counts loop time per
+// mode. All counters are static, updating them never allocates. Everything is printed in Prometheus text
+// format on /metrics. Over serial, 'm' logs a short tuning latency summary through the log ring instead.
+
+// Loop modes
+#define LOOP_RADIO 0
+#define LOOP_BLUETOOTH 1
+#define LOOP_SETTINGS 2
+#define LOOP_MODES 3
+
+// Bluetooth sink telemetry, from the last field of the slave data packet
+struct SlaveAudio {
+  uint32_t ring_fill;     // frames in the Bluetooth ring
+  uint32_t ring_target;   // adaptive ring depth, frames
+  uint32_t underruns;
+  uint32_t lost_frames;   // estimated from the A2DP stream clock
+  uint32_t bitrate;       // SBC bitrate, bits per second
+};
+
+// Startup phases, micros() since the timer started (shortly after reset) when each phase ended
+#define BOOT_NVS 0        // saved channels read
+#define BOOT_TUNED 1      // init and tune written to the RDA5807M
+#define BOOT_STC 2        // RDA5807M reported seek/tune complete
+#define BOOT_AUDIO 3      // unmuted, first audio
+#define BOOT_READY 4      // setup() done, loop() starts
+#define BOOT_WIFI 5       // access point and web server up (background task)
+#define BOOT_PHASES 6
+#define BOOT_AUDIO_TARGET_MS 600
+
+uint32_t boot_us[BOOT_PHASES];
+LatencyHistogram loop_hist[LOOP_MODES];
+uint32_t slave_packet_retries = 0;
+SlaveAudio slave_audio;
+TuneCounters tune_snapshot;          // tune_counters (rda_control.h) for the web task, copied by loop() under tune_mux
+portMUX_TYPE tune_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Parse telemetry field "fill,target,underruns,lost,bitrate" of len chars, keeps old values if invalid
+void slave_audio_update(const char* field, size_t len) {
+  char text[56];
+  if(len >= sizeof(text)) {
+    return;
+  }
+  memcpy(text, field, len);
+  text[len] = '\0';
+  unsigned long values[5];
+  if(sscanf(text, "%lu,%lu,%lu,%lu,%lu", &values[0], &values[1], &values[2], &values[3], &values[4]) == 5) {
+    slave_audio.ring_fill = values[0];
+    slave_audio.ring_target = values[1];
+    slave_audio.underruns = values[2];
+    slave_audio.lost_frames = values[3];
+    slave_audio.bitrate = values[4];
+  }
+}
+
+// End of a startup phase
+void metrics_boot(uint8_t phase) {
+  boot_us[phase] = micros();
+  if(phase == BOOT_AUDIO) {
+    unsigned long audio_ms = boot_us[BOOT_AUDIO] / 1000;
+    if(audio_ms > BOOT_AUDIO_TARGET_MS) {
+      LOG_WARN(RADIO, "First audio after %lums (target %dms)", audio_ms, BOOT_AUDIO_TARGET_MS);
+    }
+    else {
+      LOG_INFO(RADIO, "First audio after %lums", audio_ms);
+    }
+  }
+}
+
+// Loop time of one iteration (start = micros() at start of loop), closes a finished sweep and publishes the
+// tuning counters for metrics_print()
+void metrics_loop(uint8_t mode, unsigned long start) {
+  trace_record(&loop_hist[mode], micros() - start);
+  tune_sweep_close(millis());
+  portENTER_CRITICAL(&tune_mux);
+  tune_snapshot = tune_counters;
+  portEXIT_CRITICAL(&tune_mux);
+}
+
+// Print all metrics in Prometheus text format (output = /metrics response stream)
+void metrics_print(Print& output) {
+  const char* device_names[I2C_DEVICES] = {"rda5807m", "lcd", "slave"};
+  const char* mode_names[LOOP_MODES] = {"radio", "bluetooth", "settings"};
+
+  // I2C counters
+  const char* counter_names[5] = {"i2c_transactions_total", "i2c_bytes_written_total", "i2c_bytes_read_total", "i2c_errors_total", "i2c_short_reads_total"};
+  for(int counter=0; counter<5; counter++) {
+    output.printf("# TYPE %s counter\n", counter_names[counter]);
+    for(int dev=0; dev<I2C_DEVICES; dev++) {
+      const I2CCounters* counters = &i2c_counters[dev];
+      uint32_t value = counters->transactions;
+      if(counter == 1) value = counters->bytes_written;
+      else if(counter == 2) value = counters->bytes_read;
+      else if(counter == 3) value = counters->errors;
+      else if(counter == 4) value = counters->short_reads;
+      output.printf("%s{device=\"%s\"} %lu\n", counter_names[counter], device_names[dev], (unsigned long)value);
+    }
+  }
+  output.println("# HELP i2c_busy_seconds_total Time spent in Wire calls");
+  output.println("# TYPE i2c_busy_seconds_total counter");
+  for(int dev=0; dev<I2C_DEVICES; dev++) {
+    output.printf("i2c_busy_seconds_total{device=\"%s\"} %.6f\n", device_names[dev], i2c_counters[dev].busy_us / 1e6);
+  }
+  const char* class_names[I2C_CLASSES] = {"tuner", "rds", "lcd", "slave"};
+  output.println("# TYPE i2c_class_transactions_total counter");
+  for(int cls=0; cls<I2C_CLASSES; cls++) {
+    output.printf("i2c_class_transactions_total{class=\"%s\"} %lu\n", class_names[cls], (unsigned long)i2c_class_counters[cls].transactions);
+  }
+  output.println("# TYPE i2c_class_busy_seconds_total counter");
+  for(int cls=0; cls<I2C_CLASSES; cls++) {
+    output.printf("i2c_class_busy_seconds_total{class=\"%s\"} %.6f\n", class_names[cls], i2c_class_counters[cls].busy_us / 1e6);
+  }
+  output.println("# HELP i2c_wait_us Time from a request to its first transaction, microseconds");
+  output.println("# TYPE i2c_wait_us summary");
+  for(int cls=0; cls<I2C_CLASSES; cls++) {
+    const LatencyHistogram* hist = &i2c_class_counters[cls].wait;
+    output.printf("i2c_wait_us{class=\"%s\",quantile=\"0.5\"} %lu\n", class_names[cls], (unsigned long)trace_percentile(hist, 0.5f));
+    output.printf("i2c_wait_us{class=\"%s\",quantile=\"0.95\"} %lu\n", class_names[cls], (unsigned long)trace_percentile(hist, 0.95f));
+    output.printf("i2c_wait_us{class=\"%s\",quantile=\"1\"} %lu\n", class_names[cls], (unsigned long)hist->max);
+    output.printf("i2c_wait_us_sum{class=\"%s\"} %llu\n", class_names[cls], (unsigned long long)hist->sum);
+    output.printf("i2c_wait_us_count{class=\"%s\"} %lu\n", class_names[cls], (unsigned long)hist->count);
+  }
+  output.println("# HELP i2c_bus_occupancy_ratio Share of the last second the bus was busy");
+  output.println("# TYPE i2c_bus_occupancy_ratio gauge");
+  output.printf("i2c_bus_occupancy_ratio %.3f\n", i2c_occupancy);
+  output.println("# TYPE i2c_bus_occupancy_max_ratio gauge");
+  output.printf("i2c_bus_occupancy_max_ratio %.3f\n", i2c_occupancy_max);
+  output.println("# TYPE i2c_clock_hz gauge");
+  output.printf("i2c_clock_hz{device=\"rda5807m\"} %lu\n", (unsigned long)I2C_CLOCK_HZ);
+  output.printf("i2c_clock_hz{device=\"lcd\"} %lu\n", (unsigned long)I2C_LCD_CLOCK_HZ);
+  output.printf("i2c_clock_hz{device=\"slave\"} %lu\n", (unsigned long)I2C_CLOCK_HZ);
+  output.println("# TYPE slave_packet_retries_total counter");
+  output.printf("slave_packet_retries_total %lu\n", (unsigned long)slave_packet_retries);
+
+  // Tuning
+  TuneCounters tune;
+  portENTER_CRITICAL(&tune_mux);
+  tune = tune_snapshot;
+  portEXIT_CRITICAL(&tune_mux);
+  output.println("# TYPE tune_requests_total counter");
+  output.printf("tune_requests_total %lu\n", (unsigned long)tune.requests);
+  output.println("# HELP tunes_total Tune operations written to the RDA5807M");
+  output.println("# TYPE tunes_total counter");
+  output.printf("tunes_total %lu\n", (unsigned long)tune.tunes);
+  output.println("# TYPE tune_sweeps_total counter");
+  output.printf("tune_sweeps_total %lu\n", (unsigned long)tune.sweeps);
+  output.println("# HELP tune_last_sweep_requests Requests (detents) in the last finished sweep");
+  output.println("# TYPE tune_last_sweep_requests gauge");
+  output.printf("tune_last_sweep_requests %lu\n", (unsigned long)tune.last_sweep_requests);
+  output.println("# HELP tune_last_sweep_tunes Tunes written in the last finished sweep");
+  output.println("# TYPE tune_last_sweep_tunes gauge");
+  output.printf("tune_last_sweep_tunes %lu\n", (unsigned long)tune.last_sweep_tunes);
+
+  // AF following
+  output.println("# TYPE af_checks_total counter");
+  output.printf("af_checks_total %lu\n", (unsigned long)af_counters.checks);
+  output.println("# TYPE af_switches_total counter");
+  output.printf("af_switches_total %lu\n", (unsigned long)af_counters.switches);
+  output.println("# HELP af_rejected_total Stronger AFs left again because their PI did not match");
+  output.println("# TYPE af_rejected_total counter");
+  output.printf("af_rejected_total %lu\n", (unsigned long)af_counters.rejected);
+  output.println("# HELP af_check_max_seconds Longest muted AF check");
+  output.println("# TYPE af_check_max_seconds gauge");
+  output.printf("af_check_max_seconds %.3f\n", af_counters.max_check_ms / 1e3);
+
+  // Bluetooth sink (slave)
+  output.println("# HELP bt_ring_fill_frames Frames buffered in the slave Bluetooth ring");
+  output.println("# TYPE bt_ring_fill_frames gauge");
+  output.printf("bt_ring_fill_frames %lu\n", (unsigned long)slave_audio.ring_fill);
+  output.println("# HELP bt_ring_target_frames Adaptive Bluetooth ring depth");
+  output.println("# TYPE bt_ring_target_frames gauge");
+  output.printf("bt_ring_target_frames %lu\n", (unsigned long)slave_audio.ring_target);
+  output.println("# TYPE bt_underruns_total counter");
+  output.printf("bt_underruns_total %lu\n", (unsigned long)slave_audio.underruns);
+  output.println("# HELP bt_lost_frames_total Frames missing from the A2DP stream");
+  output.println("# TYPE bt_lost_frames_total counter");
+  output.printf("bt_lost_frames_total %lu\n", (unsigned long)slave_audio.lost_frames);
+  output.println("# TYPE bt_codec_bitrate_bps gauge");
+  output.printf("bt_codec_bitrate_bps %lu\n", (unsigned long)slave_audio.bitrate);
+
+  // Loop time
+  output.println("# HELP loop_time_us Duration of one loop() iteration, microseconds");
+  output.println("# TYPE loop_time_us summary");
+  for(int mode=0; mode<LOOP_MODES; mode++) {
+    const LatencyHistogram* hist = &loop_hist[mode];
+    output.printf("loop_time_us{mode=\"%s\",quantile=\"0.5\"} %lu\n", mode_names[mode], (unsigned long)trace_percentile(hist, 0.5f));
+    output.printf("loop_time_us{mode=\"%s\",quantile=\"0.95\"} %lu\n", mode_names[mode], (unsigned long)trace_percentile(hist, 0.95f));
+    output.printf("loop_time_us{mode=\"%s\",quantile=\"1\"} %lu\n", mode_names[mode], (unsigned long)hist->max);
+    output.printf("loop_time_us_sum{mode=\"%s\"} %llu\n", mode_names[mode], (unsigned long long)hist->sum);
+    output.printf("loop_time_us_count{mode=\"%s\"} %lu\n", mode_names[mode], (unsigned long)hist->count);
+  }
+
+  // Heap
+  size_t free_heap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  size_t largest_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  output.println("# TYPE heap_free_bytes gauge");
+  output.printf("heap_free_bytes %lu\n", (unsigned long)free_heap);
+  output.println("# HELP heap_min_free_bytes Lowest free heap since boot");
+  output.println("# TYPE heap_min_free_bytes gauge");
+  output.printf("heap_min_free_bytes %lu\n", (unsigned long)ESP.getMinFreeHeap());
+  output.println("# TYPE heap_largest_free_block_bytes gauge");
+  output.printf("heap_largest_free_block_bytes %lu\n", (unsigned long)largest_block);
+  output.println("# HELP heap_fragmentation_ratio 1 - largest free block / free heap");
+  output.println("# TYPE heap_fragmentation_ratio gauge");
+  output.printf("heap_fragmentation_ratio %.3f\n", (free_heap == 0) ? 0.0 : 1.0 - (double)largest_block / free_heap);
+
+  // Tuning latency
+  trace_print(output);
+
+  // Startup
+  const char* boot_names[BOOT_PHASES] = {"nvs", "tuned", "stc", "audio", "ready", "wifi"};
+  output.println("# HELP boot_phase_seconds Time from reset to the end of each startup phase, 0 if not reached");
+  output.println("# TYPE boot_phase_seconds gauge");
+  for(int phase=0; phase<BOOT_PHASES; phase++) {
+    output.printf("boot_phase_seconds{phase=\"%s\"} %.4f\n", boot_names[phase], boot_us[phase] / 1e6);
+  }
+
+  // Power
+  power_print(output);
+}
+
+// Tuning latency summary when 'm' is received over serial, one line per source and stage with samples. The
+// lines go through the log ring, loop() never waits for the UART; the full dump stays on /metrics
+void metrics_serial_poll() {
+  if(Serial.available() <= 0 || Serial.read() != 'm') {
+    return;
+  }
+  bool traced = false;
+  for(int src=0; src<TRACE_SOURCES; src++) {
+    for(int stage=0; stage<TRACE_STAGES; stage++) {
+      const LatencyHistogram* hist = &trace_hist[src][stage];
+      if(hist->count == 0) {
+        continue;
+      }
+      traced = true;
+      LOG_INFO(METRICS, "%s %s: n %lu, min %lu, avg %lu, p95 %lu, max %lu us", trace_source_names[src],
+        trace_stage_names[stage], (unsigned long)hist->count, (unsigned long)hist->min,
+        (unsigned long)(hist->sum / hist->count), (unsigned long)trace_percentile(hist, 0.95f),
+        (unsigned long)hist->max);
+    }
+  }
+  if(!traced) {
+    LOG_INFO(METRICS, "No tuning traced yet");
+  }
+}
+
+#endif
@@ -0,0 +1,208 @@
+#ifndef ota_h
+#define ota_h
+
+#include "Arduino.h"
+#include "Wire.h"
+#include "Update.h"
+#include "ESPAsyncWebServer.h"
+
+#include "constants.h"
+#include "metrics.h"       // Counted I2C transactions
+#include "logger.h"        // Non-blocking logs
+#include "json.h"          // JSON responses
+#include "ota_upload.h"    // Upload, ring and slave forwarding
+
+// Firmware updates over the soft AP
+// POST /ota/master writes the upload straight into the OTA partition, chunk by chunk as the web server receives
+// it. POST /ota/slave passes the image through a ring to loop(), which forwards it to the slave in blocks (see
+// ota_protocol.h and ota_upload.h) and frees ring space as the slave accepts them. Neither image is held in RAM as
+// a whole. Uploads need OTA_TOKEN in the OTA_TOKEN_HEADER header, it is checked before the partition is opened.
+// GET /ota/status reports progress, KB/s and the total time; the /ota page uploads and shows it.
+// Only loop() uses Wire and logs the update; the upload handler (web server task) waits for ring space instead.
+
+#define OTA_RESTART_MS 1000           // master restarts this long after its update, the response goes out first
+#define OTA_SLAVE_BOOT_MS 2000        // slave restart after its update
+
+unsigned long ota_restart_at = 0;     // master restart time, 0 - none
+unsigned long ota_slave_boot_at = 0;  // slave back after its restart, 0 - none
+uint8_t ota_logged_state = OTA_IDLE;  // state ota_loop() last logged
+
+// Slave busy with an update or restarting after it, the master leaves it alone
+bool ota_slave_active() {
+  return ota.target == OTA_TARGET_SLAVE && (ota_running() || ota_slave_boot_at != 0);
+}
+
+float ota_seconds() {
+  return ((ota_running() ? millis() : ota.end_ms) - ota.start_ms) / 1000.0;
+}
+
+float ota_kbps() {
+  float seconds = ota_seconds();
+  return (seconds > 0) ? ota.written / 1024.0 / seconds : 0;
+}
+
+bool ota_flash_begin() {
+  return Update.begin(UPDATE_SIZE_UNKNOWN);
+}
+
+size_t ota_flash_write(const uint8_t* data, size_t length) {
+  return Update.write((uint8_t*)data, length);
+}
+
+bool ota_flash_end() {
+  return Update.end(true);
+}
+
+void ota_flash_abort() {
+  Update.abort();
+}
+
+const char* ota_flash_error() {
+  return Update.errorString();
+}
+
+const OtaFlash ota_flash = {ota_flash_begin, ota_flash_write, ota_flash_end, ota_flash_abort, ota_flash_error};
+
+bool ota_link_write(const uint8_t* message, size_t length) {
+  return i2c_write(I2C_SLAVE, SLAVE_ADDRESS, message, length) == 0;
+}
+
+bool ota_link_status(uint8_t* status) {
+  uint8_t received = i2c_request(I2C_SLAVE, SLAVE_ADDRESS, OTA_STATUS_SIZE);
+  if(received != OTA_STATUS_SIZE) {
+    while(Wire.available()) {
+      Wire.read();
+    }
+    return false;
+  }
+  Wire.readBytes(status, OTA_STATUS_SIZE);
+  return true;
+}
+
+const OtaLink ota_link = {ota_link_write, ota_link_status};
+
+// Upload token of request matches OTA_TOKEN
+bool ota_authorized(AsyncWebServerRequest* request) {
+  const AsyncWebHeader* header = request->getHeader(OTA_TOKEN_HEADER);
+  return ota_token_valid(header != nullptr ? header->value().c_str() : nullptr, OTA_TOKEN);
+}
+
+// First chunk of an upload: new update for target if the token matches and no other update is running
+bool ota_open(uint8_t target, AsyncWebServerRequest* request) {
+  if(!ota_authorized(request)) {
+    LOG_WARN(OTA, "Upload without a valid token rejected");
+    return false;
+  }
+  if(ota_slave_boot_at != 0 || !ota_start(target, request, millis())) {
+    return false;
+  }
+  // a closed upload ends the update
+  request->onDisconnect([request]() {
+    ota_upload_closed(&ota_flash, request, millis());
+  });
+  return true;
+}
+
+// Upload chunk of the master image, written to flash right away
+void ota_master_upload(AsyncWebServerRequest* request, const String& filename, size_t index, uint8_t* data, size_t len, bool final) {
+  if(index == 0 && !ota_open(OTA_TARGET_MASTER, request)) {
+    return;
+  }
+  ota_master_chunk(&ota_flash, request, index, data, len, final, millis());
+}
+
+// Upload chunk of the slave image, into the ring for loop()
+void ota_slave_upload(AsyncWebServerRequest* request, const String& filename, size_t index, uint8_t* data, size_t len, bool final) {
+  if(index == 0 && !ota_open(OTA_TARGET_SLAVE, request)) {
+    return;
+  }
+  // wait until the slave accepted enough blocks
+  unsigned long start = millis();
+  while(ota_slave_chunk(request, index, data, len, final, millis()) == OTA_CHUNK_FULL) {
+    if(millis() - start > OTA_UPLOAD_WAIT_MS) {
+      ota_fail("slave not accepting blocks", millis());
+      return;
+    }
+    vTaskDelay(pdMS_TO_TICKS(2));
+  }
+}
+
+// Log state changes of the update and schedule the restarts (the handlers change the state on the web server task)
+void ota_log_state() {
+  uint8_t state = ota.state;
+  if(state == ota_logged_state) {
+    return;
+  }
+  ota_logged_state = state;
+  const char* name = (ota.target == OTA_TARGET_MASTER) ? "Master" : "Slave";
+  if(state == OTA_RECEIVING) {
+    LOG_INFO(OTA, "%s update started", name);
+  }
+  else if(state == OTA_FAILED) {
+    LOG_ERROR(OTA, "Update failed: %s", ota.message);
+  }
+  else if(state == OTA_DONE) {
+    LOG_INFO(OTA, "%s updated, %lu bytes in %.1fs (%.1f KB/s), %lu blocks resent", name, (unsigned long)ota.total,
+      ota_seconds(), ota_kbps(), (unsigned long)ota.resent);
+    if(ota.target == OTA_TARGET_MASTER) {
+      ota_restart_at = millis() + OTA_RESTART_MS;
+    }
+    else {
+      ota_slave_boot_at = millis() + OTA_SLAVE_BOOT_MS;
+    }
+  }
+}
+
+// Forward the slave image and restart after updates (from loop()), true once the slave is back after its
+// update, its mode has to be sent again
+bool ota_loop() {
+  if(ota_restart_at != 0 && (long)(millis() - ota_restart_at) >= 0) {
+    LOG_INFO(OTA, "Restarting");
+    ESP.restart();
+  }
+  ota_slave_step(&ota_link, millis());
+  ota_log_state();
+  if(ota_slave_boot_at != 0 && (long)(millis() - ota_slave_boot_at) >= 0) {
+    ota_slave_boot_at = 0;
+    return true;
+  }
+  return false;
+}
+
+// Progress as JSON
+void ota_status(AsyncWebServerRequest* request, int code) {
+  const char* states[] = {"idle", "receiving", "finishing", "done", "failed"};
+  const char* targets[] = {"none", "master", "slave"};
+  char number[16];
+  char buffer[256];
+  JsonWriter json;
+  json_begin(&json, buffer, sizeof(buffer));
+  json_string(&json, "target", targets[ota.target]);
+  json_string(&json, "state", states[ota.state]);
+  json_int(&json, "received", ota.received);
+  json_int(&json, "written", ota.written);
+  json_int(&json, "total", ota.total);
+  json_int(&json, "resent", ota.resent);
+  snprintf(number, sizeof(number), "%.1f", ota_seconds());
+  json_string(&json, "seconds", number);
+  snprintf(number, sizeof(number), "%.1f", ota_kbps());
+  json_string(&json, "kbps", number);
+  json_string(&json, "message", ota.message != nullptr ? ota.message : "");
+  const char* text = json_end(&json);
+  request->send(code, "application/json", text != nullptr ? text : "{}");
+}
+
+// Register the update endpoints (from ServerBegin)
+void ota_server_begin(AsyncWebServer* server_pt) {
+  (*server_pt).on("/ota/status", HTTP_GET, [](AsyncWebServerRequest* request) {
+    ota_status(request, 200);
+  });
+  // answered after the last chunk (see ota_upload_code())
+  ArRequestHandlerFunction uploaded = [](AsyncWebServerRequest* request) {
+    ota_status(request, ota_upload_code(request, ota_authorized(request)));
+  };
+  (*server_pt).on("/ota/master", HTTP_POST, uploaded, ota_master_upload);
+  (*server_pt).on("/ota/slave", HTTP_POST, uploaded, ota_slave_upload);
+}
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef ota_protocol_h
+#define ota_protocol_h
+
+#include "stdint.h"
+#include "string.h"
+
+// Slave firmware update over I2C, shared by master and slave (same file in both sketches, keep them equal)
+// The master forwards the image in blocks, one I2C write each, and does not wait for every block: up to
+// OTA_WINDOW blocks are written before it reads the slave status. The slave checks each block (CRC, sequence)
+// in the I2C callback and queues it for flashing; a rejected block is reported in the status and the master
+// goes back to the first block the slave is missing.
+//
+// Messages from the master:
+//   "OTAS"                                  start
+//   "OTAB" sequence(2) length(1) data crc(2) block, CRC over sequence, length and data
+//   "OTAE" size(4)                          all blocks sent (image size in bytes), check, finish and restart
+//   "OTAA"                                  abort
+// Numbers are little endian. While an update is running, reads from the slave return OTA_STATUS_SIZE bytes:
+//   'O' state next_sequence(2) error flashed_blocks(2) 0 0
+
+#define OTA_BLOCK_DATA 112            // block message 121 bytes, within the 128 byte Wire buffers
+#define OTA_BLOCK_HEADER 7            // "OTAB", sequence, length
+#define OTA_BLOCK_SIZE (OTA_BLOCK_HEADER + OTA_BLOCK_DATA + 2)
+#define OTA_WINDOW 8                  // blocks written between status reads
+#define OTA_STATUS_SIZE 8
+
+// Slave states
+#define OTA_IDLE 0
+#define OTA_RECEIVING 1
+#define OTA_FINISHING 2               // all blocks received, writing and checking the image
+#define OTA_DONE 3                    // image accepted, the slave restarts
+#define OTA_FAILED 4
+
+// Errors in the status, cleared once reported
+#define OTA_OK 0
+#define OTA_CRC 1                     // block corrupted
+#define OTA_ORDER 2                   // block is not the next one
+#define OTA_FULL 3                    // flash writer behind, block dropped
+#define OTA_FLASH 4                   // flash write or image check failed
+#define OTA_REPEATED 5                // block accepted before, not an error (ota_check_block() only)
+
+// CRC-16/CCITT-FALSE
+uint16_t ota_crc16(const uint8_t* data, size_t length, uint16_t crc = 0xffff) {
+  for(size_t i=0; i<length; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for(int bit=0; bit<8; bit++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+// Block message for length bytes of data, returns the message length
+size_t ota_block(uint8_t* message, uint16_t sequence, const uint8_t* data, uint8_t length) {
+  memcpy(message, "OTAB", 4);
+  message[4] = sequence & 0xff;
+  message[5] = sequence >> 8;
+  message[6] = length;
+  memcpy(message + OTA_BLOCK_HEADER, data, length);
+  uint16_t crc = ota_crc16(message + 4, 3 + length);
+  message[OTA_BLOCK_HEADER + length] = crc & 0xff;
+  message[OTA_BLOCK_HEADER + length + 1] = crc >> 8;
+  return OTA_BLOCK_HEADER + length + 2;
+}
+
+// Block message of len bytes against the next expected sequence (slave, I2C callback). Returns OTA_OK with the
+// data length in *length for the next block, OTA_REPEATED for a block accepted before (sent again after a
+// rejected one, ignored and not reported), OTA_CRC or OTA_ORDER
+uint8_t ota_check_block(const uint8_t* message, int len, uint16_t next, uint8_t* length) {
+  *length = (len > OTA_BLOCK_HEADER) ? message[6] : 0;
+  if(len != OTA_BLOCK_HEADER + *length + 2 || *length > OTA_BLOCK_DATA) {
+    return OTA_CRC;
+  }
+  uint16_t crc = message[OTA_BLOCK_HEADER + *length] | message[OTA_BLOCK_HEADER + *length + 1] << 8;
+  if(ota_crc16(message + 4, 3 + *length) != crc) {
+    return OTA_CRC;
+  }
+  uint16_t sequence = message[4] | message[5] << 8;
+  if(sequence < next) {
+    return OTA_REPEATED;
+  }
+  return (sequence > next) ? OTA_ORDER : OTA_OK;
+}
+
+#endif
@@ -0,0 +1,330 @@
+#ifndef ota_upload_h
+#define ota_upload_h
+
+#include "stdint.h"
+#include "string.h"
+
+#include "ota_protocol.h"  // Slave update blocks, shared with the slave
+
+// Update logic of the master, without the web server, Update and Wire (ota.h connects them)
+// The upload handlers pass every chunk in. Master chunks go straight to the flash through an OtaFlash, slave
+// chunks into a ring. ota_slave_step() (loop()) forwards the ring to the slave through an OtaLink: whole blocks,
+// up to OTA_WINDOW ahead of the slave status, back to the first block the slave is missing after a rejected block
+// or OTA_RESEND_MS without progress. Ring space is freed as the slave accepts blocks; a chunk that does not fit
+// is not taken and the handler offers it again. Times are passed in (millis()).
+// No Arduino dependencies, also used by misc/benchmark.
+
+#define OTA_TOKEN_HEADER "X-OTA-Token"  // upload token (OTA_TOKEN), checked before anything is written
+#define OTA_RING_SIZE 8192            // slave image between the upload and the slave acknowledgement
+#define OTA_UPLOAD_WAIT_MS 1000       // upload handler waits this long for ring space, then the update fails (it
+                                      // blocks the async_tcp task, whose watchdog fires after 5s)
+#define OTA_POLL_MS 50                // status reads while waiting for the slave
+#define OTA_RESEND_MS 300             // window full without progress, blocks are sent again
+#define OTA_FINISH_MS 15000           // slave image check
+
+#define OTA_TARGET_NONE 0
+#define OTA_TARGET_MASTER 1
+#define OTA_TARGET_SLAVE 2
+
+// Slave chunk results
+#define OTA_CHUNK_TAKEN 0
+#define OTA_CHUNK_FULL 1              // not enough ring space yet, offer the chunk again
+#define OTA_CHUNK_DROPPED 2           // not the upload of the running update, or the update failed
+
+// Update in progress, states as in ota_protocol.h (OTA_IDLE ... OTA_FAILED)
+struct OtaProgress {
+  uint8_t target;
+  volatile uint8_t state;
+  volatile uint32_t received;         // bytes uploaded
+  volatile uint32_t written;          // bytes in flash (master) or accepted by the slave
+  uint32_t total;                     // image size, known at the end of the upload
+  volatile bool upload_done;
+  uint32_t start_ms;
+  uint32_t end_ms;
+  uint32_t resent;                    // blocks sent to the slave again
+  const char* message;
+  const void* owner;                  // upload (web request) that owns the update
+};
+
+// Partition for the master image (Update on the ESP32)
+struct OtaFlash {
+  bool (*begin)();
+  size_t (*write)(const uint8_t* data, size_t length);  // bytes written
+  bool (*end)();                                         // check the image and boot it next time
+  void (*abort)();
+  const char* (*error)();
+};
+
+// I2C to the slave
+struct OtaLink {
+  bool (*write)(const uint8_t* message, size_t length);  // false if not acknowledged
+  bool (*read_status)(uint8_t* status);                  // OTA_STATUS_SIZE bytes, false if the read failed
+};
+
+OtaProgress ota = {OTA_TARGET_NONE, OTA_IDLE, 0, 0, 0, false, 0, 0, 0, "", nullptr};
+uint8_t ota_ring[OTA_RING_SIZE];
+uint16_t ota_sent = 0;                // next block for the slave
+uint16_t ota_acked = 0;               // blocks the slave accepted
+bool ota_slave_started = false;
+uint32_t ota_last_status = 0;
+uint32_t ota_last_progress = 0;
+
+bool ota_running() {
+  return ota.state == OTA_RECEIVING || ota.state == OTA_FINISHING;
+}
+
+void ota_fail(const char* message, uint32_t now_ms) {
+  ota.message = message;
+  ota.end_ms = now_ms;
+  ota.state = OTA_FAILED;
+}
+
+void ota_finished(uint32_t now_ms) {
+  ota.end_ms = now_ms;
+  ota.state = OTA_DONE;
+}
+
+// Upload token against secret in constant time, a missing or empty token never matches
+bool ota_token_valid(const char* token, const char* secret) {
+  if(token == nullptr) {
+    return false;
+  }
+  size_t length = strlen(secret);
+  size_t token_length = strlen(token);
+  uint8_t difference = (token_length != length || length == 0);
+  for(size_t i=0; i<length; i++) {
+    difference |= secret[i] ^ (i < token_length ? token[i] : 0);
+  }
+  return difference == 0;
+}
+
+// New update for target from owner, false if another one is running
+bool ota_start(uint8_t target, const void* owner, uint32_t now_ms) {
+  if(ota_running()) {
+    return false;
+  }
+  ota.target = target;
+  ota.received = 0;
+  ota.written = 0;
+  ota.total = 0;
+  ota.upload_done = false;
+  ota.start_ms = now_ms;
+  ota.end_ms = 0;
+  ota.resent = 0;
+  ota.message = "";
+  ota.owner = owner;
+  ota_sent = 0;
+  ota_acked = 0;
+  ota_slave_started = false;
+  ota.state = OTA_RECEIVING;
+  return true;
+}
+
+// Chunk of the master image at index (upload offset) from owner, written to flash right away
+void ota_master_chunk(const OtaFlash* flash, const void* owner, size_t index, const uint8_t* data, size_t len, bool final,
+  uint32_t now_ms) {
+  if(owner != ota.owner || ota.state != OTA_RECEIVING) {
+    return;
+  }
+  if(index == 0 && !flash->begin()) {
+    ota_fail(flash->error(), now_ms);
+    return;
+  }
+  if(index != ota.received) {
+    flash->abort();
+    ota_fail("upload chunks out of order", now_ms);
+    return;
+  }
+  if(flash->write(data, len) != len) {
+    flash->abort();
+    ota_fail(flash->error(), now_ms);
+    return;
+  }
+  ota.received += len;
+  ota.written += len;
+
+  if(final) {
+    ota.total = ota.received;
+    ota.upload_done = true;
+    if(!flash->end()) {
+      ota_fail(flash->error(), now_ms);
+      return;
+    }
+    ota_finished(now_ms);
+  }
+}
+
+// Chunk of the slave image at index (upload offset) from owner, into the ring for ota_slave_step()
+uint8_t ota_slave_chunk(const void* owner, size_t index, const uint8_t* data, size_t len, bool final, uint32_t now_ms) {
+  if(owner != ota.owner || ota.state != OTA_RECEIVING) {
+    return OTA_CHUNK_DROPPED;
+  }
+  if(len > OTA_RING_SIZE) {
+    ota_fail("upload chunk larger than the ring", now_ms);
+    return OTA_CHUNK_DROPPED;
+  }
+  if(index != ota.received) {
+    ota_fail("upload chunks out of order", now_ms);
+    return OTA_CHUNK_DROPPED;
+  }
+  if(ota.received + len - ota.written > OTA_RING_SIZE) {
+    return OTA_CHUNK_FULL;
+  }
+
+  uint32_t offset = ota.received % OTA_RING_SIZE;
+  size_t first = (len < OTA_RING_SIZE - offset) ? len : OTA_RING_SIZE - offset;
+  memcpy(ota_ring + offset, data, first);
+  memcpy(ota_ring, data + first, len - first);
+  __atomic_store_n(&ota.received, ota.received + len, __ATOMIC_RELEASE);
+
+  if(final) {
+    ota.total = ota.received;
+    __atomic_store_n(&ota.upload_done, true, __ATOMIC_RELEASE);
+  }
+  return OTA_CHUNK_TAKEN;
+}
+
+// Upload of owner closed, an incomplete one ends the update
+void ota_upload_closed(const OtaFlash* flash, const void* owner, uint32_t now_ms) {
+  if(owner != ota.owner) {
+    return;
+  }
+  ota.owner = nullptr;
+  if(ota.state == OTA_RECEIVING && !ota.upload_done) {
+    if(ota.target == OTA_TARGET_MASTER) {
+      flash->abort();
+    }
+    ota_fail("upload interrupted", now_ms);
+  }
+}
+
+// HTTP status for the upload of owner after its last chunk: 403 - wrong token, 409 - another update running,
+// 500 - failed, 200 - master updated or slave image forwarding
+int ota_upload_code(const void* owner, bool authorized) {
+  if(!authorized) {
+    return 403;
+  }
+  if(owner != ota.owner) {
+    return 409;
+  }
+  ota.owner = nullptr;
+  return (ota.state == OTA_FAILED) ? 500 : 200;
+}
+
+// Slave status into status, false if the read failed
+bool ota_read_status(const OtaLink* link, uint8_t* status, uint32_t now_ms) {
+  ota_last_status = now_ms;
+  return link->read_status(status) && status[0] == 'O';
+}
+
+// Write blocks up to the window, then read the status and go back to the first block the slave is missing
+void ota_forward(const OtaLink* link, uint32_t now_ms) {
+  if(!ota_slave_started) {
+    if(!link->write((const uint8_t*)"OTAS", 4)) {
+      ota_fail("slave not responding", now_ms);
+      return;
+    }
+    ota_slave_started = true;
+    ota_last_progress = now_ms;
+  }
+
+  bool upload_done = __atomic_load_n(&ota.upload_done, __ATOMIC_ACQUIRE);
+  uint32_t received = __atomic_load_n(&ota.received, __ATOMIC_ACQUIRE);
+  bool sent = false;
+  while(ota_sent < ota_acked + OTA_WINDOW) {
+    uint32_t begin = (uint32_t)ota_sent * OTA_BLOCK_DATA;
+    uint32_t end = (begin + OTA_BLOCK_DATA < received) ? begin + OTA_BLOCK_DATA : received;
+    // only whole blocks until the upload is complete
+    if(end <= begin || (end - begin < OTA_BLOCK_DATA && !upload_done)) {
+      break;
+    }
+    uint8_t data[OTA_BLOCK_DATA];
+    for(uint32_t i=begin; i<end; i++) {
+      data[i - begin] = ota_ring[i % OTA_RING_SIZE];
+    }
+    uint8_t message[OTA_BLOCK_SIZE];
+    size_t length = ota_block(message, ota_sent, data, end - begin);
+    // not acknowledged on the bus, the status tells where to continue
+    if(!link->write(message, length)) {
+      break;
+    }
+    ota_sent++;
+    sent = true;
+  }
+  if(!sent && now_ms - ota_last_status < OTA_POLL_MS) {
+    return;
+  }
+
+  uint8_t status[OTA_STATUS_SIZE];
+  if(!ota_read_status(link, status, now_ms)) {
+    return;
+  }
+  uint16_t next = status[2] | status[3] << 8;
+  if(status[1] == OTA_FAILED) {
+    ota_fail("slave flash error", now_ms);
+    return;
+  }
+  if(next > ota_acked) {
+    ota_acked = next;
+    ota_last_progress = now_ms;
+  }
+  uint32_t accepted = (uint32_t)ota_acked * OTA_BLOCK_DATA;
+  ota.written = (accepted < received) ? accepted : received;
+
+  // rejected block, or the window stays full without progress
+  if(status[4] != OTA_OK || (ota_sent > ota_acked && now_ms - ota_last_progress > OTA_RESEND_MS)) {
+    ota.resent += ota_sent - ota_acked;
+    ota_sent = ota_acked;
+    ota_last_progress = now_ms;
+  }
+
+  // every block accepted, the slave checks the image and restarts
+  if(upload_done && ota.written >= ota.total && ota_sent == ota_acked) {
+    uint8_t end_command[] = {'O', 'T', 'A', 'E',
+      (uint8_t)(ota.total & 0xff), (uint8_t)(ota.total >> 8), (uint8_t)(ota.total >> 16), (uint8_t)(ota.total >> 24)};
+    if(link->write(end_command, sizeof(end_command))) {
+      ota.state = OTA_FINISHING;
+      ota_last_progress = now_ms;
+    }
+  }
+}
+
+// Wait for the slave image check
+void ota_finish(const OtaLink* link, uint32_t now_ms) {
+  if(now_ms - ota_last_status < OTA_POLL_MS) {
+    return;
+  }
+  uint8_t status[OTA_STATUS_SIZE];
+  if(ota_read_status(link, status, now_ms)) {
+    if(status[1] == OTA_DONE) {
+      ota_finished(now_ms);
+      return;
+    }
+    if(status[1] == OTA_FAILED) {
+      ota_fail("slave image check failed", now_ms);
+      return;
+    }
+  }
+  if(now_ms - ota_last_progress > OTA_FINISH_MS) {
+    ota_fail("slave did not finish", now_ms);
+  }
+}
+
+// Forward the slave image, or tell the slave to drop it after a failure (from loop())
+void ota_slave_step(const OtaLink* link, uint32_t now_ms) {
+  if(ota.target != OTA_TARGET_SLAVE) {
+    return;
+  }
+  if(ota.state == OTA_RECEIVING) {
+    ota_forward(link, now_ms);
+  }
+  else if(ota.state == OTA_FINISHING) {
+    ota_finish(link, now_ms);
+  }
+  else if(ota.state == OTA_FAILED && ota_slave_started) {
+    link->write((const uint8_t*)"OTAA", 4);
+    ota_slave_started = false;
+  }
+}
+
+#endif
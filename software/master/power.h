@@ -0,0 +1,122 @@
+#ifndef power_h
+#define power_h
+
+#include "Arduino.h"
+#include "esp_pm.h"               // Automatic light sleep
+#include "esp_sleep.h"            // GPIO wakeup
+#include "driver/gpio.h"
+#include "i2c_bus.h"              // Backlight through the LCD
+#include "button.h"               // Scanner wakes loop() on button events
+#include "power_model.h"          // Wait schedule, currents, estimate
+#include "logger.h"
+
+// Power manager
+// loop() waits for its next event (knob, button, web request) or its next periodic job instead of spinning.
+// After inactivity the LCD backlight goes off and the CPU drops to POWER_IDLE_MHZ. With POWER_LIGHT_SLEEP
+// the idle task enters automatic light sleep while loop() waits (needs CONFIG_PM_ENABLE and tickless idle),
+// the knob and button pins wake it up. Wi-Fi holds the chip awake while the soft AP needs the radio.
+// Time busy and waiting is counted per mode and frequency, with the typical currents of power_model.h this gives
+// an estimate of the average current per mode on /metrics. The duty cycle and current per mode are predicted
+// by the replay of the wait schedule in misc/benchmark (host_tests power_duty), the gauge cross-checks them.
+
+// 1 - automatic light sleep while waiting. Off: the prebuilt Arduino-ESP32 core is compiled without
+// CONFIG_FREERTOS_USE_TICKLESS_IDLE, esp_pm_configure() refuses light_sleep_enable there, and the soft AP keeps
+// the chip awake anyway. Needs a core built with CONFIG_PM_ENABLE and tickless idle (ESP-IDF component build)
+#define POWER_LIGHT_SLEEP 0
+
+PowerModel power_model[POWER_MODES];
+TaskHandle_t power_loop_task = NULL;
+volatile unsigned long power_last_activity = 0;
+bool power_backlight = true;
+bool power_idle = false;          // CPU at POWER_IDLE_MHZ
+
+// Input happened, wakes loop() (from loop() or the web server task)
+void power_activity() {
+  power_last_activity = millis();
+  if(power_loop_task != NULL) {
+    xTaskNotifyGive(power_loop_task);
+  }
+}
+
+// Wake loop() from an ISR, activity is registered by loop() when it handles the input
+void IRAM_ATTR power_wake_isr() {
+  if(power_loop_task != NULL) {
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(power_loop_task, &woken);
+    if(woken) portYIELD_FROM_ISR();
+  }
+}
+
+// Call from setup() (loop task), pins = knob and button pins that wake from light sleep (low level)
+void power_begin(const uint8_t* pins, int pin_count) {
+  power_loop_task = xTaskGetCurrentTaskHandle();
+  button_wake_task = power_loop_task;
+  power_last_activity = millis();
+
+#if POWER_LIGHT_SLEEP
+  for(int i=0; i<pin_count; i++) {
+    gpio_wakeup_enable((gpio_num_t)pins[i], GPIO_INTR_LOW_LEVEL);
+  }
+  esp_sleep_enable_gpio_wakeup();
+
+  esp_pm_config_t pm_config = {};
+  pm_config.max_freq_mhz = POWER_ACTIVE_MHZ;
+  pm_config.min_freq_mhz = POWER_IDLE_MHZ;
+  pm_config.light_sleep_enable = true;
+  esp_err_t err = esp_pm_configure(&pm_config);
+  if(err != ESP_OK) {
+    LOG_WARN(UI, "Light sleep not available: %s", esp_err_to_name(err));
+  }
+#endif
+}
+
+// Backlight and CPU frequency from the time since the last input (lcd_ptr = &lcd)
+void power_update(MeteredLCD* lcd_ptr) {
+  unsigned long inactive = millis() - power_last_activity;
+
+  bool backlight = inactive < POWER_DIM_MS;
+  if(backlight != power_backlight) {
+    if(backlight) lcd_ptr->backlight();
+    else lcd_ptr->noBacklight();
+    power_backlight = backlight;
+  }
+
+  bool idle = inactive >= POWER_IDLE_MS;
+  if(idle != power_idle) {
+    setCpuFrequencyMhz(idle ? POWER_IDLE_MHZ : POWER_ACTIVE_MHZ);
+    power_idle = idle;
+    LOG_DEBUG(UI, "CPU at %dMHz", idle ? POWER_IDLE_MHZ : POWER_ACTIVE_MHZ);
+  }
+}
+
+// End of loop(): count busy time since loop_start (micros()), then wait up to timeout_ms for an event
+void power_wait(uint8_t mode, unsigned long loop_start, uint32_t timeout_ms) {
+  unsigned long start = micros();
+  ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeout_ms));
+  unsigned long end = micros();
+  power_model_count(&power_model[mode], power_idle, power_backlight, start - loop_start, end - start);
+}
+
+// Estimated average current of mode in mA, 0 if the mode was never used
+float power_estimate(uint8_t mode) {
+  return power_model_current(&power_model[mode]);
+}
+
+// Print duty cycle and estimates in Prometheus text format
+void power_print(Print& output) {
+  const char* mode_names[POWER_MODES] = {"radio", "bluetooth", "settings"};
+  output.println("# HELP power_busy_ratio Fraction of time loop() is running");
+  output.println("# TYPE power_busy_ratio gauge");
+  for(int mode=0; mode<POWER_MODES; mode++) {
+    output.printf("power_busy_ratio{mode=\"%s\"} %.4f\n", mode_names[mode], power_model_busy_ratio(&power_model[mode]));
+  }
+  output.println("# HELP power_estimated_current_ma Estimated average current of the master board");
+  output.println("# TYPE power_estimated_current_ma gauge");
+  for(int mode=0; mode<POWER_MODES; mode++) {
+    output.printf("power_estimated_current_ma{mode=\"%s\"} %.1f\n", mode_names[mode], power_estimate(mode));
+  }
+  output.println("# TYPE power_cpu_mhz gauge");
+  output.printf("power_cpu_mhz %lu\n", (unsigned long)getCpuFrequencyMhz());
+}
+
+#endif
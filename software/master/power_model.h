@@ -0,0 +1,81 @@
+#ifndef power_model_h
+#define power_model_h
+
+#include "stdint.h"
+
+// Power model (see power.h)
+// The wait schedule of loop() and the currents behind the estimate: loop() waits POWER_WAIT_MS for its next
+// event, or 1ms while the tuner is busy or a write is pending (power_wait_ms()); the button scanner runs at
+// 1kHz while a button is touched and at 100Hz after BUTTON_IDLE_SCANS quiet scans. Busy and waiting time is
+// counted per CPU frequency, power_model_current() turns it into an average current. The firmware counts the
+// real times of loop() (the gauge on /metrics), misc/benchmark replays the schedule with the pass times below.
+// No Arduino dependencies, also used by misc/benchmark.
+
+#define POWER_DIM_MS 30000        // backlight off after this long without input
+#define POWER_IDLE_MS 10000       // CPU at POWER_IDLE_MHZ after this long without input
+#define POWER_IDLE_MHZ 80         // lowest frequency Wi-Fi works at
+#define POWER_ACTIVE_MHZ 240
+#define POWER_WAIT_MS 20          // longest wait of loop(), RDS groups come every 88ms, text scrolls every 500ms
+
+// Button scanner rates (button.h)
+#define BUTTON_SCAN_US 1000               // 1kHz
+#define BUTTON_IDLE_SCAN_US 10000         // 100Hz while no button is touched, first change switches to 1kHz
+#define BUTTON_IDLE_SCANS 1000            // scans without any touch before slowing down (1s)
+
+// Typical currents in mA at 3.3V for the estimate
+#define POWER_BUSY_MA_240 45.0f   // CPU running
+#define POWER_BUSY_MA_80 25.0f
+#define POWER_WAIT_MA_240 22.0f   // CPU waiting (idle task), light sleep is not counted
+#define POWER_WAIT_MA_80 13.0f
+#define POWER_WIFI_MA 80.0f       // soft AP, receiver mostly on
+#define POWER_BACKLIGHT_MA 20.0f
+#define POWER_RDA5807M_MA 18.0f
+
+// Typical busy time at POWER_ACTIVE_MHZ for the replay, compare with power_busy_ratio on /metrics
+#define POWER_PASS_US_RADIO 400     // status read (12 bytes at 400kHz), RDS decoding, LCD runs
+#define POWER_PASS_US_BLUETOOTH 800 // slave packet (32 bytes at 400kHz), LCD runs
+#define POWER_PASS_US_SETTINGS 150  // buttons and LCD runs
+#define POWER_SCAN_US 10            // one button scan including the timer task switch
+
+#define POWER_MODES 3             // same modes as LOOP_RADIO/LOOP_BLUETOOTH/LOOP_SETTINGS
+
+struct PowerModel {
+  uint64_t busy_us[2];            // [0] - 240MHz, [1] - idle frequency
+  uint64_t wait_us[2];
+  uint64_t backlight_us;          // time with backlight on
+};
+
+// Longest wait of loop() (busy = tuner busy, write pending, AF check, slave update or I2C work left)
+uint32_t power_wait_ms(bool busy) {
+  return busy ? 1 : POWER_WAIT_MS;
+}
+
+// Count one loop pass: busy_us running, then wait_us waiting (idle = CPU at POWER_IDLE_MHZ)
+void power_model_count(PowerModel* model, bool idle, bool backlight, uint64_t busy_us, uint64_t wait_us) {
+  model->busy_us[idle] += busy_us;
+  model->wait_us[idle] += wait_us;
+  if(backlight) {
+    model->backlight_us += busy_us + wait_us;
+  }
+}
+
+// Fraction of time busy, 0 if nothing was counted
+float power_model_busy_ratio(const PowerModel* model) {
+  uint64_t busy = model->busy_us[0] + model->busy_us[1];
+  uint64_t total = busy + model->wait_us[0] + model->wait_us[1];
+  return (total == 0) ? 0 : (float)((double)busy / total);
+}
+
+// Average current in mA, 0 if nothing was counted
+float power_model_current(const PowerModel* model) {
+  uint64_t total = model->busy_us[0] + model->busy_us[1] + model->wait_us[0] + model->wait_us[1];
+  if(total == 0) {
+    return 0;
+  }
+  float charge = model->busy_us[0] * POWER_BUSY_MA_240 + model->busy_us[1] * POWER_BUSY_MA_80
+               + model->wait_us[0] * POWER_WAIT_MA_240 + model->wait_us[1] * POWER_WAIT_MA_80
+               + model->backlight_us * POWER_BACKLIGHT_MA;
+  return charge / total + POWER_WIFI_MA + POWER_RDA5807M_MA;
+}
+
+#endif
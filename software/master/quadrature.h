@@ -0,0 +1,81 @@
+#ifndef quadrature_h
+#define quadrature_h
+
+#include "stdint.h"
+
+// Quadrature decoding of the knob (see encoder.h)
+// Every transition is looked up in a 16 entry table (previous state, new state) -> -1/0/+1 quarter steps, so
+// contact bounce cancels out and invalid transitions (both pins changed) count as 0. A detent is counted when
+// the knob is back in a detent state after at least half a detent of movement, with acceleration from the time
+// since the last detent in the same direction. No Arduino dependencies, also used by misc/benchmark.
+
+// ESP32 placement attributes (esp_attr.h), nothing on the PC
+#ifndef IRAM_ATTR
+#define IRAM_ATTR
+#endif
+#ifndef DRAM_ATTR
+#define DRAM_ATTR
+#endif
+
+// Pin state = CLK << 1 | DT, clockwise is 11 -> 01 -> 00 -> 10 -> 11
+#define ENCODER_DETENT_STATES 0b1000  // bit n set - state n is a detent position (0b1001 for half step knobs)
+#define ENCODER_QUARTERS 4            // transitions from one detent to the next (2 for half step knobs)
+
+// Acceleration, time between detents -> channel steps
+#define ENCODER_FAST_US 25000         // more than 40 detents/s, 10 channels per detent
+#define ENCODER_MEDIUM_US 60000       // more than ~17 detents/s, 5 channels per detent
+
+// Quarter steps, index = previous state << 2 | new state (in DRAM, used from the ISR)
+DRAM_ATTR const int8_t encoder_table[16] = {
+  // new:  00  01  10  11        previous:
+            0, -1, +1,  0,    // 00
+           +1,  0,  0, -1,    // 01
+           -1,  0,  0, +1,    // 10
+            0, +1, -1,  0,    // 11
+};
+
+struct Quadrature {
+  uint8_t state;                // last pin state
+  int8_t quarters;              // quarter steps since the last detent
+  int8_t last_direction;
+  uint32_t last_detent;         // us of last detent
+};
+
+void quadrature_begin(Quadrature* knob, uint8_t state) {
+  knob->state = state;
+  knob->quarters = 0;
+  knob->last_direction = 0;
+  knob->last_detent = 0;
+}
+
+// New pin state at now_us (from the ISR). Returns the channel steps of a detent, signed (+ clockwise), 1, 5 or
+// 10 with acceleration; 0 if no detent was completed
+int32_t IRAM_ATTR quadrature_update(Quadrature* knob, uint8_t state, uint32_t now_us) {
+  if(state == knob->state) {
+    return 0;
+  }
+  knob->quarters += encoder_table[knob->state << 2 | state];
+  knob->state = state;
+
+  if(((ENCODER_DETENT_STATES >> state) & 1) == 0) {
+    return 0;
+  }
+  int8_t direction = 0;
+  if(knob->quarters >= ENCODER_QUARTERS / 2) direction = 1;
+  else if(knob->quarters <= -ENCODER_QUARTERS / 2) direction = -1;
+  knob->quarters = 0;
+  if(direction == 0) {
+    return 0;
+  }
+
+  int32_t step = 1;
+  if(direction == knob->last_direction) {
+    if(now_us - knob->last_detent < ENCODER_FAST_US) step = 10;
+    else if(now_us - knob->last_detent < ENCODER_MEDIUM_US) step = 5;
+  }
+  knob->last_direction = direction;
+  knob->last_detent = now_us;
+  return direction * step;
+}
+
+#endif
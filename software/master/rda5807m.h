@@ -0,0 +1,208 @@
+#ifndef rda5807m_h
+#define rda5807m_h
+
+#include "stdint.h"
+
+#include "constants.h"
+
+// RDA5807M register values
+// Only computes register bytes, the I2C writes stay in main_functions.h (no Arduino dependencies, also used by
+// misc/benchmark). Registers are described as typed fields, register values are built from fields at compile
+// time and a field change is one masked update. A field only fits the register type it belongs to.
+
+// Field of register REG: OFFSET = lowest bit, WIDTH bits
+template<uint8_t REG, uint8_t OFFSET, uint8_t WIDTH>
+struct RdaField {
+  static_assert(OFFSET + WIDTH <= 16, "field outside the 16-bit register");
+  static constexpr uint16_t mask() {
+    return ((1u << WIDTH) - 1) << OFFSET;
+  }
+};
+
+// Value of register REG
+template<uint8_t REG>
+struct RdaRegister {
+  uint16_t word;
+
+  // Same register with field set to value (bits above the field width are dropped)
+  template<uint8_t OFFSET, uint8_t WIDTH>
+  constexpr RdaRegister with(RdaField<REG, OFFSET, WIDTH> field, uint16_t value) const {
+    return RdaRegister{(uint16_t)((word & ~decltype(field)::mask()) | ((value << OFFSET) & decltype(field)::mask()))};
+  }
+  template<uint8_t OFFSET, uint8_t WIDTH>
+  constexpr uint16_t get(RdaField<REG, OFFSET, WIDTH> field) const {
+    return (word & decltype(field)::mask()) >> OFFSET;
+  }
+  constexpr uint8_t high() const {
+    return word >> 8;
+  }
+  constexpr uint8_t low() const {
+    return word & 0xff;
+  }
+};
+
+// Register 0x02
+constexpr RdaField<0x02, 15, 1> RDA_DHIZ{};                 // audio output high-z disable, 1: normal operation
+constexpr RdaField<0x02, 14, 1> RDA_DMUTE{};                // mute disable, 0: mute
+constexpr RdaField<0x02, 13, 1> RDA_MONO{};                 // mono select, 0: stereo
+constexpr RdaField<0x02, 12, 1> RDA_BASS{};                 // bass boost
+constexpr RdaField<0x02, 11, 1> RDA_RCLK_NON_CALIBRATE{};   // 0: RCLK is always supplied
+constexpr RdaField<0x02, 10, 1> RDA_RCLK_DIRECT_INPUT{};    // 0: RCLK is not in direct input mode
+constexpr RdaField<0x02, 9, 1> RDA_SEEKUP{};                // 0: seek down, 1: seek up
+constexpr RdaField<0x02, 8, 1> RDA_SEEK{};                  // start seek (when seek operation completes, SEEK->0, STC->1)
+constexpr RdaField<0x02, 7, 1> RDA_SKMODE{};                // 0: wrap at upper or lower band limit and continue seeking
+constexpr RdaField<0x02, 4, 3> RDA_CLK_MODE{};              // 000: 32.768kHz clock rate (watch crystal on the module)
+constexpr RdaField<0x02, 3, 1> RDA_RDS_EN{};                // radio data system enable
+constexpr RdaField<0x02, 2, 1> RDA_NEW_METHOD{};            // new demodulate method for improved sensitivity
+constexpr RdaField<0x02, 1, 1> RDA_SOFT_RESET{};            // perform a reset
+constexpr RdaField<0x02, 0, 1> RDA_ENABLE{};                // power up enable
+
+// Register 0x03
+constexpr RdaField<0x03, 6, 10> RDA_CHAN{};                 // channel, frequency = 87MHz + CHAN * spacing
+constexpr RdaField<0x03, 5, 1> RDA_DIRECT_MODE{};           // used only when testing
+constexpr RdaField<0x03, 4, 1> RDA_TUNE{};                  // tune to CHAN
+constexpr RdaField<0x03, 2, 2> RDA_BAND{};                  // 00: 87-108MHz (US/Europe)
+constexpr RdaField<0x03, 0, 2> RDA_SPACE{};                 // 00: spacing of 0.1MHz
+
+// Register 0x04
+constexpr RdaField<0x04, 14, 1> RDA_STCIEN{};               // seek/tune complete interrupt
+constexpr RdaField<0x04, 13, 1> RDA_RBDS{};                 // 0: RDS mode only (RBDS only used in US)
+constexpr RdaField<0x04, 12, 1> RDA_RDS_FIFO_EN{};          // RDS fifo mode
+constexpr RdaField<0x04, 11, 1> RDA_DE{};                   // de-emphasis, 1: 50us (Americas and South Korea use 75us)
+constexpr RdaField<0x04, 10, 1> RDA_RDS_FIFO_CLR{};         // clear RDS fifo
+constexpr RdaField<0x04, 9, 1> RDA_SOFTMUTE_EN{};           // gradual reduce of audio volume when signal quality drops
+constexpr RdaField<0x04, 8, 1> RDA_AFCD{};                  // automatic frequency control disable
+constexpr RdaField<0x04, 6, 1> RDA_I2S_ENABLE{};            // I2S audio output
+constexpr RdaField<0x04, 0, 6> RDA_GPIO{};                  // general purpose I/O
+
+// Register 0x05
+constexpr RdaField<0x05, 15, 1> RDA_INT_MODE{};             // 1: interrupt lasts until register 0x0C is read
+constexpr RdaField<0x05, 13, 2> RDA_SEEK_MODE{};            // 00: default, 10: RSSI seek mode (older)
+constexpr RdaField<0x05, 8, 4> RDA_SEEKTH{};                // seek SNR threshold, 1000: datasheet default
+constexpr RdaField<0x05, 6, 2> RDA_LNA_PORT_SEL{};          // LNA input port, 10: LNAP
+constexpr RdaField<0x05, 4, 2> RDA_LNA_ICSEL{};             // LNA working current, 00: 1.8mA (default) - 11: 3.0mA
+constexpr RdaField<0x05, 0, 4> RDA_VOLUME{};                // 0000: mute - 1111: max, logarithmic
+
+// Register 0x06
+constexpr RdaField<0x06, 13, 2> RDA_OPEN_MODE{};            // open reserved registers mode
+constexpr RdaField<0x06, 12, 1> RDA_SLAVE_MASTER{};         // I2S role, 0: master, 1: slave
+constexpr RdaField<0x06, 11, 1> RDA_WS_LR{};                // audio channel indication for I2S
+constexpr RdaField<0x06, 10, 1> RDA_SCLK_I_EDGE{};
+constexpr RdaField<0x06, 9, 1> RDA_DATA_SIGNED{};           // 1: signed 16-bit audio data, 0: unsigned
+constexpr RdaField<0x06, 8, 1> RDA_WS_I_EDGE{};
+constexpr RdaField<0x06, 4, 4> RDA_I2S_SW_CNT{};            // I2S sample rate (master mode only), 0111: 44.1kHz
+constexpr RdaField<0x06, 3, 1> RDA_SW_O_EDGE{};
+constexpr RdaField<0x06, 2, 1> RDA_SCLK_O_EDGE{};
+constexpr RdaField<0x06, 1, 1> RDA_L_DELY{};
+constexpr RdaField<0x06, 0, 1> RDA_R_DELY{};
+
+// Register 0x07
+constexpr RdaField<0x07, 10, 5> RDA_TH_SOFRBLEND{};         // threshold for noise soft blend, 10000: default
+constexpr RdaField<0x07, 9, 1> RDA_MODE_65M_50M{};          // 1: default
+constexpr RdaField<0x07, 2, 6> RDA_SEEK_TH_OLD{};           // seek threshold for old seek mode
+constexpr RdaField<0x07, 1, 1> RDA_SOFTBLEND_EN{};          // soft blend enable
+constexpr RdaField<0x07, 0, 1> RDA_FREQ_MODE{};             // 1: frequency set by register 0x08, 0: by CHAN
+
+// Register 0x08
+constexpr RdaField<0x08, 0, 16> RDA_FREQ_DIRECT{};          // frequency above 87MHz in kHz (FREQ_MODE 1)
+
+// Initialization (init_config[], registers 0x02-0x07): RDS on, soft reset, channel 0 not tuned
+constexpr RdaRegister<0x02> RDA_INIT_02 = RdaRegister<0x02>{0}
+  .with(RDA_DHIZ, 1).with(RDA_RDS_EN, 1).with(RDA_SOFT_RESET, 1).with(RDA_ENABLE, 1);
+constexpr RdaRegister<0x03> RDA_INIT_03 = RdaRegister<0x03>{0};
+// 50us de-emphasis, soft mute, I2S output when radio audio goes through the slave
+constexpr RdaRegister<0x04> RDA_INIT_04 = RdaRegister<0x04>{0}
+  .with(RDA_DE, 1).with(RDA_RDS_FIFO_CLR, 1).with(RDA_SOFTMUTE_EN, 1).with(RDA_I2S_ENABLE, I2S_AUDIO_PATH);
+// replaced by RDA_VOLUME_05 with the first change_vol() in setup()
+constexpr RdaRegister<0x05> RDA_INIT_05 = RdaRegister<0x05>{0}
+  .with(RDA_INT_MODE, 1).with(RDA_SEEKTH, 0b0010).with(RDA_LNA_PORT_SEL, 0b10).with(RDA_LNA_ICSEL, 0b11)
+  .with(RDA_VOLUME, 0b0111);
+// signed 16-bit I2S at 44.1kHz (same rate as A2DP) when radio audio goes through the slave
+constexpr RdaRegister<0x06> RDA_INIT_06 = RdaRegister<0x06>{0}
+  .with(RDA_SLAVE_MASTER, RDA_I2S_SLAVE).with(RDA_DATA_SIGNED, I2S_AUDIO_PATH)
+  .with(RDA_I2S_SW_CNT, I2S_AUDIO_PATH ? 0b0111 : 0b0000);
+constexpr RdaRegister<0x07> RDA_INIT_07 = RdaRegister<0x07>{0}
+  .with(RDA_TH_SOFRBLEND, 0b10000).with(RDA_MODE_65M_50M, 1).with(RDA_SOFTBLEND_EN, 1)
+  .with(RDA_FREQ_MODE, TUNE_DIRECT_MODE);
+
+// Tuning (tune_config[], registers 0x02-0x03): muted until the tune completes, CHAN set before writing
+constexpr RdaRegister<0x02> RDA_TUNE_02 = RDA_INIT_02.with(RDA_SOFT_RESET, 0);
+constexpr RdaRegister<0x03> RDA_TUNE_03 = RDA_INIT_03.with(RDA_TUNE, 1);
+
+// Register 0x05 as change_vol() writes it: seek threshold and LNA current at the datasheet defaults
+constexpr RdaRegister<0x05> RDA_VOLUME_05 = RDA_INIT_05.with(RDA_SEEKTH, 0b1000).with(RDA_LNA_ICSEL, 0b00);
+
+// Register bytes against literal bit patterns from the datasheet register map (bit 15 first), one set per
+// configuration, so a wrong field offset or width cannot cancel out
+static_assert(RDA_INIT_02.high() == 0b10000000 && RDA_INIT_02.low() == 0b00001011, "register 0x02 init");
+static_assert(RDA_INIT_03.high() == 0b00000000 && RDA_INIT_03.low() == 0b00000000, "register 0x03 init");
+static_assert(RDA_INIT_05.high() == 0b10000010 && RDA_INIT_05.low() == 0b10110111, "register 0x05 init");
+static_assert(RDA_TUNE_02.high() == 0b10000000 && RDA_TUNE_02.low() == 0b00001001, "register 0x02 tune");
+static_assert(RDA_TUNE_03.high() == 0b00000000 && RDA_TUNE_03.low() == 0b00010000, "register 0x03 tune");
+#if I2S_AUDIO_PATH
+static_assert(RDA_INIT_04.high() == 0b00001110 && RDA_INIT_04.low() == 0b01000000, "register 0x04 init");
+#if RDA_I2S_SLAVE
+static_assert(RDA_INIT_06.high() == 0b00010010 && RDA_INIT_06.low() == 0b01110000, "register 0x06 init");
+#else
+static_assert(RDA_INIT_06.high() == 0b00000010 && RDA_INIT_06.low() == 0b01110000, "register 0x06 init");
+#endif
+#else
+static_assert(RDA_INIT_04.high() == 0b00001110 && RDA_INIT_04.low() == 0b00000000, "register 0x04 init");
+#if RDA_I2S_SLAVE
+static_assert(RDA_INIT_06.high() == 0b00010000 && RDA_INIT_06.low() == 0b00000000, "register 0x06 init");
+#else
+static_assert(RDA_INIT_06.high() == 0b00000000 && RDA_INIT_06.low() == 0b00000000, "register 0x06 init");
+#endif
+#endif
+#if TUNE_DIRECT_MODE
+static_assert(RDA_INIT_07.high() == 0b01000010 && RDA_INIT_07.low() == 0b00000011, "register 0x07 init");
+#else
+static_assert(RDA_INIT_07.high() == 0b01000010 && RDA_INIT_07.low() == 0b00000010, "register 0x07 init");
+#endif
+
+// Register REG in arr, a register array written from register 0x02 (init_config[], tune_config[])
+template<uint8_t REG>
+RdaRegister<REG> rda_register(const uint8_t* arr) {
+  static_assert(REG >= 0x02, "register arrays start at register 0x02");
+  return RdaRegister<REG>{(uint16_t)(arr[2*(REG - 0x02)] << 8 | arr[2*(REG - 0x02) + 1])};
+}
+
+// Set field in the register array arr to value
+template<uint8_t REG, uint8_t OFFSET, uint8_t WIDTH>
+void rda_set(uint8_t* arr, RdaField<REG, OFFSET, WIDTH> field, uint16_t value) {
+  RdaRegister<REG> reg = rda_register<REG>(arr).with(field, value);
+  arr[2*(REG - 0x02)] = reg.high();
+  arr[2*(REG - 0x02) + 1] = reg.low();
+}
+
+// Field of the register array arr
+template<uint8_t REG, uint8_t OFFSET, uint8_t WIDTH>
+uint16_t rda_get(const uint8_t* arr, RdaField<REG, OFFSET, WIDTH> field) {
+  return rda_register<REG>(arr).get(field);
+}
+
+// Register 0x03 in arr (tune_config[]) for frequency, tune, band and spacing are kept
+void freq_register(uint8_t* arr, int frequency) {
+  rda_set(arr, RDA_CHAN, frequency - FREQ_MIN);
+}
+
+// Register 0x08 in direct frequency mode
+constexpr RdaRegister<0x08> direct_freq_register(int frequency) {
+  return RdaRegister<0x08>{0}.with(RDA_FREQ_DIRECT, (frequency - FREQ_MIN) * 100);
+}
+
+// Register 0x05 for volume
+constexpr RdaRegister<0x05> volume_register(uint8_t volume) {
+  return RDA_VOLUME_05.with(RDA_VOLUME, volume);
+}
+
+// Volume 9: INT_MODE 1, SEEKTH 1000, LNA_PORT_SEL 10, VOLUME 1001
+static_assert(volume_register(9).high() == 0b10001000 && volume_register(9).low() == 0b10001001, "register 0x05 volume");
+// 95.0MHz: CHAN = 80 = 0b0001010000 in bits 15-6, TUNE in bit 4
+static_assert(RDA_TUNE_03.with(RDA_CHAN, 950 - FREQ_MIN).high() == 0b00010100
+              && RDA_TUNE_03.with(RDA_CHAN, 950 - FREQ_MIN).low() == 0b00010000, "register 0x03 channel");
+// 95.0MHz direct: 8000kHz above 87MHz = 0x1f40
+static_assert(direct_freq_register(950).high() == 0b00011111 && direct_freq_register(950).low() == 0b01000000,
+              "register 0x08 frequency");
+
+#endif
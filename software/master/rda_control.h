@@ -0,0 +1,118 @@
+#ifndef rda_control_h
+#define rda_control_h
+
+#include "stdint.h"
+#include "stddef.h"
+
+#include "constants.h"
+#include "rda5807m.h"             // Register values
+
+// RDA5807M control writes, without Wire and the log (main_functions.h connects them)
+// Volume changes only write register 0x05 through random access (RDA5807M_RANDOM_ADDRESS), and register 0x02
+// only when DMUTE changes: registers 0x03 (TUNE) and 0x04 (RDS_FIFO_CLR) are not touched, so the chip does
+// not retune (STC stays set) and keeps its RDS FIFO. Knob detents mark the volume pending, volume_due() lets
+// one write through per VOLUME_FRAME however fast the knob turns.
+// Tuning requests (knob detents, buttons, web) only mark the frequency pending, loop() tunes the latest one
+// once the chip reports STC, so a fast spin costs one tune per STC however many detents it has. A tune writes
+// register 0x03 (and 0x08 in direct mode) only. Requests and tunes are counted per sweep, a run of requests
+// less than TUNE_SWEEP_GAP ms apart. Times are passed in (millis()).
+// No Arduino dependencies, also used by misc/benchmark.
+
+#define TUNE_SWEEP_GAP 500
+
+// I2C to the RDA5807M
+struct RdaBus {
+  uint8_t (*write)(uint8_t address, const uint8_t* data, size_t len);  // endTransmission status (0 = success)
+};
+
+// Tuning requests and tunes written, counted and closed in loop() only
+struct TuneCounters {
+  uint32_t requests;
+  uint32_t tunes;
+  uint32_t sweeps;
+  uint32_t sweep_requests;      // current sweep
+  uint32_t sweep_tunes;
+  uint32_t last_sweep_requests; // last finished sweep
+  uint32_t last_sweep_tunes;
+  uint32_t last_request;        // millis()
+};
+
+TuneCounters tune_counters;
+
+// Volume changed by the knob, written once per frame
+struct VolumeFrame {
+  bool pending;
+  uint32_t last_write;
+};
+
+// Write one register through random access mode (reg = register address, high/low = register bytes)
+uint8_t rda_write_register(const RdaBus* bus, uint8_t reg, uint8_t high, uint8_t low) {
+  const uint8_t reg_config[] = {reg, high, low};
+  return bus->write(RDA5807M_RANDOM_ADDRESS, reg_config, 3);
+}
+
+// Frequency moved by steps channels, wrapping around the band
+int step_freq(int frequency, int steps) {
+  int channels = FREQ_MAX - FREQ_MIN + 1;
+  int channel = ((frequency - FREQ_MIN + steps) % channels + channels) % channels;
+  return channel + FREQ_MIN;
+}
+
+// Finish the current sweep if no request came for TUNE_SWEEP_GAP (from loop())
+void tune_sweep_close(uint32_t now_ms) {
+  TuneCounters* counters = &tune_counters;
+  if(counters->sweep_requests > 0 && now_ms - counters->last_request > TUNE_SWEEP_GAP) {
+    counters->last_sweep_requests = counters->sweep_requests;
+    counters->last_sweep_tunes = counters->sweep_tunes;
+    counters->sweeps++;
+    counters->sweep_requests = 0;
+    counters->sweep_tunes = 0;
+  }
+}
+
+// Request tuning to the current frequency (pending=&tune_pending), merged with requests not tuned yet
+void tune_request(bool* pending, uint32_t now_ms) {
+  tune_sweep_close(now_ms);
+  *pending = true;
+  tune_counters.requests++;
+  tune_counters.sweep_requests++;
+  tune_counters.last_request = now_ms;
+}
+
+// Tune registers for frequency (arr=tune_config[], FREQ_MIN-FREQ_MAX), register 0x02 (mute, seek) is kept
+void rda_tune(const RdaBus* bus, uint8_t* arr, int frequency) {
+  freq_register(arr, frequency);
+#if TUNE_DIRECT_MODE
+  // direct frequency mode, register 0x08 = frequency above 87MHz in kHz
+  RdaRegister<0x08> direct_config = direct_freq_register(frequency);
+  rda_write_register(bus, 0x08, direct_config.high(), direct_config.low());
+#endif
+  rda_write_register(bus, 0x03, arr[2], arr[3]);
+  tune_counters.tunes++;
+  tune_counters.sweep_tunes++;
+}
+
+// Volume registers (arr=tune_config[]), DMUTE follows volume 0
+void rda_volume(const RdaBus* bus, uint8_t* arr, uint8_t volume) {
+  bool unmuted = volume != 0;
+  if(rda_get(arr, RDA_DMUTE) != unmuted) {
+    rda_set(arr, RDA_DMUTE, unmuted);
+    rda_write_register(bus, 0x02, arr[0], arr[1]);
+  }
+
+  // register 0x05, only VOLUME changes
+  RdaRegister<0x05> volume_config = volume_register(volume);
+  rda_write_register(bus, 0x05, volume_config.high(), volume_config.low());
+}
+
+// Pending volume due for its write (from loop()), true once per VOLUME_FRAME
+bool volume_due(VolumeFrame* frame, uint32_t now_ms) {
+  if(!frame->pending || now_ms - frame->last_write < VOLUME_FRAME) {
+    return false;
+  }
+  frame->pending = false;
+  frame->last_write = now_ms;
+  return true;
+}
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef rds_capture_h
+#define rds_capture_h
+
+#include "Arduino.h"
+#include "ESPAsyncWebServer.h"
+
+#include "constants.h"
+
+// RDS group capture
+// Every RDS group loop() reads is kept in a RAM ring of 8 byte records, always on. The ring can be downloaded
+// from /rds.bin and is streamed live over the /rds/ws WebSocket to the inspector page (/rds).
+// Capturing is a few compares and 4 stores per group, streaming only runs while a client is connected.
+//
+// Records are 4 little endian 16-bit words:
+//   group:  [0] bit15 = 0, bits 14-13 BLERA, bits 12-11 BLERB, bits 10-0 ms since the previous record
+//           [1] block B, [2] block C, [3] block D
+//   marker: [0] bit15 = 1, bits 14-0 channel (frequency - FREQ_MIN in 100kHz)
+//           [1] PI (block A), [2] millis() low word, [3] millis() high word
+// Block A is only stored in markers. A marker is written when the channel or PI changes, when the delta does
+// not fit in 11 bits, and at least every RDS_MARKER_GROUPS groups; downloads and streams start at a marker.
+
+#define RDS_CAPTURE_RECORDS 1024      // 8KB, more than a minute of a station sending groups continuously
+#define RDS_MARKER_GROUPS 64          // groups between markers at most
+#define RDS_DUPLICATE_MS 60           // same group again within this time is a second read (RDSR stays set), groups are 87.6ms apart
+#define RDS_STREAM_MS 250             // live stream period
+#define RDS_STREAM_RECORDS 128        // records per WebSocket message at most
+#define RDS_MARKER 0x8000
+#define RDS_DELTA_MAX 0x7ff
+
+struct RdsRecord {
+  uint16_t words[4];
+};
+
+RdsRecord rds_ring[RDS_CAPTURE_RECORDS];
+volatile uint32_t rds_head = 0;       // records written since boot
+uint16_t rds_last_group[4];           // blocks A-D of the last group
+uint32_t rds_last_ms = 0;             // millis() of the last record
+uint16_t rds_last_channel = 0xffff;
+uint16_t rds_since_marker = 0;
+volatile bool rds_force_marker = false; // new stream client, next group starts with a marker
+uint32_t rds_streamed = 0;            // records sent to the stream
+unsigned long rds_last_stream = 0;
+
+AsyncWebSocket rds_socket("/rds/ws");
+
+void rds_push(uint16_t word0, uint16_t word1, uint16_t word2, uint16_t word3) {
+  RdsRecord* record = &rds_ring[rds_head % RDS_CAPTURE_RECORDS];
+  record->words[0] = word0;
+  record->words[1] = word1;
+  record->words[2] = word2;
+  record->words[3] = word3;
+  __atomic_store_n(&rds_head, rds_head + 1, __ATOMIC_RELEASE);
+}
+
+// Capture the group in arr (requested_data) if RDSR is set, frequency = curr_freq
+void rds_capture(const uint8_t* arr, int frequency) {
+  if((arr[0] & 0b10000000) == 0) {
+    return;
+  }
+  uint16_t group[4] = {
+    (uint16_t)(arr[4] << 8 | arr[5]), (uint16_t)(arr[6] << 8 | arr[7]),
+    (uint16_t)(arr[8] << 8 | arr[9]), (uint16_t)(arr[10] << 8 | arr[11])
+  };
+  uint32_t now = millis();
+  if(now - rds_last_ms < RDS_DUPLICATE_MS && memcmp(group, rds_last_group, sizeof(group)) == 0) {
+    return;
+  }
+
+  uint16_t channel = frequency - FREQ_MIN;
+  uint32_t delta = now - rds_last_ms;
+  if(channel != rds_last_channel || group[0] != rds_last_group[0] || delta > RDS_DELTA_MAX
+     || rds_since_marker >= RDS_MARKER_GROUPS || rds_force_marker) {
+    rds_push(RDS_MARKER | channel, group[0], now & 0xffff, now >> 16);
+    rds_last_channel = channel;
+    rds_since_marker = 0;
+    rds_force_marker = false;
+    delta = 0;
+  }
+  // register 0x0B low bits: BLERA (3-2), BLERB (1-0)
+  uint16_t errors = arr[3] & 0b1111;
+  rds_push(errors << 11 | delta, group[1], group[2], group[3]);
+
+  memcpy(rds_last_group, group, sizeof(group));
+  rds_last_ms = now;
+  rds_since_marker++;
+}
+
+// First marker at or after record index from (records before it cannot be decoded)
+uint32_t rds_find_marker(uint32_t from, uint32_t end) {
+  while(from < end && (rds_ring[from % RDS_CAPTURE_RECORDS].words[0] & RDS_MARKER) == 0) {
+    from++;
+  }
+  return from;
+}
+
+// Copy records [first, end) into buffer (up to size bytes), returns bytes copied, 0 if the capture has
+// overwritten them in the meantime
+size_t rds_copy(uint8_t* buffer, size_t size, uint32_t first, uint32_t end) {
+  uint32_t count = min((uint32_t)(size / sizeof(RdsRecord)), end - first);
+  for(uint32_t i=0; i<count; i++) {
+    memcpy(buffer + i * sizeof(RdsRecord), &rds_ring[(first + i) % RDS_CAPTURE_RECORDS], sizeof(RdsRecord));
+  }
+  // the writer reached the first record while copying (its slot is written next), the copy is not valid
+  uint32_t head = __atomic_load_n(&rds_head, __ATOMIC_ACQUIRE);
+  if(head - first >= RDS_CAPTURE_RECORDS) {
+    return 0;
+  }
+  return count * sizeof(RdsRecord);
+}
+
+// Binary download of the ring, from the oldest marker to the newest record
+void rds_download(AsyncWebServerRequest* request) {
+  uint32_t end = __atomic_load_n(&rds_head, __ATOMIC_ACQUIRE);
+  uint32_t start = (end > RDS_CAPTURE_RECORDS) ? end - RDS_CAPTURE_RECORDS : 0;
+  start = rds_find_marker(start, end);
+  AsyncWebServerResponse* response = request->beginChunkedResponse("application/octet-stream",
+    [start, end](uint8_t* buffer, size_t max_length, size_t index) -> size_t {
+      uint32_t first = start + index / sizeof(RdsRecord);
+      if(first >= end) {
+        return 0;
+      }
+      return rds_copy(buffer, max_length, first, end);
+    });
+  response->addHeader("Content-Disposition", "attachment; filename=rds.bin");
+  request->send(response);
+}
+
+// Register /rds.bin and the live stream (from ServerBegin)
+void rds_server_begin(AsyncWebServer* server_pt) {
+  (*server_pt).on("/rds.bin", HTTP_GET, rds_download);
+  rds_socket.onEvent([](AsyncWebSocket* socket, AsyncWebSocketClient* client, AwsEventType type, void* arg, uint8_t* data, size_t len) {
+    if(type == WS_EVT_CONNECT) {
+      rds_force_marker = true;
+    }
+  });
+  (*server_pt).addHandler(&rds_socket);
+}
+
+// Send new records to stream clients every RDS_STREAM_MS (from loop())
+void rds_stream() {
+  if(millis() - rds_last_stream < RDS_STREAM_MS) {
+    return;
+  }
+  rds_last_stream = millis();
+  rds_socket.cleanupClients();
+
+  uint32_t head = __atomic_load_n(&rds_head, __ATOMIC_ACQUIRE);
+  if(rds_socket.count() == 0 || head - rds_streamed > RDS_CAPTURE_RECORDS) {
+    rds_streamed = head;
+    return;
+  }
+  if(head == rds_streamed || !rds_socket.availableForWriteAll()) {
+    return;
+  }
+  uint32_t end = min(head, rds_streamed + RDS_STREAM_RECORDS);
+  static uint8_t message[RDS_STREAM_RECORDS * sizeof(RdsRecord)];
+  size_t length = rds_copy(message, sizeof(message), rds_streamed, end);
+  if(length > 0) {
+    rds_socket.binaryAll(message, length);
+  }
+  rds_streamed = end;
+}
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef rds_decoder_h
+#define rds_decoder_h
+
+#include "stdint.h"
+
+// RDS decoding shared by the firmware and the host tools (misc/RDS/rds_analyzer.cpp), no Arduino headers.
+// Groups are passed in the layout of requested_data (registers from 0x0A): blocks A-D are bytes 4-11,
+// block B high byte is byte 6.
+
+// Group type code (0-15) and version (true - A, false - B) from block B (arr=requested_data)
+uint8_t rds_group_type(const uint8_t* arr) {
+  return arr[6] >> 4;
+}
+bool rds_group_version(const uint8_t* arr) {
+  return (arr[6] & 0b1000) == 0b0;
+}
+
+// Programme identification (block A) and traffic programme flag (block B bit 10)
+uint16_t rds_pi(const uint8_t* arr) {
+  return arr[4] << 8 | arr[5];
+}
+bool rds_tp(const uint8_t* arr) {
+  return (arr[6] & 0b100) != 0;
+}
+
+// Traffic announcement flag (block B bit 4), only groups 0A, 0B and 15B carry it
+bool rds_carries_ta(const uint8_t* arr) {
+  return rds_group_type(arr) == 0 || (rds_group_type(arr) == 15 && !rds_group_version(arr));
+}
+bool rds_ta(const uint8_t* arr) {
+  return (arr[7] & 0b10000) != 0;
+}
+
+// Enhanced other networks, group 14: PI of the other network (block D), variant of 14A (block B bits 3-0),
+// TA of the other network (14B block B bit 3, 14A variant 13 block C bit 0)
+uint16_t rds_eon_pi(const uint8_t* arr) {
+  return arr[10] << 8 | arr[11];
+}
+uint8_t rds_eon_variant(const uint8_t* arr) {
+  return arr[7] & 0b1111;
+}
+bool rds_eon_ta(const uint8_t* arr) {
+  if(rds_group_version(arr)) {
+    return rds_eon_variant(arr) == 13 && (arr[9] & 0b1) != 0;
+  }
+  return (arr[7] & 0b1000) != 0;
+}
+
+// clear RDS radiotext, default char is space (arr_A=radiotext_A, arr_B=radiotext_B)
+void clear_radiotext(char* arr_A, char* arr_B, char version = ' ') {
+  // version A
+  if(version != 'B') {
+    for(int i=0; i<64; i++) {
+      arr_A[i] = ' ';
+    }
+  }
+  // version B
+  if(version != 'A') {
+    for(int i=0; i<32; i++) {
+      arr_B[i] = ' ';
+    }
+  }
+}
+
+// void radiotext byte to char
+char rds_byte_to_char(uint8_t input) {
+  char output;
+  if(input == 0x0d) {
+    output = '\n';
+  }
+  else if ((input >= 0x20) && (input <= 0x7e)) {
+    output = (char)input;
+  }
+  else {
+    output = ' ';
+  }
+  return output;
+}
+
+// decode and update RDS radiotext from read data of RDA5807 (arr=requested_data, arr_A=radiotext_A, arr_B=radiotext_B)
+void update_radiotext(const uint8_t* arr, char* arr_A, char* arr_B, bool version) {
+  uint8_t segment_address = arr[7] & 0b1111;
+
+  // version A radiotext
+  if(version == true) {
+    for(int i=0; i<4; i++) {
+      arr_A[segment_address*4 + i] = rds_byte_to_char(arr[8+i]);
+    }
+  }
+  // version B radiotext
+  else {
+    for(int i=0; i<2; i++) {
+      arr_B[segment_address*2 + i] = rds_byte_to_char(arr[10+i]);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,196 @@
+#ifndef signal_h
+#define signal_h
+
+#include "Arduino.h"
+#include "ESPAsyncWebServer.h"
+
+// Signal history
+// RSSI, stereo and station flags of the register reads loop() already makes, one sample per 100ms slot, kept in
+// three rings of fixed size (6480 bytes):
+//   level 0: samples, 100ms x 600 (1 minute), 2 bytes: RSSI (0-127), flags (bit 0 station, bit 1 stereo)
+//   level 1: 1s x 600 (10 minutes), 4 bytes: min, average, max RSSI, stereo (bits 7-4) and station (bits 3-0)
+//            share of the samples in 1/15
+//   level 2: 1min x 720 (12 hours), same as level 1
+// Slots without a sample (seeking, Bluetooth mode without the TA monitor) are SIGNAL_NONE in RSSI, buckets
+// without any sample too. /signal?level=0-2 returns a level oldest first, after an 8 byte header:
+//   'S' level entry_size 0 period_ms(4, little endian)
+
+#define SIGNAL_SLOT_MS 100
+#define SIGNAL_L0_SIZE 600
+#define SIGNAL_L1_SIZE 600
+#define SIGNAL_L2_SIZE 720
+#define SIGNAL_L1_SLOTS 10            // slots per level 1 bucket
+#define SIGNAL_L2_SLOTS 600           // slots per level 2 bucket
+#define SIGNAL_LEVELS 3
+#define SIGNAL_HEADER 8
+#define SIGNAL_NONE 0xff
+#define SIGNAL_STATION 0b01
+#define SIGNAL_STEREO 0b10
+
+struct SignalLevel {
+  uint8_t* entries;
+  uint16_t size;                      // entries
+  uint8_t entry_size;                 // bytes
+  uint32_t period_ms;
+  volatile uint32_t head;             // entries written since boot
+};
+
+// Samples of the bucket being filled
+struct SignalBucket {
+  uint8_t min;
+  uint8_t max;
+  uint32_t sum;
+  uint16_t samples;
+  uint16_t stereo;
+  uint16_t station;
+};
+
+uint8_t signal_l0[SIGNAL_L0_SIZE * 2];
+uint8_t signal_l1[SIGNAL_L1_SIZE * 4];
+uint8_t signal_l2[SIGNAL_L2_SIZE * 4];
+SignalLevel signal_levels[SIGNAL_LEVELS] = {
+  {signal_l0, SIGNAL_L0_SIZE, 2, SIGNAL_SLOT_MS, 0},
+  {signal_l1, SIGNAL_L1_SIZE, 4, SIGNAL_SLOT_MS * SIGNAL_L1_SLOTS, 0},
+  {signal_l2, SIGNAL_L2_SIZE, 4, SIGNAL_SLOT_MS * SIGNAL_L2_SLOTS, 0}
+};
+SignalBucket signal_buckets[2];      // levels 1 and 2
+uint32_t signal_slot = 0;             // next slot, millis() / SIGNAL_SLOT_MS
+static_assert(sizeof(signal_l0) + sizeof(signal_l1) + sizeof(signal_l2) < 8192, "signal history over 8KB");
+
+void signal_bucket_clear(SignalBucket* bucket) {
+  bucket->min = SIGNAL_NONE;
+  bucket->max = 0;
+  bucket->sum = 0;
+  bucket->samples = 0;
+  bucket->stereo = 0;
+  bucket->station = 0;
+}
+
+void signal_push(uint8_t level, const uint8_t* entry) {
+  SignalLevel* ring = &signal_levels[level];
+  memcpy(ring->entries + (ring->head % ring->size) * ring->entry_size, entry, ring->entry_size);
+  __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+// Close a level 1 or 2 bucket into its ring
+void signal_close(uint8_t level, SignalBucket* bucket) {
+  uint8_t entry[4] = {SIGNAL_NONE, SIGNAL_NONE, SIGNAL_NONE, 0};
+  if(bucket->samples > 0) {
+    entry[0] = bucket->min;
+    entry[1] = bucket->sum / bucket->samples;
+    entry[2] = bucket->max;
+    entry[3] = (bucket->stereo * 15 / bucket->samples) << 4 | (bucket->station * 15 / bucket->samples);
+  }
+  signal_push(level, entry);
+  signal_bucket_clear(bucket);
+}
+
+// One slot, rssi = SIGNAL_NONE if there was no sample
+void signal_slot_end(uint8_t rssi, uint8_t flags) {
+  uint8_t entry[2] = {rssi, flags};
+  signal_push(0, entry);
+  if(rssi != SIGNAL_NONE) {
+    for(int i=0; i<2; i++) {
+      SignalBucket* bucket = &signal_buckets[i];
+      bucket->min = min(bucket->min, rssi);
+      bucket->max = max(bucket->max, rssi);
+      bucket->sum += rssi;
+      bucket->samples++;
+      bucket->stereo += (flags & SIGNAL_STEREO) != 0;
+      bucket->station += (flags & SIGNAL_STATION) != 0;
+    }
+  }
+  signal_slot++;
+  if(signal_slot % SIGNAL_L1_SLOTS == 0) {
+    signal_close(1, &signal_buckets[0]);
+  }
+  if(signal_slot % SIGNAL_L2_SLOTS == 0) {
+    signal_close(2, &signal_buckets[1]);
+  }
+}
+
+// Sample of a register read (arr=requested_data), the first one in each slot is kept
+void signal_sample(const uint8_t* arr) {
+  uint32_t slot = millis() / SIGNAL_SLOT_MS;
+  if(signal_slot == 0) {
+    signal_slot = slot;
+    signal_bucket_clear(&signal_buckets[0]);
+    signal_bucket_clear(&signal_buckets[1]);
+  }
+  if(slot < signal_slot) {
+    return;
+  }
+  // slots without a sample. Once level 1 is all empty, whole level 2 buckets only need their empty entry, and
+  // a gap longer than level 2 only needs as many
+  uint32_t span = (uint32_t)SIGNAL_L2_SIZE * SIGNAL_L2_SLOTS;
+  if(slot - signal_slot > span) {
+    signal_slot += (slot - signal_slot - span) / SIGNAL_L2_SLOTS * SIGNAL_L2_SLOTS;
+  }
+  uint32_t skipped = 0;
+  while(signal_slot < slot) {
+    if(skipped >= SIGNAL_L1_SIZE * SIGNAL_L1_SLOTS && signal_slot % SIGNAL_L2_SLOTS == 0
+       && slot - signal_slot >= SIGNAL_L2_SLOTS) {
+      signal_close(2, &signal_buckets[1]);
+      signal_slot += SIGNAL_L2_SLOTS;
+      continue;
+    }
+    signal_slot_end(SIGNAL_NONE, 0);
+    skipped++;
+  }
+  // register 0x0A bit 10 stereo, register 0x0B bits 15-9 RSSI, bit 8 station
+  uint8_t flags = ((arr[2] & 0b1) ? SIGNAL_STATION : 0) | ((arr[0] & 0b100) ? SIGNAL_STEREO : 0);
+  signal_slot_end(arr[2] >> 1, flags);
+}
+
+// Copy bytes [index, index + size) of the response for entries [first, end) of level into buffer, returns the
+// bytes copied, 0 at the end or if the ring has overwritten them in the meantime
+size_t signal_copy(uint8_t level, uint8_t* buffer, size_t size, size_t index, uint32_t first, uint32_t end) {
+  SignalLevel* ring = &signal_levels[level];
+  uint8_t header[SIGNAL_HEADER] = {'S', level, ring->entry_size, 0, (uint8_t)(ring->period_ms & 0xff),
+    (uint8_t)(ring->period_ms >> 8 & 0xff), (uint8_t)(ring->period_ms >> 16 & 0xff), (uint8_t)(ring->period_ms >> 24)};
+  size_t total = SIGNAL_HEADER + (end - first) * ring->entry_size;
+  size_t length = 0;
+  while(length < size && index + length < total) {
+    size_t offset = index + length;
+    if(offset < SIGNAL_HEADER) {
+      buffer[length++] = header[offset];
+      continue;
+    }
+    uint32_t entry = first + (offset - SIGNAL_HEADER) / ring->entry_size;
+    buffer[length++] = ring->entries[(entry % ring->size) * ring->entry_size + (offset - SIGNAL_HEADER) % ring->entry_size];
+  }
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  if(head - first >= ring->size) {
+    return 0;
+  }
+  return length;
+}
+
+// Binary series of one level, oldest first
+void signal_download(AsyncWebServerRequest* request) {
+  uint8_t level = 1;
+  if(request->hasParam("level")) {
+    level = request->getParam("level")->value().toInt();
+  }
+  if(level >= SIGNAL_LEVELS) {
+    request->send(400, "text/plain", "level 0-2");
+    return;
+  }
+  SignalLevel* ring = &signal_levels[level];
+  uint32_t end = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  // one entry less than the ring, the writer may be on the oldest one
+  uint32_t first = (end >= ring->size) ? end - ring->size + 1 : 0;
+  AsyncWebServerResponse* response = request->beginChunkedResponse("application/octet-stream",
+    [level, first, end](uint8_t* buffer, size_t max_length, size_t index) -> size_t {
+      return signal_copy(level, buffer, max_length, index, first, end);
+    });
+  response->addHeader("Cache-Control", "no-store");
+  request->send(response);
+}
+
+// Register /signal (from ServerBegin)
+void signal_server_begin(AsyncWebServer* server_pt) {
+  (*server_pt).on("/signal", HTTP_GET, signal_download);
+}
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef ta_h
+#define ta_h
+
+#include "Arduino.h"
+
+#include "constants.h"
+#include "main_functions.h"       // request_data(), select_audio_output()
+#include "af.h"                   // af_tune()
+#include "metrics.h"              // Counted I2C transactions
+#include "logger.h"               // Non-blocking logs
+#include "ta_monitor.h"           // TP/TA, EON and the announcement states
+
+// Traffic announcements in Bluetooth mode (see ta_monitor.h)
+// Connects the monitor to the tuner registers, the analog switch, the slave ("TA ON" pauses A2DP if it was
+// playing, "TA OFF" resumes it), millis() and the log.
+
+// Radio or Bluetooth audio, detected = millis() of the group that changed TA
+void ta_switch(bool radio, uint32_t detected) {
+  select_audio_output(!radio);
+  if(radio) {
+    i2c_write(I2C_SLAVE, SLAVE_ADDRESS, (const uint8_t*)"TA ON", 5);
+  }
+  else {
+    i2c_write(I2C_SLAVE, SLAVE_ADDRESS, (const uint8_t*)"TA OFF", 6);
+  }
+  LOG_INFO(RADIO, radio ? "Traffic announcement, radio in %lums" : "Traffic announcement ended, Bluetooth in %lums",
+    millis() - detected);
+}
+
+const TaRadio ta_radio = {af_tune, request_data, ta_switch};
+
+// From loop(), every pass in Bluetooth and radio mode (arr=requested_data, config=tune_config, frequency=curr_freq)
+// Returns true if the registers were read into arr
+bool ta_loop(bool bluetooth, uint8_t* arr, const uint8_t* config, int frequency) {
+#if TA_MONITOR
+  bool read = ta_monitor_loop(&ta_radio, bluetooth, arr, config, frequency, millis());
+  uint8_t events = ta_events;
+  ta_events = 0;
+  if(events & TA_EVENT_EON) {
+    LOG_INFO(RADIO, "EON traffic announcement on %04X, %d.%dMHz", ta_eon_pi, ta_eon_frequency / 10,
+      ta_eon_frequency % 10);
+  }
+  if(events & TA_EVENT_UNCONFIRMED) {
+    LOG_WARN(RADIO, "No TA from %04X, back to the station", ta_eon_pi);
+  }
+  if(events & TA_EVENT_LOST) {
+    LOG_WARN(RADIO, "Traffic announcement lost");
+  }
+  return read;
+#else
+  return false;
+#endif
+}
+
+// Bluetooth screen during an announcement (frequency=curr_freq), after the Bluetooth symbol
+void ta_display(int frequency, MeteredLCD* lcd_ptr) {
+  int shown = (ta_state == TA_ANNOUNCEMENT) ? frequency : ta_eon_frequency;
+  (*lcd_ptr).print("Traffic info  ");
+  (*lcd_ptr).setCursor(0, 1);
+  (*lcd_ptr).print("TA ");
+  if(shown < 1000) {
+    (*lcd_ptr).print(" ");
+  }
+  (*lcd_ptr).print(shown / 10);
+  (*lcd_ptr).print(".");
+  (*lcd_ptr).print(shown % 10);
+  (*lcd_ptr).print("MHz     ");
+}
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef ta_monitor_h
+#define ta_monitor_h
+
+#include "stdint.h"
+
+#include "rds_decoder.h"          // TP/TA and EON fields
+
+// Traffic announcements in Bluetooth mode, without the I2C access and the log (ta.h connects them)
+// The tuner keeps running on the last radio station while Bluetooth plays. ta_monitor_loop() reads its registers
+// every TA_POLL_MS and follows TP/TA from groups 0A, 0B and 15B. When a traffic programme sets TA, the audio goes
+// to the radio and the slave pauses A2DP; when TA is clear for TA_CLEAR_GROUPS groups, or no group came for
+// TA_LOST_MS, Bluetooth comes back.
+// EON: group 14A variants 5-8 map other networks to a frequency. If 14B (or 14A variant 13) reports TA
+// for a mapped network, the tuner goes there for the announcement and back to the station afterwards.
+// The switch is done in the loop that reads the TA group. Times are passed in (millis()).
+// No Arduino dependencies, also used by misc/benchmark.
+
+#define TA_POLL_MS 30             // register reads, groups come every 88ms
+#define TA_CLEAR_GROUPS 2         // TA clear this many times before the announcement ends
+#define TA_LOST_MS 3000           // no group of the station for this long ends the announcement
+#define TA_EON_CONFIRM_MS 1500    // the other network must report TA itself within this time
+#define TA_STC_TIMEOUT_MS 50      // tuning to the other network
+#define TA_EON_MAX 8              // other networks with a mapped frequency
+
+// States
+#define TA_IDLE 0
+#define TA_ANNOUNCEMENT 1         // announcement on the station
+#define TA_EON_TUNING 2           // tuning to the other network
+#define TA_EON 3                  // announcement on the other network
+
+// Events for the log, set below and cleared by ta.h once logged
+#define TA_EVENT_EON 0x01         // announcement on ta_eon_pi, tuning to ta_eon_frequency
+#define TA_EVENT_UNCONFIRMED 0x02 // the other network did not report TA, back to the station
+#define TA_EVENT_LOST 0x04        // no group for TA_LOST_MS
+
+// Tuner and audio access (I2C and the analog switch on the ESP32), config = tune_config
+struct TaRadio {
+  void (*tune)(const uint8_t* config, int frequency);    // without changing config
+  void (*read)(uint8_t* arr);                            // registers 0x0A-0x0F (request_data())
+  void (*audio)(bool radio, uint32_t detected);          // radio or Bluetooth, detected = time of the group
+};
+
+struct TaNetwork {
+  uint16_t pi;
+  int frequency;
+};
+
+uint8_t ta_state = TA_IDLE;
+uint16_t ta_pi = 0;               // PI of the station, 0 - unknown
+int ta_frequency = 0;             // frequency ta_pi and the networks belong to
+TaNetwork ta_networks[TA_EON_MAX];
+uint8_t ta_network_count = 0;
+uint16_t ta_eon_pi = 0;           // other network in TA_EON_TUNING and TA_EON
+int ta_eon_frequency = 0;
+bool ta_eon_confirmed = false;
+uint8_t ta_clear_count = 0;
+uint32_t ta_last_poll = 0;
+uint32_t ta_last_group = 0;       // last group of the station the announcement is on
+uint32_t ta_start = 0;
+uint8_t ta_events = 0;
+
+// Announcement running, the radio is heard
+bool ta_active() {
+  return ta_state != TA_IDLE;
+}
+
+// Tuning to another network, loop() polls every ms
+bool ta_tuning() {
+  return ta_state == TA_EON_TUNING;
+}
+
+void ta_map(uint16_t pi, int frequency) {
+  for(int i=0; i<ta_network_count; i++) {
+    if(ta_networks[i].pi == pi) {
+      ta_networks[i].frequency = frequency;
+      return;
+    }
+  }
+  if(ta_network_count < TA_EON_MAX) {
+    ta_networks[ta_network_count++] = {pi, frequency};
+  }
+}
+
+int ta_mapped(uint16_t pi) {
+  for(int i=0; i<ta_network_count; i++) {
+    if(ta_networks[i].pi == pi) {
+      return ta_networks[i].frequency;
+    }
+  }
+  return 0;
+}
+
+// End of the announcement, back to the station (config=tune_config, frequency=curr_freq), slave = Bluetooth back
+void ta_end(const TaRadio* radio, const uint8_t* config, int frequency, bool slave, uint32_t detected) {
+  if(ta_state == TA_EON_TUNING || ta_state == TA_EON) {
+    radio->tune(config, frequency);
+  }
+  if(slave) {
+    radio->audio(false, detected);
+  }
+  ta_state = TA_IDLE;
+}
+
+// Group 14 of the station (arr=requested_data)
+void ta_eon(const TaRadio* radio, const uint8_t* arr, const uint8_t* config, uint32_t now_ms) {
+  uint16_t pi = rds_eon_pi(arr);
+  uint8_t variant = rds_eon_variant(arr);
+  // mapped frequencies, block C = tuned frequency, frequency of the other network (AF codes)
+  if(rds_group_version(arr) && variant >= 5 && variant <= 8) {
+    if(arr[8] == ta_frequency - 875 && arr[9] >= 1 && arr[9] <= 204) {
+      ta_map(pi, 875 + arr[9]);
+    }
+    return;
+  }
+  int frequency = ta_mapped(pi);
+  if(ta_state != TA_IDLE || !rds_eon_ta(arr) || frequency == 0) {
+    return;
+  }
+  ta_events |= TA_EVENT_EON;
+  ta_eon_pi = pi;
+  ta_eon_frequency = frequency;
+  ta_eon_confirmed = false;
+  radio->tune(config, frequency);
+  ta_start = now_ms;
+  ta_state = TA_EON_TUNING;
+}
+
+// Every pass of loop() in Bluetooth and radio mode (arr=requested_data, config=tune_config, frequency=curr_freq)
+// Returns true if the registers were read into arr
+bool ta_monitor_loop(const TaRadio* radio, bool bluetooth, uint8_t* arr, const uint8_t* config, int frequency,
+  uint32_t now_ms) {
+  // radio mode, the mode switch already selected the radio
+  if(!bluetooth) {
+    if(ta_state != TA_IDLE) {
+      ta_end(radio, config, frequency, false, now_ms);
+    }
+    return false;
+  }
+  if(ta_state != TA_EON_TUNING && now_ms - ta_last_poll < TA_POLL_MS) {
+    return false;
+  }
+  ta_last_poll = now_ms;
+  if(frequency != ta_frequency) {
+    ta_frequency = frequency;
+    ta_pi = 0;
+    ta_network_count = 0;
+  }
+  radio->read(arr);
+
+  if(ta_state == TA_EON_TUNING) {
+    // STC set
+    if((arr[0] & 0b01000000) != 0 || now_ms - ta_start >= TA_STC_TIMEOUT_MS) {
+      radio->audio(true, ta_start);
+      ta_last_group = now_ms;
+      ta_clear_count = 0;
+      ta_state = TA_EON;
+    }
+    return true;
+  }
+
+  // RDS group with blocks A and B received without errors
+  bool group = (arr[0] & 0b10000000) != 0 && (arr[3] & 0b1111) == 0;
+  if(group && ta_state != TA_EON) {
+    if(ta_pi == 0) {
+      ta_pi = rds_pi(arr);
+    }
+    if(rds_pi(arr) == ta_pi) {
+      ta_last_group = now_ms;
+      if(rds_group_type(arr) == 14) {
+        ta_eon(radio, arr, config, now_ms);
+      }
+      else if(rds_carries_ta(arr) && rds_tp(arr)) {
+        if(rds_ta(arr) && ta_state == TA_IDLE) {
+          radio->audio(true, now_ms);
+          ta_clear_count = 0;
+          ta_state = TA_ANNOUNCEMENT;
+        }
+        else if(!rds_ta(arr) && ta_state == TA_ANNOUNCEMENT && ++ta_clear_count >= TA_CLEAR_GROUPS) {
+          ta_end(radio, config, frequency, true, now_ms);
+        }
+        else if(rds_ta(arr)) {
+          ta_clear_count = 0;
+        }
+      }
+    }
+  }
+  // announcement on the other network, it reports its own TA
+  else if(group && rds_pi(arr) == ta_eon_pi && rds_carries_ta(arr)) {
+    ta_last_group = now_ms;
+    if(rds_ta(arr)) {
+      ta_eon_confirmed = true;
+      ta_clear_count = 0;
+    }
+    else if(++ta_clear_count >= TA_CLEAR_GROUPS) {
+      ta_end(radio, config, frequency, true, now_ms);
+    }
+  }
+
+  if(ta_state == TA_EON && !ta_eon_confirmed && now_ms - ta_start >= TA_EON_CONFIRM_MS) {
+    ta_events |= TA_EVENT_UNCONFIRMED;
+    ta_end(radio, config, frequency, true, now_ms);
+  }
+  else if(ta_state != TA_IDLE && now_ms - ta_last_group >= TA_LOST_MS) {
+    ta_events |= TA_EVENT_LOST;
+    ta_end(radio, config, frequency, true, now_ms);
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef timeshift_h
+#define timeshift_h
+
+#include "Arduino.h"
+#include "Wire.h"
+
+#include "constants.h"
+#include "i2c_bus.h"              // Status read between loops
+#include "logger.h"               // Non-blocking logs
+#include "timeshift_protocol.h"   // Commands and status, shared with the slave
+
+// Radio time shift controls
+// With the I2S audio path the slave records the radio and can pause and rewind it (see timeshift_protocol.h).
+// Settings button 3 pauses. While paused or behind live the radio screen shows the delay, the knob button plays
+// and pauses, left/right skip timeshift_skip_s() back and forward, a long left press goes to the oldest audio and
+// a long right press back to live; tuning goes live too. The web page sends the same commands through loop().
+// Every command reads the slave status back SLAVE_PACKET_DELAY ms later, stepped by the I2C bus between loops.
+// The status is polled every TIMESHIFT_POLL_MS while not live.
+
+#define TIMESHIFT_SKIP_S 10             // skip step, smaller when the slave's ring holds less (timeshift_skip_s())
+#define TIMESHIFT_POLL_MS 500
+#define TIMESHIFT_SETTLE_MS 1000  // the slave applies a command with its next audio block, polled meanwhile
+
+struct TimeshiftStatus {
+  uint8_t state;                  // TIMESHIFT_OFF ... TIMESHIFT_BEHIND
+  uint16_t delay_s;               // behind live
+  uint16_t recorded_s;            // audio in the ring
+  uint16_t capacity_s;
+};
+
+TimeshiftStatus timeshift = {I2S_AUDIO_PATH ? TIMESHIFT_LIVE : TIMESHIFT_OFF, 0, 0, 0};
+unsigned long timeshift_last_poll = 0;
+unsigned long timeshift_last_command = 0;
+uint8_t timeshift_service = 0xff;
+unsigned long timeshift_sent_us = 0;
+bool timeshift_answered = false;        // last status read got a status
+
+// Paused or behind live, the radio screen keys control the time shift
+bool timeshift_active() {
+  return timeshift.state == TIMESHIFT_PAUSED || timeshift.state == TIMESHIFT_BEHIND;
+}
+
+// Skip step: TIMESHIFT_SKIP_S, or half the ring when it holds less (slave without PSRAM: 2s, 1s steps)
+uint16_t timeshift_skip_s() {
+  if(timeshift.capacity_s >= TIMESHIFT_SKIP_S) {
+    return TIMESHIFT_SKIP_S;
+  }
+  return (timeshift.capacity_s >= 2) ? timeshift.capacity_s / 2 : 1;
+}
+
+// Status read after a message (I2C bus service)
+uint8_t timeshift_status_step() {
+  if(micros() - timeshift_sent_us < SLAVE_PACKET_DELAY * 1000UL) {
+    return I2C_WAITING;
+  }
+  uint8_t status[TIMESHIFT_STATUS_SIZE];
+  if(i2c_request(I2C_SLAVE, SLAVE_ADDRESS, TIMESHIFT_STATUS_SIZE) != TIMESHIFT_STATUS_SIZE) {
+    LOG_WARN(SLAVE, "No time shift status");
+    return I2C_IDLE;
+  }
+  Wire.readBytes(status, TIMESHIFT_STATUS_SIZE);
+  if(status[0] != 'T') {
+    return I2C_IDLE;
+  }
+  timeshift.state = status[1];
+  timeshift.delay_s = status[2] | status[3] << 8;
+  timeshift.recorded_s = status[4] | status[5] << 8;
+  timeshift.capacity_s = status[6] | status[7] << 8;
+  timeshift_answered = true;
+  return I2C_IDLE;
+}
+
+// Status reads on the bus (from setup())
+void timeshift_begin() {
+  timeshift_service = i2c_bus_service(I2C_CLASS_SLAVE, timeshift_status_step);
+}
+
+// Send command ('P', 'R', 'S', 'L', '?', see timeshift_protocol.h) (from loop()), its status is read between
+// loops. False if the slave did not take it
+bool timeshift_command(char command, int16_t seconds = 0) {
+#if I2S_AUDIO_PATH
+  uint8_t message[TIMESHIFT_MESSAGE_SIZE];
+  timeshift_message(message, command, seconds);
+  timeshift_last_poll = millis();
+  if(command != '?') {
+    timeshift_last_command = timeshift_last_poll;
+  }
+  if(i2c_write(I2C_SLAVE, SLAVE_ADDRESS, message, TIMESHIFT_MESSAGE_SIZE) != 0) {
+    LOG_WARN(SLAVE, "Time shift command %c not sent", command);
+    return false;
+  }
+  timeshift_sent_us = micros();
+  timeshift_answered = false;
+  i2c_bus_request(timeshift_service);
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Read the status of the last command now, before another slave message replaces it. False if the slave did
+// not answer
+bool timeshift_wait() {
+  i2c_bus_finish(timeshift_service);
+  return timeshift_answered;
+}
+
+// Status while not live, and shortly after a command (from loop() in radio mode)
+void timeshift_poll() {
+  bool settling = millis() - timeshift_last_command < TIMESHIFT_SETTLE_MS;
+  if((timeshift_active() || settling) && millis() - timeshift_last_poll >= TIMESHIFT_POLL_MS &&
+    !i2c_bus_requested(timeshift_service)) {
+    timeshift_command('?');
+  }
+}
+
+// Back to live before tuning or leaving radio mode (from loop()), the status is read before "BLUETOOTH ON"
+void timeshift_catch_up() {
+  if(timeshift_active() && timeshift_command('L')) {
+    timeshift_wait();
+  }
+}
+
+// Bottom row while not live: pause or play symbol, delay and recorded audio (mm:ss)
+void timeshift_display(MeteredLCD* lcd_ptr) {
+  (*lcd_ptr).setCursor(0, 1);
+  (*lcd_ptr).write(timeshift.state == TIMESHIFT_PAUSED ? 2 : 7);
+  char text[16];
+  snprintf(text, sizeof(text), " -%02u:%02u  %02u:%02u ", timeshift.delay_s / 60 % 100, timeshift.delay_s % 60,
+    timeshift.recorded_s / 60 % 100, timeshift.recorded_s % 60);
+  (*lcd_ptr).print(text);
+}
+
+#endif
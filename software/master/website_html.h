@@ -123,6 +123,17 @@ const char index_html[] PROGMEM = R"rawliteral(
       opacity: 0.5;
     }
 
+    .signal-container {
+      margin: 20px auto;
+      max-width: 600px;
+    }
+    #signal {
+      width: 100%;
+      height: 80px;
+      background-color: #ffffff;
+      border: 1px solid #ccc;
+    }
+
     /* Media query for smaller screens */
     @media (max-width: 600px) {
       input[type="range"] {
@@ -195,6 +206,22 @@ const char index_html[] PROGMEM = R"rawliteral(
             document.getElementById("freq-status").innerHTML = "Selected frequency: " + String((parseInt(freqString)/10).toFixed(1)) + "MHz";
             document.getElementById("vol-status").innerHTML = "Volume: " + volString;
             document.getElementById("radiotext-status").innerHTML = "RDS: " + radiotext;
+
+            // Time shift, hidden without it (0), delay while paused (2) or behind live (3), skip step of the slave's ring
+            var timeshift = parseInt(data.timeshift);
+            var delay = parseInt(data.timeshift_delay);
+            var skip = parseInt(data.timeshift_skip);
+            document.getElementById("timeshift-buttons").style.display = (timeshift == 0) ? "none" : "block";
+            document.getElementById("timeshift-back").innerHTML = "&#9664&#9664 " + skip + "s";
+            document.getElementById("timeshift-forward").innerHTML = skip + "s &#9654&#9654";
+            document.getElementById("timeshift-play").innerHTML = (timeshift == 2) ? "&#9654 PLAY" : "&#10074&#10074 PAUSE";
+            if(timeshift == 2 || timeshift == 3) {
+              var time = Math.floor(delay / 60) + ":" + String(delay % 60).padStart(2, "0");
+              document.getElementById("timeshift-status").innerHTML = (timeshift == 2 ? "Paused, " : "Playing ") + time + " behind live";
+            }
+            else {
+              document.getElementById("timeshift-status").innerHTML = "";
+            }
           });
         }
         else {
@@ -355,6 +382,16 @@ const char index_html[] PROGMEM = R"rawliteral(
       refreshIntervalId = setInterval(updateWebpage, 100);
     }
 
+    // Time shift: pause/play toggle, 'B' back, 'F' forward, 'L' live
+    function timeShift(command) {
+      if(command == "P" && document.getElementById("timeshift-play").innerHTML.indexOf("PLAY") >= 0) {
+        command = "R";
+      }
+      fetch("/get?timeshift=" + command)
+      .then(response => response.text())
+      .catch(error => console.error("Error:", error));
+    }
+
     // Notify ESP32 when bluetooth mode is switched
     function switchBluetooth() {
       // Send bluetooth info to server
@@ -362,6 +399,63 @@ const char index_html[] PROGMEM = R"rawliteral(
       .then(response => response.text())
       .catch(error => console.error("Error:", error));
     }
+
+    // Signal history sparkline, level 0: last minute, 1: last 10 minutes, 2: last 12 hours (see signal.h)
+    var signalLevel = 0;
+    function updateSignal() {
+      fetch("/signal?level=" + signalLevel)
+      .then(response => response.arrayBuffer())
+      .then(buffer => drawSignal(new Uint8Array(buffer)))
+      .catch(error => console.error("Error:", error));
+    }
+
+    function drawSignal(data) {
+      if(data.length < 8 || data[0] != 83) return; // 'S'
+      var size = data[2];
+      var count = (data.length - 8) / size;
+      var capacity = [600, 600, 720][data[1]];
+      var canvas = document.getElementById("signal");
+      canvas.width = canvas.clientWidth;
+      canvas.height = canvas.clientHeight;
+      var context = canvas.getContext("2d");
+      var x = i => (capacity - count + i) * canvas.width / capacity;
+      var y = rssi => canvas.height - 2 - rssi * (canvas.height - 4) / 127;
+      var last = 255;
+      context.clearRect(0, 0, canvas.width, canvas.height);
+      for(var i=0; i<count; i++) {
+        var entry = 8 + i * size;
+        // no sample, gap in the line
+        if(data[entry] == 255) {
+          last = 255;
+          continue;
+        }
+        var rssi = (size == 2) ? data[entry] : data[entry + 1];
+        // min-max band
+        if(size == 4) {
+          context.fillStyle = "rgba(0, 120, 215, 0.25)";
+          context.fillRect(x(i), y(data[entry + 2]), Math.max(1, canvas.width / capacity), y(data[entry]) - y(data[entry + 2]) + 1);
+        }
+        // stereo darker than mono
+        var stereo = (size == 2) ? (data[entry + 1] & 2) != 0 : (data[entry + 3] >> 4) >= 8;
+        context.strokeStyle = stereo ? "#0057a7" : "#7fb2e5";
+        if(last != 255) {
+          context.beginPath();
+          context.moveTo(x(i - 1), y(last));
+          context.lineTo(x(i), y(rssi));
+          context.stroke();
+        }
+        last = rssi;
+      }
+      var now = document.getElementById("signal-now");
+      now.innerHTML = (last == 255) ? "RSSI: -" : "RSSI: " + last;
+    }
+
+    function changeSignalLevel() {
+      signalLevel = parseInt(document.getElementById("signal-level").value);
+      updateSignal();
+    }
+
+    var signalIntervalId = setInterval(updateSignal, 1000);
   </script>
 </head>
 
@@ -414,10 +508,29 @@ const char index_html[] PROGMEM = R"rawliteral(
     <button onclick="tuneFrequency('up')">TUNE UP &#9650</button>
   </div>
 
+  <!-- Time shift, pause and rewind the radio -->
+  <div id="timeshift-buttons" class="button-container" style="display: none;">
+    <button id="timeshift-back" onclick="timeShift('B')">&#9664&#9664 10s</button>
+    <button id="timeshift-play" onclick="timeShift('P')">&#10074&#10074 PAUSE</button>
+    <button id="timeshift-forward" onclick="timeShift('F')">10s &#9654&#9654</button>
+    <button onclick="timeShift('L')">LIVE</button>
+  </div>
+
   <div class="status">
     <div id="freq-status">Selected frequency: 87.0MHz</div>
     <div id="vol-status">Volume: 0</div>
     <div id="radiotext-status">RDS: </div>
+    <div id="timeshift-status"></div>
+  </div>
+
+  <div class="signal-container">
+    <canvas id="signal"></canvas>
+    <span id="signal-now">RSSI: -</span>
+    <select id="signal-level" onchange="changeSignalLevel()">
+      <option value="0">1 minute</option>
+      <option value="1">10 minutes</option>
+      <option value="2">12 hours</option>
+    </select>
   </div>
 
   <div class="button-container">
@@ -613,4 +726,291 @@ const char bluetooth_index_html[] PROGMEM = R"rawliteral(
 </html>
 )rawliteral";
 
+// RDS inspector, live groups from /rds/ws (records, see rds_capture.h)
+const char rds_html[] PROGMEM = R"rawliteral(
+<!DOCTYPE HTML>
+<html lang="en">
+<head>
+  <meta charset="UTF-8">
+  <meta name="viewport" content="width=device-width, initial-scale=1">
+  <title>RDS Inspector</title>
+
+  <style>
+    body {
+      font-family: Arial, sans-serif;
+      background-color: #f0f4f8;
+      color: #333;
+      margin: 0;
+      padding: 20px;
+      text-align: center;
+    }
+
+    h2 {
+      color: #0078d7;
+      font-size: 28px;
+      margin-bottom: 20px;
+      text-shadow: 1px 1px 2px rgba(0, 0, 0, 0.2);
+    }
+
+    .status {
+      font-size: 18px;
+      margin: 10px;
+      font-weight: bold;
+      line-height: 1.5;
+      padding: 10px;
+      background-color: #f9f9f9;
+      border-radius: 10px;
+      box-shadow: 0 4px 8px rgba(0, 0, 0, 0.1);
+      display: inline-block;
+    }
+
+    .text {
+      font-family: "Courier";
+      white-space: pre;
+    }
+
+    table {
+      margin: 20px auto;
+      border-collapse: collapse;
+      font-family: "Courier";
+      font-size: 14px;
+    }
+
+    th, td {
+      padding: 4px 10px;
+      border-bottom: 1px solid #ddd;
+    }
+
+    .error {
+      color: #c00000;
+    }
+
+    a {
+      color: #0078d7;
+    }
+  </style>
+</head>
+
+<body>
+  <h2>RDS Inspector</h2>
+
+  <div class="status">
+    <div id="station">Waiting for groups...</div>
+    <div>PS: <span id="ps" class="text">________</span></div>
+    <div>RT: <span id="rt" class="text"></span></div>
+  </div>
+  <div class="status">
+    <div id="counts">0 groups</div>
+    <div id="types"></div>
+  </div>
+
+  <div><a href="/rds.bin">Download capture (rds.bin)</a></div>
+
+  <table>
+    <thead><tr><th>Time (s)</th><th>Group</th><th>BLER A/B</th><th>B</th><th>C</th><th>D</th><th>Text</th></tr></thead>
+    <tbody id="groups"></tbody>
+  </table>
+
+  <script>
+    var MAX_ROWS = 40;
+    var time = 0, channel = -1, pi = -1;
+    var ps = new Array(8).fill("_");
+    var rt = new Array(64).fill(" ");
+    var total = 0, errors = 0, types = {};
+
+    function hex(value) {
+      return ("000" + value.toString(16).toUpperCase()).slice(-4);
+    }
+    function chars(word) {
+      return [word >> 8, word & 0xff].map(function(c) { return (c >= 32 && c < 127) ? String.fromCharCode(c) : "."; });
+    }
+
+    function group(errors_a, errors_b, b, c, d) {
+      var type = (b >> 12) + ((b & 0x800) ? "B" : "A");
+      var text = "";
+      total++;
+      if(errors_a || errors_b) errors++;
+      types[type] = (types[type] || 0) + 1;
+
+      // 0A/0B program service name, 2 characters per group
+      if((b >> 12) == 0) {
+        var segment = b & 0b11;
+        var pair = chars(d);
+        ps[2*segment] = pair[0]; ps[2*segment + 1] = pair[1];
+        text = pair.join("");
+      }
+      // 2A radiotext, 4 characters per group (2B: 2 characters in block D)
+      else if((b >> 12) == 2) {
+        var segment = b & 0b1111;
+        var quad = (b & 0x800) ? chars(d) : chars(c).concat(chars(d));
+        for(var i=0; i<quad.length; i++) rt[quad.length*segment + i] = quad[i];
+        text = quad.join("");
+      }
+
+      var row = document.createElement("tr");
+      if(errors_a || errors_b) row.className = "error";
+      [(time / 1000).toFixed(3), type, errors_a + "/" + errors_b, hex(b), hex(c), hex(d), text].forEach(function(value) {
+        var cell = document.createElement("td");
+        cell.textContent = value;
+        row.appendChild(cell);
+      });
+      var body = document.getElementById("groups");
+      body.insertBefore(row, body.firstChild);
+      while(body.rows.length > MAX_ROWS) body.deleteRow(-1);
+    }
+
+    function update() {
+      document.getElementById("ps").textContent = ps.join("");
+      document.getElementById("rt").textContent = rt.join("");
+      document.getElementById("counts").textContent = total + " groups, " + (total ? (100 * errors / total).toFixed(1) : 0) + "% with block errors";
+      document.getElementById("types").textContent = Object.keys(types).sort().map(function(type) { return type + ": " + types[type]; }).join("  ");
+    }
+
+    var socket = new WebSocket("ws://" + window.location.host + "/rds/ws");
+    socket.binaryType = "arraybuffer";
+    socket.onmessage = function(event) {
+      var view = new DataView(event.data);
+      for(var offset=0; offset + 8 <= view.byteLength; offset += 8) {
+        var word0 = view.getUint16(offset, true);
+        var word1 = view.getUint16(offset + 2, true);
+        var word2 = view.getUint16(offset + 4, true);
+        var word3 = view.getUint16(offset + 6, true);
+        // marker: channel, PI, absolute time
+        if(word0 & 0x8000) {
+          var new_channel = word0 & 0x7fff;
+          if(new_channel != channel || word1 != pi) {
+            ps.fill("_"); rt.fill(" ");
+          }
+          channel = new_channel; pi = word1;
+          time = word2 + word3 * 65536;
+          document.getElementById("station").textContent = ((870 + channel) / 10).toFixed(1) + " MHz, PI " + hex(pi);
+        }
+        // group, only after the first marker
+        else if(channel >= 0) {
+          time += word0 & 0x7ff;
+          group((word0 >> 13) & 0b11, (word0 >> 11) & 0b11, word1, word2, word3);
+        }
+      }
+      update();
+    };
+    socket.onclose = function() {
+      document.getElementById("station").textContent = "Disconnected, reload to reconnect";
+    };
+  </script>
+</body>
+</html>
+)rawliteral";
+
+const char ota_html[] PROGMEM = R"rawliteral(
+<!DOCTYPE HTML>
+<html lang="en">
+<head>
+  <meta charset="UTF-8">
+  <meta name="viewport" content="width=device-width, initial-scale=1">
+  <title>Firmware Update</title>
+
+  <style>
+    body {
+      font-family: Arial, sans-serif;
+      background-color: #f0f4f8;
+      color: #333;
+      margin: 0;
+      padding: 20px;
+      text-align: center;
+    }
+
+    h2 {
+      color: #0078d7;
+      font-size: 28px;
+      margin-bottom: 20px;
+      text-shadow: 1px 1px 2px rgba(0, 0, 0, 0.2);
+    }
+
+    .status {
+      font-size: 18px;
+      margin: 10px;
+      font-weight: bold;
+      line-height: 1.5;
+      padding: 10px;
+      background-color: #f9f9f9;
+      border-radius: 10px;
+      box-shadow: 0 4px 8px rgba(0, 0, 0, 0.1);
+      display: inline-block;
+    }
+
+    button {
+      background-color: #0078d7;
+      color: white;
+      border: none;
+      border-radius: 5px;
+      padding: 8px 16px;
+      margin: 5px;
+      cursor: pointer;
+    }
+
+    progress {
+      width: 300px;
+    }
+  </style>
+</head>
+
+<body>
+  <h2>Firmware Update</h2>
+
+  <div class="status">
+    <div>Master <input type="file" id="master" accept=".bin"> <button onclick="upload('master')">Update</button></div>
+    <div>Slave <input type="file" id="slave" accept=".bin"> <button onclick="upload('slave')">Update</button></div>
+    <div>Token <input type="password" id="token"></div>
+  </div>
+  <div class="status">
+    <div><progress id="progress" max="1" value="0"></progress></div>
+    <div id="state">Idle</div>
+    <div id="speed"></div>
+  </div>
+
+  <script>
+    var size = 0;
+    var timer = null;
+
+    function show(status) {
+      var total = status.total > 0 ? status.total : size;
+      document.getElementById("progress").value = total > 0 ? status.written / total : 0;
+      document.getElementById("state").textContent = status.target + ": " + status.state + (status.message ? " (" + status.message + ")" : "");
+      document.getElementById("speed").textContent = Math.round(status.written / 1024) + " KB in " + status.seconds + "s, " + status.kbps + " KB/s" + (status.resent > 0 ? ", " + status.resent + " blocks resent" : "");
+      if(status.state == "done" || status.state == "failed") {
+        clearInterval(timer);
+        timer = null;
+      }
+    }
+
+    function poll() {
+      var xhr = new XMLHttpRequest();
+      xhr.onload = function() { show(JSON.parse(xhr.responseText)); };
+      xhr.open("GET", "/ota/status", true);
+      xhr.send();
+    }
+
+    function upload(target) {
+      var file = document.getElementById(target).files[0];
+      if(!file) return;
+      size = file.size;
+      var form = new FormData();
+      form.append("firmware", file, file.name);
+      var xhr = new XMLHttpRequest();
+      xhr.onload = function() {
+        if(xhr.status != 403) return show(JSON.parse(xhr.responseText));
+        clearInterval(timer);
+        timer = null;
+        document.getElementById("state").textContent = "Wrong token";
+      };
+      xhr.open("POST", "/ota/" + target, true);
+      xhr.setRequestHeader("X-OTA-Token", document.getElementById("token").value);
+      xhr.send(form);
+      if(!timer) timer = setInterval(poll, 500);
+    }
+  </script>
+</body>
+</html>
+)rawliteral";
+
 #endif
\ No newline at end of file
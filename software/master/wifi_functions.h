@@ -7,14 +7,33 @@
 
 #include "constants.h"    // containing wifi name and password
 #include "website_html.h" // html for the website
+#include "metrics.h"       // I2C, loop and tuning latency metrics
+#include "logger.h"        // Non-blocking logs
+#include "metadata.h"      // Bluetooth metadata slots
+#include "rds_capture.h"   // RDS capture download and live stream
+#include "json.h"          // JSON responses
+#include "ota.h"           // Firmware updates
+#include "signal.h"        // Signal history
+#include "device_state.h"  // Published device state
 
 void notFound(AsyncWebServerRequest* request) {
   request->send(404, "text/plain", "Not found");
 }
 
+// Send a JSON object built with json.h
+void json_send(AsyncWebServerRequest* request, JsonWriter* json) {
+  const char* text = json_end(json);
+  if(text == nullptr) {
+    LOG_ERROR(WIFI, "JSON response too long");
+    request->send(500);
+    return;
+  }
+  request->send(200, "application/json", text);
+}
+
 // Setup Wi-Fi
 void WifiAP_begin() {
-  Serial.println("Configuring access point...");
+  LOG_INFO(WIFI, "Configuring access point...");
 
   // Set up the WiFi access point
   if(!WiFi.softAP(WIFI_SSID, WIFI_PW)) {
@@ -22,17 +41,47 @@ void WifiAP_begin() {
     while(1);
   }
   IPAddress myIP = WiFi.softAPIP();
-  Serial.print("AP IP address: ");
-  Serial.println(myIP);
+  LOG_INFO(WIFI, "AP IP address: %s", myIP.toString().c_str());
 }
 
-// Setup website (&server, &curr_freq, &curr_vol, &ready_state, &wifi_freq_update, &wifi_vol_update, &wifi_tune_update, &RDS_radiotext, &bluetooth_mode, &connection_state, &playback_state, &device_name, &media_title, &media_artist, &media_album, &server_bluetooth_mode)
+// Commands from the web pages, handed to loop() through web_commands (the handlers run on the async TCP task)
+#define WEB_FREQUENCY 0           // value = frequency (MHz / 0.1MHz)
+#define WEB_VOLUME 1              // value = volume
+#define WEB_TUNE 2                // value = 1 up, 0 down
+#define WEB_BLUETOOTH 3           // value = 1 Bluetooth mode, 0 radio mode
+#define WEB_TIMESHIFT 4           // value = 'P' pause, 'R' play, 'B' back, 'F' forward, 'L' live
+#define WEB_COMMANDS 8
+
+struct WebCommand {
+  uint8_t type;
+  int value;
+};
+
+QueueHandle_t web_commands = NULL;
+
+void web_command(uint8_t type, int value) {
+  WebCommand command = {type, value};
+  if(xQueueSend(web_commands, &command, 0) != pdTRUE) {
+    LOG_WARN(WIFI, "Web command %d dropped", type);
+  }
+}
+
+// Next command from the web pages (from loop()), false if there is none
+bool web_command_receive(WebCommand* command) {
+  return web_commands != NULL && xQueueReceive(web_commands, command, 0) == pdTRUE;
+}
+
+// Setup website (&server), the handlers read the published device state (device_state.h)
 // AsyncWebServer server(80);
-void ServerBegin(AsyncWebServer* server_pt, const int* freq_pt, const uint8_t* vol_pt, const bool* state_pt, int* freq_update, uint8_t* vol_update, String* tune_update, const String* radio_text, const bool* bluetooth_mode, const uint8_t* connection_state, const uint8_t* playback_state, char** device_name, char** media_title, char** media_artist, char** media_album, bool* server_bluetooth_mode) {
+void ServerBegin(AsyncWebServer* server_pt) {
+  web_commands = xQueueCreate(WEB_COMMANDS, sizeof(WebCommand));
+
   // Serve the web page with FM radio station list
-  (*server_pt).on("/", HTTP_GET, [=](AsyncWebServerRequest* request) {
+  (*server_pt).on("/", HTTP_GET, [](AsyncWebServerRequest* request) {
+    DeviceState state;
+    state_read(&state);
     // Radio mode
-    if(!(*bluetooth_mode)) {
+    if(!state.bluetooth_mode) {
       request->send_P(200, "text/html", index_html);
     }
     // Bluetooth mode, different html
@@ -42,87 +91,126 @@ void ServerBegin(AsyncWebServer* server_pt, const int* freq_pt, const uint8_t* v
   });
 
   // Updates bluetooth mode
-  (*server_pt).on("/bluetooth", HTTP_GET, [=](AsyncWebServerRequest *request) {
+  (*server_pt).on("/bluetooth", HTTP_GET, [](AsyncWebServerRequest *request) {
+    DeviceState state;
+    state_read(&state);
     // Create a JSON response with the state value "0" or "1"
-    String jsonResponse = "{\"mode\":\"" + String(*bluetooth_mode) + "\"}";
-    request->send(200, "application/json", jsonResponse);
+    char buffer[32];
+    JsonWriter json;
+    json_begin(&json, buffer, sizeof(buffer));
+    json_int(&json, "mode", state.bluetooth_mode);
+    json_send(request, &json);
   });
 
   // Updates on bluetooth metadata
-  (*server_pt).on("/bluetooth-metadata", HTTP_GET, [=](AsyncWebServerRequest *request) {
-    if(*bluetooth_mode) {
-      String temp_device_name = *device_name;
-      String temp_media_title = *media_title;
-      String temp_media_artist = *media_artist;
-      String temp_media_album = *media_album;
-
-      String jsonResponse = "{";
-      jsonResponse += "\"connection_state\":\"" + String(*connection_state) + "\",";
-      jsonResponse += "\"playback_state\":\"" + String(*playback_state) + "\",";
-      jsonResponse += "\"device_name\":\"" + temp_device_name + "\",";
-      jsonResponse += "\"media_title\":\"" + temp_media_title + "\",";
-      jsonResponse += "\"media_artist\":\"" + temp_media_artist + "\",";
-      jsonResponse += "\"media_album\":\"" + temp_media_album + "\"";
-      jsonResponse += "}";
-      request->send(200, "application/json", jsonResponse);
+  (*server_pt).on("/bluetooth-metadata", HTTP_GET, [](AsyncWebServerRequest *request) {
+    DeviceState state;
+    state_read(&state);
+    if(state.bluetooth_mode) {
+      // room for the slots with some escaped characters
+      char buffer[1024];
+      JsonWriter json;
+      json_begin(&json, buffer, sizeof(buffer));
+      json_int(&json, "connection_state", state.connection_state);
+      json_int(&json, "playback_state", state.playback_state);
+      json_string(&json, "device_name", state.metadata.device_name);
+      json_string(&json, "media_title", state.metadata.media_title);
+      json_string(&json, "media_artist", state.metadata.media_artist);
+      json_string(&json, "media_album", state.metadata.media_album);
+      json_send(request, &json);
     }
   });
 
   // Handle AJAX requests, get current frequency, volume and radiotext
-  (*server_pt).on("/update", HTTP_GET, [=](AsyncWebServerRequest *request) {
+  (*server_pt).on("/update", HTTP_GET, [](AsyncWebServerRequest *request) {
+    DeviceState state;
+    state_read(&state);
     // Create a JSON response with both values
-    String jsonResponse = "{";
-    jsonResponse += "\"frequency\":\"" + String(*freq_pt) + "\",";
-    jsonResponse += "\"volume\":\"" + String(*vol_pt) + "\",";
-    jsonResponse += "\"radiotext\":\"" + String(*radio_text) + "\"";
-    jsonResponse += "}";
-    request->send(200, "application/json", jsonResponse);
+    char buffer[352];
+    JsonWriter json;
+    json_begin(&json, buffer, sizeof(buffer));
+    json_int(&json, "frequency", state.frequency);
+    json_int(&json, "volume", state.volume);
+    json_string(&json, "radiotext", state.radiotext);
+    json_int(&json, "timeshift", state.timeshift_state);
+    json_int(&json, "timeshift_delay", state.timeshift_delay);
+    json_int(&json, "timeshift_skip", state.timeshift_skip);
+    json_send(request, &json);
   });
 
   // Retrieve current state (radio ready or not), ready = true
-  (*server_pt).on("/status", HTTP_GET, [=](AsyncWebServerRequest *request) {
+  (*server_pt).on("/status", HTTP_GET, [](AsyncWebServerRequest *request) {
+    DeviceState state;
+    state_read(&state);
     // Create a JSON response with the state value "0" or "1"
-    String jsonResponse = "{\"status\":\"" + String(*state_pt) + "\"}";
-    request->send(200, "application/json", jsonResponse);
+    char buffer[32];
+    JsonWriter json;
+    json_begin(&json, buffer, sizeof(buffer));
+    json_int(&json, "status", state.ready);
+    json_send(request, &json);
   });
 
   // If commands of settings are changed from server, gets info
-  (*server_pt).on("/get", HTTP_GET, [=](AsyncWebServerRequest* request) {
-    String frequencyMessage = "Nan";
-    String volumeMessage = "Nan";
-    String tuneMessage = "Nan";
-    String bluetoothModeMessage = "Nan";
+  (*server_pt).on("/get", HTTP_GET, [](AsyncWebServerRequest* request) {
+    power_activity();
     if(request->hasParam("frequency")) {
-      frequencyMessage = request->getParam("frequency")->value();
-      *freq_update = frequencyMessage.toFloat() * 10;
+      trace_begin(TRACE_WEB);
+      web_command(WEB_FREQUENCY, request->getParam("frequency")->value().toFloat() * 10);
     }
     if(request->hasParam("volume")) {
-      volumeMessage = request->getParam("volume")->value();
-      *vol_update = volumeMessage.toInt();
+      web_command(WEB_VOLUME, request->getParam("volume")->value().toInt());
     }
     if(request->hasParam("tune")) {
-      tuneMessage = request->getParam("tune")->value();
-      *tune_update = tuneMessage;
+      trace_begin(TRACE_WEB);
+      web_command(WEB_TUNE, request->getParam("tune")->value() == "up");
     }
     if(request->hasParam("bluetooth-mode")) {
-      bluetoothModeMessage = request->getParam("bluetooth-mode")->value();
-      *server_bluetooth_mode = (bluetoothModeMessage == "true");
+      web_command(WEB_BLUETOOTH, request->getParam("bluetooth-mode")->value() == "true");
+    }
+    // pause, play, back, forward, live
+    if(request->hasParam("timeshift")) {
+      String command = request->getParam("timeshift")->value();
+      if(command.length() > 0 && strchr("PRBFL", command[0]) != nullptr) {
+        web_command(WEB_TIMESHIFT, command[0]);
+      }
     }
   });
 
   // If tune up is activated from server, gets info
   (*server_pt).on("/tune_up", HTTP_GET, [](AsyncWebServerRequest* request) {
-    Serial.println("Tune up pressed");
+    LOG_INFO(WIFI, "Tune up pressed");
   });
 
   // If tune down is activated from server, gets info
   (*server_pt).on("/tune_down", HTTP_GET, [](AsyncWebServerRequest* request) {
-    Serial.println("Tune down pressed");
+    LOG_INFO(WIFI, "Tune down pressed");
+  });
+
+  // Metrics, Prometheus text format
+  (*server_pt).on("/metrics", HTTP_GET, [](AsyncWebServerRequest* request) {
+    AsyncResponseStream* response = request->beginResponseStream("text/plain; version=0.0.4");
+    metrics_print(*response);
+    request->send(response);
+  });
+
+  // RDS inspector, capture download and live stream
+  (*server_pt).on("/rds", HTTP_GET, [](AsyncWebServerRequest* request) {
+    request->send_P(200, "text/html", rds_html);
+  });
+  rds_server_begin(server_pt);
+
+  // Signal history, binary series for the sparkline
+  signal_server_begin(server_pt);
+
+  // Firmware updates, page and upload endpoints
+  (*server_pt).on("/ota", HTTP_GET, [](AsyncWebServerRequest* request) {
+    request->send_P(200, "text/html", ota_html);
   });
+  ota_server_begin(server_pt);
 
   (*server_pt).onNotFound(notFound);
   (*server_pt).begin();
-  Serial.println("Server started");
+  LOG_INFO(WIFI, "Server started");
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,133 @@
+#ifndef adpcm_h
+#define adpcm_h
+
+#include "stdint.h"
+#include "string.h"
+
+// IMA ADPCM for the time shift ring
+// Radio frames (16-bit stereo, 44.1kHz) are mixed to mono and decimated by 2 (average of 2 frames), then coded
+// with 4 bits per sample: 11kB per second. The code goes in blocks of ADPCM_BLOCK_BYTES that start with the coder
+// state (predictor, step index), so decoding can start at any block. Decoding interpolates back to 44.1kHz
+// stereo. Encoder and decoder update the predictor with the same integer steps, so they never drift apart.
+// No Arduino dependencies, also used by misc/benchmark.
+
+#define ADPCM_BLOCK_BYTES 256
+#define ADPCM_BLOCK_HEADER 4                                              // predictor (2, little endian), index, 0
+#define ADPCM_BLOCK_SAMPLES ((ADPCM_BLOCK_BYTES - ADPCM_BLOCK_HEADER) * 2)  // 504
+#define ADPCM_DECIMATION 2                                                // 44.1kHz frames per sample
+#define ADPCM_BLOCK_FRAMES (ADPCM_BLOCK_SAMPLES * ADPCM_DECIMATION)        // 1008 frames, 22.9ms
+#define ADPCM_SAMPLE_RATE 22050
+
+const int16_t adpcm_steps[89] = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66, 73, 80, 88, 97,
+  107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+  876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428,
+  4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350,
+  22385, 24623, 27086, 29794, 32767
+};
+
+const int8_t adpcm_index_change[8] = {-1, -1, -1, -1, 2, 4, 6, 8};
+
+struct AdpcmState {
+  int32_t predictor;
+  int32_t index;                      // into adpcm_steps
+};
+
+struct AdpcmEncoder {
+  AdpcmState state;
+  uint8_t block[ADPCM_BLOCK_BYTES];
+  uint16_t samples;                   // samples in block
+  int32_t half;                       // first frame of a pair split between calls (L + R)
+  bool split;
+};
+
+// Predictor and index after code (encoder and decoder)
+inline void adpcm_step(AdpcmState* state, uint8_t code) {
+  int32_t step = adpcm_steps[state->index];
+  int32_t delta = step >> 3;
+  if(code & 4) delta += step;
+  if(code & 2) delta += step >> 1;
+  if(code & 1) delta += step >> 2;
+  int32_t predictor = (code & 8) ? state->predictor - delta : state->predictor + delta;
+  state->predictor = (predictor > 32767) ? 32767 : (predictor < -32768) ? -32768 : predictor;
+  int32_t index = state->index + adpcm_index_change[code & 7];
+  state->index = (index < 0) ? 0 : (index > 88) ? 88 : index;
+}
+
+inline uint8_t adpcm_encode_sample(AdpcmState* state, int32_t sample) {
+  int32_t step = adpcm_steps[state->index];
+  int32_t diff = sample - state->predictor;
+  uint8_t code = 0;
+  if(diff < 0) {
+    code = 8;
+    diff = -diff;
+  }
+  if(diff >= step) { code |= 4; diff -= step; }
+  step >>= 1;
+  if(diff >= step) { code |= 2; diff -= step; }
+  step >>= 1;
+  if(diff >= step) { code |= 1; }
+  adpcm_step(state, code);
+  return code;
+}
+
+void adpcm_encoder_begin(AdpcmEncoder* encoder) {
+  memset(encoder, 0, sizeof(AdpcmEncoder));
+}
+
+// Encode up to count frames (interleaved stereo), stops when the block is full. Returns the frames used,
+// *full = encoder->block holds a whole block, the next call starts a new one
+uint32_t adpcm_encode(AdpcmEncoder* encoder, const int16_t* frames, uint32_t count, bool* full) {
+  *full = false;
+  uint32_t used = 0;
+  while(used < count) {
+    int32_t pair = frames[2*used] + frames[2*used + 1];
+    used++;
+    if(!encoder->split) {
+      encoder->half = pair;
+      encoder->split = true;
+      continue;
+    }
+    encoder->split = false;
+    int32_t sample = (encoder->half + pair) >> 2;
+
+    uint16_t n = encoder->samples;
+    if(n == 0) {
+      encoder->block[0] = encoder->state.predictor & 0xff;
+      encoder->block[1] = (encoder->state.predictor >> 8) & 0xff;
+      encoder->block[2] = encoder->state.index;
+      encoder->block[3] = 0;
+    }
+    uint8_t code = adpcm_encode_sample(&encoder->state, sample);
+    uint8_t* byte = &encoder->block[ADPCM_BLOCK_HEADER + n / 2];
+    *byte = (n & 1) ? (*byte | code << 4) : code;
+    encoder->samples = n + 1;
+    if(encoder->samples == ADPCM_BLOCK_SAMPLES) {
+      encoder->samples = 0;
+      *full = true;
+      break;
+    }
+  }
+  return used;
+}
+
+// Decode a block into ADPCM_BLOCK_FRAMES frames (interleaved stereo, 44.1kHz), *previous = last sample of the
+// block before, for the interpolation across blocks
+void adpcm_decode_block(const uint8_t* block, int16_t* frames, int16_t* previous) {
+  AdpcmState state;
+  state.predictor = (int16_t)(block[0] | block[1] << 8);
+  state.index = (block[2] > 88) ? 88 : block[2];
+  int32_t last = *previous;
+  for(int n=0; n<ADPCM_BLOCK_SAMPLES; n++) {
+    uint8_t byte = block[ADPCM_BLOCK_HEADER + n / 2];
+    adpcm_step(&state, (n & 1) ? byte >> 4 : byte & 0x0f);
+    int16_t middle = (last + state.predictor) >> 1;
+    int16_t sample = state.predictor;
+    frames[4*n] = middle; frames[4*n + 1] = middle;
+    frames[4*n + 2] = sample; frames[4*n + 3] = sample;
+    last = sample;
+  }
+  *previous = last;
+}
+
+#endif
@@ -0,0 +1,376 @@
+#ifndef audio_path_h
+#define audio_path_h
+
+#include "Arduino.h"
+#include "AudioTools.h"           // Digital audio library
+#include "BluetoothA2DPSink.h"    // Bluetooth library
+
+#include "logger.h"
+#include "audio_ring.h"           // Source rings, Bluetooth depth and radio drift control
+#include "dsp.h"                  // EQ, loudness and limiter for Bluetooth audio
+#include "timeshift.h"            // Radio time shift ring
+
+// Digital audio path
+// Bluetooth (A2DP) and radio (RDA5807M I2S output) audio are written into 2 frame rings. The audio task
+// mixes them into the I2S output, so radio and Bluetooth can be crossfaded and the radio gets a digital
+// volume. Frames are 16-bit signed interleaved stereo at 44.1kHz. The radio is also recorded for the time shift,
+// which replaces the radio ring in the mix while the master has paused or rewound it. The fill of both rings is
+// controlled in audio_ring.h: an adaptive depth for Bluetooth, clock drift correction for the radio.
+
+// Radio input, 1 - RDA5807M I2S output is wired to the RADIO_* pins (master needs I2S_AUDIO_PATH 1)
+#ifndef RADIO_I2S_INPUT
+#define RADIO_I2S_INPUT 0
+#endif
+// 1 - RDA5807M is I2S master (generates BCK/WS), 0 - ESP32 generates the clocks
+#define RADIO_I2S_RDA_MASTER 1
+// 1 - replace the radio input with a generated 1kHz tone, for testing the path without the RDA5807M
+#define RADIO_TEST_SOURCE 0
+// 1 - replace the Bluetooth input with a 440Hz tone sent in bursts with random delays and drops,
+// for testing the adaptive depth and the telemetry without a phone
+#define BT_JITTER_TEST 0
+
+// Radio I2S pins (RDA5807M GPIO1-3 in I2S mode)
+#define RADIO_BCK 32
+#define RADIO_WS 33
+#define RADIO_DIN 34
+
+#define AUDIO_CROSSFADE_MS 50
+#define AUDIO_IDLE_BLOCKS 16         // silent blocks written before the output task sleeps (fills the DMA buffers)
+
+#define BT_LOSS_FRAMES 4410          // data more than 100ms behind the stream clock is counted as lost
+
+// 1 - Bluetooth audio goes through the DSP chain (EQ, loudness, limiter)
+#define DSP_ENABLE 1
+// 1 - log cycles per sample of the DSP chain and samples over the limiter threshold at startup
+#define DSP_SELFTEST 0
+
+// Radio volume 0-15 to Q15 gain, 3dB per step like the RDA5807M volume
+const int16_t radio_volume_gain[16] = {
+  0, 260, 368, 519, 734, 1036, 1464, 2067, 2920, 4125, 5827, 8231, 11626, 16422, 23197, 32767
+};
+
+FrameRing bt_ring;
+FrameRing radio_ring;
+BtDepth bt_depth;
+RadioDrift radio_drift;
+
+I2SStream i2s;                // output to DAC
+#if RADIO_I2S_INPUT && !RADIO_TEST_SOURCE
+I2SStream i2s_radio;          // input from RDA5807M
+#endif
+
+DspChain bt_dsp;
+
+// Bluetooth telemetry, sent to the master in the slave data packet
+volatile uint32_t bt_lost_frames = 0;         // frames missing from the stream (estimated, see bt_audio_reader)
+volatile uint32_t bt_bitrate = 0;             // SBC bitrate at the negotiated max bitpool, bits per second
+volatile unsigned long bt_last_data = 0;      // millis() of last A2DP data
+
+// Mixer state, gains in Q15
+volatile bool audio_bluetooth = false;    // source selected
+TaskHandle_t audio_output_handle = NULL;  // woken when a source is selected
+volatile uint8_t audio_radio_volume = 15;
+int32_t bt_gain = 0;
+int32_t radio_gain = 0;
+
+// Bluetooth PCM from A2DP task
+// The stack decodes SBC before this callback, so RTP sequence numbers are not visible. Loss is estimated
+// from the stream clock instead: frames received are compared to the time since the stream started, a
+// deficit of more than BT_LOSS_FRAMES is counted as lost and the clock is restarted
+void bt_audio_reader(const uint8_t* data, uint32_t length) {
+  static unsigned long stream_start = 0; // micros() of stream clock origin
+  static uint64_t received = 0;          // frames since stream_start
+  uint32_t frames = length / 4;
+  unsigned long now = micros();
+
+  // first data after a pause restarts the stream clock
+  if(millis() - bt_last_data > BT_PAUSE_MS) {
+    stream_start = now;
+    received = 0;
+  }
+  bt_last_data = millis();
+
+  int64_t expected = (uint64_t)(now - stream_start) * AUDIO_SAMPLE_RATE / 1000000;
+  int64_t deficit = expected - (int64_t)received;
+  if(deficit > BT_LOSS_FRAMES || deficit < 0) {
+    if(deficit > 0) bt_lost_frames += deficit;
+    // source is ahead (burst) or data was lost, restart clock at this packet
+    stream_start = now;
+    received = 0;
+  }
+  received += frames;
+
+  ring_write(&bt_ring, (const int16_t*)data, frames);
+}
+
+// SBC bitrate from the codec information element, assuming the source uses the max bitpool
+uint32_t sbc_bitrate(const uint8_t* cie) {
+  uint32_t sample_rate = (cie[0] & 0x80) ? 16000 : (cie[0] & 0x40) ? 32000 : (cie[0] & 0x20) ? 44100 : 48000;
+  uint8_t channel_mode = cie[0] & 0x0f;  // 8 - mono, 4 - dual channel, 2 - stereo, 1 - joint stereo
+  uint32_t blocks = (cie[1] & 0x80) ? 4 : (cie[1] & 0x40) ? 8 : (cie[1] & 0x20) ? 12 : 16;
+  uint32_t subbands = (cie[1] & 0x08) ? 4 : 8;
+  uint32_t bitpool = cie[3];
+  uint32_t channels = (channel_mode == 0x08) ? 1 : 2;
+
+  uint32_t frame_length = 4 + (4 * subbands * channels) / 8;
+  if(channel_mode == 0x08 || channel_mode == 0x04) frame_length += (blocks * channels * bitpool + 7) / 8;
+  else if(channel_mode == 0x02) frame_length += (blocks * bitpool + 7) / 8;
+  else frame_length += (subbands + blocks * bitpool + 7) / 8;
+  return 8 * frame_length * sample_rate / (subbands * blocks);
+}
+
+// A2DP sink that keeps the negotiated codec configuration for telemetry
+class MeteredA2DPSink : public BluetoothA2DPSink {
+  protected:
+    void handle_audio_cfg(uint16_t event, void* p_param) {
+      BluetoothA2DPSink::handle_audio_cfg(event, p_param);
+      esp_a2d_cb_param_t* a2d = (esp_a2d_cb_param_t*)p_param;
+      if(a2d->audio_cfg.mcc.type == ESP_A2D_MCT_SBC) {
+        bt_bitrate = sbc_bitrate(a2d->audio_cfg.mcc.cie.sbc);
+        LOG_INFO(AUDIO, "SBC codec, %lu bps", (unsigned long)bt_bitrate);
+      }
+    }
+};
+
+#if BT_JITTER_TEST
+// Test Bluetooth source: 512 frame packets, mostly on time, sometimes in late bursts, 2% dropped
+void bt_jitter_task(void* parameter) {
+  static int16_t packet[512 * 2];
+  uint32_t phase = 0;
+  unsigned long next = micros();
+  while(true) {
+    for(int i=0; i<512; i++) {
+      int16_t sample = (int16_t)(8000 * sinf(2 * PI * phase / 100.227f)); // 440Hz
+      packet[2*i] = sample; packet[2*i + 1] = sample;
+      phase = (phase + 1) % 100227;
+    }
+    next += 512 * 1000000UL / AUDIO_SAMPLE_RATE;
+    // 10% of packets are late by up to 60ms, they arrive together with the following ones
+    long late = (esp_random() % 10 == 0) ? (esp_random() % 60000) : 0;
+    long wait = (long)(next + late - micros());
+    if(wait > 0) vTaskDelay(pdMS_TO_TICKS(wait / 1000));
+    if(esp_random() % 50 != 0) {
+      bt_audio_reader((const uint8_t*)packet, sizeof(packet));
+    }
+  }
+}
+#endif
+
+#if RADIO_I2S_INPUT
+// Radio input task, moves the I2S DMA buffers (or the test tone) into the radio ring
+void radio_input_task(void* parameter) {
+  static int16_t block[AUDIO_BLOCK_FRAMES * 2];
+#if RADIO_TEST_SOURCE
+  uint32_t phase = 0;
+  uint64_t generated = 0;
+  unsigned long start = micros();
+#endif
+  while(true) {
+#if RADIO_TEST_SOURCE
+    // 1kHz tone (44.1 samples per period), generated at the sample rate
+    vTaskDelay(pdMS_TO_TICKS(5));
+    uint64_t due = (uint64_t)(micros() - start) * AUDIO_SAMPLE_RATE / 1000000 - generated;
+    uint32_t frames = (due < AUDIO_BLOCK_FRAMES) ? due : AUDIO_BLOCK_FRAMES;
+    for(int i=0; i<frames; i++) {
+      int16_t sample = (int16_t)(8000 * sinf(2 * PI * phase / 44.1f));
+      block[2*i] = sample; block[2*i + 1] = sample;
+      phase = (phase + 1) % 441;
+    }
+    ring_write(&radio_ring, block, frames);
+    timeshift_write(block, frames);
+    generated += frames;
+#else
+    size_t bytes = i2s_radio.readBytes((uint8_t*)block, sizeof(block));
+    ring_write(&radio_ring, block, bytes / 4);
+    timeshift_write(block, bytes / 4);
+#endif
+  }
+}
+#endif
+
+// Mix both rings into the output, paced by the blocking I2S write
+void audio_output_task(void* parameter) {
+  static int16_t bt_block[AUDIO_BLOCK_FRAMES * 2];
+  static int16_t radio_block[AUDIO_BLOCK_FRAMES * 2];
+  static int16_t out_block[AUDIO_BLOCK_FRAMES * 2];
+  const int32_t gain_step = 32767 / (AUDIO_SAMPLE_RATE * AUDIO_CROSSFADE_MS / 1000);
+  int silent_blocks = 0;
+  bt_depth_begin(&bt_depth);
+  radio_drift_reset(&radio_drift);
+
+  while(true) {
+    // Nothing audible (Bluetooth off, radio is analog): DMA buffers hold silence, sleep until a source is selected
+    if(!RADIO_I2S_INPUT && !audio_bluetooth && bt_gain == 0) {
+      if(silent_blocks >= AUDIO_IDLE_BLOCKS) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        continue;
+      }
+      silent_blocks++;
+    }
+    else {
+      silent_blocks = 0;
+    }
+
+    int32_t bt_target_gain = audio_bluetooth ? 32767 : 0;
+    int32_t radio_target = audio_bluetooth ? 0 : 32767;
+
+    // Only pull from rings of audible sources, count underruns
+    if(bt_target_gain != 0 || bt_gain != 0) {
+      bool streaming = millis() - bt_last_data <= BT_PAUSE_MS;
+      if(bt_ring_block(&bt_ring, &bt_depth, bt_block, streaming, bt_target_gain != 0, millis())) {
+        LOG_WARN(AUDIO, "Bluetooth underrun, target depth %lu frames", (unsigned long)bt_depth.target);
+      }
+      if(DSP_ENABLE) {
+        dsp_process(&bt_dsp, bt_block, AUDIO_BLOCK_FRAMES);
+      }
+    }
+    else {
+      bt_ring_idle(&bt_ring, &bt_depth, bt_block);
+    }
+    if(RADIO_I2S_INPUT && (radio_target != 0 || radio_gain != 0)) {
+      // paused or behind live, the live frames are dropped
+      if(timeshift_read(radio_block, AUDIO_BLOCK_FRAMES)) {
+        ring_drop(&radio_ring);
+        radio_drift_reset(&radio_drift);
+      }
+      else if(!radio_ring_block(&radio_ring, &radio_drift, radio_block) && radio_target != 0) {
+        radio_ring.underruns++;
+      }
+    }
+    else {
+      memset(radio_block, 0, sizeof(radio_block));
+      ring_drop(&radio_ring);
+      radio_drift_reset(&radio_drift);
+    }
+
+    int32_t volume = radio_volume_gain[audio_radio_volume & 0b1111];
+    for(int i=0; i<AUDIO_BLOCK_FRAMES; i++) {
+      // crossfade ramps, per frame
+      if(bt_gain < bt_target_gain) bt_gain = min(bt_gain + gain_step, bt_target_gain);
+      else if(bt_gain > bt_target_gain) bt_gain = max(bt_gain - gain_step, bt_target_gain);
+      if(radio_gain < radio_target) radio_gain = min(radio_gain + gain_step, radio_target);
+      else if(radio_gain > radio_target) radio_gain = max(radio_gain - gain_step, radio_target);
+      int32_t radio_total = (radio_gain * volume) >> 15;
+
+      for(int ch=0; ch<2; ch++) {
+        int32_t mixed = ((int32_t)bt_block[2*i + ch] * bt_gain + (int32_t)radio_block[2*i + ch] * radio_total) >> 15;
+        out_block[2*i + ch] = (int16_t)constrain(mixed, -32768, 32767);
+      }
+    }
+
+    i2s.write((const uint8_t*)out_block, sizeof(out_block));
+  }
+}
+
+// Select audio source, crossfades over AUDIO_CROSSFADE_MS
+void audio_select_bluetooth(bool bluetooth) {
+  audio_bluetooth = bluetooth;
+  if(audio_output_handle != NULL) {
+    xTaskNotifyGive(audio_output_handle);
+  }
+}
+
+// Digital radio volume 0-15
+void audio_set_radio_volume(uint8_t volume) {
+  audio_radio_volume = (volume > 15) ? 15 : volume;
+}
+
+// A2DP volume 0-127, loudness curve follows it
+void audio_set_bt_volume(int volume) {
+  dsp_set_volume(&bt_dsp, (uint8_t)volume);
+}
+
+#if DSP_SELFTEST
+// Runs a full scale test signal through the chain, logs cycles per sample and samples over the limiter
+// threshold. The accuracy of the chain is checked against double precision filters on the PC
+// (misc/benchmark/host_tests.cpp dsp_biquads and dsp_limiter), this only measures the target
+void dsp_selftest() {
+  static int16_t block[AUDIO_BLOCK_FRAMES * 2];
+  static DspChain test;
+  dsp_begin(&test);
+  dsp_set_volume(&test, 40);
+
+  uint32_t overs = 0;
+  uint32_t cycles = 0;
+  for(int n=0; n<16; n++) {
+    // chirp at full scale on the left, 1kHz on the right
+    for(int i=0; i<AUDIO_BLOCK_FRAMES; i++) {
+      float t = (n * AUDIO_BLOCK_FRAMES + i) / (float)AUDIO_SAMPLE_RATE;
+      block[2*i] = (int16_t)(32000 * sinf(2 * PI * (50 + 4000 * t) * t));
+      block[2*i + 1] = (int16_t)(16000 * sinf(2 * PI * 1000 * t));
+    }
+
+    uint32_t start = ESP.getCycleCount();
+    dsp_process(&test, block, AUDIO_BLOCK_FRAMES);
+    cycles += ESP.getCycleCount() - start;
+
+    for(int i=0; i<AUDIO_BLOCK_FRAMES * 2; i++) {
+      if(abs(block[i]) > DSP_LIMITER_THRESHOLD) overs++;
+    }
+  }
+
+  LOG_INFO(AUDIO, "DSP selftest: %lu samples over threshold, %.1f cycles per sample",
+    (unsigned long)overs, cycles / (16.0f * AUDIO_BLOCK_FRAMES * 2));
+}
+#endif
+
+// Bluetooth telemetry as text for the slave data packet: "fill,target,underruns,lost,bitrate"
+// (digits and commas only, cannot contain the 0x1d separator)
+int audio_telemetry(char* out, size_t size) {
+  return snprintf(out, size, "%lu,%lu,%lu,%lu,%lu",
+    (unsigned long)ring_fill(&bt_ring), (unsigned long)bt_depth.target, (unsigned long)bt_ring.underruns,
+    (unsigned long)bt_lost_frames, (unsigned long)bt_bitrate);
+}
+
+// Log ring fill levels and underruns
+void audio_log_stats() {
+  LOG_INFO(AUDIO, "bt ring %lu/%lu frames, %lu underruns, %lu overruns, %lu lost | radio ring %lu frames, %lu underruns, %lu overruns, %lu skipped, %lu repeated",
+    (unsigned long)ring_fill(&bt_ring), (unsigned long)bt_depth.target, (unsigned long)bt_ring.underruns,
+    (unsigned long)bt_ring.overruns, (unsigned long)bt_lost_frames,
+    (unsigned long)ring_fill(&radio_ring), (unsigned long)radio_ring.underruns, (unsigned long)radio_ring.overruns,
+    (unsigned long)radio_drift.skipped, (unsigned long)radio_drift.repeated);
+}
+
+// Start I2S output, radio input and the audio tasks (a2dp_sink = Bluetooth sink, not started yet)
+void audio_begin(BluetoothA2DPSink* a2dp_sink, int pin_bck, int pin_ws, int pin_data) {
+  auto cfg = i2s.defaultConfig(TX_MODE); //set the config to default: 44.1 kHz sample frequency and 16 bits per sample
+  cfg.pin_bck = pin_bck;
+  cfg.pin_ws = pin_ws;
+  cfg.pin_data = pin_data;
+  i2s.begin(cfg);
+
+#if RADIO_I2S_INPUT && !RADIO_TEST_SOURCE
+  auto radio_cfg = i2s_radio.defaultConfig(RX_MODE);
+  radio_cfg.port_no = 1;
+  radio_cfg.is_master = !RADIO_I2S_RDA_MASTER;
+  radio_cfg.pin_bck = RADIO_BCK;
+  radio_cfg.pin_ws = RADIO_WS;
+  radio_cfg.pin_data = RADIO_DIN;
+  radio_cfg.sample_rate = AUDIO_SAMPLE_RATE;
+  radio_cfg.buffer_count = 8;   // DMA ring, 8 x 256 frames
+  radio_cfg.buffer_size = 1024;
+  i2s_radio.begin(radio_cfg);
+#endif
+
+#if RADIO_I2S_INPUT
+  timeshift_begin();
+#endif
+
+  dsp_begin(&bt_dsp);
+#if DSP_SELFTEST
+  dsp_selftest();
+#endif
+
+  // Bluetooth PCM goes into the ring instead of directly to I2S
+  a2dp_sink->set_stream_reader(bt_audio_reader, false);
+
+#if BT_JITTER_TEST
+  xTaskCreatePinnedToCore(bt_jitter_task, "bt_jitter", 4096, NULL, 4, NULL, 0);
+#endif
+#if RADIO_I2S_INPUT
+  xTaskCreatePinnedToCore(radio_input_task, "radio_input", 4096, NULL, 5, NULL, 1);
+#endif
+  xTaskCreatePinnedToCore(audio_output_task, "audio_output", 4096, NULL, 5, &audio_output_handle, 1);
+}
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef audio_ring_h
+#define audio_ring_h
+
+#include "stdint.h"
+#include "string.h"
+
+// Frame rings of the audio path and their fill control
+// Sources write 16-bit stereo frames into a FrameRing, the output task reads one block per I2S write.
+// Bluetooth: playback starts once the ring holds a target depth. The target grows when underruns happen while
+// data is still arriving (phone far away) and shrinks again after a stable period.
+// Radio: the RDA5807M clocks its I2S output from its own crystal, the ESP32 output runs from another one, so
+// the radio ring slowly fills or drains (up to ~100ppm, a frame every 0.2s). The output keeps a smoothed fill
+// near RADIO_TARGET_FRAMES: above the band one frame is skipped, below it the last frame is played twice, at most
+// one frame per block. After an underrun or a drop the ring fills up to the target again before it plays.
+// No Arduino dependencies, also used by misc/benchmark.
+
+#define AUDIO_SAMPLE_RATE 44100
+#define AUDIO_BLOCK_FRAMES 256       // frames mixed per output write, 5.8ms
+#define AUDIO_RING_FRAMES 4096       // frames per source ring, 93ms
+
+// Bluetooth ring target depth (prebuffer), frames
+#define BT_TARGET_MIN 1024           // 23ms
+#define BT_TARGET_MAX 3584           // 81ms, leaves space for one A2DP packet
+#define BT_TARGET_STEP 512
+#define BT_STABLE_MS 30000           // no underrun for this long, target goes down one step
+#define BT_PAUSE_MS 500              // no data for this long, stream is paused (not an underrun)
+
+// Radio ring fill, frames
+#define RADIO_TARGET_FRAMES 768      // 3 blocks, the input task writes in blocks too
+#define RADIO_SLIP_FRAMES 256        // band around the target without correction
+#define RADIO_FILL_SHIFT 4           // smoothing of the fill, 1/16 per block
+
+// Single producer, single consumer ring of stereo frames (one frame = 2 int16 samples)
+struct FrameRing {
+  int16_t data[AUDIO_RING_FRAMES * 2];
+  volatile uint32_t head; // frames written
+  volatile uint32_t tail; // frames read
+  uint32_t overruns;      // frames dropped because the ring was full
+  uint32_t underruns;     // blocks that could not be filled while the source was playing
+};
+
+// Bluetooth depth control (output task)
+struct BtDepth {
+  volatile uint32_t target;   // ring depth playback waits for
+  bool buffering;             // waiting for the ring to reach target
+  uint32_t last_change;       // ms of last underrun or target decrease
+};
+
+// Radio clock drift control (output task)
+struct RadioDrift {
+  bool priming;               // filling up to RADIO_TARGET_FRAMES
+  int32_t fill;               // smoothed fill << RADIO_FILL_SHIFT
+  uint32_t skipped;           // frames dropped, input faster
+  uint32_t repeated;          // frames played twice, input slower
+};
+
+uint32_t ring_fill(const FrameRing* ring) {
+  return ring->head - ring->tail;
+}
+
+// Write frames into ring, frames that do not fit are dropped
+void ring_write(FrameRing* ring, const int16_t* samples, uint32_t frames) {
+  uint32_t space = AUDIO_RING_FRAMES - ring_fill(ring);
+  if(frames > space) {
+    ring->overruns += frames - space;
+    frames = space;
+  }
+  uint32_t head = ring->head;
+  for(uint32_t i=0; i<frames; i++) {
+    uint32_t index = (head + i) % AUDIO_RING_FRAMES;
+    ring->data[2*index] = samples[2*i];
+    ring->data[2*index + 1] = samples[2*i + 1];
+  }
+  ring->head = head + frames;
+}
+
+// Read up to frames from ring, the rest is filled with silence. Returns frames read
+uint32_t ring_read(FrameRing* ring, int16_t* samples, uint32_t frames) {
+  uint32_t available = ring_fill(ring);
+  uint32_t count = (frames < available) ? frames : available;
+  uint32_t tail = ring->tail;
+  for(uint32_t i=0; i<count; i++) {
+    uint32_t index = (tail + i) % AUDIO_RING_FRAMES;
+    samples[2*i] = ring->data[2*index];
+    samples[2*i + 1] = ring->data[2*index + 1];
+  }
+  memset(samples + 2*count, 0, (frames - count) * 2 * sizeof(int16_t));
+  ring->tail = tail + count;
+  return count;
+}
+
+// Drop everything written so far (the reader side of the ring)
+void ring_drop(FrameRing* ring) {
+  ring->tail = ring->head;
+}
+
+void bt_depth_begin(BtDepth* depth) {
+  depth->target = BT_TARGET_MIN;
+  depth->buffering = true;
+  depth->last_change = 0;
+}
+
+// One block of Bluetooth audio while it is audible (output task). streaming = data arrived in the last
+// BT_PAUSE_MS, selected = Bluetooth is the selected source (not fading out), now_ms = millis().
+// Returns true on an underrun that deepened the target
+bool bt_ring_block(FrameRing* ring, BtDepth* depth, int16_t* block, bool streaming, bool selected, uint32_t now_ms) {
+  bool deepened = false;
+  if(depth->buffering) {
+    memset(block, 0, AUDIO_BLOCK_FRAMES * 2 * sizeof(int16_t));
+    if(ring_fill(ring) >= depth->target) {
+      depth->buffering = false;
+    }
+    else if(!streaming) {
+      ring_drop(ring); // end of a stream, do not play it with the next one
+    }
+  }
+  else if(ring_read(ring, block, AUDIO_BLOCK_FRAMES) < AUDIO_BLOCK_FRAMES) {
+    depth->buffering = true;
+    // data still arriving, the buffer was too small: deepen it
+    if(streaming && selected) {
+      ring->underruns++;
+      if(depth->target < BT_TARGET_MAX) depth->target += BT_TARGET_STEP;
+      depth->last_change = now_ms;
+      deepened = true;
+    }
+  }
+  // stable for a while, shrink target; extra latency is dropped one frame per block (inaudible)
+  if(now_ms - depth->last_change > BT_STABLE_MS) {
+    if(depth->target > BT_TARGET_MIN) depth->target -= BT_TARGET_STEP;
+    depth->last_change = now_ms;
+  }
+  if(!depth->buffering && ring_fill(ring) > depth->target + BT_TARGET_STEP) {
+    ring->tail = ring->tail + 1;
+  }
+  return deepened;
+}
+
+// Bluetooth not audible, stale audio is dropped
+void bt_ring_idle(FrameRing* ring, BtDepth* depth, int16_t* block) {
+  memset(block, 0, AUDIO_BLOCK_FRAMES * 2 * sizeof(int16_t));
+  ring_drop(ring);
+  depth->buffering = true;
+}
+
+// Radio ring dropped or not played, it fills up to the target again
+void radio_drift_reset(RadioDrift* drift) {
+  drift->priming = true;
+  drift->fill = RADIO_TARGET_FRAMES << RADIO_FILL_SHIFT;
+}
+
+// One block of radio audio (output task), returns false on an underrun
+bool radio_ring_block(FrameRing* ring, RadioDrift* drift, int16_t* block) {
+  uint32_t fill = ring_fill(ring);
+  if(drift->priming) {
+    if(fill < RADIO_TARGET_FRAMES) {
+      memset(block, 0, AUDIO_BLOCK_FRAMES * 2 * sizeof(int16_t));
+      return true;
+    }
+    drift->priming = false;
+  }
+
+  drift->fill += (int32_t)fill - (drift->fill >> RADIO_FILL_SHIFT);
+  int32_t average = drift->fill >> RADIO_FILL_SHIFT;
+  uint32_t count;
+  if(average > RADIO_TARGET_FRAMES + RADIO_SLIP_FRAMES && fill > AUDIO_BLOCK_FRAMES) {
+    // input clock faster, one frame less
+    ring->tail = ring->tail + 1;
+    drift->skipped++;
+    drift->fill -= 1 << RADIO_FILL_SHIFT;
+    count = ring_read(ring, block, AUDIO_BLOCK_FRAMES);
+  }
+  else if(average < RADIO_TARGET_FRAMES - RADIO_SLIP_FRAMES && fill >= AUDIO_BLOCK_FRAMES - 1) {
+    // input clock slower, the last frame twice
+    count = ring_read(ring, block, AUDIO_BLOCK_FRAMES - 1) + 1;
+    block[2*(AUDIO_BLOCK_FRAMES - 1)] = block[2*(AUDIO_BLOCK_FRAMES - 2)];
+    block[2*(AUDIO_BLOCK_FRAMES - 1) + 1] = block[2*(AUDIO_BLOCK_FRAMES - 2) + 1];
+    drift->repeated++;
+    drift->fill += 1 << RADIO_FILL_SHIFT;
+  }
+  else {
+    count = ring_read(ring, block, AUDIO_BLOCK_FRAMES);
+  }
+
+  if(count < AUDIO_BLOCK_FRAMES) {
+    radio_drift_reset(drift);
+    return false;
+  }
+  return true;
+}
+
+#endif
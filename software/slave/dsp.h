@@ -0,0 +1,211 @@
+#ifndef dsp_h
+#define dsp_h
+
+#include "stdint.h"
+#include "string.h"
+#include "math.h"
+
+// Fixed point DSP chain for the Bluetooth stream
+// EQ (biquads) -> loudness (bass/treble shelves that follow the A2DP volume) -> look-ahead limiter.
+// Works in place on interleaved 16-bit stereo blocks. Samples are Q15, biquad coefficients are Q28
+// (range -8..8) with 64-bit accumulators, so the result does not depend on the block size.
+// The WROOM-32 has no SIMD unit, the inner loops are plain 32x32 multiply-accumulates that the Xtensa
+// compiler maps to MULL/MULSH; coefficients are only designed (in double) when a setting changes.
+
+#define DSP_SAMPLE_RATE 44100.0f
+#define DSP_EQ_BANDS 3
+#define DSP_LIMITER_FRAMES 32              // look-ahead, 0.73ms, blocks must be a multiple of this
+#define DSP_LIMITER_THRESHOLD 29204        // -1dBFS
+#define DSP_LIMITER_RELEASE 1000           // Q15 release per 32 frames, ~25ms back to unity
+
+// Filter types
+#define DSP_HIGHPASS 0
+#define DSP_PEAK 1
+#define DSP_LOWSHELF 2
+#define DSP_HIGHSHELF 3
+
+struct Biquad {
+  int32_t b0, b1, b2, a1, a2; // Q28, a0 normalized to 1
+  int32_t x1[2], x2[2];       // input history per channel
+  int32_t y1[2], y2[2];       // output history per channel
+  int32_t error1[2], error2[2]; // truncation error of the last 2 samples, fed back (Q28)
+};
+
+struct Limiter {
+  int16_t delay[DSP_LIMITER_FRAMES * 2];
+  int32_t delay_peak;         // peak of the delayed sub-block
+  int32_t gain;               // Q15 gain at the start of the next output sub-block
+};
+
+struct DspChain {
+  Biquad eq[DSP_EQ_BANDS];
+  Biquad loudness_low;
+  Biquad loudness_high;
+  Limiter limiter;
+  volatile uint8_t volume;    // A2DP volume 0-127, set from Bluetooth task
+  uint8_t applied_volume;     // volume the loudness filters were designed for
+};
+
+// EQ for small speakers: cut below the driver's range, tame the box resonance and the harsh region
+struct EqBand {
+  uint8_t type;
+  float freq;
+  float q;
+  float gain_db;
+};
+const EqBand dsp_eq_bands[DSP_EQ_BANDS] = {
+  {DSP_HIGHPASS, 90.0f, 0.707f, 0.0f},
+  {DSP_PEAK, 250.0f, 1.0f, -2.0f},
+  {DSP_PEAK, 3500.0f, 1.5f, -2.0f},
+};
+
+int16_t dsp_saturate(int32_t value) {
+  if(value > 32767) return 32767;
+  if(value < -32768) return -32768;
+  return (int16_t)value;
+}
+
+// Design biquad (RBJ audio EQ cookbook), coefficients converted to Q28, keeps the history. In double: the poles
+// of the low bands sit close to 1, single precision moves them enough to change the response by 0.1%
+void dsp_design(Biquad* bq, uint8_t type, float freq, float q, float gain_db) {
+  double a = pow(10.0, gain_db / 40.0);
+  double w0 = 2.0 * M_PI * freq / DSP_SAMPLE_RATE;
+  double cos_w0 = cos(w0);
+  double alpha = sin(w0) / (2.0 * q);
+  double b0, b1, b2, a0, a1, a2;
+
+  if(type == DSP_HIGHPASS) {
+    b0 = (1.0 + cos_w0) / 2.0; b1 = -(1.0 + cos_w0); b2 = b0;
+    a0 = 1.0 + alpha; a1 = -2.0 * cos_w0; a2 = 1.0 - alpha;
+  }
+  else if(type == DSP_PEAK) {
+    b0 = 1.0 + alpha * a; b1 = -2.0 * cos_w0; b2 = 1.0 - alpha * a;
+    a0 = 1.0 + alpha / a; a1 = -2.0 * cos_w0; a2 = 1.0 - alpha / a;
+  }
+  else {
+    double sqrt_a = 2.0 * sqrt(a) * alpha;
+    double sign = (type == DSP_LOWSHELF) ? 1.0 : -1.0;
+    b0 = a * ((a + 1.0) - sign * (a - 1.0) * cos_w0 + sqrt_a);
+    b1 = sign * 2.0 * a * ((a - 1.0) - sign * (a + 1.0) * cos_w0);
+    b2 = a * ((a + 1.0) - sign * (a - 1.0) * cos_w0 - sqrt_a);
+    a0 = (a + 1.0) + sign * (a - 1.0) * cos_w0 + sqrt_a;
+    a1 = -sign * 2.0 * ((a - 1.0) + sign * (a + 1.0) * cos_w0);
+    a2 = (a + 1.0) + sign * (a - 1.0) * cos_w0 - sqrt_a;
+  }
+
+  bq->b0 = lrint(b0 / a0 * 268435456.0);
+  bq->b1 = lrint(b1 / a0 * 268435456.0);
+  bq->b2 = lrint(b2 / a0 * 268435456.0);
+  bq->a1 = lrint(a1 / a0 * 268435456.0);
+  bq->a2 = lrint(a2 / a0 * 268435456.0);
+}
+
+// Biquad on interleaved stereo, in place (Direct Form I, saturated output). The part of the accumulator
+// that is cut off when going back to 16 bits is fed back as 2*e[n-1] - e[n-2] (second order error feedback):
+// the truncation noise gets a (1 - z^-1)^2 zero pair that cancels the low frequency poles (close to 1).
+// Without it they amplify the noise by tens of LSB or get stuck in limit cycles
+void dsp_biquad(Biquad* bq, int16_t* samples, int frames) {
+  const int32_t b0 = bq->b0, b1 = bq->b1, b2 = bq->b2, a1 = bq->a1, a2 = bq->a2;
+  for(int ch=0; ch<2; ch++) {
+    int32_t x1 = bq->x1[ch], x2 = bq->x2[ch], y1 = bq->y1[ch], y2 = bq->y2[ch];
+    int32_t error1 = bq->error1[ch], error2 = bq->error2[ch];
+    int16_t* sample = samples + ch;
+    for(int i=0; i<frames; i++) {
+      int32_t x0 = *sample;
+      int64_t acc = (int64_t)b0 * x0 + (int64_t)b1 * x1 + (int64_t)b2 * x2 - (int64_t)a1 * y1 - (int64_t)a2 * y2
+                    + 2 * (int64_t)error1 - error2;
+      int32_t y0 = (int32_t)(acc >> 28);
+      error2 = error1;
+      error1 = (int32_t)(acc - ((int64_t)y0 << 28));
+      if(y0 > 32767 || y0 < -32768) {
+        y0 = dsp_saturate(y0);
+        error1 = 0;
+        error2 = 0;
+      }
+      *sample = (int16_t)y0;
+      x2 = x1; x1 = x0;
+      y2 = y1; y1 = y0;
+      sample += 2;
+    }
+    bq->x1[ch] = x1; bq->x2[ch] = x2; bq->y1[ch] = y1; bq->y2[ch] = y2;
+    bq->error1[ch] = error1; bq->error2[ch] = error2;
+  }
+}
+
+// Look-ahead limiter, delays by DSP_LIMITER_FRAMES. The gain over an output sub-block ramps linearly
+// between 2 values that are both below threshold/peak of that sub-block, so no sample goes over
+void dsp_limiter(Limiter* lim, int16_t* samples, int frames) {
+  int16_t incoming[DSP_LIMITER_FRAMES * 2];
+  for(int start=0; start<frames; start+=DSP_LIMITER_FRAMES) {
+    int16_t* block = samples + 2*start;
+
+    // peak of the incoming sub-block
+    int32_t peak = 0;
+    for(int i=0; i<DSP_LIMITER_FRAMES * 2; i++) {
+      int32_t value = block[i] < 0 ? -(int32_t)block[i] : block[i];
+      if(value > peak) peak = value;
+    }
+
+    // gain at the end of the delayed sub-block: release towards unity, but below both limits
+    // rounded up, truncating would stop the release up to 32 steps below unity
+    int32_t gain_end = lim->gain + (((32767 - lim->gain) * DSP_LIMITER_RELEASE + 32767) >> 15);
+    if(lim->delay_peak > DSP_LIMITER_THRESHOLD) {
+      int32_t limit = ((int32_t)DSP_LIMITER_THRESHOLD << 15) / lim->delay_peak;
+      if(gain_end > limit) gain_end = limit;
+    }
+    if(peak > DSP_LIMITER_THRESHOLD) {
+      int32_t limit = ((int32_t)DSP_LIMITER_THRESHOLD << 15) / peak;
+      if(gain_end > limit) gain_end = limit;
+    }
+
+    // output the delayed sub-block, store the incoming one
+    memcpy(incoming, block, sizeof(incoming));
+    int32_t gain_start = lim->gain;
+    for(int i=0; i<DSP_LIMITER_FRAMES; i++) {
+      int32_t gain = gain_start + ((gain_end - gain_start) * (i + 1)) / DSP_LIMITER_FRAMES;
+      block[2*i] = (int16_t)((lim->delay[2*i] * gain) >> 15);
+      block[2*i + 1] = (int16_t)((lim->delay[2*i + 1] * gain) >> 15);
+    }
+    memcpy(lim->delay, incoming, sizeof(incoming));
+    lim->delay_peak = peak;
+    lim->gain = gain_end;
+  }
+}
+
+// Loudness: more bass and treble at low volume (up to +9dB at 150Hz and +4dB at 8kHz)
+void dsp_design_loudness(DspChain* dsp, uint8_t volume) {
+  float quietness = 1.0f - (volume > 127 ? 127 : volume) / 127.0f;
+  dsp_design(&dsp->loudness_low, DSP_LOWSHELF, 150.0f, 0.707f, 9.0f * quietness);
+  dsp_design(&dsp->loudness_high, DSP_HIGHSHELF, 8000.0f, 0.707f, 4.0f * quietness);
+  dsp->applied_volume = volume;
+}
+
+void dsp_begin(DspChain* dsp) {
+  memset(dsp, 0, sizeof(DspChain));
+  for(int i=0; i<DSP_EQ_BANDS; i++) {
+    dsp_design(&dsp->eq[i], dsp_eq_bands[i].type, dsp_eq_bands[i].freq, dsp_eq_bands[i].q, dsp_eq_bands[i].gain_db);
+  }
+  dsp->volume = 127;
+  dsp_design_loudness(dsp, dsp->volume);
+  dsp->limiter.gain = 32767;
+}
+
+// Set volume the loudness curve follows (0-127), applied at the next block
+void dsp_set_volume(DspChain* dsp, uint8_t volume) {
+  dsp->volume = volume;
+}
+
+// Full chain on interleaved stereo block, frames must be a multiple of DSP_LIMITER_FRAMES
+void dsp_process(DspChain* dsp, int16_t* samples, int frames) {
+  if(dsp->volume != dsp->applied_volume) {
+    dsp_design_loudness(dsp, dsp->volume);
+  }
+  for(int i=0; i<DSP_EQ_BANDS; i++) {
+    dsp_biquad(&dsp->eq[i], samples, frames);
+  }
+  dsp_biquad(&dsp->loudness_low, samples, frames);
+  dsp_biquad(&dsp->loudness_high, samples, frames);
+  dsp_limiter(&dsp->limiter, samples, frames);
+}
+
+#endif
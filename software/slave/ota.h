@@ -0,0 +1,201 @@
+#ifndef ota_h
+#define ota_h
+
+#include "Arduino.h"
+#include "Wire.h"
+#include "Update.h"
+
+#include "logger.h"        // Non-blocking logs
+#include "ota_protocol.h"  // Update blocks, shared with the master
+
+// Slave side of the firmware update (see ota_protocol.h)
+// onReceive() hands every "OTA" message to ota_receive(), which checks blocks and queues them. Only ota_loop()
+// in loop() writes the flash, so the I2C callback stays short. While an update runs, onRequest() answers with
+// the status instead of data frames.
+
+#define OTA_QUEUE_BLOCKS 16           // blocks waiting for the flash, more than the master window
+#define OTA_RESTART_MS 500            // restart after a successful update, the master reads OTA_DONE first
+
+struct OtaBlock {
+  uint8_t length;
+  uint8_t data[OTA_BLOCK_DATA];
+};
+
+QueueHandle_t ota_queue = NULL;
+TaskHandle_t ota_task = NULL;         // task running ota_loop(), notified on new messages
+volatile uint8_t ota_state = OTA_IDLE;
+volatile uint16_t ota_next = 0;       // next block accepted
+volatile uint8_t ota_error = OTA_OK;  // first problem since the last status read
+volatile bool ota_start_requested = false;
+volatile bool ota_end_requested = false;
+volatile bool ota_abort_requested = false;
+volatile uint32_t ota_size = 0;       // image size from the end message
+uint32_t ota_written = 0;
+volatile uint16_t ota_flashed = 0;    // blocks written to flash
+unsigned long ota_done_ms = 0;
+
+// Queue for the blocks, task = task that calls ota_loop() (from setup())
+void ota_begin(TaskHandle_t task) {
+  ota_task = task;
+  ota_queue = xQueueCreate(OTA_QUEUE_BLOCKS, sizeof(OtaBlock));
+}
+
+bool ota_active() {
+  return ota_state != OTA_IDLE;
+}
+
+void ota_report(uint8_t error) {
+  if(ota_error == OTA_OK) {
+    ota_error = error;
+  }
+}
+
+void ota_notify() {
+  if(ota_task != NULL) {
+    xTaskNotifyGive(ota_task);
+  }
+}
+
+// Message of len bytes from the master (I2C callback), false if it is not an update message
+bool ota_receive(const uint8_t* message, int len) {
+  if(len < 4 || memcmp(message, "OTA", 3) != 0) {
+    return false;
+  }
+  switch(message[3]) {
+    // start, ota_loop() opens the partition, blocks are queued meanwhile
+    case 'S':
+      xQueueReset(ota_queue);
+      ota_next = 0;
+      ota_flashed = 0;
+      ota_error = OTA_OK;
+      ota_end_requested = false;
+      ota_start_requested = true;
+      ota_state = OTA_RECEIVING;
+      ota_notify();
+      break;
+
+    case 'B': {
+      if(ota_state != OTA_RECEIVING) {
+        break;
+      }
+      uint8_t length;
+      uint8_t result = ota_check_block(message, len, ota_next, &length);
+      if(result == OTA_REPEATED) {
+        break;
+      }
+      if(result != OTA_OK) {
+        ota_report(result);
+        break;
+      }
+      OtaBlock block;
+      block.length = length;
+      memcpy(block.data, message + OTA_BLOCK_HEADER, length);
+      if(xQueueSend(ota_queue, &block, 0) != pdTRUE) {
+        ota_report(OTA_FULL);
+        break;
+      }
+      ota_next = ota_next + 1;
+      ota_notify();
+      break;
+    }
+
+    case 'E':
+      if(len >= 8) {
+        ota_size = message[4] | message[5] << 8 | message[6] << 16 | (uint32_t)message[7] << 24;
+        ota_end_requested = true;
+        ota_notify();
+      }
+      break;
+
+    case 'A':
+      ota_abort_requested = true;
+      ota_notify();
+      break;
+
+    default:
+      return false;
+  }
+  return true;
+}
+
+// Status for the master (from onRequest() while ota_active())
+void ota_write_status() {
+  uint16_t next = ota_next;
+  uint16_t flashed = ota_flashed;
+  uint8_t status[OTA_STATUS_SIZE] = {'O', ota_state, (uint8_t)(next & 0xff), (uint8_t)(next >> 8), ota_error,
+    (uint8_t)(flashed & 0xff), (uint8_t)(flashed >> 8), 0};
+  ota_error = OTA_OK;
+  Wire.write(status, OTA_STATUS_SIZE);
+}
+
+void ota_fail(const char* message) {
+  if(Update.isRunning()) {
+    Update.abort();
+  }
+  ota_report(OTA_FLASH);
+  ota_state = OTA_FAILED;
+  LOG_ERROR(OTA, "Update failed: %s", message);
+}
+
+// Open the partition, write queued blocks, check the image and restart (from loop()), true while an update runs
+bool ota_loop() {
+  if(ota_abort_requested) {
+    ota_abort_requested = false;
+    if(Update.isRunning()) {
+      Update.abort();
+    }
+    xQueueReset(ota_queue);
+    ota_state = OTA_IDLE;
+    LOG_WARN(OTA, "Update aborted");
+    return false;
+  }
+  if(ota_start_requested) {
+    ota_start_requested = false;
+    if(Update.isRunning()) {
+      Update.abort();
+    }
+    ota_written = 0;
+    if(!Update.begin(UPDATE_SIZE_UNKNOWN)) {
+      ota_fail(Update.errorString());
+    }
+    else {
+      LOG_INFO(OTA, "Update started");
+    }
+  }
+  if(ota_state == OTA_IDLE) {
+    return false;
+  }
+
+  OtaBlock block;
+  while(ota_state == OTA_RECEIVING && xQueueReceive(ota_queue, &block, 0) == pdTRUE) {
+    if(Update.write(block.data, block.length) != block.length) {
+      ota_fail(Update.errorString());
+      break;
+    }
+    ota_written += block.length;
+    ota_flashed = ota_flashed + 1;
+  }
+
+  // the master only ends after every block was accepted, so an empty queue means all are written
+  if(ota_end_requested && ota_state == OTA_RECEIVING && uxQueueMessagesWaiting(ota_queue) == 0) {
+    ota_end_requested = false;
+    ota_state = OTA_FINISHING;
+    if(ota_written != ota_size) {
+      ota_fail("image size mismatch");
+    }
+    else if(!Update.end(true)) {
+      ota_fail(Update.errorString());
+    }
+    else {
+      ota_state = OTA_DONE;
+      ota_done_ms = millis();
+      LOG_INFO(OTA, "Update complete, %lu bytes, restarting", (unsigned long)ota_written);
+    }
+  }
+  if(ota_state == OTA_DONE && millis() - ota_done_ms >= OTA_RESTART_MS) {
+    ESP.restart();
+  }
+  return true;
+}
+
+#endif
@@ -4,6 +4,10 @@
 #include "cstdlib"                // Standrad functions (malloc)
 #include "AudioTools.h"           // Digital audio library
 #include "BluetoothA2DPSink.h"    // Bluetooth library
+#include "logger.h"               // Non-blocking logs
+#include "audio_path.h"           // Bluetooth/radio mixer and I2S output
+#include "metadata.h"             // Bluetooth metadata slots, shared with the master
+#include "ota.h"                  // Firmware update from the master
 
 // I2C address
 #define SLAVE_ADDRESS 0x55
@@ -14,70 +18,82 @@
 // Device name
 #define BT_DEVICE_NAME "DIP-E036 Speaker"
 
-// Bluetooth audio output
-I2SStream i2s;
-BluetoothA2DPSink a2dp_sink(i2s);
+// CPU frequency, Bluetooth and the radio I2S input (mixer, DSP, time shift) need full speed, I2C and the idle
+// audio task run at the lowest one (APB stays 80MHz). Changed from loop() only (see cpu_update())
+#define CPU_ACTIVE_MHZ 240
+#define CPU_IDLE_MHZ 80
+
+// Bluetooth audio input, output is done by the audio path
+MeteredA2DPSink a2dp_sink;
 
 // Bluetooth data to put in datastring to send
 bool bluetooth_mode = false;
 uint8_t connection_state = 0; // 0 - OFF, 1 - CONNECTED, 2 - DISCONNECTED, 3 - CONNECTING, 4 - DISCONNECTING
 uint8_t playback_state = 0; // 0 - STOPPED, 1 - PLAYING, 2 - PAUSED, 3 - FWD SEEK, 4 - REV SEEK, 5 - ERROR
-char* device_name = (char*)malloc(1);
-char* media_title = (char*)malloc(1);
-char* media_artist = (char*)malloc(1);
-char* media_album = (char*)malloc(1);
-
-// Datastring to send for I2C
-uint8_t* datastring = (uint8_t*)malloc(1);
-uint8_t data_length = 0; // total length of datastring
-uint8_t packet_num = 0; // total packet number
+Metadata metadata; // device name and media, fixed slots (see metadata.h)
+portMUX_TYPE metadata_lock = portMUX_INITIALIZER_UNLOCKED; // Bluetooth callbacks write, loop() builds frames
+
+uint32_t cpu_mhz = 0;         // frequency set by cpu_update()
+
+// Last time audio statistics were logged
+unsigned long last_stats = 0;
+
+// Device name is only asked for after a connection, until the peer reports it
+volatile bool name_pending = false;
+
+// Traffic announcement on the radio, Bluetooth pauses and comes back afterwards. "TA ON"/"TA OFF" arrive in the
+// I2C callback, which only switches the audio and leaves the request; ta_update() in loop() sends the AVRCP
+// pause/play, they go through the Bluetooth stack
+#define TA_REQUEST_NONE 0
+#define TA_REQUEST_ON 1
+#define TA_REQUEST_OFF 2
+volatile uint8_t ta_request = TA_REQUEST_NONE;
+bool ta_paused = false;       // playback paused for the announcement, resumed when it ends
+
+// Data sent to the master, split into 32 byte frames: packet index, total packet number, 30 bytes of data.
+// Frames are built by loop() whenever the data changes, into the buffer the master is not reading (see
+// FrameBuffers in metadata.h). onRequest() runs in the I2C slave callback and only copies out a ready frame,
+// so the answer is in the TX FIFO before the master reads.
+#define TELEMETRY_PERIOD 1000         // frames are rebuilt at least this often for the audio telemetry
+
+FrameBuffers frame_buffers;
+volatile bool data_dirty = true;      // data changed since the last build
+unsigned long last_build = 0;
 uint8_t packet_index = 0; // packet index
+TaskHandle_t loop_task = NULL;
 
-// Update datastring to send
-void update_datastring() {
-  // Info to send to master
-  // max length for one packet is 32 bits
-  // First 2 bits will be packet index and total packet number (0 indexed)
-  // example 3 packets: 0/3, 1/3, 2/3
-  // The rest will be the data, split using 0x1d as separator
-  // Terminator and paddings will be using NULL, 0x00
-  data_length = 0;
-  data_length += 2; // bluetooth_mode
-  data_length += 2; // connection_state
-  data_length += 2; // playback_state
-  data_length += strlen(device_name) + 1;
-  data_length += strlen(media_title) + 1;
-  data_length += strlen(media_artist) + 1;
-  data_length += strlen(media_album) + 1;
-  // determine packet number, each packet contains 30 bytes of metadata
-  packet_num = (data_length - 1) / 30 + 1;
-
-  // create datastring to send
-  free(datastring);
-  datastring = (uint8_t*)malloc(data_length);
-  datastring[0] = bluetooth_mode; datastring[1] = 0x1d;
-  datastring[2] = connection_state; datastring[3] = 0x1d;
-  datastring[4] = playback_state; datastring[5] = 0x1d;
-  // device_name + separator
-  for(int i=0; i<strlen(device_name); i++) {
-    datastring[6 + i] = device_name[i];
-  }
-  datastring[6 + strlen(device_name)] = 0x1d;
-  // media_title + separator
-  for(int i=0; i<strlen(media_title); i++) {
-    datastring[6 + strlen(device_name) + 1 + i] = media_title[i];
-  }
-  datastring[6 + strlen(device_name) + 1 + strlen(media_title)] = 0x1d;
-  // media_artist + separator
-  for(int i=0; i<strlen(media_artist); i++) {
-    datastring[6 + strlen(device_name) + 1 + strlen(media_title) + 1 + i] = media_artist[i];
+// Data changed, rebuild the frames from loop() (any task)
+void mark_dirty() {
+  data_dirty = true;
+  if(loop_task != NULL) {
+    xTaskNotifyGive(loop_task);
   }
-  datastring[6 + strlen(device_name) + 1 + strlen(media_title) + 1 + strlen(media_artist)] = 0x1d;
-  // media_album + separator
-  for(int i=0; i<strlen(media_album); i++) {
-    datastring[6 + strlen(device_name) + 1 + strlen(media_title) + 1 + strlen(media_artist) + 1 + i] = media_album[i];
+}
+
+// Build frames into the back buffer and publish them, false if the master is still reading that buffer
+bool build_frames() {
+  int back = frame_back_buffer(&frame_buffers, millis());
+  if(back < 0) {
+    return false;
   }
-  datastring[6 + strlen(device_name) + 1 + strlen(media_title) + 1 + strlen(media_artist) + 1 + strlen(media_album)] = 0x1d;
+  // cleared first, a change during the build marks it again
+  data_dirty = false;
+
+  // Info to send to master, fields separated by 0x1d (see frame_build_data()), paddings are NULL, 0x00
+  char telemetry[METADATA_TELEMETRY_SIZE];
+  int telemetry_length = audio_telemetry(telemetry, sizeof(telemetry));
+  uint8_t data[SLAVE_FRAMES * SLAVE_FRAME_DATA];
+  portENTER_CRITICAL(&metadata_lock);
+  uint16_t length = frame_build_data(data, bluetooth_mode, connection_state, playback_state, &metadata,
+                                     telemetry, telemetry_length > 0 ? telemetry_length : 0);
+  portEXIT_CRITICAL(&metadata_lock);
+
+  // each packet contains 30 bytes of data
+  frame_publish(&frame_buffers, back, data, length);
+  last_build = millis();
+
+  LOG_DEBUG(I2C, "Frames built: %d bytes, %d packets", length, frame_buffers.count[back]);
+  return true;
 }
 
 // Function when receiving from master
@@ -94,187 +110,226 @@ void onReceive(int len) {
   // Null-terminate the received string
   temp[len] = '\0';  // Make sure temp is a valid C-style string
 
+  // Firmware update blocks and commands
+  if(ota_receive((const uint8_t*)temp, index)) {
+    return;
+  }
+  // Radio time shift, answered with its status
+  if(timeshift_receive((const uint8_t*)temp, index)) {
+    return;
+  }
+
   // Do stuff
   // Turn bluetooth on
   if(strcmp(temp, "BLUETOOTH ON") == 0) {
     a2dp_sink.start(BT_DEVICE_NAME);
+    audio_select_bluetooth(true);
+    timeshift_live();
     bluetooth_mode = true;
     connection_state = 2; // DISCONNECTED
-    Serial.println("Bluetooth ON");
+    mark_dirty();
+    LOG_INFO(BLUETOOTH, "Bluetooth ON");
   }
   // Turn bluetooth off
   else if(strcmp(temp, "BLUETOOTH OFF") == 0) {
     a2dp_sink.end();
+    audio_select_bluetooth(false);
     bluetooth_mode = false;
     connection_state = 0; // OFF
-    Serial.println("Bluetooth OFF");
+    name_pending = false;
+    ta_request = TA_REQUEST_NONE;
+    mark_dirty();
+    LOG_INFO(BLUETOOTH, "Bluetooth OFF");
+  }
+  // Traffic announcement on the radio, Bluetooth pauses and comes back afterwards
+  else if(strcmp(temp, "TA ON") == 0) {
+    audio_select_bluetooth(false);
+    ta_request = TA_REQUEST_ON;
+    xTaskNotifyGive(loop_task);
+  }
+  else if(strcmp(temp, "TA OFF") == 0) {
+    audio_select_bluetooth(true);
+    ta_request = TA_REQUEST_OFF;
+    xTaskNotifyGive(loop_task);
   }
   // Change current packet number, syntax "PACKET<byte>" where <byte> is packet index
   else if(strncmp(temp, "PACKET", 6) == 0) {
     packet_index = (uint8_t)temp[6];
-    Serial.printf("Packet number: %d\n", packet_index);
+    LOG_DEBUG(I2C, "Packet number: %d", packet_index);
+  }
+  // Digital radio volume, syntax "VOLUME<byte>" where <byte> is 0-15
+  else if(strncmp(temp, "VOLUME", 6) == 0) {
+    audio_set_radio_volume((uint8_t)temp[6]);
+    LOG_DEBUG(I2C, "Radio volume: %d", temp[6]);
   }
   else {
-    Serial.print("Invalid signal received: ");
-    Serial.println(temp);
+    LOG_WARN(I2C, "Invalid signal received: %s", temp);
   }
 }
 
-// Function when sending info to master
+// Function when sending info to master, hands out a prebuilt frame
 void onRequest() {
-  // Update if it is the start of data
-  if(packet_index == 0) {
-    update_datastring();
+  // the master reads the update status while updating
+  if(ota_active()) {
+    ota_write_status();
+    return;
   }
-
-  // sending data sequentially
-  Wire.write(packet_index); // packet index
-  Serial.printf("%02x ", packet_index);
-  Wire.write(packet_num); // total packet number
-  Serial.printf("%02x ", packet_num);
-  // datastring from index 30*packet_index, padding with 0x00
-  for(int i=0; i<30; i++) {
-    if(30*packet_index + i < data_length) {
-      Wire.write(datastring[30*packet_index + i]);
-      Serial.printf("%02x ", datastring[30*packet_index + i]);
-    }
-    else {
-      Wire.write(0x00);
-      Serial.printf("%02x ", 0x00);
-    }
+  // status of the time shift message just received
+  if(timeshift_status_requested()) {
+    timeshift_write_status();
+    return;
   }
-  Serial.println("");
+  // the whole read uses the frames that were ready at packet 0
+  uint8_t packet[32];
+  frame_serve(&frame_buffers, packet_index, millis(), packet);
+  Wire.write(packet, 32);
 }
 
 // Change in bluetooth connection state
 void connection_state_change(esp_a2d_connection_state_t state, void *obj) {
   switch (state) {
     case ESP_A2D_CONNECTION_STATE_CONNECTED:
-      Serial.println("Connection state: CONNECTED");
+      LOG_INFO(BLUETOOTH, "Connection state: CONNECTED");
       connection_state = 1;
+      name_pending = true;
       break;
     case ESP_A2D_CONNECTION_STATE_DISCONNECTED:
-      Serial.println("Connection state: DISCONNECTED");
+      LOG_INFO(BLUETOOTH, "Connection state: DISCONNECTED");
       connection_state = 2;
       break;
     case ESP_A2D_CONNECTION_STATE_CONNECTING:
-      Serial.println("Connection state: CONNECTING");
+      LOG_INFO(BLUETOOTH, "Connection state: CONNECTING");
       connection_state = 3;
       break;
     case ESP_A2D_CONNECTION_STATE_DISCONNECTING:
-      Serial.println("Connection state: DISCONNECTING");
+      LOG_INFO(BLUETOOTH, "Connection state: DISCONNECTING");
       connection_state = 4;
       break;
     default:
-      Serial.println("Invalid bluetooth connection state.");
+      LOG_WARN(BLUETOOTH, "Invalid bluetooth connection state.");
       break;
   }
+  mark_dirty();
 }
 
 // Change in bluetooth playback state
 void playback_state_change(esp_avrc_playback_stat_t state) {
   switch (state) {
     case ESP_AVRC_PLAYBACK_STOPPED:
-      Serial.println("Playback state: STOPPED");
+      LOG_INFO(BLUETOOTH, "Playback state: STOPPED");
       playback_state = 0;
       break;
     case ESP_AVRC_PLAYBACK_PLAYING:
-      Serial.println("Playback state: PLAYING");
+      LOG_INFO(BLUETOOTH, "Playback state: PLAYING");
       playback_state = 1;
       break;
     case ESP_AVRC_PLAYBACK_PAUSED:
-      Serial.println("Playback state: PAUSED");
+      LOG_INFO(BLUETOOTH, "Playback state: PAUSED");
       playback_state = 2;
       break;
     case ESP_AVRC_PLAYBACK_FWD_SEEK:
-      Serial.println("Playback state: FWD_SEEK");
+      LOG_INFO(BLUETOOTH, "Playback state: FWD_SEEK");
       playback_state = 3;
       break;
     case ESP_AVRC_PLAYBACK_REV_SEEK:
-      Serial.println("Playback state: REV_SEEK");
+      LOG_INFO(BLUETOOTH, "Playback state: REV_SEEK");
       playback_state = 4;
       break;
     case ESP_AVRC_PLAYBACK_ERROR:
-      Serial.println("Playback state: ERROR");
+      LOG_INFO(BLUETOOTH, "Playback state: ERROR");
       playback_state = 5;
       break;
     default:
-      Serial.println("Invalid bluetooth playback state.");
+      LOG_WARN(BLUETOOTH, "Invalid bluetooth playback state.");
       break;
   }
+  mark_dirty();
 }
 
 // Change in metadata
 void metadata_update(uint8_t id, const uint8_t *data) {
   const char* data_string = (const char*)data;
-  // Title
-  if(id == ESP_AVRC_MD_ATTR_TITLE) {
-    if(strcmp(media_title, data_string) != 0) {
-      free(media_title);
-      // Allocate new memory for the new string
-      media_title = (char*)malloc(strlen(data_string) + 1); // Allocate memory, +1 for the null terminator
-      // Copy the new value to global variable
-      strcpy(media_title, data_string);
-
-      Serial.print("Media title: ");
-      Serial.println(media_title);
-    }
-  }
-  // Artist
-  else if(id == ESP_AVRC_MD_ATTR_ARTIST) {
-    if(strcmp(media_artist, data_string) != 0) {
-      free(media_artist);
-      // Allocate new memory for the new string
-      media_artist = (char*)malloc(strlen(data_string) + 1); // Allocate memory, +1 for the null terminator
-      // Copy the new value to global variable
-      strcpy(media_artist, data_string);
-
-      Serial.print("Media artist: ");
-      Serial.println(media_artist);
-    }
-  }
-  // Album
-  else if(id == ESP_AVRC_MD_ATTR_ALBUM) {
-    if(strcmp(media_album, data_string) != 0) {
-      free(media_album);
-      // Allocate new memory for the new string
-      media_album = (char*)malloc(strlen(data_string) + 1); // Allocate memory, +1 for the null terminator
-      // Copy the new value to global variable
-      strcpy(media_album, data_string);
-
-      Serial.print("Media album: ");
-      Serial.println(media_album);
-    }
+  size_t length = strlen(data_string);
+  char* slot;
+  if(id == ESP_AVRC_MD_ATTR_TITLE) slot = metadata.media_title;
+  else if(id == ESP_AVRC_MD_ATTR_ARTIST) slot = metadata.media_artist;
+  else if(id == ESP_AVRC_MD_ATTR_ALBUM) slot = metadata.media_album;
+  else return;
+
+  // Title, artist and album show "..." when cut
+  portENTER_CRITICAL(&metadata_lock);
+  bool changed = metadata_set(slot, METADATA_TEXT_SIZE, data_string, length, METADATA_ELLIPSIS);
+  portEXIT_CRITICAL(&metadata_lock);
+
+  if(changed) {
+    mark_dirty();
+    if(id == ESP_AVRC_MD_ATTR_TITLE) LOG_INFO(BLUETOOTH, "Media title: %s", data_string);
+    else if(id == ESP_AVRC_MD_ATTR_ARTIST) LOG_INFO(BLUETOOTH, "Media artist: %s", data_string);
+    else LOG_INFO(BLUETOOTH, "Media album: %s", data_string);
   }
 }
 
 // Update device name
 void device_name_update() {
-  // Get device name
+  // Get device name, empty until the remote name request is answered
   const char* retrieved_name = a2dp_sink.get_peer_name();
+  if(retrieved_name == NULL || retrieved_name[0] == '\0') {
+    return;
+  }
+  name_pending = false;
   // If device name is different
-  if(strcmp(device_name, retrieved_name) != 0) {
-    free(device_name);
-    // Allocate new memory for the new string
-    device_name = (char*)malloc(strlen(retrieved_name) + 1); // Allocate memory, +1 for the null terminator
-    // Copy the new value to global variable
-    strcpy(device_name, retrieved_name);
-
-    Serial.print("Device name: ");
-    Serial.println(device_name);
+  portENTER_CRITICAL(&metadata_lock);
+  bool changed = metadata_set(metadata.device_name, sizeof(metadata.device_name), retrieved_name, strlen(retrieved_name));
+  portEXIT_CRITICAL(&metadata_lock);
+  if(changed) {
+    mark_dirty();
+    LOG_INFO(BLUETOOTH, "Device name: %s", retrieved_name);
+  }
+}
+
+// CPU frequency for the current mode (in loop(), mark_dirty() wakes it after a mode change). Not in the I2C
+// callback: setCpuFrequencyMhz() waits for the clock switch and reconfigures the peripherals on the APB
+void cpu_update() {
+  uint32_t mhz = (bluetooth_mode || RADIO_I2S_INPUT) ? CPU_ACTIVE_MHZ : CPU_IDLE_MHZ;
+  if(mhz != cpu_mhz) {
+    setCpuFrequencyMhz(mhz);
+    cpu_mhz = mhz;
+    LOG_DEBUG(AUDIO, "CPU at %luMHz", (unsigned long)mhz);
+  }
+}
+
+// Pause or resume playback for the last traffic announcement request (from loop())
+void ta_update() {
+  uint8_t request = __atomic_exchange_n(&ta_request, TA_REQUEST_NONE, __ATOMIC_ACQ_REL);
+  if(!bluetooth_mode) {
+    ta_paused = false;
+  }
+  else if(request == TA_REQUEST_ON) {
+    if(playback_state == 1 && !ta_paused) {
+      a2dp_sink.pause();
+      ta_paused = true;
+    }
+    LOG_INFO(BLUETOOTH, "Traffic announcement, playback paused: %d", ta_paused);
+  }
+  else if(request == TA_REQUEST_OFF) {
+    if(ta_paused) {
+      a2dp_sink.play();
+      ta_paused = false;
+    }
+    LOG_INFO(BLUETOOTH, "Traffic announcement ended");
   }
 }
 
 void setup() {
   // Initialize serial output
   Serial.begin(115200);
+  logger_begin();
+
+  // Bluetooth is off until the master turns it on
+  cpu_update();
 
-  // Bluetooth config
-  auto cfg = i2s.defaultConfig(); //set the config to default: 44.1 kHz sample frequency and 16 bits per sample
-  cfg.pin_bck = BCK;
-  cfg.pin_ws = LRCK;
-  cfg.pin_data = DIN;
-  i2s.begin(cfg);
+  // Audio output, Bluetooth and radio input
+  audio_begin(&a2dp_sink, BCK, LRCK, DIN);
 
   // Metadata options
   a2dp_sink.set_avrc_metadata_attribute_mask(
@@ -287,6 +342,12 @@ void setup() {
   a2dp_sink.set_on_connection_state_changed(connection_state_change); // Connection state changed
   a2dp_sink.set_avrc_rn_playstatus_callback(playback_state_change); // Playback state changed
   a2dp_sink.set_avrc_metadata_callback(metadata_update); // Metadata state changed
+  a2dp_sink.set_on_volumechange(audio_set_bt_volume); // Volume changed, loudness follows it
+
+  // First frames before the master can ask, loop() is notified when data changes
+  loop_task = xTaskGetCurrentTaskHandle();
+  build_frames();
+  ota_begin(loop_task);
 
   // I2C config
   Wire.onReceive(onReceive);
@@ -301,8 +362,27 @@ void setup() {
 }
 
 void loop() {
-  if(connection_state == 1) {
+  cpu_update();
+  ta_update();
+  if(name_pending && connection_state == 1) {
     device_name_update();
   }
-  delay(100);
+  // audio path statistics every 5s
+  if(millis() - last_stats >= 5000) {
+    last_stats = millis();
+    audio_log_stats();
+  }
+  // rebuild frames on changes, and periodically for the telemetry
+  bool built = true;
+  if(data_dirty || millis() - last_build >= TELEMETRY_PERIOD) {
+    built = build_frames();
+  }
+  // firmware update blocks from the master into the flash
+  bool updating = ota_loop();
+  // wait for the next change, short while the master holds the back buffer, the device name is expected or
+  // an update finishes
+  uint32_t wait_ms = TELEMETRY_PERIOD;
+  if(!built || updating) wait_ms = 10;
+  else if(name_pending) wait_ms = 100;
+  ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait_ms));
 }
\ No newline at end of file
@@ -0,0 +1,219 @@
+#ifndef timeshift_h
+#define timeshift_h
+
+#include "Arduino.h"
+#include "Wire.h"
+#include "esp_heap_caps.h"
+
+#include "logger.h"
+#include "adpcm.h"                // Ring blocks
+#include "timeshift_protocol.h"   // Commands and status, shared with the master
+
+// Live radio time shift
+// radio_input_task() codes every radio block into a ring of ADPCM blocks (adpcm.h, 11kB/s), TIMESHIFT_SECONDS
+// take 6.6MB of PSRAM. Without PSRAM (ESP32-WROOM) the ring is TIMESHIFT_FALLBACK_BYTES of internal RAM, a few
+// seconds. While live, the output task plays the radio ring as before; paused it plays silence while the ring
+// keeps recording, behind live it decodes the ring from the play position instead (mono, 11kHz bandwidth).
+// Commands come in the I2C callback and are only stored, the output task applies them before its next block
+// and is the only one that moves the play position. The ring head is published by the input task.
+
+#define TIMESHIFT_SECONDS 600
+#define TIMESHIFT_FALLBACK_BYTES 32768  // 2.9s
+#define TIMESHIFT_PSRAM_RESERVE 65536   // PSRAM left for others
+#define TIMESHIFT_GUARD_BLOCKS 4        // oldest blocks not played, the input task may be overwriting them
+
+#define TIMESHIFT_NONE 0                // no command waiting
+
+uint8_t* ts_ring = NULL;
+uint32_t ts_blocks = 0;                 // ring size in blocks, 0 - no ring
+volatile uint32_t ts_head = 0;          // blocks written
+AdpcmEncoder ts_encoder;                // input task
+
+// Output task
+volatile uint8_t ts_state = TIMESHIFT_OFF;
+uint32_t ts_position = 0;               // next block played
+int16_t ts_decoded[ADPCM_BLOCK_FRAMES * 2];
+uint32_t ts_decoded_left = 0;           // frames of ts_decoded not played yet
+int16_t ts_previous = 0;
+
+// From the I2C callback
+volatile uint8_t ts_command = TIMESHIFT_NONE;
+volatile int16_t ts_command_seconds = 0;
+volatile bool ts_status_requested = false;
+
+uint32_t timeshift_blocks(uint32_t seconds) {
+  return (uint64_t)seconds * ADPCM_SAMPLE_RATE / ADPCM_BLOCK_SAMPLES;
+}
+
+uint16_t timeshift_seconds(uint32_t blocks) {
+  return (uint64_t)blocks * ADPCM_BLOCK_SAMPLES / ADPCM_SAMPLE_RATE;
+}
+
+// Allocate the ring (from audio_begin(), radio input only)
+void timeshift_begin() {
+  size_t size = timeshift_blocks(TIMESHIFT_SECONDS) * ADPCM_BLOCK_BYTES;
+  if(psramFound()) {
+    size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM);
+    if(largest < size + TIMESHIFT_PSRAM_RESERVE) {
+      size = (largest > TIMESHIFT_PSRAM_RESERVE) ? largest - TIMESHIFT_PSRAM_RESERVE : 0;
+    }
+    ts_ring = (size > 0) ? (uint8_t*)heap_caps_malloc(size, MALLOC_CAP_SPIRAM) : NULL;
+  }
+  else {
+    size = TIMESHIFT_FALLBACK_BYTES;
+    ts_ring = (uint8_t*)heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  }
+  if(ts_ring == NULL) {
+    LOG_ERROR(AUDIO, "No memory for the time shift ring");
+    return;
+  }
+  ts_blocks = size / ADPCM_BLOCK_BYTES;
+  adpcm_encoder_begin(&ts_encoder);
+  ts_state = TIMESHIFT_LIVE;
+  LOG_INFO(AUDIO, "Time shift ring: %us in %s", timeshift_seconds(ts_blocks), psramFound() ? "PSRAM" : "internal RAM");
+}
+
+// Radio frames into the ring (input task)
+void timeshift_write(const int16_t* frames, uint32_t count) {
+  if(ts_blocks == 0) {
+    return;
+  }
+  while(count > 0) {
+    bool full;
+    uint32_t used = adpcm_encode(&ts_encoder, frames, count, &full);
+    if(full) {
+      uint32_t head = ts_head;
+      memcpy(ts_ring + (head % ts_blocks) * ADPCM_BLOCK_BYTES, ts_encoder.block, ADPCM_BLOCK_BYTES);
+      __atomic_store_n(&ts_head, head + 1, __ATOMIC_RELEASE);
+    }
+    frames += 2 * used;
+    count -= used;
+  }
+}
+
+// Oldest block that can be played for head
+uint32_t timeshift_oldest(uint32_t head) {
+  return (head > ts_blocks - TIMESHIFT_GUARD_BLOCKS) ? head - ts_blocks + TIMESHIFT_GUARD_BLOCKS : 0;
+}
+
+// Apply the waiting command (output task)
+void timeshift_apply() {
+  uint8_t command = ts_command;
+  if(command == TIMESHIFT_NONE || ts_blocks == 0) {
+    return;
+  }
+  ts_command = TIMESHIFT_NONE;
+  uint32_t head = __atomic_load_n(&ts_head, __ATOMIC_ACQUIRE);
+  switch(command) {
+    case 'P':
+      if(ts_state == TIMESHIFT_LIVE) {
+        ts_position = head;
+        ts_decoded_left = 0;
+      }
+      ts_state = TIMESHIFT_PAUSED;
+      break;
+
+    case 'R':
+      if(ts_state == TIMESHIFT_PAUSED) {
+        ts_state = TIMESHIFT_BEHIND;
+      }
+      break;
+
+    case 'S': {
+      int64_t position = (ts_state == TIMESHIFT_LIVE) ? head : ts_position;
+      int32_t blocks = timeshift_blocks(abs(ts_command_seconds));
+      position += (ts_command_seconds < 0) ? -blocks : blocks;
+      position = max(position, (int64_t)timeshift_oldest(head));
+      ts_decoded_left = 0;
+      if(position >= head) {
+        ts_state = TIMESHIFT_LIVE;
+        break;
+      }
+      ts_position = position;
+      if(ts_state == TIMESHIFT_LIVE) {
+        ts_state = TIMESHIFT_BEHIND;
+      }
+      break;
+    }
+
+    case 'L':
+      ts_state = TIMESHIFT_LIVE;
+      break;
+  }
+  LOG_INFO(AUDIO, "Time shift %c, state %d, %us behind", command, ts_state,
+    (ts_state == TIMESHIFT_LIVE) ? 0 : timeshift_seconds(head - ts_position));
+}
+
+// Radio frames for the output block (output task), false while live: the radio ring is played
+bool timeshift_read(int16_t* samples, uint32_t frames) {
+  timeshift_apply();
+  if(ts_state == TIMESHIFT_LIVE || ts_state == TIMESHIFT_OFF) {
+    return false;
+  }
+  if(ts_state == TIMESHIFT_PAUSED) {
+    memset(samples, 0, frames * 2 * sizeof(int16_t));
+    return true;
+  }
+  uint32_t done = 0;
+  while(done < frames) {
+    if(ts_decoded_left == 0) {
+      uint32_t head = __atomic_load_n(&ts_head, __ATOMIC_ACQUIRE);
+      // caught up (skipped forward), rest of the block is silent
+      if(ts_position >= head) {
+        memset(samples + 2*done, 0, (frames - done) * 2 * sizeof(int16_t));
+        ts_state = TIMESHIFT_LIVE;
+        break;
+      }
+      // paused longer than the ring, the oldest audio left is played
+      ts_position = max(ts_position, timeshift_oldest(head));
+      adpcm_decode_block(ts_ring + (ts_position % ts_blocks) * ADPCM_BLOCK_BYTES, ts_decoded, &ts_previous);
+      ts_position++;
+      ts_decoded_left = ADPCM_BLOCK_FRAMES;
+    }
+    uint32_t count = min(frames - done, ts_decoded_left);
+    memcpy(samples + 2*done, ts_decoded + 2*(ADPCM_BLOCK_FRAMES - ts_decoded_left), count * 2 * sizeof(int16_t));
+    done += count;
+    ts_decoded_left -= count;
+  }
+  return true;
+}
+
+// Every message from the master (I2C callback), false if it is not a time shift message
+bool timeshift_receive(const uint8_t* message, int len) {
+  if(len != TIMESHIFT_MESSAGE_SIZE || memcmp(message, "SHIFT", 5) != 0) {
+    // the status is only for the read right after a time shift message
+    ts_status_requested = false;
+    return false;
+  }
+  if(message[5] != '?') {
+    ts_command_seconds = (int16_t)(message[6] | message[7] << 8);
+    ts_command = message[5];
+  }
+  ts_status_requested = true;
+  return true;
+}
+
+// Back to live, Bluetooth mode plays the radio live again (I2C callback)
+void timeshift_live() {
+  ts_command = 'L';
+}
+
+bool timeshift_status_requested() {
+  return ts_status_requested;
+}
+
+// Status for the master (from onRequest() after a time shift message)
+void timeshift_write_status() {
+  ts_status_requested = false;
+  uint32_t head = __atomic_load_n(&ts_head, __ATOMIC_ACQUIRE);
+  uint8_t state = ts_state;
+  // a command not applied yet is reported by the next status
+  uint16_t delay_s = (state == TIMESHIFT_PAUSED || state == TIMESHIFT_BEHIND) ? timeshift_seconds(head - ts_position) : 0;
+  uint16_t recorded_s = timeshift_seconds(min(head, ts_blocks));
+  uint16_t capacity_s = timeshift_seconds(ts_blocks);
+  uint8_t status[TIMESHIFT_STATUS_SIZE] = {'T', state, (uint8_t)(delay_s & 0xff), (uint8_t)(delay_s >> 8),
+    (uint8_t)(recorded_s & 0xff), (uint8_t)(recorded_s >> 8), (uint8_t)(capacity_s & 0xff), (uint8_t)(capacity_s >> 8)};
+  Wire.write(status, TIMESHIFT_STATUS_SIZE);
+}
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef timeshift_protocol_h
+#define timeshift_protocol_h
+
+#include "stdint.h"
+#include "string.h"
+
+// Radio time shift commands, shared by master and slave (same file in both sketches, keep them equal)
+// The slave records the radio into a ring and plays it from there when the master pauses or rewinds.
+//
+// Messages from the master, TIMESHIFT_MESSAGE_SIZE bytes:
+//   "SHIFTP" 0 0                            pause, the ring keeps recording
+//   "SHIFTR" 0 0                            resume where it was paused
+//   "SHIFTS" seconds(2)                     skip, negative rewinds (also from live), catching up plays live
+//   "SHIFTL" 0 0                            back to live
+//   "SHIFT?" 0 0                            status only
+// Numbers are little endian, seconds signed. The read right after a message returns TIMESHIFT_STATUS_SIZE bytes:
+//   'T' state delay_s(2) recorded_s(2) capacity_s(2)
+
+#define TIMESHIFT_MESSAGE_SIZE 8
+#define TIMESHIFT_STATUS_SIZE 8
+
+// Slave states
+#define TIMESHIFT_OFF 0                 // no ring (no radio I2S input or no memory)
+#define TIMESHIFT_LIVE 1
+#define TIMESHIFT_PAUSED 2
+#define TIMESHIFT_BEHIND 3              // playing the ring, delay_s behind live
+
+// Message for command ('P', 'R', 'S', 'L', '?')
+void timeshift_message(uint8_t* message, char command, int16_t seconds) {
+  memcpy(message, "SHIFT", 5);
+  message[5] = command;
+  message[6] = (uint16_t)seconds & 0xff;
+  message[7] = (uint16_t)seconds >> 8;
+}
+
+#endif